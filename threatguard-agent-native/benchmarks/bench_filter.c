@@ -0,0 +1,880 @@
+/*  ThreatGuard Agent - Security Filter Benchmark
+ *  Times rule evaluation per rule type and rule count on synthetic syslog,
+ *  auth, auditd and DNS records, and the whole filter callback on chunks
+ *  of them or on a recorded chunk file
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../plugins/filter_threatguard_security/security_rules.h"
+#include "../include/threatguard.h"
+
+#include <getopt.h>
+
+#define BENCH_SHAPES        4
+#define BENCH_LINE_MAX      512
+#define BENCH_MAX_COUNTS    8
+#define BENCH_INTEL_SIZE    10000   /* indicators of each of IPs and domains */
+
+/* Allocations are counted when the binary is linked with --wrap for
+ * malloc, calloc and realloc; flb_malloc and msgpack allocate through them */
+#ifdef TG_BENCH_WRAP_MALLOC
+static uint64_t bench_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+#define BENCH_ALLOCS()          __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED)
+#define BENCH_COUNTS_ALLOCS     1
+#else
+#define BENCH_ALLOCS()          0
+#define BENCH_COUNTS_ALLOCS     0
+#endif
+
+/* Rule types timed one at a time, by the name -t selects them with;
+ * literal rules are FIELD_REGEX rules without regex syntax, which compile
+ * to the shared substring automaton instead of the DFA */
+static const struct {
+    const char *name;
+    int type;
+    int literal;
+} bench_types[] = {
+    { "match",      TG_RULE_TYPE_FIELD_MATCH,   0 },
+    { "literal",    TG_RULE_TYPE_FIELD_REGEX,   1 },
+    { "regex",      TG_RULE_TYPE_FIELD_REGEX,   0 },
+    { "exists",     TG_RULE_TYPE_FIELD_EXISTS,  0 },
+    { "intel",      TG_RULE_TYPE_THREAT_INTEL,  0 },
+    { "behavioral", TG_RULE_TYPE_BEHAVIORAL,    0 },
+    { "compliance", TG_RULE_TYPE_COMPLIANCE,    0 },
+    { "rate",       TG_RULE_TYPE_RATE,          0 },
+    { "distinct",   TG_RULE_TYPE_DISTINCT,      0 },
+    { "sequence",   TG_RULE_TYPE_SEQUENCE,      0 },
+    { NULL, 0, 0 }
+};
+
+/* Rules that hit the synthetic records; further rules get patterns that
+ * miss, as most rules of a large set do */
+static const char *match_rules[][2] = {
+    { "user", "root" }, { "user", "admin" }, { "event_type", "sudo" }, { "host", "bastion" },
+    { "level", "critical" }, { "exe", "/tmp/xmrig" }, { NULL, NULL }
+};
+
+static const char *literal_patterns[] = {
+    "Failed password", "invalid user", "/tmp/xmrig", "payments", "health check", NULL
+};
+
+static const char *regex_patterns[] = {
+    "(failed|failure|denied|invalid).*user", "(sudo|su|runas|escalat|privileg)",
+    "(virus|malware|trojan|ransomware|backdoor)", "exe=\"/tmp/[a-z]+\"",
+    "query\\[(TXT|ANY)\\]", "port [0-9]+ ssh2", NULL
+};
+
+static const char *exists_fields[] = {
+    "src_ip", "exe", "query", "user", "dst_port", NULL
+};
+
+static const char *match_fields[] = { "message", "user", "query" };
+
+static const char *hosts[] = { "web01", "web02", "db01", "bastion", "dns01", "worker07" };
+static const char *users[] = {
+    "root", "admin", "alice", "bob", "deploy", "postgres", "www-data", "backup",
+    "jenkins", "oracle", "test", "guest"
+};
+static const char *exes[] = {
+    "/usr/bin/sudo", "/usr/bin/bash", "/usr/bin/curl", "/usr/sbin/sshd", "/usr/bin/python3",
+    "/tmp/xmrig", "/usr/bin/cat", "/usr/bin/systemctl"
+};
+static const char *domains[] = {
+    "api.github.com", "updates.example.org", "cdn.jsdelivr.net", "mail.google.com",
+    "s3.amazonaws.com", "ntp.ubuntu.com", "login.microsoftonline.com", "repo.maven.apache.org"
+};
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void bench_usage(const char *name)
+{
+    printf("usage: %s [-e events] [-i iterations] [-n rule_counts] [-t types]\n"
+           "       [-c chunk_records] [-C] [-w workers] [-r chunk_file]\n", name);
+}
+
+/* Name is in the comma separated list, or there is no list */
+static int bench_selected(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = list;
+
+    if (!list) {
+        return 1;
+    }
+    while (*p) {
+        const char *end = strchr(p, ',');
+        size_t token = end ? (size_t) (end - p) : strlen(p);
+
+        if (token == len && memcmp(p, name, len) == 0) {
+            return 1;
+        }
+        p += token + (end ? 1 : 0);
+    }
+    return 0;
+}
+
+static void bench_pack_str(msgpack_packer *pk, const char *str)
+{
+    size_t len = strlen(str);
+
+    msgpack_pack_str(pk, len);
+    msgpack_pack_str_body(pk, str, len);
+}
+
+static void bench_pack_ip(msgpack_packer *pk, char *buf, size_t size)
+{
+    /* One source in 50 is a known bad address */
+    if (rand() % 50 == 0) {
+        snprintf(buf, size, "203.0.%d.%d", rand() % (BENCH_INTEL_SIZE / 256), rand() % 256);
+    } else {
+        snprintf(buf, size, "10.0.%d.%d", rand() % 4, rand() % 256);
+    }
+    bench_pack_str(pk, buf);
+}
+
+/* One record of a shape: syslog, sshd auth, auditd or DNS query log */
+static void bench_pack_record(msgpack_packer *pk, int shape)
+{
+    const char *host = hosts[rand() % 6];
+    const char *user = users[rand() % 12];
+    char line[BENCH_LINE_MAX];
+    char ip[32];
+    char query[128];
+    int pid = 1000 + rand() % 60000;
+    int failed;
+
+    switch (shape) {
+        case 0:
+            msgpack_pack_map(pk, 5);
+            bench_pack_str(pk, "host");
+            bench_pack_str(pk, host);
+            bench_pack_str(pk, "ident");
+            bench_pack_str(pk, rand() % 4 == 0 ? "nginx" : "systemd");
+            bench_pack_str(pk, "pid");
+            msgpack_pack_int(pk, pid);
+            bench_pack_str(pk, "level");
+            bench_pack_str(pk, rand() % 200 == 0 ? "critical" : rand() % 10 == 0 ? "warning" : "info");
+            bench_pack_str(pk, "message");
+            if (rand() % 6 == 0) {
+                snprintf(line, sizeof(line), "10.%d.%d.%d - - \"POST /api/v1/payments/%d HTTP/1.1\" "
+                         "200 %d \"-\" \"Mozilla/5.0 (X11; Linux x86_64)\"",
+                         rand() % 256, rand() % 256, rand() % 256, rand() % 100000, rand() % 10000);
+            } else if (rand() % 20 == 0) {
+                snprintf(line, sizeof(line), "health check ok, %d ms", rand() % 100);
+            } else {
+                snprintf(line, sizeof(line), "Started Session %d of user %s.", rand() % 100000, user);
+            }
+            bench_pack_str(pk, line);
+            break;
+        case 1:
+            failed = rand() % 3 != 0;
+            msgpack_pack_map(pk, 8);
+            bench_pack_str(pk, "host");
+            bench_pack_str(pk, host);
+            bench_pack_str(pk, "ident");
+            bench_pack_str(pk, "sshd");
+            bench_pack_str(pk, "pid");
+            msgpack_pack_int(pk, pid);
+            bench_pack_str(pk, "event_type");
+            bench_pack_str(pk, failed ? "login_failure" : "login_success");
+            bench_pack_str(pk, "user");
+            bench_pack_str(pk, user);
+            bench_pack_str(pk, "src_ip");
+            bench_pack_ip(pk, ip, sizeof(ip));
+            bench_pack_str(pk, "dst_port");
+            msgpack_pack_int(pk, 22);
+            bench_pack_str(pk, "message");
+            if (failed) {
+                snprintf(line, sizeof(line), "Failed password for %s%s from %s port %d ssh2",
+                         rand() % 4 == 0 ? "invalid user " : "", user, ip, rand() % 65536);
+            } else {
+                snprintf(line, sizeof(line), "Accepted publickey for %s from %s port %d ssh2: "
+                         "RSA SHA256:%08x%08x", user, ip, rand() % 65536, rand(), rand());
+            }
+            bench_pack_str(pk, line);
+            break;
+        case 2:
+            msgpack_pack_map(pk, 8);
+            bench_pack_str(pk, "host");
+            bench_pack_str(pk, host);
+            bench_pack_str(pk, "ident");
+            bench_pack_str(pk, "auditd");
+            bench_pack_str(pk, "type");
+            bench_pack_str(pk, "SYSCALL");
+            bench_pack_str(pk, "event_type");
+            bench_pack_str(pk, rand() % 8 == 0 ? "sudo" : "execve");
+            bench_pack_str(pk, "user");
+            bench_pack_str(pk, user);
+            bench_pack_str(pk, "exe");
+            bench_pack_str(pk, exes[rand() % 8]);
+            bench_pack_str(pk, "pid");
+            msgpack_pack_int(pk, pid);
+            bench_pack_str(pk, "message");
+            snprintf(line, sizeof(line), "audit(%d.%03d:%d): arch=c000003e syscall=59 success=yes "
+                     "exit=0 ppid=%d pid=%d auid=%d uid=0 tty=pts%d comm=\"%s\" exe=\"%s\" "
+                     "key=\"exec\"", 1760000000 + rand() % 100000, rand() % 1000, rand() % 100000,
+                     pid - 1, pid, 1000 + rand() % 10, rand() % 8, user, exes[rand() % 8]);
+            bench_pack_str(pk, line);
+            break;
+        default:
+            /* One query in 50 is for a known bad domain */
+            if (rand() % 50 == 0) {
+                snprintf(query, sizeof(query), "c2.bad%d.example", rand() % BENCH_INTEL_SIZE);
+            } else {
+                snprintf(query, sizeof(query), "%s", domains[rand() % 8]);
+            }
+            msgpack_pack_map(pk, 8);
+            bench_pack_str(pk, "host");
+            bench_pack_str(pk, "dns01");
+            bench_pack_str(pk, "ident");
+            bench_pack_str(pk, "dnsmasq");
+            bench_pack_str(pk, "event_type");
+            bench_pack_str(pk, "dns_query");
+            bench_pack_str(pk, "query");
+            bench_pack_str(pk, query);
+            bench_pack_str(pk, "domain");
+            bench_pack_str(pk, query);
+            bench_pack_str(pk, "query_type");
+            bench_pack_str(pk, rand() % 4 == 0 ? "AAAA" : "A");
+            bench_pack_str(pk, "src_ip");
+            bench_pack_ip(pk, ip, sizeof(ip));
+            bench_pack_str(pk, "message");
+            snprintf(line, sizeof(line), "query[%s] %s from %s", rand() % 4 == 0 ? "AAAA" : "A",
+                     query, ip);
+            bench_pack_str(pk, line);
+            break;
+    }
+}
+
+/* Rule number i of a set of rules of one type */
+static int bench_add_rule(struct tg_security_ruleset *set, int type, int literal, int i)
+{
+    const char *field = "message";
+    char field_name[32];
+    char pattern[128];
+    char name[64];
+    int known;
+
+    snprintf(name, sizeof(name), "Benchmark rule %d", i + 1);
+
+    switch (type) {
+        case TG_RULE_TYPE_FIELD_MATCH:
+            known = (int) (sizeof(match_rules) / sizeof(match_rules[0])) - 1;
+            if (i < known) {
+                field = match_rules[i][0];
+                snprintf(pattern, sizeof(pattern), "%s", match_rules[i][1]);
+            } else {
+                field = match_fields[i % 3];
+                snprintf(pattern, sizeof(pattern), "marker-%d", i);
+            }
+            break;
+        case TG_RULE_TYPE_FIELD_REGEX:
+            if (literal) {
+                known = (int) (sizeof(literal_patterns) / sizeof(literal_patterns[0])) - 1;
+                if (i < known) {
+                    snprintf(pattern, sizeof(pattern), "%s", literal_patterns[i]);
+                } else {
+                    snprintf(pattern, sizeof(pattern), "marker-%d", i);
+                }
+                break;
+            }
+            known = (int) (sizeof(regex_patterns) / sizeof(regex_patterns[0])) - 1;
+            if (i < known) {
+                snprintf(pattern, sizeof(pattern), "%s", regex_patterns[i]);
+            } else {
+                snprintf(pattern, sizeof(pattern), "(denied|refused) port %d[0-9]*", i);
+            }
+            break;
+        case TG_RULE_TYPE_FIELD_EXISTS:
+            known = (int) (sizeof(exists_fields) / sizeof(exists_fields[0])) - 1;
+            snprintf(field_name, sizeof(field_name), "field_%d", i);
+            field = i < known ? exists_fields[i] : field_name;
+            snprintf(pattern, sizeof(pattern), "*");
+            break;
+        case TG_RULE_TYPE_THREAT_INTEL:
+            field = "*";
+            snprintf(pattern, sizeof(pattern), "*");
+            break;
+        case TG_RULE_TYPE_BEHAVIORAL:
+            field = "event_type";
+            snprintf(pattern, sizeof(pattern), "*");
+            break;
+        case TG_RULE_TYPE_COMPLIANCE:
+            snprintf(pattern, sizeof(pattern), i % 2 ? "(patient|medical|phi)" :
+                     "(card|payment|transaction)");
+            break;
+        case TG_RULE_TYPE_RATE:
+            field = i % 2 ? "user" : "src_ip";
+            snprintf(pattern, sizeof(pattern), "%d/1m,login_failure", 5 + i % 50);
+            break;
+        case TG_RULE_TYPE_DISTINCT:
+            field = "src_ip";
+            snprintf(pattern, sizeof(pattern), "user:%d/5m", 3 + i % 20);
+            break;
+        default:
+            field = "user";
+            snprintf(pattern, sizeof(pattern), "login_failure*%d>login_success>sudo/10m", 1 + i % 5);
+            break;
+    }
+
+    return tg_security_add_rule(set, i + 1, name, "Benchmark rule", type, 1 + i % 100,
+                                TG_SECURITY_ACTION_FLAG, field, pattern);
+}
+
+/* Compiled set of count rules of bench_types[type], or of every type in
+ * turn if type is -1, or the default rules if count is 0 */
+static struct tg_security_ruleset *bench_ruleset(int type, int count)
+{
+    struct tg_security_ruleset *set;
+    int types = (int) (sizeof(bench_types) / sizeof(bench_types[0])) - 1;
+
+    set = tg_security_ruleset_create();
+    if (!set) {
+        return NULL;
+    }
+
+    if (count == 0) {
+        tg_security_add_default_rules(set);
+    }
+    for (int i = 0; i < count; i++) {
+        int t = type < 0 ? i % types : type;
+
+        if (bench_add_rule(set, bench_types[t].type, bench_types[t].literal, i) != 0) {
+            tg_security_ruleset_destroy(set);
+            return NULL;
+        }
+    }
+
+    if (tg_security_compile_rules(set) != 0) {
+        tg_security_ruleset_destroy(set);
+        return NULL;
+    }
+    return set;
+}
+
+/* Known bad addresses and domains, some of which the records use */
+static struct tg_ioc_store *bench_ioc_create(void)
+{
+    struct tg_ioc_store *store;
+    char value[64];
+    int len;
+
+    store = tg_ioc_store_create();
+    if (!store) {
+        return NULL;
+    }
+
+    for (int i = 0; i < BENCH_INTEL_SIZE; i++) {
+        len = snprintf(value, sizeof(value), "203.0.%d.%d", i / 256, i % 256);
+        tg_ioc_store_add(store, TG_IOC_IP, value, (size_t) len, 1);
+        len = snprintf(value, sizeof(value), "bad%d.example", i);
+        tg_ioc_store_add(store, TG_IOC_DOMAIN, value, (size_t) len, 1);
+    }
+
+    if (tg_ioc_store_compile(store) != 0) {
+        tg_ioc_store_destroy(store);
+        return NULL;
+    }
+    return store;
+}
+
+/* Filter context set up like the plugin's, with every behavioral table
+ * and an indicator store, evaluating set; freed by the plugin's exit
+ * callback */
+static struct tg_security_ctx *bench_ctx_create(struct tg_security_ruleset *set,
+                                                int columnar, int workers)
+{
+    struct flb_filter_plugin *plugin = tg_security_plugin_register();
+    struct tg_security_ctx *ctx;
+    struct tg_ioc_store *store;
+
+    if (!set) {
+        return NULL;
+    }
+
+    ctx = flb_calloc(1, sizeof(struct tg_security_ctx));
+    if (!ctx) {
+        tg_security_ruleset_destroy(set);
+        return NULL;
+    }
+
+    ctx->config = flb_calloc(1, sizeof(struct tg_agent_config));
+    if (!ctx->config || tg_security_init_rules(ctx) != 0) {
+        tg_security_ruleset_destroy(set);
+        plugin->cb_exit(ctx, NULL);
+        return NULL;
+    }
+
+    ctx->columnar_evaluation = columnar;
+    tg_security_ruleset_publish(ctx, set);
+
+    store = bench_ioc_create();
+    if (store) {
+        tg_security_ioc_publish(ctx, store);
+    }
+
+    ctx->rate_keys = tg_session_table_create(TG_SECURITY_RATE_KEYS, TG_SECURITY_RATE_MAX_WINDOW,
+                                             NULL, NULL);
+    ctx->distinct_keys = tg_distinct_table_create(TG_SECURITY_DISTINCT_KEYS);
+    ctx->sequence_keys = tg_correlate_table_create(TG_SECURITY_SEQUENCE_KEYS);
+
+    if (!store || !ctx->rate_keys || !ctx->distinct_keys || !ctx->sequence_keys ||
+        tg_security_enrich_init(ctx) != 0) {
+        plugin->cb_exit(ctx, NULL);
+        return NULL;
+    }
+
+    /* With workers, every chunk is evaluated by the pool */
+    if (workers > 0) {
+        ctx->pool = tg_pool_create(workers);
+        ctx->pool_min_chunk = 0;
+        if (!ctx->pool) {
+            plugin->cb_exit(ctx, NULL);
+            return NULL;
+        }
+    }
+
+    return ctx;
+}
+
+struct bench_result {
+    uint64_t ns;
+    uint64_t events;
+    uint64_t allocs;
+    uint64_t flagged;
+};
+
+static void bench_report(const char *name, int rules, const struct bench_result *result)
+{
+    char allocs[32];
+
+    if (BENCH_COUNTS_ALLOCS) {
+        snprintf(allocs, sizeof(allocs), "%.2f", (double) result->allocs / result->events);
+    } else {
+        snprintf(allocs, sizeof(allocs), "-");
+    }
+
+    printf("%-12s %7d %12.0f %10.1f %13s %10llu\n", name, rules,
+           result->events * 1e9 / result->ns, (double) result->ns / result->events, allocs,
+           (unsigned long long) result->flagged);
+}
+
+/* Evaluate decoded records against the rule set the way the filter does,
+ * one at a time or in batches */
+static int bench_evaluate(struct tg_security_ctx *ctx, msgpack_object *records, int count,
+                          int iterations, struct bench_result *result)
+{
+    struct tg_security_ruleset *set;
+    struct tg_security_worker *worker;
+    uint8_t actions[TG_SECURITY_BATCH_RECORDS];
+    uint64_t allocs;
+    uint64_t start;
+
+    worker = tg_security_worker_get(ctx);
+    if (!worker) {
+        return -1;
+    }
+
+    allocs = BENCH_ALLOCS();
+    start = bench_now_ns();
+
+    for (int it = 0; it < iterations; it++) {
+        set = tg_security_ruleset_read_lock(ctx, worker);
+        if (!set || tg_security_worker_bind(ctx, worker, set) != 0) {
+            tg_security_ruleset_read_unlock(worker);
+            return -1;
+        }
+
+        if (worker->columnar) {
+            for (int e = 0; e < count; e += TG_SECURITY_BATCH_RECORDS) {
+                uint32_t batch = (uint32_t) (count - e < TG_SECURITY_BATCH_RECORDS ?
+                                             count - e : TG_SECURITY_BATCH_RECORDS);
+
+                tg_security_apply_batch(records + e, batch, set, worker, actions);
+                for (uint32_t r = 0; r < batch; r++) {
+                    if (actions[r] != TG_SECURITY_ACTION_PASS) {
+                        result->flagged++;
+                    }
+                }
+            }
+        } else {
+            for (int e = 0; e < count; e++) {
+                if (tg_security_apply_filter(&records[e], set, worker) != TG_SECURITY_ACTION_PASS) {
+                    result->flagged++;
+                }
+            }
+        }
+
+        tg_security_ruleset_read_unlock(worker);
+    }
+
+    result->ns = bench_now_ns() - start;
+    result->allocs = BENCH_ALLOCS() - allocs;
+    result->events = (uint64_t) count * iterations;
+    return 0;
+}
+
+/* Run chunks through the plugin's filter callback */
+static int bench_filter(struct tg_security_ctx *ctx, const char *data, const size_t *chunk_ends,
+                        int chunks, int records, int iterations, struct bench_result *result)
+{
+    struct flb_filter_plugin *plugin = tg_security_plugin_register();
+    struct flb_filter_instance ins;
+    struct tg_security_worker *worker;
+    uint64_t flagged;
+    uint64_t allocs;
+    uint64_t start;
+    void *out_buf;
+    size_t out_size;
+    size_t off;
+    int ret;
+
+    memset(&ins, 0, sizeof(ins));
+
+    worker = tg_security_worker_get(ctx);
+    if (!worker) {
+        return -1;
+    }
+    flagged = worker->stats.events_flagged;
+
+    allocs = BENCH_ALLOCS();
+    start = bench_now_ns();
+
+    for (int it = 0; it < iterations; it++) {
+        off = 0;
+        for (int c = 0; c < chunks; c++) {
+            ret = plugin->cb_filter(data + off, chunk_ends[c] - off, "bench", 5,
+                                    &out_buf, &out_size, &ins, ctx, NULL);
+            if (ret == FLB_FILTER_MODIFIED) {
+                flb_free(out_buf);
+            }
+            off = chunk_ends[c];
+        }
+    }
+
+    result->ns = bench_now_ns() - start;
+    result->allocs = BENCH_ALLOCS() - allocs;
+    result->events = (uint64_t) records * iterations;
+    result->flagged = worker->stats.events_flagged - flagged;
+    return 0;
+}
+
+/* Whole file in memory, past the header if it is a Fluent Bit chunk file */
+static char *bench_read_chunk(const char *path, size_t *size, size_t *skip)
+{
+    FILE *file;
+    char *data;
+    long len;
+    const unsigned char *bytes;
+
+    file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    if (fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) <= 0 ||
+        fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    data = malloc((size_t) len);
+    if (!data || fread(data, 1, (size_t) len, file) != (size_t) len) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    /* Chunk files start with 0xC1 0x00, a byte msgpack never uses, and
+     * hold a 24 byte header and metadata ahead of the records */
+    bytes = (const unsigned char *) data;
+    *skip = 0;
+    if (len >= 24 && bytes[0] == 0xC1 && bytes[1] == 0x00) {
+        *skip = 24 + ((size_t) bytes[22] << 8 | bytes[23]);
+        if (*skip > (size_t) len) {
+            free(data);
+            return NULL;
+        }
+    }
+
+    *size = (size_t) len;
+    return data;
+}
+
+/* The filter callback on the records of a recorded chunk, with the
+ * default rules and with mixed sets of each size */
+static int bench_replay(const char *path, const int *counts, int count_num, int iterations,
+                        int columnar, int workers)
+{
+    struct tg_security_ctx *ctx;
+    struct bench_result result;
+    msgpack_unpacked unpacked;
+    size_t chunk_end;
+    size_t size;
+    size_t skip;
+    size_t off;
+    char *data;
+    int records = 0;
+    int others = 0;
+
+    data = bench_read_chunk(path, &size, &skip);
+    if (!data) {
+        fprintf(stderr, "cannot read chunk file %s\n", path);
+        return -1;
+    }
+
+    /* The filter evaluates maps and the maps of [timestamp, map] event
+     * arrays; anything else passes unevaluated */
+    off = skip;
+    msgpack_unpacked_init(&unpacked);
+    while (msgpack_unpack_next(&unpacked, data, size, &off) == MSGPACK_UNPACK_SUCCESS) {
+        msgpack_object *record = &unpacked.data;
+
+        if (record->type == MSGPACK_OBJECT_ARRAY && record->via.array.size == 2) {
+            record = &record->via.array.ptr[1];
+        }
+        if (record->type != MSGPACK_OBJECT_MAP) {
+            others++;
+        }
+        records++;
+    }
+    msgpack_unpacked_destroy(&unpacked);
+
+    if (records == others) {
+        fprintf(stderr, "no events in %s\n", path);
+        free(data);
+        return -1;
+    }
+    if (others > 0) {
+        fprintf(stderr, "warning: %d of %d records in %s are not events and are not "
+                "evaluated\n", others, records, path);
+    }
+
+    printf("replay: %s, %d records x %d, %zu bytes\n", path, records, iterations, size - skip);
+    printf("%-12s %7s %12s %10s %13s %10s\n", "rules", "count", "events/s", "ns/event",
+           "allocs/event", "flagged");
+
+    chunk_end = size - skip;
+    for (int n = -1; n < count_num; n++) {
+        ctx = bench_ctx_create(bench_ruleset(-1, n < 0 ? 0 : counts[n]), columnar, workers);
+        if (!ctx) {
+            fprintf(stderr, "cannot set up the filter\n");
+            free(data);
+            return -1;
+        }
+
+        memset(&result, 0, sizeof(result));
+        if (bench_filter(ctx, data + skip, &chunk_end, 1, records, iterations, &result) == 0) {
+            bench_report(n < 0 ? "default" : "mixed", n < 0 ? ctx->ruleset->rule_count : counts[n],
+                         &result);
+        }
+        tg_security_plugin_register()->cb_exit(ctx, NULL);
+    }
+
+    free(data);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int event_count = 10000;
+    int iterations = 1;
+    int chunk_records = 1000;
+    int columnar = 0;
+    int workers = 0;
+    int counts[BENCH_MAX_COUNTS] = { 10, 1000, 10000 };
+    int count_num = 3;
+    const char *types = NULL;
+    const char *replay = NULL;
+    struct tg_security_ruleset *set;
+    struct tg_security_ctx *ctx;
+    struct bench_result result;
+    msgpack_sbuffer sbuf;
+    msgpack_packer packer;
+    msgpack_zone zone;
+    msgpack_object *records;
+    size_t *record_ends;
+    size_t *chunk_ends;
+    int chunks;
+    size_t off;
+    char *p;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:i:n:t:c:Cw:r:h")) != -1) {
+        switch (opt) {
+            case 'e':
+                event_count = atoi(optarg);
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            case 'n':
+                count_num = 0;
+                p = optarg;
+                while (*p && count_num < BENCH_MAX_COUNTS) {
+                    counts[count_num++] = (int) strtol(p, &p, 10);
+                    if (*p == ',') {
+                        p++;
+                    }
+                }
+                break;
+            case 't':
+                types = optarg;
+                break;
+            case 'c':
+                chunk_records = atoi(optarg);
+                break;
+            case 'C':
+                columnar = 1;
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'r':
+                replay = optarg;
+                break;
+            default:
+                bench_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (event_count <= 0 || iterations <= 0 || chunk_records <= 0 || count_num == 0 ||
+        workers < 0 || workers > TG_POOL_MAX_THREADS) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+    for (int n = 0; n < count_num; n++) {
+        if (counts[n] <= 0 || counts[n] > TG_SECURITY_MAX_RULES) {
+            fprintf(stderr, "rule counts are 1 to %d\n", TG_SECURITY_MAX_RULES);
+            return 1;
+        }
+    }
+
+    if (replay) {
+        return bench_replay(replay, counts, count_num, iterations, columnar, workers) == 0 ? 0 : 1;
+    }
+
+    srand(42);
+
+    /* Records of each shape in turn, in one buffer cut into chunks */
+    records = calloc(event_count, sizeof(msgpack_object));
+    record_ends = calloc(event_count, sizeof(size_t));
+    chunks = (event_count + chunk_records - 1) / chunk_records;
+    chunk_ends = calloc(chunks, sizeof(size_t));
+    if (!records || !record_ends || !chunk_ends) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&packer, &sbuf, msgpack_sbuffer_write);
+    for (int e = 0; e < event_count; e++) {
+        bench_pack_record(&packer, e % BENCH_SHAPES);
+        record_ends[e] = sbuf.size;
+    }
+    for (int c = 0; c < chunks; c++) {
+        int last = (c + 1) * chunk_records;
+
+        chunk_ends[c] = record_ends[(last < event_count ? last : event_count) - 1];
+    }
+
+    /* Decoded once, for timing evaluation alone */
+    msgpack_zone_init(&zone, MSGPACK_ZONE_CHUNK_SIZE);
+    off = 0;
+    for (int e = 0; e < event_count; e++) {
+        if (msgpack_unpack(sbuf.data, sbuf.size, &off, &zone, &records[e]) < 0) {
+            fprintf(stderr, "cannot decode record %d\n", e);
+            return 1;
+        }
+    }
+
+    printf("records: %d x %d (syslog, auth, auditd, dns), avg record: %.0f bytes, %s\n",
+           event_count, iterations, (double) sbuf.size / event_count,
+           columnar ? "columnar" : "record at a time");
+
+    /* Rule evaluation alone, per rule type and rule count */
+    printf("%-12s %7s %12s %10s %13s %10s\n", "type", "rules", "events/s", "ns/event",
+           "allocs/event", "flagged");
+    for (int t = 0; bench_types[t].name; t++) {
+        if (!bench_selected(types, bench_types[t].name)) {
+            continue;
+        }
+
+        for (int n = 0; n < count_num; n++) {
+            set = bench_ruleset(t, counts[n]);
+            ctx = set ? bench_ctx_create(set, columnar, 0) : NULL;
+            if (!ctx) {
+                fprintf(stderr, "cannot set up %d %s rules\n", counts[n], bench_types[t].name);
+                return 1;
+            }
+
+            memset(&result, 0, sizeof(result));
+            if (bench_evaluate(ctx, records, event_count, iterations, &result) != 0) {
+                fprintf(stderr, "cannot evaluate %s rules\n", bench_types[t].name);
+                return 1;
+            }
+            bench_report(bench_types[t].name, counts[n], &result);
+
+            tg_security_plugin_register()->cb_exit(ctx, NULL);
+        }
+    }
+
+    /* The filter callback on whole chunks: decoding, evaluation and output */
+    printf("\nfilter: %d chunks of %d records, %d workers\n", chunks, chunk_records, workers);
+    printf("%-12s %7s %12s %10s %13s %10s\n", "rules", "count", "events/s", "ns/event",
+           "allocs/event", "flagged");
+    for (int n = -1; n < count_num; n++) {
+        ctx = bench_ctx_create(bench_ruleset(-1, n < 0 ? 0 : counts[n]), columnar, workers);
+        if (!ctx) {
+            fprintf(stderr, "cannot set up the filter\n");
+            return 1;
+        }
+
+        memset(&result, 0, sizeof(result));
+        if (bench_filter(ctx, sbuf.data, chunk_ends, chunks, event_count, iterations,
+                         &result) == 0) {
+            bench_report(n < 0 ? "default" : "mixed", n < 0 ? ctx->ruleset->rule_count : counts[n],
+                         &result);
+        }
+        tg_security_plugin_register()->cb_exit(ctx, NULL);
+    }
+
+    msgpack_zone_destroy(&zone);
+    msgpack_sbuffer_destroy(&sbuf);
+    free(records);
+    free(record_ends);
+    free(chunk_ends);
+
+    return 0;
+}
@@ -0,0 +1,255 @@
+/*  ThreatGuard Agent - Regex Matcher Benchmark
+ *  Compares the per-rule substring path used before regex support with a
+ *  single lazy DFA scan over all regex rules of a field
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../plugins/filter_threatguard_security/security_regex.h"
+#include "../include/threatguard.h"
+
+#include <getopt.h>
+
+/* Default FIELD_REGEX message rules shipped with the filter */
+static const char *default_patterns[] = {
+    "(failed|failure|denied|invalid).*login",
+    "(sudo|runas|escalat|privileg|su([^a-z]|$))",
+    "(virus|malware|trojan|ransomware|backdoor)",
+    "(connection.*refused|port.*scan|brute.*force)",
+    "(system32|etc/passwd|etc/shadow|hosts).*modif",
+    "^(heartbeat|ping|health.*check)",
+    NULL
+};
+
+static const char *words[] = {
+    "sshd", "kernel", "systemd", "cron", "nginx", "postgres", "audit", "session",
+    "opened", "closed", "user", "root", "admin", "accepted", "password", "publickey",
+    "from", "port", "connection", "timeout", "reset", "denied", "failed", "login",
+    "started", "stopped", "service", "unit", "request", "GET", "POST", "status",
+    "disk", "usage", "warning", "error", "token", "expired", "policy", "update",
+    NULL
+};
+
+#define BENCH_LINE_SHAPES 6
+
+/* Synthetic syslog, auth, audit, cron, access and systemd lines */
+static void bench_make_line(char *buf, size_t size, int shape)
+{
+    const char *host = "Oct 16 12:00:00 host01";
+    const char *word = words[rand() % (int) (sizeof(words) / sizeof(words[0]) - 1)];
+
+    switch (shape) {
+        case 0:
+            snprintf(buf, size, "%s sshd[%d]: Accepted publickey for %s from 10.%d.%d.%d port %d ssh2",
+                     host, rand() % 65536, word, rand() % 256, rand() % 256, rand() % 256,
+                     rand() % 65536);
+            break;
+        case 1:
+            snprintf(buf, size, "%s sshd[%d]: Failed password for invalid user %s from "
+                     "192.168.%d.%d port %d ssh2 login",
+                     host, rand() % 65536, word, rand() % 256, rand() % 256, rand() % 65536);
+            break;
+        case 2:
+            snprintf(buf, size, "%s kernel: [%d.%06d] audit: type=1400 apparmor=\"ALLOWED\" "
+                     "operation=\"open\" profile=\"%s\"",
+                     host, rand() % 100000, rand() % 1000000, word);
+            break;
+        case 3:
+            snprintf(buf, size, "%s CRON[%d]: pam_unix(cron:session): session opened for user %s "
+                     "by (uid=%d)", host, rand() % 65536, word, rand() % 1000);
+            break;
+        case 4:
+            snprintf(buf, size, "%s nginx: 10.%d.%d.%d - - \"GET /api/v1/%s HTTP/1.1\" 200 %d",
+                     host, rand() % 256, rand() % 256, rand() % 256, word, rand() % 10000);
+            break;
+        default:
+            snprintf(buf, size, "%s systemd[1]: Started Session %d of user %s; heartbeat "
+                     "interval %dms", host, rand() % 10000, word, rand() % 5000);
+            break;
+    }
+}
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* Same semantics as BSD strnstr(), which the substring path relies on */
+static const char *bench_strnstr(const char *haystack, const char *needle, size_t len)
+{
+    size_t needle_len = strlen(needle);
+
+    if (needle_len == 0) {
+        return haystack;
+    }
+
+    for (size_t i = 0; i + needle_len <= len && haystack[i]; i++) {
+        if (haystack[i] == needle[0] && memcmp(haystack + i, needle, needle_len) == 0) {
+            return haystack + i;
+        }
+    }
+    return NULL;
+}
+
+static int bench_count_match(uint32_t pattern_id, void *data)
+{
+    (void) pattern_id;
+    (*(uint64_t *) data)++;
+    return 0;
+}
+
+static void bench_usage(const char *name)
+{
+    printf("usage: %s [-r rules] [-e events] [-i iterations] [-c cache_bytes]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int rule_count = 1000;
+    int event_count = 10000;
+    int iterations = 5;
+    size_t cache_size = TG_REGEX_DEFAULT_CACHE_SIZE;
+    char **patterns;
+    char **lines;
+    size_t *line_lens;
+    size_t total_bytes = 0;
+    int word_count = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:e:i:c:h")) != -1) {
+        switch (opt) {
+            case 'r':
+                rule_count = atoi(optarg);
+                break;
+            case 'e':
+                event_count = atoi(optarg);
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            case 'c':
+                cache_size = (size_t) strtoull(optarg, NULL, 10);
+                break;
+            default:
+                bench_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (rule_count <= 0 || event_count <= 0 || iterations <= 0) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    while (words[word_count]) {
+        word_count++;
+    }
+
+    srand(42);
+
+    /* Default rules first, then synthetic "(a|b).*c" rules */
+    patterns = calloc(rule_count, sizeof(char *));
+    for (int i = 0; i < rule_count; i++) {
+        patterns[i] = malloc(128);
+        if (i < 6) {
+            snprintf(patterns[i], 128, "%s", default_patterns[i]);
+        } else {
+            snprintf(patterns[i], 128, "(%s|%s%d).*%s",
+                     words[rand() % word_count], words[rand() % word_count], i,
+                     words[rand() % word_count]);
+        }
+    }
+
+    lines = calloc(event_count, sizeof(char *));
+    line_lens = calloc(event_count, sizeof(size_t));
+    for (int i = 0; i < event_count; i++) {
+        lines[i] = malloc(512);
+        bench_make_line(lines[i], 512, i % BENCH_LINE_SHAPES);
+        line_lens[i] = strlen(lines[i]);
+        total_bytes += line_lens[i];
+    }
+
+    /* Substring path: one strnstr per rule per event */
+    uint64_t substring_hits = 0;
+    uint64_t start = bench_now_ns();
+    for (int it = 0; it < iterations; it++) {
+        for (int e = 0; e < event_count; e++) {
+            for (int r = 0; r < rule_count; r++) {
+                if (bench_strnstr(lines[e], patterns[r], line_lens[e])) {
+                    substring_hits++;
+                }
+            }
+        }
+    }
+    uint64_t substring_ns = bench_now_ns() - start;
+
+    /* Regex path: one DFA scan per event for all rules */
+    struct tg_regex_set *set = tg_regex_set_create();
+    char error[128];
+    start = bench_now_ns();
+    for (int r = 0; r < rule_count; r++) {
+        if (tg_regex_set_add(set, patterns[r], r, error, sizeof(error)) != 0) {
+            fprintf(stderr, "pattern %d '%s': %s\n", r, patterns[r], error);
+            return 1;
+        }
+    }
+    tg_regex_set_compile(set);
+    struct tg_regex_dfa *dfa = tg_regex_dfa_create(set, cache_size);
+    uint64_t compile_ns = bench_now_ns() - start;
+
+    /* Warm the state cache once, then measure steady state */
+    uint64_t regex_hits = 0;
+    for (int e = 0; e < event_count; e++) {
+        tg_regex_dfa_scan(dfa, lines[e], line_lens[e], bench_count_match, &regex_hits);
+    }
+
+    regex_hits = 0;
+    start = bench_now_ns();
+    for (int it = 0; it < iterations; it++) {
+        for (int e = 0; e < event_count; e++) {
+            if (tg_regex_dfa_scan(dfa, lines[e], line_lens[e],
+                                  bench_count_match, &regex_hits) < 0) {
+                fprintf(stderr, "regex scan failed\n");
+                return 1;
+            }
+        }
+    }
+    uint64_t regex_ns = bench_now_ns() - start;
+
+    struct tg_regex_dfa_stats stats;
+    tg_regex_dfa_get_stats(dfa, &stats);
+
+    double events = (double) event_count * iterations;
+    double bytes = (double) total_bytes * iterations;
+
+    printf("rules: %d, events: %d x %d, avg line: %.0f bytes\n",
+           rule_count, event_count, iterations, (double) total_bytes / event_count);
+    printf("%-10s %12s %12s %12s %14s\n", "path", "ns/event", "events/s", "MB/s", "reports");
+    printf("%-10s %12.1f %12.0f %12.1f %14llu\n", "substring",
+           substring_ns / events, events * 1e9 / substring_ns, bytes * 1e3 / substring_ns,
+           (unsigned long long) substring_hits);
+    printf("%-10s %12.1f %12.0f %12.1f %14llu\n", "regex-dfa",
+           regex_ns / events, events * 1e9 / regex_ns, bytes * 1e3 / regex_ns,
+           (unsigned long long) regex_hits);
+    printf("regex compile: %.2f ms, dfa states: %u (%llu built), cache: %zu/%zu bytes, "
+           "flushes: %llu, nfa scans: %llu\n",
+           compile_ns / 1e6, stats.states, (unsigned long long) stats.states_built,
+           stats.cache_used, stats.cache_size, (unsigned long long) stats.cache_flushes,
+           (unsigned long long) stats.nfa_scans);
+
+    tg_regex_dfa_destroy(dfa);
+    tg_regex_set_destroy(set);
+    for (int i = 0; i < rule_count; i++) {
+        free(patterns[i]);
+    }
+    for (int i = 0; i < event_count; i++) {
+        free(lines[i]);
+    }
+    free(patterns);
+    free(lines);
+    free(line_lens);
+
+    return 0;
+}
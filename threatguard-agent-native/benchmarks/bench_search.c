@@ -0,0 +1,244 @@
+/*  ThreatGuard Agent - Substring Search Benchmark
+ *  Compares the byte-at-a-time strnstr() path of the substring checks with
+ *  each vector search implementation the CPU supports, on log lines
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../plugins/filter_threatguard_security/security_search.h"
+#include "../include/threatguard.h"
+
+#include <getopt.h>
+
+/* Keywords of the behavioral and compliance checks, and literal rules */
+static const char *needles[] = {
+    "privilege", "escalation", "sudo", "payment", "card", "transaction",
+    "patient", "medical", "phi", "failed password", "mimikatz", "/etc/shadow",
+    NULL
+};
+
+static const char *words[] = {
+    "sshd", "kernel", "systemd", "cron", "nginx", "postgres", "audit", "session",
+    "opened", "closed", "user", "root", "admin", "accepted", "password", "publickey",
+    "from", "port", "connection", "timeout", "reset", "denied", "failed", "login",
+    "started", "stopped", "service", "unit", "request", "GET", "POST", "status",
+    "disk", "usage", "warning", "error", "token", "expired", "policy", "update",
+    NULL
+};
+
+#define BENCH_LINE_SHAPES 6
+#define BENCH_LINE_MAX    4096
+
+/* Synthetic syslog, auth, audit, cron, access and systemd lines, padded
+ * with words to at least min_len bytes */
+static size_t bench_make_line(char *buf, size_t size, int shape, size_t min_len, int word_count)
+{
+    const char *host = "Oct 16 12:00:00 host01";
+    const char *word = words[rand() % word_count];
+    size_t len;
+
+    switch (shape) {
+        case 0:
+            snprintf(buf, size, "%s sshd[%d]: Accepted publickey for %s from 10.%d.%d.%d port %d ssh2",
+                     host, rand() % 65536, word, rand() % 256, rand() % 256, rand() % 256,
+                     rand() % 65536);
+            break;
+        case 1:
+            snprintf(buf, size, "%s sshd[%d]: Failed password for invalid user %s from "
+                     "192.168.%d.%d port %d ssh2",
+                     host, rand() % 65536, word, rand() % 256, rand() % 256, rand() % 65536);
+            break;
+        case 2:
+            snprintf(buf, size, "%s kernel: [%d.%06d] audit: type=1400 apparmor=\"ALLOWED\" "
+                     "operation=\"open\" profile=\"%s\" name=\"/etc/shadow\"",
+                     host, rand() % 100000, rand() % 1000000, word);
+            break;
+        case 3:
+            snprintf(buf, size, "%s sudo: %s : TTY=pts/%d ; PWD=/home/%s ; USER=root ; "
+                     "COMMAND=/usr/bin/systemctl restart nginx",
+                     host, word, rand() % 10, word);
+            break;
+        case 4:
+            snprintf(buf, size, "%s nginx: 10.%d.%d.%d - - \"POST /api/v1/payments/%d HTTP/1.1\" "
+                     "200 %d \"-\" \"Mozilla/5.0 (X11; Linux x86_64)\"",
+                     host, rand() % 256, rand() % 256, rand() % 256, rand() % 100000,
+                     rand() % 10000);
+            break;
+        default:
+            snprintf(buf, size, "%s systemd[1]: Started Session %d of user %s.",
+                     host, rand() % 10000, word);
+            break;
+    }
+
+    len = strlen(buf);
+    while (len < min_len && len + 16 < size) {
+        len += (size_t) snprintf(buf + len, size - len, " %s", words[rand() % word_count]);
+    }
+    return len;
+}
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* Same semantics as BSD strnstr(), which the substring checks used */
+static const char *bench_strnstr(const char *haystack, const char *needle, size_t len)
+{
+    size_t needle_len = strlen(needle);
+
+    if (needle_len == 0) {
+        return haystack;
+    }
+
+    for (size_t i = 0; i + needle_len <= len && haystack[i]; i++) {
+        if (haystack[i] == needle[0] && memcmp(haystack + i, needle, needle_len) == 0) {
+            return haystack + i;
+        }
+    }
+    return NULL;
+}
+
+static void bench_usage(const char *name)
+{
+    printf("usage: %s [-e events] [-i iterations] [-l min_line_length]\n", name);
+}
+
+static void bench_report(const char *path, uint64_t ns, double searches, double bytes,
+                         uint64_t hits)
+{
+    printf("%-14s %12.1f %12.1f %14llu\n", path, ns / searches, bytes * 1e3 / ns,
+           (unsigned long long) hits);
+}
+
+int main(int argc, char **argv)
+{
+    int event_count = 10000;
+    int iterations = 20;
+    size_t min_len = 0;
+    int needle_count = 0;
+    int word_count = 0;
+    size_t needle_lens[16];
+    char **lines;
+    size_t *line_lens;
+    size_t total_bytes = 0;
+    uint64_t reference_hits = 0;
+    uint64_t start;
+    uint64_t ns;
+    int best;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:i:l:h")) != -1) {
+        switch (opt) {
+            case 'e':
+                event_count = atoi(optarg);
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            case 'l':
+                min_len = (size_t) strtoull(optarg, NULL, 10);
+                break;
+            default:
+                bench_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (event_count <= 0 || iterations <= 0 || min_len >= BENCH_LINE_MAX) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    while (words[word_count]) {
+        word_count++;
+    }
+    while (needles[needle_count]) {
+        needle_lens[needle_count] = strlen(needles[needle_count]);
+        needle_count++;
+    }
+
+    srand(42);
+
+    lines = calloc(event_count, sizeof(char *));
+    line_lens = calloc(event_count, sizeof(size_t));
+    for (int i = 0; i < event_count; i++) {
+        lines[i] = malloc(BENCH_LINE_MAX);
+        line_lens[i] = bench_make_line(lines[i], BENCH_LINE_MAX, i % BENCH_LINE_SHAPES,
+                                       min_len, word_count);
+        total_bytes += line_lens[i];
+    }
+
+    double searches = (double) event_count * iterations * needle_count;
+    double bytes = (double) total_bytes * iterations * needle_count;
+
+    printf("events: %d x %d, needles: %d, avg line: %.0f bytes\n",
+           event_count, iterations, needle_count, (double) total_bytes / event_count);
+    printf("%-14s %12s %12s %14s\n", "path", "ns/search", "MB/s", "hits");
+
+    /* Current path: one strnstr per needle per line */
+    start = bench_now_ns();
+    for (int it = 0; it < iterations; it++) {
+        for (int e = 0; e < event_count; e++) {
+            for (int n = 0; n < needle_count; n++) {
+                if (bench_strnstr(lines[e], needles[n], line_lens[e])) {
+                    reference_hits++;
+                }
+            }
+        }
+    }
+    ns = bench_now_ns() - start;
+    bench_report("strnstr", ns, searches, bytes, reference_hits);
+
+    /* Every implementation up to the best one supported */
+    best = tg_search_init(TG_SEARCH_AVX2);
+    for (int level = TG_SEARCH_SCALAR; level <= best; level++) {
+        uint64_t hits = 0;
+        uint64_t nocase_hits = 0;
+        char name[32];
+
+        tg_search_init(level);
+
+        start = bench_now_ns();
+        for (int it = 0; it < iterations; it++) {
+            for (int e = 0; e < event_count; e++) {
+                for (int n = 0; n < needle_count; n++) {
+                    if (tg_search(lines[e], line_lens[e], needles[n], needle_lens[n])) {
+                        hits++;
+                    }
+                }
+            }
+        }
+        ns = bench_now_ns() - start;
+        bench_report(tg_search_name(level), ns, searches, bytes, hits);
+
+        start = bench_now_ns();
+        for (int it = 0; it < iterations; it++) {
+            for (int e = 0; e < event_count; e++) {
+                for (int n = 0; n < needle_count; n++) {
+                    if (tg_search_nocase(lines[e], line_lens[e], needles[n], needle_lens[n])) {
+                        nocase_hits++;
+                    }
+                }
+            }
+        }
+        ns = bench_now_ns() - start;
+        snprintf(name, sizeof(name), "%s-nocase", tg_search_name(level));
+        bench_report(name, ns, searches, bytes, nocase_hits);
+
+        if (hits != reference_hits || nocase_hits < hits) {
+            fprintf(stderr, "%s: results differ from strnstr\n", tg_search_name(level));
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < event_count; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    free(line_lens);
+
+    return 0;
+}
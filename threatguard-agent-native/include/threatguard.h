@@ -193,18 +193,11 @@ struct tg_discovery_ctx {
     int health_timer;
 };
 
-struct tg_security_ctx {
-    struct flb_filter_instance *ins;
-    struct tg_agent_config *config;
-    
-    /* Security rules */
-    int rule_count;
-    struct {
-        char pattern[256];
-        int priority;
-        int action;  /* 0=pass, 1=flag, 2=drop */
-    } rules[100];
-};
+/* Security filter context and rule sets, defined by the filter plugin
+ * (security_rules.h) */
+struct tg_security_ctx;
+struct tg_security_ruleset;
+struct tg_security_worker;
 
 struct tg_platform_ctx {
     struct flb_output_instance *ins;
@@ -228,6 +221,8 @@ int tg_log_init(void);
 void tg_log(int level, const char *fmt, ...);
 int tg_utils_get_hostname(char *hostname, size_t len);
 uint64_t tg_utils_get_timestamp_ms(void);
+time_t tg_utils_coarse_time(void);
+uint64_t tg_utils_monotonic_ns(void);
 int tg_utils_file_exists(const char *path);
 char *tg_utils_read_file(const char *path, size_t *size);
 
@@ -261,8 +256,8 @@ int tg_darwin_detect_compliance(tg_compliance_t *compliance);
 
 /* Security functions */
 int tg_security_init_rules(struct tg_security_ctx *ctx);
-int tg_security_apply_filter(msgpack_object *obj, struct tg_security_ctx *ctx);
-int tg_security_enrich_event(msgpack_object *obj, struct tg_discovery_result *result);
+int tg_security_apply_filter(msgpack_object *obj, const struct tg_security_ruleset *set,
+                             struct tg_security_worker *worker);
 
 /* Transport functions */
 int tg_transport_init(struct tg_platform_ctx *ctx);
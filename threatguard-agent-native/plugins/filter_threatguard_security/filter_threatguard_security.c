@@ -10,31 +10,101 @@
 #include <fluent-bit/flb_mem.h>
 #include <fluent-bit/flb_time.h>
 #include <fluent-bit/flb_hash.h>
+#include <fluent-bit/flb_utils.h>
 
-#include "../../include/threatguard.h"
+#include "security_rules.h"
 
 /* Plugin configuration properties */
 static struct flb_config_map config_map[] = {
     {
         FLB_CONFIG_MAP_STR, "rules_file", "/etc/threatguard-agent/security-rules.conf",
         0, FLB_TRUE, 0,
-        "Path to security rules configuration file"
+        "Path to security rules configuration file or compiled rule bundle"
+    },
+    {
+        FLB_CONFIG_MAP_BOOL, "watch_rules_file", "true",
+        0, FLB_TRUE, 0,
+        "Reload the rules file when it changes, without restarting"
     },
     {
         FLB_CONFIG_MAP_BOOL, "enable_threat_intel", "true",
         0, FLB_TRUE, 0,
         "Enable threat intelligence enrichment"
     },
+    {
+        FLB_CONFIG_MAP_STR, "threat_intel_file", "/etc/threatguard-agent/threat-intel.feed",
+        0, FLB_TRUE, 0,
+        "Path to the threat intelligence feed of kind|indicator lines"
+    },
+    {
+        FLB_CONFIG_MAP_STR, "threat_intel_spool_dir", "/var/lib/threatguard-agent/threat-intel.d",
+        0, FLB_TRUE, 0,
+        "Directory of threat intelligence delta files (*.delta) applied as they arrive"
+    },
+    {
+        FLB_CONFIG_MAP_INT, "threat_intel_update_interval", "60",
+        0, FLB_TRUE, 0,
+        "Seconds between scans of the threat intelligence spool directory"
+    },
+    {
+        FLB_CONFIG_MAP_INT, "threat_intel_cache_size", "8192",
+        0, FLB_TRUE, 0,
+        "Threat intelligence verdicts cached per worker, 0 to disable"
+    },
     {
         FLB_CONFIG_MAP_BOOL, "enable_behavioral_analysis", "true",
         0, FLB_TRUE, 0,
         "Enable behavioral analysis detection"
     },
+    {
+        FLB_CONFIG_MAP_INT, "behavioral_rate_keys", "65536",
+        0, FLB_TRUE, 0,
+        "Field values counted at once by rate rules; the least recent are evicted"
+    },
+    {
+        FLB_CONFIG_MAP_INT, "behavioral_distinct_keys", "16384",
+        0, FLB_TRUE, 0,
+        "Field values with distinct-count sketches at once; the least recent are evicted"
+    },
+    {
+        FLB_CONFIG_MAP_INT, "behavioral_sequence_keys", "131072",
+        0, FLB_TRUE, 0,
+        "Open partial matches of sequence rules; those closest to expiring are evicted"
+    },
     {
         FLB_CONFIG_MAP_INT, "max_rules", "10000",
         0, FLB_TRUE, 0,
         "Maximum number of security rules to load"
     },
+    {
+        FLB_CONFIG_MAP_SIZE, "regex_cache_size", "1M",
+        0, FLB_TRUE, 0,
+        "Memory budget for the lazy regex DFA state cache of each field"
+    },
+    {
+        FLB_CONFIG_MAP_BOOL, "full_rule_stats", "false",
+        0, FLB_TRUE, 0,
+        "Evaluate every rule on every event for exact match counts, instead of "
+        "stopping once no remaining rule can change the action"
+    },
+    {
+        FLB_CONFIG_MAP_BOOL, "columnar_evaluation", "false",
+        0, FLB_TRUE, 0,
+        "Decode chunks in batches of records and run each rule over the field "
+        "values of a whole batch"
+    },
+    {
+        FLB_CONFIG_MAP_INT, "evaluation_workers", "0",
+        0, FLB_TRUE, 0,
+        "Threads that evaluate large chunks together with the filter thread, "
+        "0 to evaluate every chunk on the filter thread"
+    },
+    {
+        FLB_CONFIG_MAP_SIZE, "evaluation_min_chunk_size", "256K",
+        0, FLB_TRUE, 0,
+        "Smallest chunk split across the evaluation workers; smaller chunks are "
+        "evaluated on the filter thread"
+    },
     {
         FLB_CONFIG_MAP_BOOL, "drop_noise", "true",
         0, FLB_TRUE, 0,
@@ -48,7 +118,21 @@ static int tg_security_init(struct flb_filter_instance *ins,
                            struct flb_config *config, void *data)
 {
     struct tg_security_ctx *ctx;
+    struct tg_security_ruleset *set;
     const char *rules_file;
+    const char *intel_file;
+    const char *intel_spool;
+    const char *intel_interval;
+    const char *intel_cache;
+    const char *cache_size;
+    const char *watch;
+    const char *enabled;
+    const char *rate_keys;
+    const char *distinct_keys;
+    const char *sequence_keys;
+    const char *pool_workers;
+    const char *pool_chunk;
+    int64_t cache_bytes;
     int ret;
     
     flb_plg_info(ins, "initializing ThreatGuard security filter v%s", TG_VERSION);
@@ -79,30 +163,288 @@ static int tg_security_init(struct flb_filter_instance *ins,
         return -1;
     }
     
-    /* Load rules from file */
+    /* Load rules from file, either rule text or a precompiled bundle */
+    set = NULL;
     rules_file = flb_filter_get_property("rules_file", ins);
     if (rules_file && tg_utils_file_exists(rules_file)) {
-        ret = tg_security_load_rules_file(ctx, rules_file);
-        if (ret > 0) {
-            flb_plg_info(ins, "loaded %d security rules from %s", ret, rules_file);
+        set = tg_security_load_ruleset(rules_file);
+        if (set) {
+            flb_plg_info(ins, "loaded %d security rules from %s", set->rule_count, rules_file);
         } else {
             flb_plg_warn(ins, "failed to load rules from %s, using defaults", rules_file);
         }
     }
     
     /* Add default rules if no rules loaded */
-    if (ctx->rule_count == 0) {
-        tg_security_add_default_rules(ctx);
-        flb_plg_info(ins, "loaded %d default security rules", ctx->rule_count);
+    if (!set) {
+        set = tg_security_ruleset_create();
+        if (!set) {
+            tg_security_cleanup_rules(ctx);
+            flb_free(ctx->config);
+            flb_free(ctx);
+            return -1;
+        }
+        
+        tg_security_add_default_rules(set);
+        flb_plg_info(ins, "loaded %d default security rules", set->rule_count);
+        
+        /* Compile field rules into per-field automata */
+        ret = tg_security_compile_rules(set);
+        if (ret != 0) {
+            flb_plg_warn(ins, "failed to compile rule matchers, using per-rule evaluation");
+        }
+    }
+    
+    /* Size of each worker's lazy regex DFA cache */
+    cache_size = flb_filter_get_property("regex_cache_size", ins);
+    if (cache_size) {
+        cache_bytes = flb_utils_size_to_bytes(cache_size);
+        if (cache_bytes > 0) {
+            ctx->regex_cache_size = (size_t) cache_bytes;
+        } else {
+            flb_plg_warn(ins, "invalid regex_cache_size '%s', using default", cache_size);
+        }
+    }
+    
+    /* Rules that cannot change the action are skipped unless asked for */
+    enabled = flb_filter_get_property("full_rule_stats", ins);
+    if (enabled && flb_utils_bool(enabled) == FLB_TRUE) {
+        ctx->full_rule_stats = 1;
+    }
+    
+    /* Record at a time unless batches are asked for */
+    enabled = flb_filter_get_property("columnar_evaluation", ins);
+    if (enabled && flb_utils_bool(enabled) == FLB_TRUE) {
+        ctx->columnar_evaluation = 1;
+    }
+    
+    tg_security_ruleset_publish(ctx, set);
+    
+    /* Load threat intelligence indicators */
+    enabled = flb_filter_get_property("enable_threat_intel", ins);
+    intel_file = flb_filter_get_property("threat_intel_file", ins);
+    intel_spool = flb_filter_get_property("threat_intel_spool_dir", ins);
+    intel_interval = flb_filter_get_property("threat_intel_update_interval", ins);
+    intel_cache = flb_filter_get_property("threat_intel_cache_size", ins);
+    if (!enabled || flb_utils_bool(enabled) == FLB_TRUE) {
+        if (intel_file && tg_utils_file_exists(intel_file) &&
+            tg_security_load_threat_intel(ctx, intel_file) < 0) {
+            flb_plg_warn(ins, "failed to load threat intelligence from %s", intel_file);
+        }
+        
+        /* Delta files are applied by the watcher thread */
+        if (intel_spool && intel_spool[0] != '\0') {
+            ctx->threat_intel_spool = flb_strdup(intel_spool);
+        }
+        if (intel_interval && atoi(intel_interval) > 0) {
+            ctx->threat_intel_interval = atoi(intel_interval);
+        }
+        if (intel_cache && atoi(intel_cache) >= 0) {
+            ctx->threat_intel_cache_size = (uint32_t) atoi(intel_cache);
+        }
+    }
+    
+    /* Sliding-window counters of RATE rules, sketches of DISTINCT rules
+     * and partial matches of SEQUENCE rules, preallocated */
+    enabled = flb_filter_get_property("enable_behavioral_analysis", ins);
+    rate_keys = flb_filter_get_property("behavioral_rate_keys", ins);
+    distinct_keys = flb_filter_get_property("behavioral_distinct_keys", ins);
+    sequence_keys = flb_filter_get_property("behavioral_sequence_keys", ins);
+    if (!enabled || flb_utils_bool(enabled) == FLB_TRUE) {
+        ctx->rate_keys = tg_session_table_create(rate_keys && atoi(rate_keys) > 0 ?
+                                                 (uint32_t) atoi(rate_keys) :
+                                                 TG_SECURITY_RATE_KEYS,
+                                                 TG_SECURITY_RATE_MAX_WINDOW, NULL, NULL);
+        if (!ctx->rate_keys) {
+            flb_plg_warn(ins, "cannot allocate rate counters, rate rules disabled");
+        }
+        
+        ctx->distinct_keys = tg_distinct_table_create(distinct_keys && atoi(distinct_keys) > 0 ?
+                                                      (uint32_t) atoi(distinct_keys) :
+                                                      TG_SECURITY_DISTINCT_KEYS);
+        if (!ctx->distinct_keys) {
+            flb_plg_warn(ins, "cannot allocate distinct counters, distinct rules disabled");
+        }
+        
+        ctx->sequence_keys = tg_correlate_table_create(sequence_keys && atoi(sequence_keys) > 0 ?
+                                                       (uint32_t) atoi(sequence_keys) :
+                                                       TG_SECURITY_SEQUENCE_KEYS);
+        if (!ctx->sequence_keys) {
+            flb_plg_warn(ins, "cannot allocate sequence matches, sequence rules disabled");
+        }
+    }
+    
+    /* Flagged events get enrichment encoded once, here */
+    if (tg_security_enrich_init(ctx) != 0) {
+        flb_plg_error(ins, "failed to encode the event enrichment");
+        tg_security_cleanup_rules(ctx);
+        flb_free(ctx->config);
+        flb_free(ctx);
+        return -1;
+    }
+    
+    /* Large chunks are split across a pool of evaluation threads */
+    pool_workers = flb_filter_get_property("evaluation_workers", ins);
+    pool_chunk = flb_filter_get_property("evaluation_min_chunk_size", ins);
+    if (pool_chunk) {
+        cache_bytes = flb_utils_size_to_bytes(pool_chunk);
+        if (cache_bytes > 0) {
+            ctx->pool_min_chunk = (size_t) cache_bytes;
+        } else {
+            flb_plg_warn(ins, "invalid evaluation_min_chunk_size '%s', using default", pool_chunk);
+        }
+    }
+    ret = pool_workers ? atoi(pool_workers) : 0;
+    if (ret > 0) {
+        ctx->pool = tg_pool_create(ret < TG_POOL_MAX_THREADS ? ret : TG_POOL_MAX_THREADS);
+        if (ctx->pool) {
+            flb_plg_info(ins, "evaluating chunks of %zu bytes or more on %d threads",
+                         ctx->pool_min_chunk, tg_pool_width(ctx->pool));
+        } else {
+            flb_plg_warn(ins, "cannot start evaluation workers, evaluating on the filter thread");
+        }
+    }
+    
+    /* Reload the rules file in the background whenever it changes */
+    watch = flb_filter_get_property("watch_rules_file", ins);
+    if (!watch || flb_utils_bool(watch) == FLB_TRUE) {
+        if (rules_file && tg_security_reload_start(ctx, rules_file) != 0) {
+            flb_plg_warn(ins, "cannot watch %s, rules reload on restart only", rules_file);
+        }
+    } else if (ctx->threat_intel_spool && tg_security_reload_start(ctx, NULL) != 0) {
+        flb_plg_warn(ins, "cannot start threat intelligence updates");
     }
     
     /* Set plugin context */
     flb_filter_set_context(ins, ctx);
     
-    flb_plg_info(ins, "ThreatGuard security filter initialized with %d rules", ctx->rule_count);
+    flb_plg_info(ins, "ThreatGuard security filter initialized with %d rules", set->rule_count);
+    return 0;
+}
+
+/* Fluent Bit hands events over as [timestamp, map] or, with metadata,
+ * [[timestamp, metadata], map] arrays; rules see the map, which replaces
+ * the decoded record. Bare maps and other records are left as they are. */
+static void tg_security_event_unwrap(msgpack_object *record)
+{
+    if (record->type == MSGPACK_OBJECT_ARRAY && record->via.array.size == 2 &&
+        record->via.array.ptr[1].type == MSGPACK_OBJECT_MAP) {
+        *record = record->via.array.ptr[1];
+    }
+}
+
+/* Output of one chunk. Unchanged records are never re-serialized: they
+ * stay in the input and are copied as raw byte ranges, adjacent ones in a
+ * single write, once a record needs rewriting. */
+struct tg_security_output {
+    const char *data;
+    msgpack_sbuffer sbuf;
+    msgpack_packer packer;
+    size_t record_start;
+    size_t copy_start;          /* first input byte not yet written or dropped */
+    int modified;
+    int processed;
+    int flagged;
+    int dropped;
+};
+
+/* Apply the action decided for the record ending at input offset end,
+ * which matched the rules of event */
+static void tg_security_emit(struct tg_security_ctx *ctx, struct tg_security_output *out,
+                             msgpack_object *root, size_t end, int action,
+                             const struct tg_security_event *event)
+{
+    const char *raw = out->data + out->record_start;
+    size_t raw_size = end - out->record_start;
+    
+    out->processed++;
+    
+    if (action == TG_SECURITY_ACTION_FLAG ||
+        action == TG_SECURITY_ACTION_DROP ||
+        action == TG_SECURITY_ACTION_ENRICH) {
+        /* Flush the pending pass-through run */
+        if (out->record_start > out->copy_start) {
+            msgpack_sbuffer_write(&out->sbuf, out->data + out->copy_start,
+                                  out->record_start - out->copy_start);
+        }
+        out->copy_start = end;
+        out->modified = 1;
+    }
+    
+    switch (action) {
+        case TG_SECURITY_ACTION_FLAG:
+            /* Enrich with security metadata and pass */
+            tg_security_enrich_event(root, raw, raw_size, event, ctx, &out->packer);
+            out->flagged++;
+            break;
+            
+        case TG_SECURITY_ACTION_DROP:
+            /* Drop the event */
+            out->dropped++;
+            break;
+            
+        case TG_SECURITY_ACTION_ENRICH:
+            /* Enrich with additional context */
+            tg_security_enrich_event(root, raw, raw_size, event, ctx, &out->packer);
+            break;
+            
+        default:
+            /* PASS or unknown action: leave the record in the run */
+            break;
+    }
+    
+    out->record_start = end;
+}
+
+/* Decode the chunk a batch of records at a time and evaluate each batch
+ * column by column. Returns -1 if no batch could be decoded into memory. */
+static int tg_security_filter_batches(struct tg_security_ctx *ctx,
+                                      const struct tg_security_ruleset *set,
+                                      struct tg_security_worker *worker,
+                                      struct tg_security_output *out, size_t bytes)
+{
+    uint8_t actions[TG_SECURITY_BATCH_RECORDS];
+    msgpack_zone zone;
+    size_t off = 0;
+    uint32_t count;
+    int ret;
+    
+    if (!msgpack_zone_init(&zone, MSGPACK_ZONE_CHUNK_SIZE)) {
+        return -1;
+    }
+    
+    do {
+        /* Records of the previous batch are written out */
+        msgpack_zone_clear(&zone);
+        
+        count = 0;
+        while (count < TG_SECURITY_BATCH_RECORDS && off < bytes) {
+            ret = msgpack_unpack(out->data, bytes, &off, &zone, &worker->batch_records[count]);
+            if (ret != MSGPACK_UNPACK_SUCCESS && ret != MSGPACK_UNPACK_EXTRA_BYTES) {
+                break;
+            }
+            tg_security_event_unwrap(&worker->batch_records[count]);
+            worker->batch_ends[count++] = off;
+        }
+        
+        if (count > 0) {
+            tg_security_apply_batch(worker->batch_records, count, set, worker, actions);
+            for (uint32_t r = 0; r < count; r++) {
+                tg_security_emit(ctx, out, &worker->batch_records[r], worker->batch_ends[r],
+                                 actions[r], &worker->batch_events[r]);
+            }
+        }
+    } while (count == TG_SECURITY_BATCH_RECORDS);
+    
+    msgpack_zone_destroy(&zone);
     return 0;
 }
 
+static int tg_security_filter_parallel(struct tg_security_ctx *ctx,
+                                       const struct tg_security_ruleset *set,
+                                       struct tg_security_worker *worker,
+                                       struct tg_security_output *out, size_t bytes);
+
 static int tg_security_filter(const void *data, size_t bytes,
                              const char *tag, int tag_len,
                              void **out_buf, size_t *out_size,
@@ -110,77 +452,84 @@ static int tg_security_filter(const void *data, size_t bytes,
                              void *filter_context, struct flb_config *config)
 {
     struct tg_security_ctx *ctx = filter_context;
+    struct tg_security_ruleset *set;
+    struct tg_security_worker *worker;
+    struct tg_security_output out;
     msgpack_unpacked result;
     msgpack_object root;
-    msgpack_sbuffer mp_sbuf;
-    msgpack_packer mp_pck;
     size_t off = 0;
-    int processed = 0;
-    int flagged = 0;
-    int dropped = 0;
+    
+    worker = tg_security_worker_get(ctx);
+    if (!worker) {
+        flb_plg_error(ins, "failed to allocate worker state, passing records through");
+        return FLB_FILTER_NOTOUCH;
+    }
+    
+    /* Behavioral state whose time is up is closed in one batch per chunk */
+    tg_security_behavior_expire(ctx);
+    
+    /* The whole chunk is filtered with the rule set current now; a reload
+     * takes effect at the next chunk, and the set stays alive until the
+     * read section ends */
+    set = tg_security_ruleset_read_lock(ctx, worker);
+    if (!set || tg_security_worker_bind(ctx, worker, set) != 0) {
+        tg_security_ruleset_read_unlock(worker);
+        flb_plg_error(ins, "failed to prepare rule evaluation, passing records through");
+        return FLB_FILTER_NOTOUCH;
+    }
     
     /* Initialize msgpack */
-    msgpack_unpacked_init(&result);
-    msgpack_sbuffer_init(&mp_sbuf);
-    msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
+    memset(&out, 0, sizeof(out));
+    out.data = data;
+    msgpack_sbuffer_init(&out.sbuf);
+    msgpack_packer_init(&out.packer, &out.sbuf, msgpack_sbuffer_write);
     
-    /* Process each record */
-    while (msgpack_unpack_next(&result, data, bytes, &off) == MSGPACK_UNPACK_SUCCESS) {
-        root = result.data;
-        processed++;
-        
-        /* Apply security filtering */
-        int action = tg_security_apply_filter(&root, ctx);
-        
-        switch (action) {
-            case TG_SECURITY_ACTION_PASS:
-                /* Pass through unchanged */
-                msgpack_pack_object(&mp_pck, root);
-                break;
-                
-            case TG_SECURITY_ACTION_FLAG:
-                /* Enrich with security metadata and pass */
-                tg_security_enrich_event(&root, ctx, &mp_pck);
-                flagged++;
-                break;
-                
-            case TG_SECURITY_ACTION_DROP:
-                /* Drop the event */
-                dropped++;
-                break;
-                
-            case TG_SECURITY_ACTION_ENRICH:
-                /* Enrich with additional context */
-                tg_security_enrich_event(&root, ctx, &mp_pck);
-                break;
-                
-            default:
-                /* Unknown action, pass through */
-                msgpack_pack_object(&mp_pck, root);
+    /* Process the records across the pool, in batches, or each one as it
+     * is decoded */
+    if (ctx->pool && bytes >= ctx->pool_min_chunk &&
+        tg_security_filter_parallel(ctx, set, worker, &out, bytes) == 0) {
+        /* Evaluated by the pool */
+    } else if (!worker->columnar ||
+               tg_security_filter_batches(ctx, set, worker, &out, bytes) != 0) {
+        msgpack_unpacked_init(&result);
+        while (msgpack_unpack_next(&result, data, bytes, &off) == MSGPACK_UNPACK_SUCCESS) {
+            root = result.data;
+            tg_security_event_unwrap(&root);
+            
+            /* Apply security filtering */
+            tg_security_emit(ctx, &out, &root, off,
+                             tg_security_apply_filter(&root, set, worker), &worker->event);
         }
+        msgpack_unpacked_destroy(&result);
     }
     
+    tg_security_ruleset_read_unlock(worker);
+    
+    /* Worker statistics */
+    worker->stats.events_flagged += out.flagged;
+    worker->stats.events_dropped += out.dropped;
+    
     /* Log processing statistics */
-    if (processed > 0) {
+    if (out.processed > 0) {
         flb_plg_debug(ins, "processed %d events: %d flagged, %d dropped", 
-                      processed, flagged, dropped);
+                      out.processed, out.flagged, out.dropped);
     }
     
-    /* Set output buffer */
-    *out_buf = flb_malloc(mp_sbuf.size);
-    if (!*out_buf) {
-        flb_plg_error(ins, "failed to allocate output buffer");
-        msgpack_sbuffer_destroy(&mp_sbuf);
-        msgpack_unpacked_destroy(&result);
+    /* Nothing was rewritten or dropped: hand the input back untouched */
+    if (!out.modified) {
+        msgpack_sbuffer_destroy(&out.sbuf);
         return FLB_FILTER_NOTOUCH;
     }
     
-    memcpy(*out_buf, mp_sbuf.data, mp_sbuf.size);
-    *out_size = mp_sbuf.size;
+    /* Trailing pass-through run */
+    if (out.record_start > out.copy_start) {
+        msgpack_sbuffer_write(&out.sbuf, out.data + out.copy_start,
+                              out.record_start - out.copy_start);
+    }
     
-    /* Cleanup */
-    msgpack_sbuffer_destroy(&mp_sbuf);
-    msgpack_unpacked_destroy(&result);
+    /* The output takes ownership of the sbuffer memory */
+    *out_buf = out.sbuf.data;
+    *out_size = out.sbuf.size;
     
     return FLB_FILTER_MODIFIED;
 }
@@ -193,6 +542,9 @@ static int tg_security_exit(void *data, struct flb_config *config)
         return 0;
     }
     
+    /* Release rules, matchers and behavioral state */
+    tg_security_cleanup_rules(ctx);
+    
     /* Free configuration */
     if (ctx->config) {
         flb_free(ctx->config);
@@ -204,193 +556,1311 @@ static int tg_security_exit(void *data, struct flb_config *config)
     return 0;
 }
 
-/* Apply security rules to an event */
-int tg_security_apply_filter(msgpack_object *obj, struct tg_security_ctx *ctx)
+/* Running result while scanning an event */
+struct tg_security_match_state {
+    const struct tg_security_ruleset *set;
+    struct tg_security_worker *worker;
+    time_t now;                         /* coarse clock, read when first needed */
+    int highest_priority;
+    int action;
+    uint32_t rule;                      /* rule the action is from, TG_SECURITY_RULE_NONE */
+    uint32_t group;                     /* plan group of that rule, TG_SECURITY_GROUP_NONE */
+};
+
+/* Whether a match of rule index outranks the result so far: a higher
+ * priority or, at equal priority, a rule loaded earlier. Ties thus go to
+ * the first rule of the file, whatever order rules are evaluated in. */
+static int tg_security_outranks(const struct tg_security_ruleset *set, uint32_t index,
+                                int priority, uint32_t rule)
 {
-    if (!obj || !ctx) {
-        return TG_SECURITY_ACTION_PASS;
+    return set->rules[index].priority > priority ||
+           (set->rules[index].priority == priority && rule != TG_SECURITY_RULE_NONE &&
+            index < rule);
+}
+
+/* Whether step can no longer change a result of its own priority taken
+ * from rule of group: all its rules of that priority were loaded after
+ * rule, or rule is in its group, whose matches all give the same action.
+ * With no rule matched, no rule of that priority can take the result. */
+static int tg_security_step_settled(const struct tg_security_step *step, uint32_t rule,
+                                    uint32_t group)
+{
+    return rule == TG_SECURITY_RULE_NONE || rule < step->first || group == step->group;
+}
+
+/* Group a result taken while evaluating step is from */
+static uint32_t tg_security_step_group(const struct tg_security_step *step, int priority)
+{
+    return priority == step->priority ? step->group : TG_SECURITY_GROUP_NONE;
+}
+
+/* Take the action of rule index if its match outranks the result so far */
+static void tg_security_take_match(struct tg_security_match_state *state, uint32_t index)
+{
+    if (tg_security_outranks(state->set, index, state->highest_priority, state->rule)) {
+        state->highest_priority = state->set->rules[index].priority;
+        state->action = state->set->rules[index].action;
+        state->rule = index;
     }
+}
+
+/* Start the list of rules an event matched */
+static void tg_security_event_reset(struct tg_security_event *event)
+{
+    event->rule_count = 0;
+    event->clear = 10000;
+}
+
+/* Add rule index to the rules an event matched. Each match lowers the
+ * chance that none is right by the rule's priority taken as a percentage. */
+static void tg_security_event_add(struct tg_security_event *event,
+                                  const struct tg_security_ruleset *set, uint32_t index)
+{
+    int priority = set->rules[index].priority;
     
-    /* Only process map objects (structured events) */
-    if (obj->type != MSGPACK_OBJECT_MAP) {
-        return TG_SECURITY_ACTION_PASS;
+    if (priority < 0) {
+        priority = 0;
+    } else if (priority > 100) {
+        priority = 100;
     }
+    event->clear = (uint16_t) (event->clear * (100 - priority) / 100);
     
-    msgpack_object_map map = obj->via.map;
-    int highest_priority_action = TG_SECURITY_ACTION_PASS;
-    int highest_priority = -1;
-    
-    /* Apply each security rule */
-    for (int i = 0; i < ctx->rule_count; i++) {
-        struct tg_security_rule *rule = &ctx->rules[i];
-        
-        /* Skip disabled rules */
-        if (!rule->enabled) {
-            continue;
-        }
-        
-        /* Check if rule matches */
-        if (tg_security_rule_matches(rule, &map)) {
-            /* Rule matched, check if it has higher priority */
-            if (rule->priority > highest_priority) {
-                highest_priority = rule->priority;
-                highest_priority_action = rule->action;
-            }
-            
-            /* Update rule statistics */
-            rule->match_count++;
-            rule->last_match = time(NULL);
-        }
+    if (event->rule_count < TG_SECURITY_EVENT_RULES) {
+        event->rule_ids[event->rule_count++] = set->rule_info[index].id;
     }
-    
-    return highest_priority_action;
 }
 
-/* Check if a security rule matches an event */
-int tg_security_rule_matches(struct tg_security_rule *rule, msgpack_object_map *map)
+/* The coarse clock, read at most once per event or batch */
+static time_t tg_security_match_now(struct tg_security_match_state *state)
 {
-    switch (rule->type) {
-        case TG_RULE_TYPE_FIELD_MATCH:
-            return tg_security_check_field_match(rule, map);
-            
-        case TG_RULE_TYPE_FIELD_REGEX:
-            return tg_security_check_field_regex(rule, map);
-            
-        case TG_RULE_TYPE_FIELD_EXISTS:
-            return tg_security_check_field_exists(rule, map);
-            
-        case TG_RULE_TYPE_THREAT_INTEL:
-            return tg_security_check_threat_intel(rule, map);
-            
-        case TG_RULE_TYPE_BEHAVIORAL:
-            return tg_security_check_behavioral(rule, map);
-            
-        case TG_RULE_TYPE_COMPLIANCE:
-            return tg_security_check_compliance(rule, map);
-            
-        default:
-            return 0;
+    if (state->now == 0) {
+        state->now = tg_utils_coarse_time();
     }
+    return state->now;
 }
 
-/* Check field exact match */
-int tg_security_check_field_match(struct tg_security_rule *rule, msgpack_object_map *map)
+/* Count a rule match in the worker's statistics and in the rules the
+ * event, or in a batch the current record, matched */
+static void tg_security_count_match(struct tg_security_match_state *state, int index)
 {
-    /* Find the field in the event */
-    for (uint32_t i = 0; i < map->size; i++) {
-        msgpack_object key = map->ptr[i].key;
-        msgpack_object val = map->ptr[i].val;
-        
-        if (key.type == MSGPACK_OBJECT_STR && 
-            key.via.str.size == strlen(rule->field_name) &&
-            memcmp(key.via.str.ptr, rule->field_name, key.via.str.size) == 0) {
-            
-            /* Field found, check value */
-            if (val.type == MSGPACK_OBJECT_STR) {
-                if (val.via.str.size == strlen(rule->pattern) &&
-                    memcmp(val.via.str.ptr, rule->pattern, val.via.str.size) == 0) {
-                    return 1;
-                }
-            }
-        }
-    }
+    struct tg_security_worker *worker = state->worker;
+    struct tg_security_rule_counters *counters;
     
-    return 0;
+    counters = &worker->rules[index];
+    counters->matches++;
+    counters->last_match = tg_security_match_now(state);
+    worker->stats.rules_matched++;
+    
+    tg_security_event_add(worker->batch ? &worker->batch_events[worker->batch_record] :
+                          &worker->event, state->set, (uint32_t) index);
 }
 
-/* Check field regex match */
-int tg_security_check_field_regex(struct tg_security_rule *rule, msgpack_object_map *map)
+/* Count count evaluations that began at start, or were not timed if it is 0 */
+static void tg_security_count_evaluation(struct tg_security_rule_counters *counters,
+                                         uint32_t count, uint64_t start)
 {
-    /* This would implement regex matching using PCRE or similar */
-    /* For now, fall back to substring matching */
+    counters->evaluations += count;
+    if (start) {
+        counters->timed_evaluations += count;
+        counters->timed_ns += tg_utils_monotonic_ns() - start;
+    }
+}
+
+/* Record a match reported by a compiled matcher; pattern ids are rule indexes */
+static int tg_security_record_match(struct tg_security_match_state *state, uint32_t index)
+{
+    const struct tg_security_rule *rule = &state->set->rules[index];
+    struct tg_security_worker *worker = state->worker;
     
-    for (uint32_t i = 0; i < map->size; i++) {
-        msgpack_object key = map->ptr[i].key;
-        msgpack_object val = map->ptr[i].val;
-        
-        if (key.type == MSGPACK_OBJECT_STR && 
-            key.via.str.size == strlen(rule->field_name) &&
-            memcmp(key.via.str.ptr, rule->field_name, key.via.str.size) == 0) {
-            
-            if (val.type == MSGPACK_OBJECT_STR) {
-                /* Simple substring matching */
-                if (strnstr(val.via.str.ptr, rule->pattern, val.via.str.size)) {
-                    return 1;
-                }
-            }
-        }
+    /* Report each rule once per event, however often its pattern occurs */
+    if (!rule->enabled || worker->rule_match_seq[index] == worker->match_seq) {
+        return 0;
     }
+    worker->rule_match_seq[index] = worker->match_seq;
+    
+    /* The automaton reports rules in the order their patterns occur */
+    tg_security_take_match(state, index);
+    tg_security_count_match(state, index);
     
     return 0;
 }
 
-/* Check field exists */
-int tg_security_check_field_exists(struct tg_security_rule *rule, msgpack_object_map *map)
+static int tg_security_literal_match(uint32_t pattern_id, size_t end_offset, void *data)
+{
+    (void) end_offset;
+    return tg_security_record_match(data, pattern_id);
+}
+
+static int tg_security_regex_match(uint32_t pattern_id, void *data)
+{
+    return tg_security_record_match(data, pattern_id);
+}
+
+/* Index the keys of a record into the field slot table; when a key
+ * repeats, the first occurrence wins */
+static void tg_security_index_record(const struct tg_security_ruleset *set,
+                                     struct tg_security_worker *worker,
+                                     msgpack_object_map *map)
 {
     for (uint32_t i = 0; i < map->size; i++) {
-        msgpack_object key = map->ptr[i].key;
+        msgpack_object *key = &map->ptr[i].key;
+        int slot;
         
-        if (key.type == MSGPACK_OBJECT_STR && 
-            key.via.str.size == strlen(rule->field_name) &&
-            memcmp(key.via.str.ptr, rule->field_name, key.via.str.size) == 0) {
-            return 1;
+        if (key->type != MSGPACK_OBJECT_STR) {
+            continue;
+        }
+        
+        slot = tg_field_dict_lookup(set->fields, key->via.str.ptr, key->via.str.size);
+        if (slot != TG_FIELD_SLOT_NONE && worker->field_seq[slot] != worker->match_seq) {
+            worker->field_seq[slot] = worker->match_seq;
+            worker->field_values[slot] = &map->ptr[i].val;
         }
     }
-    
-    return 0;
 }
 
-/* Check threat intelligence indicators */
-int tg_security_check_threat_intel(struct tg_security_rule *rule, msgpack_object_map *map)
+/* Value one nested path step into val: an array element, or with index
+ * -1 the value of the first occurrence of key in a map */
+static const msgpack_object *tg_security_path_step(const msgpack_object *val, int32_t index,
+                                                   const char *key, size_t key_len)
 {
-    /* This would implement IOC lookup against threat intelligence feeds */
-    /* Check for malicious IPs, domains, file hashes, etc. */
+    if (!val) {
+        return NULL;
+    }
     
-    /* Look for common threat indicators */
-    const char *threat_fields[] = {"src_ip", "dst_ip", "domain", "url", "file_hash", NULL};
+    if (index >= 0) {
+        if (val->type != MSGPACK_OBJECT_ARRAY || (uint32_t) index >= val->via.array.size) {
+            return NULL;
+        }
+        return &val->via.array.ptr[index];
+    }
     
-    for (int field_idx = 0; threat_fields[field_idx]; field_idx++) {
-        for (uint32_t i = 0; i < map->size; i++) {
-            msgpack_object key = map->ptr[i].key;
-            msgpack_object val = map->ptr[i].val;
-            
-            if (key.type == MSGPACK_OBJECT_STR && 
-                key.via.str.size == strlen(threat_fields[field_idx]) &&
-                memcmp(key.via.str.ptr, threat_fields[field_idx], key.via.str.size) == 0) {
-                
-                if (val.type == MSGPACK_OBJECT_STR) {
-                    /* Check against threat intelligence */
-                    if (tg_threat_intel_lookup(val.via.str.ptr, val.via.str.size)) {
-                        return 1;
-                    }
-                }
-            }
+    if (val->type != MSGPACK_OBJECT_MAP) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < val->via.map.size; i++) {
+        const msgpack_object *k = &val->via.map.ptr[i].key;
+        
+        if (k->type == MSGPACK_OBJECT_STR && k->via.str.size == key_len &&
+            memcmp(k->via.str.ptr, key, key_len) == 0) {
+            return &val->via.map.ptr[i].val;
         }
     }
     
-    return 0;
+    return NULL;
 }
 
-/* Check behavioral analysis patterns */
-int tg_security_check_behavioral(struct tg_security_rule *rule, msgpack_object_map *map)
+/* Value of field name in map without a slot table: the top-level key of
+ * that name or, failing that, the nested path it names walked from the
+ * top */
+static const msgpack_object *tg_security_find_field(msgpack_object_map *map,
+                                                    const char *name, size_t len)
 {
-    /* This would implement behavioral analysis */
-    /* Check for unusual login patterns, privilege escalation, etc. */
+    size_t parent_len;
+    int32_t index;
     
-    /* Look for behavioral indicators */
     for (uint32_t i = 0; i < map->size; i++) {
         msgpack_object key = map->ptr[i].key;
-        msgpack_object val = map->ptr[i].val;
         
-        if (key.type == MSGPACK_OBJECT_STR && val.type == MSGPACK_OBJECT_STR) {
-            /* Check for privilege escalation keywords */
-            if (strncmp(key.via.str.ptr, "event_type", key.via.str.size) == 0) {
-                if (strnstr(val.via.str.ptr, "privilege", val.via.str.size) ||
-                    strnstr(val.via.str.ptr, "escalation", val.via.str.size) ||
-                    strnstr(val.via.str.ptr, "sudo", val.via.str.size)) {
-                    return 1;
-                }
-            }
+        if (key.type == MSGPACK_OBJECT_STR && key.via.str.size == len &&
+            memcmp(key.via.str.ptr, name, len) == 0) {
+            return &map->ptr[i].val;
+        }
+    }
+    
+    if (tg_field_path_split(name, len, &parent_len, &index) != 0) {
+        return NULL;
+    }
+    return tg_security_path_step(tg_security_find_field(map, name, parent_len), index,
+                                 name + parent_len + 1, len - parent_len - 1);
+}
+
+/* Resolve nested path slot in the current record from the path it steps
+ * into, which is itself resolved once per record for every path under it */
+static const msgpack_object *tg_security_resolve_path(const struct tg_security_ruleset *set,
+                                                      struct tg_security_worker *worker,
+                                                      int slot)
+{
+    const struct tg_field_path *path = &set->paths[slot];
+    const msgpack_object *parent = NULL;
+    const msgpack_object *val;
+    
+    if (worker->field_seq[path->parent] == worker->match_seq) {
+        parent = worker->field_values[path->parent];
+    } else if (set->paths[path->parent].parent != TG_FIELD_SLOT_NONE) {
+        parent = tg_security_resolve_path(set, worker, path->parent);
+    }
+    
+    val = tg_security_path_step(parent, path->index, path->key, path->key_len);
+    worker->field_seq[slot] = worker->match_seq;
+    worker->field_values[slot] = val;
+    return val;
+}
+
+/* Value of a field in the current record. Indexed fields are read from the
+ * slot table, or from the columns of a batch, nested paths the record has
+ * no top-level key for being resolved on first use; other fields, or all
+ * of them if rules were not compiled, fall back to scanning the map. */
+static const msgpack_object *tg_security_get_field(const struct tg_security_ruleset *set,
+                                                   struct tg_security_worker *worker,
+                                                   msgpack_object_map *map,
+                                                   int slot, const char *name)
+{
+    if (set->fields && slot != TG_FIELD_SLOT_NONE) {
+        if (worker->batch) {
+            return worker->batch_values[(size_t) slot * TG_SECURITY_BATCH_RECORDS +
+                                        worker->batch_record];
+        }
+        if (worker->field_seq[slot] == worker->match_seq) {
+            return worker->field_values[slot];
+        }
+        if (set->paths && set->paths[slot].parent != TG_FIELD_SLOT_NONE) {
+            return tg_security_resolve_path(set, worker, slot);
+        }
+        return NULL;
+    }
+    
+    return tg_security_find_field(map, name, strlen(name));
+}
+
+/* Scan one field with compiled matcher m */
+static void tg_security_evaluate_matcher(struct tg_security_match_state *state,
+                                         msgpack_object_map *map, uint32_t m, int timed)
+{
+    const struct tg_security_ruleset *set = state->set;
+    const struct tg_security_field_matcher *matcher = &set->matchers[m];
+    struct tg_security_worker *worker = state->worker;
+    const msgpack_object *val;
+    uint64_t matched = worker->stats.rules_matched;
+    uint64_t start;
+    
+    val = tg_security_get_field(set, worker, map, matcher->field_slot, matcher->field_name);
+    if (!val || val->type != MSGPACK_OBJECT_STR) {
+        return;
+    }
+    
+    start = timed ? tg_utils_monotonic_ns() : 0;
+    if (matcher->ac) {
+        tg_ac_scan(matcher->ac, val->via.str.ptr, val->via.str.size,
+                   tg_security_literal_match, state);
+    }
+    if (worker->dfas[m]) {
+        tg_regex_dfa_scan(worker->dfas[m], val->via.str.ptr, val->via.str.size,
+                          tg_security_regex_match, state);
+    }
+    tg_security_count_evaluation(&worker->matchers[m], 1, start);
+    
+    /* A scan that reported any rule counts as a hit of the matcher */
+    if (worker->stats.rules_matched != matched) {
+        worker->matchers[m].matches++;
+    }
+}
+
+/* Evaluate one generic rule; returns whether it matched */
+static int tg_security_evaluate_rule(struct tg_security_match_state *state,
+                                     msgpack_object_map *map, uint32_t index, int timed)
+{
+    const struct tg_security_rule *rule = &state->set->rules[index];
+    uint64_t start;
+    int matched;
+    
+    start = timed ? tg_utils_monotonic_ns() : 0;
+    matched = tg_security_rule_matches(state->set, state->worker, rule, map,
+                                       tg_security_match_now(state));
+    tg_security_count_evaluation(&state->worker->rules[index], 1, start);
+    
+    if (matched) {
+        tg_security_take_match(state, index);
+        tg_security_count_match(state, index);
+    }
+    
+    return matched;
+}
+
+/* New event: invalidates the field slot table and rule match stamps */
+static void tg_security_next_event(const struct tg_security_ruleset *set,
+                                   struct tg_security_worker *worker)
+{
+    if (++worker->match_seq == 0) {
+        memset(worker->rule_match_seq, 0, set->rule_count * sizeof(uint32_t));
+        memset(worker->field_seq, 0, tg_field_dict_count(set->fields) * sizeof(uint32_t));
+        worker->match_seq = 1;
+    }
+}
+
+/* Evaluate an event. Window rules run first unless stateful holds the
+ * result of each, stateful[s * stride] for window rule s, found apart by
+ * tg_security_chunk_shard and already counted. */
+static int tg_security_evaluate_event(msgpack_object *obj, const struct tg_security_ruleset *set,
+                                      struct tg_security_worker *worker,
+                                      const uint8_t *stateful, size_t stride)
+{
+    if (!obj || !set || !worker) {
+        return TG_SECURITY_ACTION_PASS;
+    }
+    
+    tg_security_event_reset(&worker->event);
+    
+    /* Only process map objects (structured events) */
+    if (obj->type != MSGPACK_OBJECT_MAP) {
+        return TG_SECURITY_ACTION_PASS;
+    }
+    
+    msgpack_object_map map = obj->via.map;
+    struct tg_security_match_state state;
+    int timed = 0;
+    
+    state.set = set;
+    state.worker = worker;
+    state.now = 0;
+    state.highest_priority = -1;
+    state.action = TG_SECURITY_ACTION_PASS;
+    state.rule = TG_SECURITY_RULE_NONE;
+    state.group = TG_SECURITY_GROUP_NONE;
+    
+    /* Time the rule evaluations of one event in TG_SECURITY_STATS_SAMPLE */
+    timed = worker->stats.events_processed++ % TG_SECURITY_STATS_SAMPLE == 0;
+    
+    /* Move the likeliest, cheapest rules of each priority forward */
+    if (worker->stats.events_processed % TG_SECURITY_PLAN_REORDER == 0) {
+        tg_security_worker_reorder(set, worker);
+    }
+    
+    tg_security_next_event(set, worker);
+    
+    /* One pass over the keys; rules then read their fields by slot */
+    if (set->fields) {
+        tg_security_index_record(set, worker, &map);
+    }
+    
+    /* Rules counting events across a window must see every event */
+    for (int s = 0; s < set->stateful_count; s++) {
+        if (!stateful) {
+            tg_security_evaluate_rule(&state, &map, set->stateful[s], timed);
+        } else if (stateful[s * stride]) {
+            tg_security_event_add(&worker->event, set, set->stateful[s]);
+            tg_security_take_match(&state, set->stateful[s]);
+        }
+    }
+    
+    /* The rest run in decreasing priority: once no remaining step can
+     * report a higher priority than the match found, or take a tie from
+     * it, none can change the action, and they only run to keep exact
+     * rule statistics */
+    for (int s = 0; s < set->plan_count; s++) {
+        const struct tg_security_step *step = &worker->plan[s];
+        uint32_t rule = state.rule;
+        
+        if (!worker->full_stats) {
+            if (step->priority < state.highest_priority) {
+                break;
+            }
+            if (step->priority == state.highest_priority &&
+                tg_security_step_settled(step, state.rule, state.group)) {
+                continue;
+            }
+        }
+        
+        if (step->kind == TG_SECURITY_STEP_MATCHER) {
+            tg_security_evaluate_matcher(&state, &map, step->index, timed);
+        } else {
+            tg_security_evaluate_rule(&state, &map, step->index, timed);
+        }
+        if (state.rule != rule) {
+            state.group = tg_security_step_group(step, state.highest_priority);
+        }
+    }
+    
+    return state.action;
+}
+
+/* Apply security rules to an event */
+int tg_security_apply_filter(msgpack_object *obj, const struct tg_security_ruleset *set,
+                             struct tg_security_worker *worker)
+{
+    return tg_security_evaluate_event(obj, set, worker, NULL, 0);
+}
+
+/* Record of the lowest bit set in a word of a batch bitmap */
+#define TG_SECURITY_BIT_RECORD(word, bits)  ((word) * 64 + (uint32_t) __builtin_ctzll(bits))
+
+/* Set a cell of the field columns, listing it to be cleared */
+static void tg_security_batch_set(struct tg_security_worker *worker, size_t cell,
+                                  const msgpack_object *val)
+{
+    if (worker->batch_cell_count < TG_SECURITY_BATCH_CELLS) {
+        worker->batch_cells[worker->batch_cell_count] = (uint32_t) cell;
+    }
+    if (worker->batch_cell_count <= TG_SECURITY_BATCH_CELLS) {
+        worker->batch_cell_count++;
+    }
+    worker->batch_values[cell] = val;
+    if (val->type == MSGPACK_OBJECT_STR) {
+        worker->batch_views[cell].ptr = val->via.str.ptr;
+        worker->batch_views[cell].len = val->via.str.size;
+    } else {
+        worker->batch_views[cell].ptr = NULL;
+        worker->batch_views[cell].len = 0;
+    }
+}
+
+/* Index the keys of every map record of a batch into the field columns.
+ * Keys are visited last to first so that, when a key repeats, the first
+ * occurrence is written last and wins. Nested paths are then resolved in
+ * slot order, each from the column of the path it steps into. The cells
+ * the previous batch set are cleared first, or all columns if it set too
+ * many to list. */
+static void tg_security_index_batch(const struct tg_security_ruleset *set,
+                                    struct tg_security_worker *worker,
+                                    msgpack_object *records, uint32_t count)
+{
+    uint32_t field_count = tg_field_dict_count(set->fields);
+    size_t cells = (size_t) field_count * TG_SECURITY_BATCH_RECORDS;
+    
+    if (worker->batch_cell_count > TG_SECURITY_BATCH_CELLS) {
+        memset(worker->batch_values, 0, cells * sizeof(msgpack_object *));
+        memset(worker->batch_views, 0, cells * sizeof(struct tg_security_view));
+    } else {
+        for (uint32_t i = 0; i < worker->batch_cell_count; i++) {
+            worker->batch_values[worker->batch_cells[i]] = NULL;
+            worker->batch_views[worker->batch_cells[i]].ptr = NULL;
+        }
+    }
+    worker->batch_cell_count = 0;
+    
+    for (uint32_t r = 0; r < count; r++) {
+        msgpack_object_map *map = &records[r].via.map;
+        
+        if (records[r].type != MSGPACK_OBJECT_MAP) {
+            continue;
+        }
+        
+        for (uint32_t i = map->size; i-- > 0; ) {
+            msgpack_object *key = &map->ptr[i].key;
+            int slot;
+            
+            if (key->type != MSGPACK_OBJECT_STR) {
+                continue;
+            }
+            
+            slot = tg_field_dict_lookup(set->fields, key->via.str.ptr, key->via.str.size);
+            if (slot != TG_FIELD_SLOT_NONE) {
+                tg_security_batch_set(worker, (size_t) slot * TG_SECURITY_BATCH_RECORDS + r,
+                                      &map->ptr[i].val);
+            }
+        }
+        
+        for (uint32_t slot = 0; set->paths && slot < field_count; slot++) {
+            const struct tg_field_path *path = &set->paths[slot];
+            size_t cell = (size_t) slot * TG_SECURITY_BATCH_RECORDS + r;
+            const msgpack_object *val;
+            
+            if (path->parent == TG_FIELD_SLOT_NONE || worker->batch_values[cell]) {
+                continue;
+            }
+            
+            val = tg_security_path_step(worker->batch_values[(size_t) path->parent *
+                                                             TG_SECURITY_BATCH_RECORDS + r],
+                                        path->index, path->key, path->key_len);
+            if (val) {
+                tg_security_batch_set(worker, cell, val);
+            }
+        }
+    }
+}
+
+/* Reduce the match bitmap of rule index, of plan group, into the actions
+ * of the batch, counting the matches unless they were counted already, in
+ * which case they are only added to the rules each record matched */
+static void tg_security_batch_reduce(struct tg_security_match_state *state, uint32_t index,
+                                     uint32_t group, uint32_t words, int counted)
+{
+    const struct tg_security_rule *rule = &state->set->rules[index];
+    struct tg_security_worker *worker = state->worker;
+    
+    for (uint32_t w = 0; w < words; w++) {
+        for (uint64_t bits = worker->batch_matched[w]; bits; bits &= bits - 1) {
+            uint32_t r = TG_SECURITY_BIT_RECORD(w, bits);
+            
+            if (tg_security_outranks(state->set, index, worker->batch_priority[r],
+                                     worker->batch_rule[r])) {
+                worker->batch_priority[r] = rule->priority;
+                worker->batch_action[r] = (uint8_t) rule->action;
+                worker->batch_rule[r] = index;
+                worker->batch_group[r] = group;
+                worker->batch_dirty[w] |= bits & -bits;
+            }
+            if (!counted) {
+                worker->batch_record = r;
+                tg_security_count_match(state, index);
+            } else {
+                tg_security_event_add(&worker->batch_events[r], state->set, index);
+            }
+        }
+    }
+}
+
+/* Scan a field column of the active records with the compiled matcher of
+ * step */
+static void tg_security_batch_matcher(struct tg_security_match_state *state,
+                                      msgpack_object *records,
+                                      const struct tg_security_step *step, uint32_t words)
+{
+    const struct tg_security_ruleset *set = state->set;
+    uint32_t m = step->index;
+    const struct tg_security_field_matcher *matcher = &set->matchers[m];
+    struct tg_security_worker *worker = state->worker;
+    const struct tg_security_view *views = NULL;
+    uint64_t start = tg_utils_monotonic_ns();
+    uint32_t scanned = 0;
+    
+    if (matcher->field_slot != TG_FIELD_SLOT_NONE) {
+        views = &worker->batch_views[(size_t) matcher->field_slot * TG_SECURITY_BATCH_RECORDS];
+    }
+    
+    for (uint32_t w = 0; w < words; w++) {
+        for (uint64_t bits = worker->batch_active[w]; bits; bits &= bits - 1) {
+            uint32_t r = TG_SECURITY_BIT_RECORD(w, bits);
+            uint64_t matched = worker->stats.rules_matched;
+            struct tg_security_view view;
+            
+            /* A field without a slot is looked up in the record */
+            if (views) {
+                view = views[r];
+            } else {
+                const msgpack_object *val = tg_security_get_field(set, worker,
+                                                                  &records[r].via.map,
+                                                                  TG_FIELD_SLOT_NONE,
+                                                                  matcher->field_name);
+                
+                view.ptr = val && val->type == MSGPACK_OBJECT_STR ? val->via.str.ptr : NULL;
+                view.len = view.ptr ? val->via.str.size : 0;
+            }
+            if (!view.ptr) {
+                continue;
+            }
+            
+            /* Rules report once per scan; the running result is the record's */
+            tg_security_next_event(set, worker);
+            worker->batch_record = r;
+            state->highest_priority = worker->batch_priority[r];
+            state->action = worker->batch_action[r];
+            state->rule = worker->batch_rule[r];
+            
+            if (matcher->ac) {
+                tg_ac_scan(matcher->ac, view.ptr, view.len, tg_security_literal_match, state);
+            }
+            if (worker->dfas[m]) {
+                tg_regex_dfa_scan(worker->dfas[m], view.ptr, view.len,
+                                  tg_security_regex_match, state);
+            }
+            scanned++;
+            
+            if (worker->stats.rules_matched != matched) {
+                worker->matchers[m].matches++;
+                if (state->rule != worker->batch_rule[r]) {
+                    worker->batch_priority[r] = state->highest_priority;
+                    worker->batch_action[r] = (uint8_t) state->action;
+                    worker->batch_rule[r] = state->rule;
+                    worker->batch_group[r] = tg_security_step_group(step,
+                                                                    state->highest_priority);
+                    worker->batch_dirty[w] |= bits & -bits;
+                }
+            }
+        }
+    }
+    
+    tg_security_count_evaluation(&worker->matchers[m], scanned, start);
+}
+
+/* Evaluate generic rule index, of plan group, on the active records.
+ * Field checks of indexed fields are loops over their column; the other
+ * rules are evaluated record by record, reading the columns through the
+ * slot lookups. */
+static void tg_security_batch_rule(struct tg_security_match_state *state,
+                                   msgpack_object *records, uint32_t index, uint32_t group,
+                                   uint32_t words)
+{
+    const struct tg_security_ruleset *set = state->set;
+    const struct tg_security_rule *rule = &set->rules[index];
+    struct tg_security_worker *worker = state->worker;
+    const struct tg_security_view *views = NULL;
+    const msgpack_object **values = NULL;
+    const char *pattern = set->patterns + rule->pattern;
+    uint64_t start = tg_utils_monotonic_ns();
+    uint32_t evaluated = 0;
+    
+    if (rule->field_slot != TG_FIELD_SLOT_NONE) {
+        views = &worker->batch_views[(size_t) rule->field_slot * TG_SECURITY_BATCH_RECORDS];
+        values = &worker->batch_values[(size_t) rule->field_slot * TG_SECURITY_BATCH_RECORDS];
+    }
+    
+    for (uint32_t w = 0; w < words; w++) {
+        uint64_t bits = worker->batch_active[w];
+        uint64_t matched = 0;
+        
+        evaluated += (uint32_t) __builtin_popcountll(bits);
+        
+        if (views && rule->type == TG_RULE_TYPE_FIELD_MATCH) {
+            for (; bits; bits &= bits - 1) {
+                const struct tg_security_view *view = &views[TG_SECURITY_BIT_RECORD(w, bits)];
+                
+                if (view->ptr && view->len == rule->pattern_len &&
+                    memcmp(view->ptr, pattern, view->len) == 0) {
+                    matched |= bits & -bits;
+                }
+            }
+        } else if (views && rule->type == TG_RULE_TYPE_FIELD_REGEX) {
+            for (; bits; bits &= bits - 1) {
+                const struct tg_security_view *view = &views[TG_SECURITY_BIT_RECORD(w, bits)];
+                
+                if (view->ptr && tg_search(view->ptr, view->len, pattern, rule->pattern_len)) {
+                    matched |= bits & -bits;
+                }
+            }
+        } else if (values && rule->type == TG_RULE_TYPE_FIELD_EXISTS) {
+            for (; bits; bits &= bits - 1) {
+                if (values[TG_SECURITY_BIT_RECORD(w, bits)]) {
+                    matched |= bits & -bits;
+                }
+            }
+        } else {
+            for (; bits; bits &= bits - 1) {
+                worker->batch_record = TG_SECURITY_BIT_RECORD(w, bits);
+                if (tg_security_rule_matches(set, worker, rule,
+                                             &records[worker->batch_record].via.map,
+                                             tg_security_match_now(state))) {
+                    matched |= bits & -bits;
+                }
+            }
+        }
+        
+        worker->batch_matched[w] = matched;
+    }
+    
+    tg_security_count_evaluation(&worker->rules[index], evaluated, start);
+    tg_security_batch_reduce(state, index, group, words, 0);
+}
+
+/* Stop evaluating the records whose match outranks the priority of step:
+ * no step from here on can change their action. Of the pending records,
+ * step runs on those whose result it could still take. Returns 0 once no
+ * record is left. */
+static int tg_security_batch_settle(struct tg_security_worker *worker,
+                                    const struct tg_security_step *step, uint32_t words)
+{
+    uint64_t pending = 0;
+    
+    for (uint32_t w = 0; w < words; w++) {
+        uint64_t settled = 0;
+        uint64_t skipped = 0;
+        
+        for (uint64_t bits = worker->batch_dirty[w]; bits; bits &= bits - 1) {
+            uint32_t r = TG_SECURITY_BIT_RECORD(w, bits);
+            
+            if (worker->batch_priority[r] > step->priority) {
+                settled |= bits & -bits;
+            } else if (worker->batch_priority[r] == step->priority &&
+                       tg_security_step_settled(step, worker->batch_rule[r],
+                                                worker->batch_group[r])) {
+                skipped |= bits & -bits;
+            }
+        }
+        worker->batch_pending[w] &= ~settled;
+        worker->batch_dirty[w] &= ~settled;
+        worker->batch_active[w] = worker->batch_pending[w] & ~skipped;
+        pending |= worker->batch_pending[w];
+    }
+    
+    return pending != 0;
+}
+
+/* Apply security rules to a batch of at most TG_SECURITY_BATCH_RECORDS
+ * events, setting the action of each. The batch is indexed into one
+ * column per field, then each step of the plan runs over its column for
+ * the records it can still change, producing a match bitmap that is
+ * reduced into their actions. Each record gets the action, counts and
+ * matched rules it would get evaluated alone, the rules in batch_events;
+ * window rules see the records in order, unless stateful holds their
+ * results as for tg_security_evaluate_event. Evaluation is timed per column rather than sampled. */
+static void tg_security_evaluate_batch(msgpack_object *records, uint32_t count,
+                                       const struct tg_security_ruleset *set,
+                                       struct tg_security_worker *worker, uint8_t *actions,
+                                       const uint8_t *stateful, size_t stride)
+{
+    struct tg_security_match_state state;
+    uint32_t words = (count + 63) / 64;
+    uint64_t processed;
+    
+    if (!records || !set || !worker || !actions || count == 0) {
+        return;
+    }
+    
+    /* Without a field dictionary there are no columns to build */
+    if (!set->fields || !worker->batch_values || count > TG_SECURITY_BATCH_RECORDS) {
+        for (uint32_t r = 0; r < count; r++) {
+            actions[r] = (uint8_t) tg_security_evaluate_event(&records[r], set, worker,
+                                                              stateful ? stateful + r : NULL,
+                                                              stride);
+            if (worker->batch_events && r < TG_SECURITY_BATCH_RECORDS) {
+                worker->batch_events[r] = worker->event;
+            }
+        }
+        return;
+    }
+    
+    /* Only map objects (structured events) are evaluated; all of them are
+     * settled before the first step */
+    memset(worker->batch_pending, 0, sizeof(worker->batch_pending));
+    processed = worker->stats.events_processed;
+    for (uint32_t r = 0; r < count; r++) {
+        worker->batch_priority[r] = -1;
+        worker->batch_action[r] = TG_SECURITY_ACTION_PASS;
+        worker->batch_rule[r] = TG_SECURITY_RULE_NONE;
+        worker->batch_group[r] = TG_SECURITY_GROUP_NONE;
+        tg_security_event_reset(&worker->batch_events[r]);
+        if (records[r].type == MSGPACK_OBJECT_MAP) {
+            worker->batch_pending[r / 64] |= 1ull << (r % 64);
+            worker->stats.events_processed++;
+        }
+    }
+    
+    memcpy(worker->batch_dirty, worker->batch_pending, sizeof(worker->batch_dirty));
+    
+    if (worker->stats.events_processed / TG_SECURITY_PLAN_REORDER !=
+        processed / TG_SECURITY_PLAN_REORDER) {
+        tg_security_worker_reorder(set, worker);
+    }
+    
+    tg_security_index_batch(set, worker, records, count);
+    
+    state.set = set;
+    state.worker = worker;
+    state.now = 0;
+    state.highest_priority = -1;
+    state.action = TG_SECURITY_ACTION_PASS;
+    state.rule = TG_SECURITY_RULE_NONE;
+    state.group = TG_SECURITY_GROUP_NONE;
+    worker->batch = 1;
+    memcpy(worker->batch_active, worker->batch_pending, sizeof(worker->batch_active));
+    
+    /* Window rules, over every record, unless their results are given */
+    for (int s = 0; s < set->stateful_count; s++) {
+        if (!stateful) {
+            tg_security_batch_rule(&state, records, set->stateful[s], TG_SECURITY_GROUP_NONE,
+                                   words);
+            continue;
+        }
+        
+        for (uint32_t w = 0; w < words; w++) {
+            uint64_t matched = 0;
+            
+            for (uint64_t bits = worker->batch_pending[w]; bits; bits &= bits - 1) {
+                if (stateful[s * stride + TG_SECURITY_BIT_RECORD(w, bits)]) {
+                    matched |= bits & -bits;
+                }
+            }
+            worker->batch_matched[w] = matched;
+        }
+        tg_security_batch_reduce(&state, set->stateful[s], TG_SECURITY_GROUP_NONE, words, 1);
+    }
+    
+    /* The plan, over the records it can still change */
+    for (int s = 0; s < set->plan_count; s++) {
+        const struct tg_security_step *step = &worker->plan[s];
+        
+        if (!worker->full_stats && !tg_security_batch_settle(worker, step, words)) {
+            break;
+        }
+        
+        if (step->kind == TG_SECURITY_STEP_MATCHER) {
+            tg_security_batch_matcher(&state, records, step, words);
+        } else {
+            tg_security_batch_rule(&state, records, step->index, step->group, words);
+        }
+    }
+    
+    worker->batch = 0;
+    memcpy(actions, worker->batch_action, count);
+}
+
+void tg_security_apply_batch(msgpack_object *records, uint32_t count,
+                             const struct tg_security_ruleset *set,
+                             struct tg_security_worker *worker, uint8_t *actions)
+{
+    tg_security_evaluate_batch(records, count, set, worker, actions, NULL, 0);
+}
+
+/* A chunk evaluated by the worker pool */
+struct tg_security_chunk {
+    struct tg_security_ctx *ctx;
+    const struct tg_security_ruleset *set;
+    struct tg_security_worker *owner;   /* the filter thread's, in its read section */
+    const char *data;
+    msgpack_object *records;
+    size_t *ends;               /* input offset past each record */
+    uint32_t count;
+    uint32_t alloc;
+    uint8_t *stateful;          /* window rule s matched record r at s * count + r */
+    uint32_t shards;
+    uint8_t *shard_done;
+    uint32_t range_size;
+    uint32_t ranges;
+    uint8_t *range_done;
+    struct tg_security_output *outputs;     /* one per range */
+};
+
+/* Worker of the calling thread ready to evaluate the chunk, or NULL. Pool
+ * threads evaluate the set and indicator store of the filter thread's read
+ * section, which keeps both alive until the chunk is done. */
+static struct tg_security_worker *tg_security_chunk_worker(struct tg_security_chunk *chunk)
+{
+    struct tg_security_worker *worker = tg_security_worker_get(chunk->ctx);
+    
+    if (worker == chunk->owner) {
+        return worker;
+    }
+    if (!worker || tg_security_worker_bind(chunk->ctx, worker, chunk->set) != 0) {
+        return NULL;
+    }
+    
+    worker->ioc = chunk->owner->ioc;
+    return worker;
+}
+
+static void tg_security_chunk_release(struct tg_security_chunk *chunk,
+                                      struct tg_security_worker *worker)
+{
+    if (worker != chunk->owner) {
+        worker->ioc = NULL;
+    }
+}
+
+/* Evaluate the window rules of the chunk for the field values of one key
+ * shard. Each shard walks the records in order, so the events of one key
+ * reach the behavioral tables in the order they came in. A record without
+ * the rule's field cannot match and is evaluated in shard 0. */
+static void tg_security_chunk_shard(void *data, uint32_t shard)
+{
+    struct tg_security_chunk *chunk = data;
+    const struct tg_security_ruleset *set = chunk->set;
+    struct tg_security_match_state state;
+    struct tg_security_worker *worker;
+    
+    worker = tg_security_chunk_worker(chunk);
+    if (!worker) {
+        return;
+    }
+    
+    state.set = set;
+    state.worker = worker;
+    state.now = 0;
+    
+    for (uint32_t r = 0; r < chunk->count; r++) {
+        msgpack_object_map *map = &chunk->records[r].via.map;
+        
+        if (chunk->records[r].type != MSGPACK_OBJECT_MAP) {
+            continue;
+        }
+        
+        tg_security_next_event(set, worker);
+        if (set->fields) {
+            tg_security_index_record(set, worker, map);
+        }
+        
+        for (int s = 0; s < set->stateful_count; s++) {
+            uint32_t index = set->stateful[s];
+            const msgpack_object *val;
+            uint32_t key_shard = 0;
+            
+            val = tg_security_get_field(set, worker, map, set->rules[index].field_slot,
+                                        set->rule_info[index].field_name);
+            if (val && val->type == MSGPACK_OBJECT_STR) {
+                key_shard = (uint32_t) (tg_session_key(val->via.str.ptr, val->via.str.size,
+                                                       NULL, 0) % chunk->shards);
+            }
+            if (key_shard != shard) {
+                continue;
+            }
+            
+            state.highest_priority = -1;
+            state.action = TG_SECURITY_ACTION_PASS;
+            state.rule = TG_SECURITY_RULE_NONE;
+            state.group = TG_SECURITY_GROUP_NONE;
+            chunk->stateful[(size_t) s * chunk->count + r] =
+                (uint8_t) tg_security_evaluate_rule(&state, map, index, 0);
+        }
+    }
+    
+    tg_security_chunk_release(chunk, worker);
+    chunk->shard_done[shard] = 1;
+}
+
+/* Evaluate one range of records and write it to the range's output */
+static void tg_security_chunk_range(void *data, uint32_t range)
+{
+    struct tg_security_chunk *chunk = data;
+    const struct tg_security_ruleset *set = chunk->set;
+    struct tg_security_output *out = &chunk->outputs[range];
+    struct tg_security_worker *worker;
+    uint8_t actions[TG_SECURITY_BATCH_RECORDS];
+    uint32_t first = range * chunk->range_size;
+    uint32_t last = first + chunk->range_size < chunk->count ?
+                    first + chunk->range_size : chunk->count;
+    
+    worker = tg_security_chunk_worker(chunk);
+    if (!worker) {
+        return;
+    }
+    
+    out->record_start = first > 0 ? chunk->ends[first - 1] : 0;
+    out->copy_start = out->record_start;
+    
+    for (uint32_t r = first; r < last; ) {
+        uint32_t n = last - r < TG_SECURITY_BATCH_RECORDS ? last - r : TG_SECURITY_BATCH_RECORDS;
+        const uint8_t *stateful = set->stateful_count > 0 ? chunk->stateful + r : NULL;
+        
+        if (worker->columnar) {
+            tg_security_evaluate_batch(&chunk->records[r], n, set, worker, actions,
+                                       stateful, chunk->count);
+            for (uint32_t i = 0; i < n; i++) {
+                tg_security_emit(chunk->ctx, out, &chunk->records[r + i], chunk->ends[r + i],
+                                 actions[i], &worker->batch_events[i]);
+            }
+        } else {
+            for (uint32_t i = 0; i < n; i++) {
+                int action = tg_security_evaluate_event(&chunk->records[r + i], set, worker,
+                                                       stateful ? stateful + i : NULL,
+                                                       chunk->count);
+                
+                tg_security_emit(chunk->ctx, out, &chunk->records[r + i], chunk->ends[r + i],
+                                 action, &worker->event);
+            }
+        }
+        r += n;
+    }
+    
+    /* Trailing pass-through run of the range */
+    if (out->modified && out->record_start > out->copy_start) {
+        msgpack_sbuffer_write(&out->sbuf, out->data + out->copy_start,
+                              out->record_start - out->copy_start);
+    }
+    
+    tg_security_chunk_release(chunk, worker);
+    chunk->range_done[range] = 1;
+}
+
+/* Run the tasks of a chunk on the pool; tasks a pool thread could not
+ * run, for want of memory to bind its worker, run on the filter thread.
+ * Returns -1 if the pool is busy with another chunk. */
+static int tg_security_chunk_run(struct tg_security_chunk *chunk, tg_pool_task_cb task,
+                                 uint8_t *done, uint32_t tasks)
+{
+    if (tg_pool_run(chunk->ctx->pool, task, chunk, tasks) != 0) {
+        return -1;
+    }
+    
+    for (uint32_t i = 0; i < tasks; i++) {
+        if (!done[i]) {
+            task(chunk, i);
+        }
+    }
+    return 0;
+}
+
+static void tg_security_chunk_destroy(struct tg_security_chunk *chunk)
+{
+    if (chunk->outputs) {
+        for (uint32_t i = 0; i < chunk->ranges; i++) {
+            msgpack_sbuffer_destroy(&chunk->outputs[i].sbuf);
+        }
+    }
+    flb_free(chunk->outputs);
+    flb_free(chunk->range_done);
+    flb_free(chunk->shard_done);
+    flb_free(chunk->stateful);
+    flb_free(chunk->records);
+    flb_free(chunk->ends);
+}
+
+/* Decode a whole chunk into zone; returns -1 if it does not fit in memory */
+static int tg_security_chunk_decode(struct tg_security_chunk *chunk, msgpack_zone *zone,
+                                    size_t bytes)
+{
+    size_t off = 0;
+    int ret;
+    
+    while (off < bytes) {
+        if (chunk->count == chunk->alloc) {
+            uint32_t alloc = chunk->alloc ? chunk->alloc * 2 : 1024;
+            msgpack_object *records;
+            size_t *ends;
+            
+            records = flb_realloc(chunk->records, alloc * sizeof(msgpack_object));
+            if (!records) {
+                return -1;
+            }
+            chunk->records = records;
+            
+            ends = flb_realloc(chunk->ends, alloc * sizeof(size_t));
+            if (!ends) {
+                return -1;
+            }
+            chunk->ends = ends;
+            chunk->alloc = alloc;
+        }
+        
+        ret = msgpack_unpack(chunk->data, bytes, &off, zone, &chunk->records[chunk->count]);
+        if (ret != MSGPACK_UNPACK_SUCCESS && ret != MSGPACK_UNPACK_EXTRA_BYTES) {
+            break;
+        }
+        tg_security_event_unwrap(&chunk->records[chunk->count]);
+        chunk->ends[chunk->count++] = off;
+    }
+    
+    return 0;
+}
+
+/* Evaluate a chunk on the worker pool. The chunk is decoded at once; the
+ * window rules then run split by key shard, and the rest of the
+ * evaluation and the output split in ranges of records, whose outputs are
+ * joined in order. Returns -1, having written nothing, if the chunk is to
+ * be evaluated on the filter thread instead. */
+static int tg_security_filter_parallel(struct tg_security_ctx *ctx,
+                                       const struct tg_security_ruleset *set,
+                                       struct tg_security_worker *worker,
+                                       struct tg_security_output *out, size_t bytes)
+{
+    struct tg_security_chunk chunk;
+    msgpack_zone zone;
+    uint32_t width = (uint32_t) tg_pool_width(ctx->pool);
+    int ret = -1;
+    
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.ctx = ctx;
+    chunk.set = set;
+    chunk.owner = worker;
+    chunk.data = out->data;
+    
+    if (!msgpack_zone_init(&zone, MSGPACK_ZONE_CHUNK_SIZE)) {
+        return -1;
+    }
+    
+    if (tg_security_chunk_decode(&chunk, &zone, bytes) != 0 || chunk.count == 0) {
+        tg_security_chunk_destroy(&chunk);
+        msgpack_zone_destroy(&zone);
+        return -1;
+    }
+    
+    /* Several ranges per thread even out ranges of unequal cost */
+    chunk.range_size = (chunk.count + width * 4 - 1) / (width * 4);
+    if (chunk.range_size < TG_SECURITY_POOL_RANGE) {
+        chunk.range_size = TG_SECURITY_POOL_RANGE;
+    }
+    chunk.ranges = (chunk.count + chunk.range_size - 1) / chunk.range_size;
+    chunk.shards = width;
+    
+    chunk.outputs = flb_calloc(chunk.ranges, sizeof(struct tg_security_output));
+    chunk.range_done = flb_calloc(chunk.ranges, 1);
+    chunk.shard_done = flb_calloc(chunk.shards, 1);
+    if (set->stateful_count > 0) {
+        chunk.stateful = flb_calloc((size_t) set->stateful_count * chunk.count, 1);
+    }
+    if (!chunk.outputs || !chunk.range_done || !chunk.shard_done ||
+        (set->stateful_count > 0 && !chunk.stateful)) {
+        tg_security_chunk_destroy(&chunk);
+        msgpack_zone_destroy(&zone);
+        return -1;
+    }
+    
+    for (uint32_t i = 0; i < chunk.ranges; i++) {
+        chunk.outputs[i].data = out->data;
+        msgpack_sbuffer_init(&chunk.outputs[i].sbuf);
+        msgpack_packer_init(&chunk.outputs[i].packer, &chunk.outputs[i].sbuf,
+                            msgpack_sbuffer_write);
+    }
+    
+    /* Nothing is evaluated unless the pool takes the first job; once the
+     * window rules ran, the ranges run here if the pool got busy since */
+    if (set->stateful_count > 0 &&
+        tg_security_chunk_run(&chunk, tg_security_chunk_shard, chunk.shard_done,
+                              chunk.shards) != 0) {
+        ret = -1;
+    } else if (tg_security_chunk_run(&chunk, tg_security_chunk_range, chunk.range_done,
+                                     chunk.ranges) == 0) {
+        ret = 0;
+    } else if (set->stateful_count > 0) {
+        for (uint32_t i = 0; i < chunk.ranges; i++) {
+            tg_security_chunk_range(&chunk, i);
+        }
+        ret = 0;
+    }
+    
+    if (ret == 0) {
+        /* Ranges left unchanged are copied from the input */
+        for (uint32_t i = 0; i < chunk.ranges; i++) {
+            out->processed += chunk.outputs[i].processed;
+            out->flagged += chunk.outputs[i].flagged;
+            out->dropped += chunk.outputs[i].dropped;
+            out->modified |= chunk.outputs[i].modified;
+        }
+        
+        for (uint32_t i = 0; out->modified && i < chunk.ranges; i++) {
+            size_t first = i > 0 ? chunk.ends[i * chunk.range_size - 1] : 0;
+            size_t last = chunk.outputs[i].record_start;
+            
+            if (chunk.outputs[i].modified) {
+                msgpack_sbuffer_write(&out->sbuf, chunk.outputs[i].sbuf.data,
+                                      chunk.outputs[i].sbuf.size);
+            } else if (last > first) {
+                msgpack_sbuffer_write(&out->sbuf, out->data + first, last - first);
+            }
+        }
+        
+        out->record_start = chunk.ends[chunk.count - 1];
+        out->copy_start = out->record_start;
+    }
+    
+    tg_security_chunk_destroy(&chunk);
+    msgpack_zone_destroy(&zone);
+    return ret;
+}
+
+/* Check if a security rule matches an event */
+int tg_security_rule_matches(const struct tg_security_ruleset *set,
+                             struct tg_security_worker *worker,
+                             const struct tg_security_rule *rule, msgpack_object_map *map,
+                             time_t now)
+{
+    switch (rule->type) {
+        case TG_RULE_TYPE_FIELD_MATCH:
+            return tg_security_check_field_match(set, worker, rule, map);
+            
+        case TG_RULE_TYPE_FIELD_REGEX:
+            return tg_security_check_field_regex(set, worker, rule, map);
+            
+        case TG_RULE_TYPE_FIELD_EXISTS:
+            return tg_security_check_field_exists(set, worker, rule, map);
+            
+        case TG_RULE_TYPE_THREAT_INTEL:
+            return tg_security_check_threat_intel(set, worker, rule, map);
+            
+        case TG_RULE_TYPE_BEHAVIORAL:
+            return tg_security_check_behavioral(set, worker, rule, map);
+            
+        case TG_RULE_TYPE_COMPLIANCE:
+            return tg_security_check_compliance(set, worker, rule, map);
+            
+        case TG_RULE_TYPE_RATE:
+            return tg_security_check_rate(set, worker, rule, map, now);
+            
+        case TG_RULE_TYPE_DISTINCT:
+            return tg_security_check_distinct(set, worker, rule, map, now);
+            
+        case TG_RULE_TYPE_SEQUENCE:
+            return tg_security_check_sequence(set, worker, rule, map, now);
+            
+        default:
+            return 0;
+    }
+}
+
+/* Check field exact match */
+int tg_security_check_field_match(const struct tg_security_ruleset *set,
+                                  struct tg_security_worker *worker,
+                                  const struct tg_security_rule *rule, msgpack_object_map *map)
+{
+    const msgpack_object *val;
+    
+    val = tg_security_get_field(set, worker, map, rule->field_slot,
+                                set->rule_info[rule - set->rules].field_name);
+    
+    /* Field found, check value */
+    if (val && val->type == MSGPACK_OBJECT_STR) {
+        if (val->via.str.size == rule->pattern_len &&
+            memcmp(val->via.str.ptr, set->patterns + rule->pattern, val->via.str.size) == 0) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+/* Check field regex match */
+int tg_security_check_field_regex(const struct tg_security_ruleset *set,
+                                  struct tg_security_worker *worker,
+                                  const struct tg_security_rule *rule, msgpack_object_map *map)
+{
+    const msgpack_object *val;
+    
+    /* Compiled regex rules never reach this path; it only serves patterns
+     * the regex compiler rejected, which are matched as plain substrings */
+    
+    val = tg_security_get_field(set, worker, map, rule->field_slot,
+                                set->rule_info[rule - set->rules].field_name);
+    
+    if (val && val->type == MSGPACK_OBJECT_STR) {
+        /* Simple substring matching */
+        if (tg_search(val->via.str.ptr, val->via.str.size,
+                      set->patterns + rule->pattern, rule->pattern_len)) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+/* Check field exists */
+int tg_security_check_field_exists(const struct tg_security_ruleset *set,
+                                   struct tg_security_worker *worker,
+                                   const struct tg_security_rule *rule, msgpack_object_map *map)
+{
+    return tg_security_get_field(set, worker, map, rule->field_slot,
+                                set->rule_info[rule - set->rules].field_name) != NULL;
+}
+
+/* Check threat intelligence indicators */
+int tg_security_check_threat_intel(const struct tg_security_ruleset *set,
+                                   struct tg_security_worker *worker,
+                                   const struct tg_security_rule *rule, msgpack_object_map *map)
+{
+    /* Look up IPs, domains, URLs and file hashes in the indicator store */
+    for (int field_idx = 0; field_idx < TG_SECURITY_THREAT_INTEL_FIELDS; field_idx++) {
+        const msgpack_object *val;
+        
+        val = tg_security_get_field(set, worker, map, set->threat_intel_slots[field_idx],
+                                    tg_security_threat_intel_fields[field_idx]);
+        
+        if (val && val->type == MSGPACK_OBJECT_STR) {
+            /* Check against threat intelligence */
+            if (tg_threat_intel_lookup(worker->ioc, worker->ioc_cache,
+                                       tg_security_threat_intel_kinds[field_idx],
+                                       val->via.str.ptr, val->via.str.size)) {
+                return 1;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+/* Check behavioral analysis patterns */
+int tg_security_check_behavioral(const struct tg_security_ruleset *set,
+                                 struct tg_security_worker *worker,
+                                 const struct tg_security_rule *rule, msgpack_object_map *map)
+{
+    const msgpack_object *val;
+    
+    /* This would implement behavioral analysis */
+    /* Check for unusual login patterns, privilege escalation, etc. */
+    
+    /* Check for privilege escalation keywords */
+    val = tg_security_get_field(set, worker, map, set->event_type_slot, "event_type");
+    
+    if (val && val->type == MSGPACK_OBJECT_STR) {
+        if (TG_SEARCH_LITERAL(val->via.str.ptr, val->via.str.size, "privilege") ||
+            TG_SEARCH_LITERAL(val->via.str.ptr, val->via.str.size, "escalation") ||
+            TG_SEARCH_LITERAL(val->via.str.ptr, val->via.str.size, "sudo")) {
+            return 1;
         }
     }
     
@@ -398,7 +1868,9 @@ int tg_security_check_behavioral(struct tg_security_rule *rule, msgpack_object_m
 }
 
 /* Check compliance-related events */
-int tg_security_check_compliance(struct tg_security_rule *rule, msgpack_object_map *map)
+int tg_security_check_compliance(const struct tg_security_ruleset *set,
+                                 struct tg_security_worker *worker,
+                                 const struct tg_security_rule *rule, msgpack_object_map *map)
 {
     /* Check for compliance-relevant events (PCI DSS, HIPAA, SOX, etc.) */
     
@@ -409,18 +1881,18 @@ int tg_security_check_compliance(struct tg_security_rule *rule, msgpack_object_m
         if (key.type == MSGPACK_OBJECT_STR && val.type == MSGPACK_OBJECT_STR) {
             /* PCI DSS indicators */
             if (rule->compliance_type & TG_COMPLIANCE_PCI_DSS) {
-                if (strnstr(val.via.str.ptr, "payment", val.via.str.size) ||
-                    strnstr(val.via.str.ptr, "card", val.via.str.size) ||
-                    strnstr(val.via.str.ptr, "transaction", val.via.str.size)) {
+                if (TG_SEARCH_LITERAL(val.via.str.ptr, val.via.str.size, "payment") ||
+                    TG_SEARCH_LITERAL(val.via.str.ptr, val.via.str.size, "card") ||
+                    TG_SEARCH_LITERAL(val.via.str.ptr, val.via.str.size, "transaction")) {
                     return 1;
                 }
             }
             
             /* HIPAA indicators */
             if (rule->compliance_type & TG_COMPLIANCE_HIPAA) {
-                if (strnstr(val.via.str.ptr, "patient", val.via.str.size) ||
-                    strnstr(val.via.str.ptr, "medical", val.via.str.size) ||
-                    strnstr(val.via.str.ptr, "phi", val.via.str.size)) {
+                if (TG_SEARCH_LITERAL(val.via.str.ptr, val.via.str.size, "patient") ||
+                    TG_SEARCH_LITERAL(val.via.str.ptr, val.via.str.size, "medical") ||
+                    TG_SEARCH_LITERAL(val.via.str.ptr, val.via.str.size, "phi")) {
                     return 1;
                 }
             }
@@ -430,46 +1902,308 @@ int tg_security_check_compliance(struct tg_security_rule *rule, msgpack_object_m
     return 0;
 }
 
-/* Enrich event with security metadata */
-void tg_security_enrich_event(msgpack_object *obj, struct tg_security_ctx *ctx, msgpack_packer *packer)
+/* The event's event_type is type of len bytes, or type is NULL */
+static int tg_security_event_type_is(const struct tg_security_ruleset *set,
+                                     struct tg_security_worker *worker,
+                                     msgpack_object_map *map, const char *type, size_t len)
+{
+    const msgpack_object *val;
+    
+    if (!type) {
+        return 1;
+    }
+    
+    val = tg_security_get_field(set, worker, map, set->event_type_slot, "event_type");
+    return val && val->type == MSGPACK_OBJECT_STR && val->via.str.size == len &&
+           memcmp(val->via.str.ptr, type, len) == 0;
+}
+
+/* Parsed pattern of a window rule, NULL if the set has none for it */
+static const struct tg_security_window *tg_security_rule_window(
+    const struct tg_security_ruleset *set, const struct tg_security_rule *rule)
+{
+    int32_t s;
+    
+    if (!set->window_index) {
+        return NULL;
+    }
+    s = set->window_index[rule - set->rules];
+    return s >= 0 ? &set->windows[s] : NULL;
+}
+
+/* Check the event rate of the rule field's value */
+int tg_security_check_rate(const struct tg_security_ruleset *set,
+                           struct tg_security_worker *worker,
+                           const struct tg_security_rule *rule, msgpack_object_map *map,
+                           time_t now)
+{
+    const struct tg_security_rule_info *info = &set->rule_info[rule - set->rules];
+    const struct tg_security_window *window = tg_security_rule_window(set, rule);
+    const msgpack_object *val;
+    struct tg_session session;
+    uint32_t prefix[2];
+    
+    if (!worker->rates || !window) {
+        return 0;
+    }
+    
+    val = tg_security_get_field(set, worker, map, rule->field_slot, info->field_name);
+    if (!val || val->type != MSGPACK_OBJECT_STR || val->via.str.size == 0) {
+        return 0;
+    }
+    
+    if (!tg_security_event_type_is(set, worker, map, window->event_type,
+                                   window->event_type_len)) {
+        return 0;
+    }
+    
+    /* The key is the rule id, the bucket width and the value: rules count
+     * apart, and a reload that changes a rule's window starts new counts
+     * instead of reading the old buckets at another width */
+    prefix[0] = (uint32_t) info->id;
+    prefix[1] = window->width;
+    if (tg_session_track(worker->rates,
+                         tg_session_key((const char *) prefix, sizeof(prefix),
+                                        val->via.str.ptr, val->via.str.size),
+                         now, window->width, &session) < 0) {
+        return 0;
+    }
+    
+    return tg_window_sum(&session.window, (uint32_t) now / window->width,
+                         (window->window + window->width - 1) / window->width) > window->limit;
+}
+
+/* Check the distinct values of a field seen with the rule field's value */
+int tg_security_check_distinct(const struct tg_security_ruleset *set,
+                               struct tg_security_worker *worker,
+                               const struct tg_security_rule *rule, msgpack_object_map *map,
+                               time_t now)
+{
+    const struct tg_security_rule_info *info = &set->rule_info[rule - set->rules];
+    const struct tg_security_window *window = tg_security_rule_window(set, rule);
+    const msgpack_object *key;
+    const msgpack_object *val;
+    uint32_t prefix[2];
+    uint64_t hash;
+    
+    if (!worker->distinct || !window) {
+        return 0;
+    }
+    
+    key = tg_security_get_field(set, worker, map, rule->field_slot, info->field_name);
+    if (!key || key->type != MSGPACK_OBJECT_STR || key->via.str.size == 0 ||
+        !tg_security_event_type_is(set, worker, map, window->event_type,
+                                   window->event_type_len)) {
+        return 0;
+    }
+    
+    val = tg_security_get_field(set, worker, map, window->field_slot, window->field_name);
+    if (!val) {
+        return 0;
+    }
+    
+    /* Ports and the like may come as numbers */
+    if (val->type == MSGPACK_OBJECT_STR) {
+        hash = tg_session_key(val->via.str.ptr, val->via.str.size, NULL, 0);
+    } else if (val->type == MSGPACK_OBJECT_POSITIVE_INTEGER ||
+               val->type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
+        hash = tg_session_key((const char *) &val->via.u64, sizeof(val->via.u64), NULL, 0);
+    } else {
+        return 0;
+    }
+    
+    /* Sketches are counted with one window, so it is part of the key */
+    prefix[0] = (uint32_t) info->id;
+    prefix[1] = window->window;
+    return tg_distinct_track(worker->distinct,
+                             tg_session_key((const char *) prefix, sizeof(prefix),
+                                            key->via.str.ptr, key->via.str.size),
+                             hash, now, window->window) > window->limit;
+}
+
+/* Check whether the event completes a sequence for the rule field's value */
+int tg_security_check_sequence(const struct tg_security_ruleset *set,
+                               struct tg_security_worker *worker,
+                               const struct tg_security_rule *rule, msgpack_object_map *map,
+                               time_t now)
 {
-    if (!obj || !ctx || !packer) {
+    const struct tg_security_rule_info *info = &set->rule_info[rule - set->rules];
+    const struct tg_security_window *window = tg_security_rule_window(set, rule);
+    const struct tg_security_sequence *sequence;
+    const msgpack_object *type;
+    const msgpack_object *key;
+    uint32_t matches = 0;
+    
+    if (!worker->sequences || !window) {
+        return 0;
+    }
+    sequence = &window->sequence;
+    
+    /* Most events are no step of the sequence and never reach the table */
+    type = tg_security_get_field(set, worker, map, set->event_type_slot, "event_type");
+    if (!type || type->type != MSGPACK_OBJECT_STR) {
+        return 0;
+    }
+    for (int i = 0; i < sequence->steps; i++) {
+        if (type->via.str.size == sequence->type_lens[i] &&
+            memcmp(type->via.str.ptr, sequence->types[i], type->via.str.size) == 0) {
+            matches |= 1u << i;
+        }
+    }
+    if (matches == 0) {
+        return 0;
+    }
+    
+    key = tg_security_get_field(set, worker, map, rule->field_slot, info->field_name);
+    if (!key || key->type != MSGPACK_OBJECT_STR || key->via.str.size == 0) {
+        return 0;
+    }
+    
+    return tg_correlate_feed(worker->sequences,
+                             tg_session_key((const char *) &info->id, sizeof(info->id),
+                                            key->via.str.ptr, key->via.str.size),
+                             now, sequence->window, sequence->counts, sequence->steps,
+                             matches);
+}
+
+/* Pack a string key or value of the enrichment */
+static void tg_security_enrich_str(msgpack_packer *packer, const char *str)
+{
+    msgpack_pack_str(packer, strlen(str));
+    msgpack_pack_str_body(packer, str, strlen(str));
+}
+
+/* Encode the constant part of the enrichment once */
+int tg_security_enrich_init(struct tg_security_ctx *ctx)
+{
+    msgpack_sbuffer sbuf;
+    msgpack_packer packer;
+    
+    if (!ctx) {
+        return -1;
+    }
+    
+    msgpack_sbuffer_init(&sbuf);
+    msgpack_packer_init(&packer, &sbuf, msgpack_sbuffer_write);
+    
+    tg_security_enrich_str(&packer, "tg_security_tag");
+    tg_security_enrich_str(&packer, "flagged");
+    tg_security_enrich_str(&packer, "tg_agent_id");
+    tg_security_enrich_str(&packer, TG_AGENT_NAME);
+    tg_security_enrich_str(&packer, "tg_detection_time");
+    ctx->enrichment.time = sbuf.size;
+    tg_security_enrich_str(&packer, "tg_threat_score");
+    ctx->enrichment.score = sbuf.size;
+    tg_security_enrich_str(&packer, "tg_matched_rules");
+    
+    if (!sbuf.data) {
+        msgpack_sbuffer_destroy(&sbuf);
+        return -1;
+    }
+    
+    /* The context takes ownership of the sbuffer memory */
+    flb_free(ctx->enrichment.data);
+    ctx->enrichment.data = sbuf.data;
+    ctx->enrichment.size = sbuf.size;
+    return 0;
+}
+
+/* Size of the header of the msgpack map encoded at raw, 0 if none is */
+static size_t tg_security_map_header(const char *raw, size_t size)
+{
+    uint8_t type = size > 0 ? (uint8_t) raw[0] : 0;
+    
+    if ((type & 0xf0) == 0x80) {
+        return 1;
+    }
+    if (type == 0xde && size >= 3) {
+        return 3;
+    }
+    if (type == 0xdf && size >= 5) {
+        return 5;
+    }
+    return 0;
+}
+
+/* Offset of the map in an event array [timestamp, map] encoded at raw,
+ * 0 if raw is not one */
+static size_t tg_security_event_map_offset(const char *raw, size_t size)
+{
+    msgpack_unpacked result;
+    uint8_t type = size > 0 ? (uint8_t) raw[0] : 0;
+    size_t off;
+    
+    if (type == 0x92) {
+        off = 1;
+    } else if (type == 0xdc && size >= 3) {
+        off = 3;
+    } else if (type == 0xdd && size >= 5) {
+        off = 5;
+    } else {
+        return 0;
+    }
+    
+    /* Step over the timestamp, with its metadata if any */
+    msgpack_unpacked_init(&result);
+    if (msgpack_unpack_next(&result, raw, size, &off) != MSGPACK_UNPACK_SUCCESS) {
+        off = 0;
+    }
+    msgpack_unpacked_destroy(&result);
+    return off;
+}
+
+/* Enrich event with security metadata. obj is the event map and raw the
+ * record's bytes in the input; the timestamp of an event array and the
+ * original pairs are copied as encoded, the pairs under a header counting
+ * the enrichment, which is the template of tg_security_enrich_init with
+ * the detection time, the threat score and the ids of the rules event
+ * matched filled in. */
+void tg_security_enrich_event(msgpack_object *obj, const char *raw, size_t raw_size,
+                              const struct tg_security_event *event,
+                              struct tg_security_ctx *ctx, msgpack_packer *packer)
+{
+    const struct tg_security_enrichment *enrichment;
+    size_t header = 0;
+    size_t map = 0;
+    
+    if (!obj || !raw || !event || !ctx || !packer) {
         return;
     }
     
+    enrichment = &ctx->enrichment;
     if (obj->type == MSGPACK_OBJECT_MAP) {
-        msgpack_object_map map = obj->via.map;
-        
-        /* Create new map with additional security fields */
-        msgpack_pack_map(packer, map.size + 4);
-        
-        /* Copy original fields */
-        for (uint32_t i = 0; i < map.size; i++) {
-            msgpack_pack_object(packer, map.ptr[i].key);
-            msgpack_pack_object(packer, map.ptr[i].val);
+        header = tg_security_map_header(raw, raw_size);
+        if (header == 0) {
+            map = tg_security_event_map_offset(raw, raw_size);
+            header = map > 0 ? tg_security_map_header(raw + map, raw_size - map) : 0;
         }
-        
-        /* Add security enrichment */
-        msgpack_pack_str(packer, 15);
-        msgpack_pack_str_body(packer, "tg_security_tag", 15);
-        msgpack_pack_str(packer, 8);
-        msgpack_pack_str_body(packer, "flagged", 8);
-        
-        msgpack_pack_str(packer, 18);
-        msgpack_pack_str_body(packer, "tg_detection_time", 18);
-        msgpack_pack_uint64(packer, time(NULL));
-        
-        msgpack_pack_str(packer, 16);
-        msgpack_pack_str_body(packer, "tg_threat_score", 16);
-        msgpack_pack_int(packer, 75); /* Medium threat score */
-        
-        msgpack_pack_str(packer, 12);
-        msgpack_pack_str_body(packer, "tg_agent_id", 12);
-        msgpack_pack_str(packer, strlen(TG_AGENT_NAME));
-        msgpack_pack_str_body(packer, TG_AGENT_NAME, strlen(TG_AGENT_NAME));
-    } else {
-        /* Non-map object, pass through unchanged */
-        msgpack_pack_object(packer, *obj);
+    }
+    
+    /* Non-map object, or no template, pass through unchanged */
+    if (header == 0 || !enrichment->data) {
+        packer->callback(packer->data, raw, raw_size);
+        return;
+    }
+    
+    if (map > 0) {
+        packer->callback(packer->data, raw, map);
+    }
+    msgpack_pack_map(packer, obj->via.map.size + TG_SECURITY_ENRICH_FIELDS);
+    packer->callback(packer->data, raw + map + header, raw_size - map - header);
+    
+    packer->callback(packer->data, enrichment->data, enrichment->time);
+    msgpack_pack_uint64(packer, (uint64_t) tg_utils_coarse_time());
+    
+    /* The score is the chance, in percent, that any matched rule is right */
+    packer->callback(packer->data, enrichment->data + enrichment->time,
+                     enrichment->score - enrichment->time);
+    msgpack_pack_int(packer, event->rule_count > 0 ? 100 - (event->clear + 99) / 100 : 0);
+    
+    packer->callback(packer->data, enrichment->data + enrichment->score,
+                     enrichment->size - enrichment->score);
+    msgpack_pack_array(packer, event->rule_count);
+    for (int i = 0; i < event->rule_count; i++) {
+        msgpack_pack_int(packer, event->rule_ids[i]);
     }
 }
 
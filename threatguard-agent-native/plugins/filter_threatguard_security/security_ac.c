@@ -0,0 +1,637 @@
+/*  ThreatGuard Agent - Aho-Corasick Multi-Pattern Matcher
+ *  Literal patterns are collected into a sparse trie, then compiled into an
+ *  automaton over byte equivalence classes. States near the root, where a
+ *  scan spends most of its time, get dense rows costing one table lookup
+ *  per byte; deeper states keep sorted edge lists and a failure link, so
+ *  the tables grow with the patterns rather than with states x classes.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_ac.h"
+
+/* States of depth below TG_AC_DENSE_DEPTH get dense rows, as long as the
+ * rows stay within TG_AC_DENSE_CELLS transitions */
+#define TG_AC_DENSE_DEPTH   3
+#define TG_AC_DENSE_CELLS   (1 << 18)
+
+/* Build-time trie node, siblings kept as a singly linked list */
+struct tg_ac_node {
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint8_t byte;
+};
+
+struct tg_ac {
+    int compiled;
+    int mapped;                 /* tables borrowed from an image */
+
+    /* Build-time trie, released by tg_ac_compile() */
+    struct tg_ac_node *nodes;
+    uint32_t node_count;
+    uint32_t node_alloc;
+    uint32_t *pattern_node;
+    uint32_t *pattern_ids;
+    uint32_t pattern_count;
+    uint32_t pattern_alloc;
+
+    /* Compiled automaton; states are numbered breadth-first, so a state's
+     * failure state has a lower number and the dense states come first */
+    uint16_t byte_class[256];   /* byte -> column, 0 = byte not in any pattern */
+    uint32_t class_count;
+    uint32_t state_count;
+    uint32_t dense_count;       /* states with a row in delta */
+    uint32_t edge_count;
+    uint32_t *delta;            /* dense_count x class_count transitions */
+    uint32_t *edge_start;       /* state - dense_count -> first edge, + 1 entry */
+    uint16_t *edge_class;       /* edges of each sparse state by ascending class */
+    uint32_t *edge_target;
+    uint32_t *fail;             /* state -> failure state */
+    uint32_t *out_start;        /* state -> first own output, state_count + 1 entries */
+    uint32_t *out_ids;          /* pattern ids grouped by terminal state */
+    uint32_t *dict_link;        /* nearest proper suffix state with output, 0 = none */
+    uint8_t *has_output;
+};
+
+/* Serialized automaton; the tables follow in this order, each starting
+ * on an 8-byte boundary */
+struct tg_ac_image {
+    uint32_t class_count;
+    uint32_t state_count;
+    uint32_t pattern_count;
+    uint32_t dense_count;
+    uint32_t edge_count;
+    uint32_t reserved;
+    uint16_t byte_class[256];
+};
+
+static size_t tg_ac_align(size_t size)
+{
+    return (size + 7) & ~(size_t) 7;
+}
+
+static int tg_ac_grow(void **ptr, uint32_t *alloc, uint32_t needed, size_t elem_size)
+{
+    uint32_t new_alloc;
+    void *tmp;
+
+    if (needed <= *alloc) {
+        return 0;
+    }
+
+    new_alloc = *alloc ? *alloc * 2 : 64;
+    while (new_alloc < needed) {
+        new_alloc *= 2;
+    }
+
+    tmp = flb_realloc(*ptr, (size_t) new_alloc * elem_size);
+    if (!tmp) {
+        return -1;
+    }
+
+    *ptr = tmp;
+    *alloc = new_alloc;
+    return 0;
+}
+
+/* Create an empty matcher */
+struct tg_ac *tg_ac_create(void)
+{
+    struct tg_ac *ac;
+
+    ac = flb_calloc(1, sizeof(struct tg_ac));
+    if (!ac) {
+        return NULL;
+    }
+
+    /* Node 0 is the root */
+    if (tg_ac_grow((void **) &ac->nodes, &ac->node_alloc, 1,
+                   sizeof(struct tg_ac_node)) != 0) {
+        flb_free(ac);
+        return NULL;
+    }
+    memset(&ac->nodes[0], 0, sizeof(struct tg_ac_node));
+    ac->node_count = 1;
+
+    return ac;
+}
+
+/* Add a literal pattern; several patterns may share the same bytes */
+int tg_ac_add_pattern(struct tg_ac *ac, const char *pattern, size_t len, uint32_t pattern_id)
+{
+    uint32_t node = 0;
+    uint32_t child;
+    size_t i;
+
+    if (!ac || ac->compiled || !pattern || len == 0) {
+        return -1;
+    }
+
+    for (i = 0; i < len; i++) {
+        uint8_t byte = (uint8_t) pattern[i];
+
+        for (child = ac->nodes[node].first_child; child; child = ac->nodes[child].next_sibling) {
+            if (ac->nodes[child].byte == byte) {
+                break;
+            }
+        }
+
+        if (!child) {
+            if (ac->node_count == UINT32_MAX ||
+                tg_ac_grow((void **) &ac->nodes, &ac->node_alloc, ac->node_count + 1,
+                           sizeof(struct tg_ac_node)) != 0) {
+                return -1;
+            }
+
+            child = ac->node_count++;
+            ac->nodes[child].byte = byte;
+            ac->nodes[child].first_child = 0;
+            ac->nodes[child].next_sibling = ac->nodes[node].first_child;
+            ac->nodes[node].first_child = child;
+        }
+
+        node = child;
+    }
+
+    if (ac->pattern_count == ac->pattern_alloc) {
+        uint32_t new_alloc = ac->pattern_alloc ? ac->pattern_alloc * 2 : 64;
+        uint32_t *tmp;
+
+        tmp = flb_realloc(ac->pattern_node, (size_t) new_alloc * sizeof(uint32_t));
+        if (!tmp) {
+            return -1;
+        }
+        ac->pattern_node = tmp;
+
+        tmp = flb_realloc(ac->pattern_ids, (size_t) new_alloc * sizeof(uint32_t));
+        if (!tmp) {
+            return -1;
+        }
+        ac->pattern_ids = tmp;
+        ac->pattern_alloc = new_alloc;
+    }
+
+    ac->pattern_node[ac->pattern_count] = node;
+    ac->pattern_ids[ac->pattern_count] = pattern_id;
+    ac->pattern_count++;
+
+    return 0;
+}
+
+/* Transition from state on byte class c: a sparse state without an edge
+ * for c falls back to its failure state, which is shallower, until a
+ * dense row answers */
+static inline uint32_t tg_ac_next(const struct tg_ac *ac, uint32_t state, uint32_t c)
+{
+    while (state >= ac->dense_count) {
+        uint32_t s = state - ac->dense_count;
+
+        for (uint32_t e = ac->edge_start[s]; e < ac->edge_start[s + 1]; e++) {
+            if (ac->edge_class[e] >= c) {
+                if (ac->edge_class[e] == c) {
+                    return ac->edge_target[e];
+                }
+                break;
+            }
+        }
+        state = ac->fail[state];
+    }
+    return ac->delta[(size_t) state * ac->class_count + c];
+}
+
+/* Compute failure links breadth-first, then fill the dense rows of the
+ * shallow states and the edge lists of the others */
+int tg_ac_compile(struct tg_ac *ac)
+{
+    uint8_t used[256];
+    uint32_t *queue = NULL;
+    uint32_t *number = NULL;
+    uint8_t *depth = NULL;
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    uint32_t cc;
+    uint32_t i;
+
+    if (!ac || ac->compiled) {
+        return -1;
+    }
+
+    /* Map bytes that never appear in a pattern to a shared column */
+    memset(used, 0, sizeof(used));
+    for (i = 1; i < ac->node_count; i++) {
+        used[ac->nodes[i].byte] = 1;
+    }
+
+    ac->class_count = 1;
+    for (i = 0; i < 256; i++) {
+        ac->byte_class[i] = used[i] ? (uint16_t) ac->class_count++ : 0;
+    }
+
+    cc = ac->class_count;
+    ac->state_count = ac->node_count;
+
+    /* Number the trie nodes breadth-first */
+    queue = flb_malloc((size_t) ac->state_count * sizeof(uint32_t));
+    number = flb_malloc((size_t) ac->state_count * sizeof(uint32_t));
+    depth = flb_calloc(ac->state_count, sizeof(uint8_t));
+    if (!queue || !number || !depth) {
+        tg_log(TG_LOG_ERROR, "failed to allocate automaton with %u states", ac->state_count);
+        flb_free(queue);
+        flb_free(number);
+        flb_free(depth);
+        return -1;
+    }
+
+    queue[tail++] = 0;
+    number[0] = 0;
+    while (head < tail) {
+        uint32_t u = queue[head];
+
+        for (uint32_t v = ac->nodes[u].first_child; v; v = ac->nodes[v].next_sibling) {
+            depth[tail] = depth[head] < TG_AC_DENSE_DEPTH ? depth[head] + 1 : depth[head];
+            number[v] = tail;
+            queue[tail++] = v;
+        }
+        head++;
+    }
+
+    ac->dense_count = 1;
+    while (ac->dense_count < ac->state_count && depth[ac->dense_count] < TG_AC_DENSE_DEPTH &&
+           (size_t) (ac->dense_count + 1) * cc <= TG_AC_DENSE_CELLS) {
+        ac->dense_count++;
+    }
+    flb_free(depth);
+
+    ac->delta = flb_calloc((size_t) ac->dense_count * cc, sizeof(uint32_t));
+    ac->edge_start = flb_calloc((size_t) (ac->state_count - ac->dense_count) + 1,
+                                sizeof(uint32_t));
+    ac->edge_class = flb_malloc((size_t) ac->state_count * sizeof(uint16_t));
+    ac->edge_target = flb_malloc((size_t) ac->state_count * sizeof(uint32_t));
+    ac->fail = flb_calloc(ac->state_count, sizeof(uint32_t));
+    ac->out_start = flb_calloc((size_t) ac->state_count + 1, sizeof(uint32_t));
+    ac->out_ids = flb_calloc(ac->pattern_count ? ac->pattern_count : 1, sizeof(uint32_t));
+    ac->dict_link = flb_calloc(ac->state_count, sizeof(uint32_t));
+    ac->has_output = flb_calloc(ac->state_count, sizeof(uint8_t));
+
+    if (!ac->delta || !ac->edge_start || !ac->edge_class || !ac->edge_target ||
+        !ac->fail || !ac->out_start || !ac->out_ids || !ac->dict_link || !ac->has_output) {
+        tg_log(TG_LOG_ERROR, "failed to allocate automaton with %u states", ac->state_count);
+        flb_free(queue);
+        flb_free(number);
+        return -1;
+    }
+
+    /* Group pattern ids by terminal state (counting sort) */
+    for (i = 0; i < ac->pattern_count; i++) {
+        ac->out_start[number[ac->pattern_node[i]] + 1]++;
+    }
+    for (i = 0; i < ac->state_count; i++) {
+        ac->out_start[i + 1] += ac->out_start[i];
+    }
+    for (i = 0; i < ac->pattern_count; i++) {
+        uint32_t state = number[ac->pattern_node[i]];
+        uint32_t slot = ac->out_start[state]++;
+        ac->out_ids[slot] = ac->pattern_ids[i];
+    }
+    for (i = ac->state_count; i > 0; i--) {
+        ac->out_start[i] = ac->out_start[i - 1];
+    }
+    ac->out_start[0] = 0;
+
+    /* A dense row starts as a copy of its failure state's row, then its
+     * own children override the columns they consume; failure states are
+     * shallower, so their rows are complete by the time we copy. A sparse
+     * state only lists its children, and their failure states are found
+     * through the transitions already built. */
+    ac->edge_count = 0;
+    for (uint32_t u = 0; u < ac->state_count; u++) {
+        uint32_t *row = NULL;
+
+        if (u < ac->dense_count) {
+            row = &ac->delta[(size_t) u * cc];
+            if (u != 0) {
+                memcpy(row, &ac->delta[(size_t) ac->fail[u] * cc], cc * sizeof(uint32_t));
+            }
+        } else {
+            ac->edge_start[u - ac->dense_count] = ac->edge_count;
+        }
+
+        for (uint32_t v = ac->nodes[queue[u]].first_child; v; v = ac->nodes[v].next_sibling) {
+            uint32_t c = ac->byte_class[ac->nodes[v].byte];
+            uint32_t target = number[v];
+
+            if (row) {
+                ac->fail[target] = (u == 0) ? 0 : row[c];
+                row[c] = target;
+                continue;
+            }
+
+            ac->fail[target] = tg_ac_next(ac, ac->fail[u], c);
+
+            /* Insertion into the edges of u, kept sorted by class */
+            i = ac->edge_count++;
+            while (i > ac->edge_start[u - ac->dense_count] && ac->edge_class[i - 1] > c) {
+                ac->edge_class[i] = ac->edge_class[i - 1];
+                ac->edge_target[i] = ac->edge_target[i - 1];
+                i--;
+            }
+            ac->edge_class[i] = (uint16_t) c;
+            ac->edge_target[i] = target;
+        }
+    }
+    ac->edge_start[ac->state_count - ac->dense_count] = ac->edge_count;
+
+    /* Output links in state order so each failure state is resolved first */
+    for (i = 1; i < ac->state_count; i++) {
+        uint32_t f = ac->fail[i];
+
+        if (ac->out_start[f + 1] > ac->out_start[f]) {
+            ac->dict_link[i] = f;
+        } else {
+            ac->dict_link[i] = ac->dict_link[f];
+        }
+
+        ac->has_output[i] = (ac->out_start[i + 1] > ac->out_start[i]) ||
+                            ac->dict_link[i] != 0;
+    }
+
+    flb_free(queue);
+    flb_free(number);
+
+    /* The sparse trie is no longer needed */
+    flb_free(ac->nodes);
+    flb_free(ac->pattern_node);
+    flb_free(ac->pattern_ids);
+    ac->nodes = NULL;
+    ac->pattern_node = NULL;
+    ac->pattern_ids = NULL;
+    ac->node_alloc = 0;
+    ac->pattern_alloc = 0;
+
+    ac->compiled = 1;
+
+    tg_log(TG_LOG_DEBUG, "compiled automaton: %u patterns, %u states (%u dense), "
+           "%u byte classes", ac->pattern_count, ac->state_count, ac->dense_count,
+           ac->class_count);
+    return 0;
+}
+
+/* Scan a value, reporting every pattern occurrence; returns the number reported */
+int tg_ac_scan(const struct tg_ac *ac, const char *text, size_t len,
+               tg_ac_match_cb cb, void *data)
+{
+    uint32_t state = 0;
+    int matches = 0;
+    size_t i;
+
+    if (!ac || !ac->compiled || !text) {
+        return 0;
+    }
+
+    for (i = 0; i < len; i++) {
+        uint32_t s;
+        uint32_t k;
+
+        state = tg_ac_next(ac, state, ac->byte_class[(uint8_t) text[i]]);
+        if (!ac->has_output[state]) {
+            continue;
+        }
+
+        for (s = state; s; s = ac->dict_link[s]) {
+            for (k = ac->out_start[s]; k < ac->out_start[s + 1]; k++) {
+                matches++;
+                if (cb && cb(ac->out_ids[k], i + 1, data) != 0) {
+                    return matches;
+                }
+            }
+        }
+    }
+
+    return matches;
+}
+
+/* Offsets of the tables in an image; returns the image size */
+static size_t tg_ac_image_layout(const struct tg_ac_image *image, size_t offsets[9])
+{
+    size_t states = image->state_count;
+    size_t sparse = states - image->dense_count;
+    size_t size = tg_ac_align(sizeof(struct tg_ac_image));
+
+    offsets[0] = size;          /* delta */
+    size = tg_ac_align(size + (size_t) image->dense_count * image->class_count * sizeof(uint32_t));
+    offsets[1] = size;          /* edge_start */
+    size = tg_ac_align(size + (sparse + 1) * sizeof(uint32_t));
+    offsets[2] = size;          /* edge_class */
+    size = tg_ac_align(size + (size_t) image->edge_count * sizeof(uint16_t));
+    offsets[3] = size;          /* edge_target */
+    size = tg_ac_align(size + (size_t) image->edge_count * sizeof(uint32_t));
+    offsets[4] = size;          /* fail */
+    size = tg_ac_align(size + states * sizeof(uint32_t));
+    offsets[5] = size;          /* out_start */
+    size = tg_ac_align(size + (states + 1) * sizeof(uint32_t));
+    offsets[6] = size;          /* out_ids */
+    size = tg_ac_align(size + (size_t) image->pattern_count * sizeof(uint32_t));
+    offsets[7] = size;          /* dict_link */
+    size = tg_ac_align(size + states * sizeof(uint32_t));
+    offsets[8] = size;          /* has_output */
+    return tg_ac_align(size + states);
+}
+
+size_t tg_ac_serialize(const struct tg_ac *ac, void *buf, size_t size)
+{
+    struct tg_ac_image header;
+    size_t offsets[9];
+    size_t sparse;
+    size_t needed;
+    char *base = buf;
+
+    if (!ac || !ac->compiled) {
+        return 0;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.class_count = ac->class_count;
+    header.state_count = ac->state_count;
+    header.pattern_count = ac->pattern_count;
+    header.dense_count = ac->dense_count;
+    header.edge_count = ac->edge_count;
+    memcpy(header.byte_class, ac->byte_class, sizeof(header.byte_class));
+
+    needed = tg_ac_image_layout(&header, offsets);
+    if (!buf || size < needed) {
+        return needed;
+    }
+
+    sparse = (size_t) ac->state_count - ac->dense_count;
+    memset(buf, 0, needed);
+    memcpy(buf, &header, sizeof(header));
+    memcpy(base + offsets[0], ac->delta,
+           (size_t) ac->dense_count * ac->class_count * sizeof(uint32_t));
+    memcpy(base + offsets[1], ac->edge_start, (sparse + 1) * sizeof(uint32_t));
+    memcpy(base + offsets[2], ac->edge_class, (size_t) ac->edge_count * sizeof(uint16_t));
+    memcpy(base + offsets[3], ac->edge_target, (size_t) ac->edge_count * sizeof(uint32_t));
+    memcpy(base + offsets[4], ac->fail, (size_t) ac->state_count * sizeof(uint32_t));
+    memcpy(base + offsets[5], ac->out_start, ((size_t) ac->state_count + 1) * sizeof(uint32_t));
+    memcpy(base + offsets[6], ac->out_ids, (size_t) ac->pattern_count * sizeof(uint32_t));
+    memcpy(base + offsets[7], ac->dict_link, (size_t) ac->state_count * sizeof(uint32_t));
+    memcpy(base + offsets[8], ac->has_output, ac->state_count);
+    return needed;
+}
+
+/* Check that every table entry stays in range, so a damaged image cannot
+ * send a scan out of bounds; failure links must lead to lower states so
+ * that falling back always ends at a dense row */
+static int tg_ac_image_valid(const struct tg_ac *ac, uint32_t id_limit)
+{
+    size_t cells = (size_t) ac->dense_count * ac->class_count;
+    uint32_t sparse = ac->state_count - ac->dense_count;
+
+    for (int b = 0; b < 256; b++) {
+        if (ac->byte_class[b] >= ac->class_count) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < cells; i++) {
+        if (ac->delta[i] >= ac->state_count) {
+            return 0;
+        }
+    }
+    if (ac->edge_start[0] != 0 || ac->edge_start[sparse] != ac->edge_count) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < sparse; i++) {
+        if (ac->edge_start[i] > ac->edge_start[i + 1]) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < ac->edge_count; i++) {
+        if (ac->edge_class[i] >= ac->class_count || ac->edge_target[i] >= ac->state_count) {
+            return 0;
+        }
+    }
+    if (ac->out_start[0] != 0 || ac->out_start[ac->state_count] != ac->pattern_count) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < ac->state_count; i++) {
+        if (ac->out_start[i] > ac->out_start[i + 1] || ac->dict_link[i] >= ac->state_count ||
+            (i > 0 && ac->fail[i] >= i)) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < ac->pattern_count; i++) {
+        if (ac->out_ids[i] >= id_limit) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+struct tg_ac *tg_ac_map(const void *image, size_t size, uint32_t id_limit)
+{
+    const struct tg_ac_image *header = image;
+    const char *base = image;
+    struct tg_ac *ac;
+    size_t offsets[9];
+
+    if (!image || size < sizeof(struct tg_ac_image) ||
+        header->class_count == 0 || header->class_count > 257 || header->state_count == 0 ||
+        header->dense_count == 0 || header->dense_count > header->state_count ||
+        header->edge_count >= header->state_count ||
+        tg_ac_image_layout(header, offsets) > size) {
+        return NULL;
+    }
+
+    ac = flb_calloc(1, sizeof(struct tg_ac));
+    if (!ac) {
+        return NULL;
+    }
+
+    ac->compiled = 1;
+    ac->mapped = 1;
+    ac->class_count = header->class_count;
+    ac->state_count = header->state_count;
+    ac->dense_count = header->dense_count;
+    ac->edge_count = header->edge_count;
+    ac->pattern_count = header->pattern_count;
+    memcpy(ac->byte_class, header->byte_class, sizeof(ac->byte_class));
+    ac->delta = (uint32_t *) (base + offsets[0]);
+    ac->edge_start = (uint32_t *) (base + offsets[1]);
+    ac->edge_class = (uint16_t *) (base + offsets[2]);
+    ac->edge_target = (uint32_t *) (base + offsets[3]);
+    ac->fail = (uint32_t *) (base + offsets[4]);
+    ac->out_start = (uint32_t *) (base + offsets[5]);
+    ac->out_ids = (uint32_t *) (base + offsets[6]);
+    ac->dict_link = (uint32_t *) (base + offsets[7]);
+    ac->has_output = (uint8_t *) (base + offsets[8]);
+
+    if (!tg_ac_image_valid(ac, id_limit)) {
+        flb_free(ac);
+        return NULL;
+    }
+
+    return ac;
+}
+
+uint32_t tg_ac_pattern_count(const struct tg_ac *ac)
+{
+    return ac ? ac->pattern_count : 0;
+}
+
+uint32_t tg_ac_state_count(const struct tg_ac *ac)
+{
+    if (!ac) {
+        return 0;
+    }
+    return ac->compiled ? ac->state_count : ac->node_count;
+}
+
+/* Approximate heap footprint of the compiled tables */
+size_t tg_ac_memory_usage(const struct tg_ac *ac)
+{
+    size_t size;
+
+    if (!ac) {
+        return 0;
+    }
+
+    size = sizeof(struct tg_ac);
+    if (ac->compiled) {
+        size += (size_t) ac->dense_count * ac->class_count * sizeof(uint32_t);
+        size += ((size_t) ac->state_count - ac->dense_count + 1) * sizeof(uint32_t);
+        size += (size_t) ac->state_count * (sizeof(uint16_t) + sizeof(uint32_t));
+        size += ((size_t) ac->state_count + 1) * sizeof(uint32_t);
+        size += (size_t) ac->pattern_count * sizeof(uint32_t);
+        size += (size_t) ac->state_count * (2 * sizeof(uint32_t) + sizeof(uint8_t));
+    } else {
+        size += (size_t) ac->node_alloc * sizeof(struct tg_ac_node);
+        size += (size_t) ac->pattern_alloc * 2 * sizeof(uint32_t);
+    }
+
+    return size;
+}
+
+void tg_ac_destroy(struct tg_ac *ac)
+{
+    if (!ac) {
+        return;
+    }
+
+    if (ac->mapped) {
+        flb_free(ac);
+        return;
+    }
+
+    flb_free(ac->nodes);
+    flb_free(ac->pattern_node);
+    flb_free(ac->pattern_ids);
+    flb_free(ac->delta);
+    flb_free(ac->edge_start);
+    flb_free(ac->edge_class);
+    flb_free(ac->edge_target);
+    flb_free(ac->fail);
+    flb_free(ac->out_start);
+    flb_free(ac->out_ids);
+    flb_free(ac->dict_link);
+    flb_free(ac->has_output);
+    flb_free(ac);
+}
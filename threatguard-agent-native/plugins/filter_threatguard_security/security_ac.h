@@ -0,0 +1,39 @@
+/*  ThreatGuard Agent - Aho-Corasick Multi-Pattern Matcher
+ *  Scans a value once and reports every literal pattern it contains
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_AC_H
+#define TG_SECURITY_AC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct tg_ac;
+
+/* Called once per pattern occurrence; return non-zero to stop the scan */
+typedef int (*tg_ac_match_cb)(uint32_t pattern_id, size_t end_offset, void *data);
+
+/* Build phase: add patterns, then compile once before scanning */
+struct tg_ac *tg_ac_create(void);
+int tg_ac_add_pattern(struct tg_ac *ac, const char *pattern, size_t len, uint32_t pattern_id);
+int tg_ac_compile(struct tg_ac *ac);
+
+/* Scan phase: read-only, safe to share between threads */
+int tg_ac_scan(const struct tg_ac *ac, const char *text, size_t len,
+               tg_ac_match_cb cb, void *data);
+
+/* Flat image of a compiled matcher, for rule bundles. serialize returns
+ * the image size and writes it to buf if size allows (buf 8-byte
+ * aligned); 0 if ac is not compiled. map validates an image and returns a
+ * matcher that reads it in place, so the image must outlive the matcher;
+ * every pattern id must be below id_limit. */
+size_t tg_ac_serialize(const struct tg_ac *ac, void *buf, size_t size);
+struct tg_ac *tg_ac_map(const void *image, size_t size, uint32_t id_limit);
+
+uint32_t tg_ac_pattern_count(const struct tg_ac *ac);
+uint32_t tg_ac_state_count(const struct tg_ac *ac);
+size_t tg_ac_memory_usage(const struct tg_ac *ac);
+void tg_ac_destroy(struct tg_ac *ac);
+
+#endif /* TG_SECURITY_AC_H */
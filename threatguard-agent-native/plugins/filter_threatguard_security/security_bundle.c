@@ -0,0 +1,435 @@
+/*  ThreatGuard Agent - Security Rule Bundles
+ *  Binary rule bundles hold a compiled rule set: the rule tables, pattern
+ *  pool, field dictionary and matcher automata, each laid out the way the
+ *  filter uses it. Loading a bundle maps the file and points the rule set
+ *  into it, so startup does no parsing or compiling and agents on one host
+ *  share the pages.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "security_rules.h"
+
+#include <fcntl.h>
+
+#ifdef TG_PLATFORM_WINDOWS
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define TG_BUNDLE_MAGIC         "TGRB"
+#define TG_BUNDLE_VERSION       2
+#define TG_BUNDLE_BYTE_ORDER    0x01020304u
+
+/* Bundle header at offset 0. All offsets are from the start of the file
+ * and 8-byte aligned; sections never overlap. */
+struct tg_bundle_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;        /* TG_BUNDLE_BYTE_ORDER as written */
+    uint16_t rule_size;         /* sizeof(struct tg_security_rule) */
+    uint16_t rule_info_size;    /* sizeof(struct tg_security_rule_info) */
+    uint64_t file_size;
+    uint64_t created;
+
+    uint32_t rule_count;
+    uint32_t matcher_count;
+    uint64_t rules_off;
+    uint64_t rule_info_off;
+    uint64_t patterns_off;
+    uint64_t patterns_len;
+    uint64_t matchers_off;
+    uint64_t fields_off;        /* field dictionary image, 0 if rules are not indexed */
+    uint64_t fields_size;
+
+    int32_t threat_intel_slots[TG_SECURITY_THREAT_INTEL_FIELDS];
+    int32_t event_type_slot;
+};
+
+/* One field matcher; each automaton is an image at its own offset, 0 if
+ * the field has none */
+struct tg_bundle_matcher {
+    char field_name[64];
+    int32_t field_slot;
+    uint32_t reserved;
+    uint64_t ac_off;
+    uint64_t ac_size;
+    uint64_t regex_off;
+    uint64_t regex_size;
+};
+
+static size_t tg_bundle_align(size_t size)
+{
+    return (size + 7) & ~(size_t) 7;
+}
+
+/* Whether filename starts like a rule bundle */
+int tg_security_bundle_detect(const char *filename)
+{
+    char magic[4];
+    FILE *file;
+    int ret;
+
+    file = fopen(filename, "rb");
+    if (!file) {
+        return 0;
+    }
+
+    ret = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+          memcmp(magic, TG_BUNDLE_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return ret;
+}
+
+/* Write a compiled rule set as a bundle. The file is replaced by a rename,
+ * so a filter watching it never maps a partly written bundle. */
+int tg_security_bundle_write(const struct tg_security_ruleset *set, const char *filename)
+{
+    struct tg_bundle_header *header;
+    struct tg_bundle_matcher *entries;
+    char tmp_name[TG_MAX_PATH];
+    char *image;
+    size_t size;
+    FILE *file;
+    int ret;
+
+    if (!set || !filename || set->map) {
+        return -1;
+    }
+
+    /* Lay out the sections */
+    size = tg_bundle_align(sizeof(struct tg_bundle_header));
+    size_t rules_off = size;
+    size = tg_bundle_align(size + (size_t) set->rule_count * sizeof(struct tg_security_rule));
+    size_t rule_info_off = size;
+    size = tg_bundle_align(size + (size_t) set->rule_count * sizeof(struct tg_security_rule_info));
+    size_t patterns_off = size;
+    size = tg_bundle_align(size + set->patterns_len);
+    size_t matchers_off = size;
+    size = tg_bundle_align(size + (size_t) set->matcher_count * sizeof(struct tg_bundle_matcher));
+    size_t fields_off = size;
+    size_t fields_size = tg_field_dict_serialize(set->fields, NULL, 0);
+    size = tg_bundle_align(size + fields_size);
+    size_t automata_off = size;
+
+    for (int i = 0; i < set->matcher_count; i++) {
+        size += tg_ac_serialize(set->matchers[i].ac, NULL, 0);
+        size += tg_regex_set_serialize(set->matchers[i].regex, NULL, 0);
+    }
+
+    image = flb_calloc(1, size);
+    if (!image) {
+        tg_log(TG_LOG_ERROR, "failed to allocate %zu byte rule bundle", size);
+        return -1;
+    }
+
+    header = (struct tg_bundle_header *) image;
+    memcpy(header->magic, TG_BUNDLE_MAGIC, sizeof(header->magic));
+    header->version = TG_BUNDLE_VERSION;
+    header->byte_order = TG_BUNDLE_BYTE_ORDER;
+    header->rule_size = sizeof(struct tg_security_rule);
+    header->rule_info_size = sizeof(struct tg_security_rule_info);
+    header->file_size = size;
+    header->created = (uint64_t) time(NULL);
+    header->rule_count = (uint32_t) set->rule_count;
+    header->matcher_count = (uint32_t) set->matcher_count;
+    header->rules_off = rules_off;
+    header->rule_info_off = rule_info_off;
+    header->patterns_off = patterns_off;
+    header->patterns_len = set->patterns_len;
+    header->matchers_off = matchers_off;
+    header->fields_off = fields_size ? fields_off : 0;
+    header->fields_size = fields_size;
+    for (int i = 0; i < TG_SECURITY_THREAT_INTEL_FIELDS; i++) {
+        header->threat_intel_slots[i] = set->threat_intel_slots[i];
+    }
+    header->event_type_slot = set->event_type_slot;
+
+    if (set->rule_count > 0) {
+        memcpy(image + rules_off, set->rules,
+               (size_t) set->rule_count * sizeof(struct tg_security_rule));
+        memcpy(image + rule_info_off, set->rule_info,
+               (size_t) set->rule_count * sizeof(struct tg_security_rule_info));
+    }
+    if (set->patterns_len > 0) {
+        memcpy(image + patterns_off, set->patterns, set->patterns_len);
+    }
+    if (fields_size) {
+        tg_field_dict_serialize(set->fields, image + fields_off, fields_size);
+    }
+
+    entries = (struct tg_bundle_matcher *) (image + matchers_off);
+    size_t off = automata_off;
+    for (int i = 0; i < set->matcher_count; i++) {
+        const struct tg_security_field_matcher *matcher = &set->matchers[i];
+        struct tg_bundle_matcher *entry = &entries[i];
+
+        memcpy(entry->field_name, matcher->field_name, sizeof(entry->field_name));
+        entry->field_slot = matcher->field_slot;
+
+        entry->ac_size = tg_ac_serialize(matcher->ac, image + off, size - off);
+        entry->ac_off = entry->ac_size ? off : 0;
+        off += entry->ac_size;
+
+        entry->regex_size = tg_regex_set_serialize(matcher->regex, image + off, size - off);
+        entry->regex_off = entry->regex_size ? off : 0;
+        off += entry->regex_size;
+    }
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+    file = fopen(tmp_name, "wb");
+    if (!file) {
+        tg_log(TG_LOG_ERROR, "failed to create %s: %s", tmp_name, strerror(errno));
+        flb_free(image);
+        return -1;
+    }
+
+    ret = fwrite(image, 1, size, file) == size ? 0 : -1;
+    if (fclose(file) != 0) {
+        ret = -1;
+    }
+    flb_free(image);
+
+    if (ret != 0 || rename(tmp_name, filename) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to write rule bundle %s: %s", filename, strerror(errno));
+        remove(tmp_name);
+        return -1;
+    }
+
+    tg_log(TG_LOG_INFO, "wrote %d rules and %d field matchers to %s (%zu bytes)",
+           set->rule_count, set->matcher_count, filename, size);
+    return 0;
+}
+
+/* Whether [off, off + len) is an aligned range inside the bundle */
+static int tg_bundle_range(const struct tg_bundle_header *header, uint64_t off, uint64_t len)
+{
+    return (off & 7) == 0 && off <= header->file_size && len <= header->file_size - off;
+}
+
+static int tg_bundle_has_nul(const char *str, size_t size)
+{
+    return memchr(str, '\0', size) != NULL;
+}
+
+/* Check the header and rule tables of a mapped bundle */
+static int tg_bundle_check(const char *base, size_t size)
+{
+    const struct tg_bundle_header *header = (const struct tg_bundle_header *) base;
+    const struct tg_security_rule *rules;
+    const struct tg_security_rule_info *info;
+    const char *patterns;
+
+    if (size < sizeof(struct tg_bundle_header) ||
+        memcmp(header->magic, TG_BUNDLE_MAGIC, sizeof(header->magic)) != 0) {
+        tg_log(TG_LOG_ERROR, "not a rule bundle");
+        return -1;
+    }
+    if (header->version != TG_BUNDLE_VERSION || header->byte_order != TG_BUNDLE_BYTE_ORDER ||
+        header->rule_size != sizeof(struct tg_security_rule) ||
+        header->rule_info_size != sizeof(struct tg_security_rule_info)) {
+        tg_log(TG_LOG_ERROR, "rule bundle version %u was built for another agent version "
+               "or platform, recompile it", header->version);
+        return -1;
+    }
+    if (header->file_size != size || header->rule_count > TG_SECURITY_MAX_RULES ||
+        header->matcher_count > header->rule_count ||
+        !tg_bundle_range(header, header->rules_off,
+                         (uint64_t) header->rule_count * sizeof(struct tg_security_rule)) ||
+        !tg_bundle_range(header, header->rule_info_off,
+                         (uint64_t) header->rule_count * sizeof(struct tg_security_rule_info)) ||
+        !tg_bundle_range(header, header->patterns_off, header->patterns_len) ||
+        !tg_bundle_range(header, header->matchers_off,
+                         (uint64_t) header->matcher_count * sizeof(struct tg_bundle_matcher)) ||
+        !tg_bundle_range(header, header->fields_off, header->fields_size)) {
+        tg_log(TG_LOG_ERROR, "rule bundle is truncated or damaged");
+        return -1;
+    }
+
+    rules = (const struct tg_security_rule *) (base + header->rules_off);
+    info = (const struct tg_security_rule_info *) (base + header->rule_info_off);
+    patterns = base + header->patterns_off;
+
+    for (uint32_t i = 0; i < header->rule_count; i++) {
+        if ((uint64_t) rules[i].pattern + rules[i].pattern_len >= header->patterns_len ||
+            patterns[rules[i].pattern + rules[i].pattern_len] != '\0' ||
+            rules[i].matcher > TG_RULE_MATCHER_REGEX ||
+            !tg_bundle_has_nul(info[i].name, sizeof(info[i].name)) ||
+            !tg_bundle_has_nul(info[i].description, sizeof(info[i].description)) ||
+            !tg_bundle_has_nul(info[i].field_name, sizeof(info[i].field_name))) {
+            tg_log(TG_LOG_ERROR, "rule bundle entry %u is damaged", i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Slots must be unused or index the field dictionary */
+static int tg_bundle_slot_valid(const struct tg_security_ruleset *set, int slot)
+{
+    return slot == TG_FIELD_SLOT_NONE ||
+           (slot >= 0 && (uint32_t) slot < tg_field_dict_count(set->fields));
+}
+
+/* Point set at the sections of a checked bundle and map its automata */
+static int tg_bundle_attach(struct tg_security_ruleset *set, const char *base)
+{
+    const struct tg_bundle_header *header = (const struct tg_bundle_header *) base;
+    const struct tg_bundle_matcher *entries;
+
+    set->rule_count = (int) header->rule_count;
+    set->rule_alloc = set->rule_count;
+    set->rules = (struct tg_security_rule *) (base + header->rules_off);
+    set->rule_info = (struct tg_security_rule_info *) (base + header->rule_info_off);
+    set->patterns = (char *) (base + header->patterns_off);
+    set->patterns_len = header->patterns_len;
+    set->patterns_alloc = header->patterns_len;
+
+    if (header->fields_size) {
+        set->fields = tg_field_dict_map(base + header->fields_off, header->fields_size);
+        if (!set->fields) {
+            return -1;
+        }
+        set->paths = tg_field_dict_paths(set->fields);
+    }
+
+    for (int i = 0; i < TG_SECURITY_THREAT_INTEL_FIELDS; i++) {
+        set->threat_intel_slots[i] = header->threat_intel_slots[i];
+        if (!tg_bundle_slot_valid(set, set->threat_intel_slots[i])) {
+            return -1;
+        }
+    }
+    set->event_type_slot = header->event_type_slot;
+    if (!tg_bundle_slot_valid(set, set->event_type_slot)) {
+        return -1;
+    }
+
+    for (int i = 0; i < set->rule_count; i++) {
+        if (!tg_bundle_slot_valid(set, set->rules[i].field_slot)) {
+            return -1;
+        }
+    }
+
+    if (header->matcher_count == 0) {
+        return 0;
+    }
+
+    set->matchers = flb_calloc(header->matcher_count, sizeof(struct tg_security_field_matcher));
+    if (!set->matchers) {
+        return -1;
+    }
+
+    entries = (const struct tg_bundle_matcher *) (base + header->matchers_off);
+    for (uint32_t i = 0; i < header->matcher_count; i++) {
+        struct tg_security_field_matcher *matcher = &set->matchers[i];
+        const struct tg_bundle_matcher *entry = &entries[i];
+
+        set->matcher_count++;
+        if (!tg_bundle_has_nul(entry->field_name, sizeof(entry->field_name)) ||
+            !tg_bundle_slot_valid(set, entry->field_slot) ||
+            !tg_bundle_range(header, entry->ac_off, entry->ac_size) ||
+            !tg_bundle_range(header, entry->regex_off, entry->regex_size)) {
+            return -1;
+        }
+
+        memcpy(matcher->field_name, entry->field_name, sizeof(matcher->field_name));
+        matcher->field_slot = entry->field_slot;
+
+        /* Automaton pattern ids are rule indexes */
+        if (entry->ac_size &&
+            !(matcher->ac = tg_ac_map(base + entry->ac_off, entry->ac_size,
+                                      header->rule_count))) {
+            return -1;
+        }
+        if (entry->regex_size &&
+            !(matcher->regex = tg_regex_set_map(base + entry->regex_off, entry->regex_size,
+                                                header->rule_count))) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Map a bundle read-only and return the compiled rule set it holds */
+struct tg_security_ruleset *tg_security_bundle_load(const char *filename)
+{
+    struct tg_security_ruleset *set;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        tg_log(TG_LOG_ERROR, "failed to open rule bundle %s: %s", filename, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct tg_bundle_header)) {
+        tg_log(TG_LOG_ERROR, "rule bundle %s is truncated", filename);
+        close(fd);
+        return NULL;
+    }
+
+#ifdef TG_PLATFORM_WINDOWS
+    /* No shared mapping: read the bundle into memory as is */
+    map = flb_malloc(st.st_size);
+    if (map && read(fd, map, st.st_size) != st.st_size) {
+        flb_free(map);
+        map = NULL;
+    }
+#else
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        map = NULL;
+    }
+#endif
+    close(fd);
+
+    if (!map) {
+        tg_log(TG_LOG_ERROR, "failed to map rule bundle %s: %s", filename, strerror(errno));
+        return NULL;
+    }
+
+    set = tg_security_ruleset_create();
+    if (set) {
+        set->map = map;
+        set->map_size = st.st_size;
+    }
+
+    if (!set || tg_bundle_check(map, st.st_size) != 0 || tg_bundle_attach(set, map) != 0 ||
+        tg_security_plan_rules(set) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to load rule bundle %s", filename);
+        if (set) {
+            tg_security_ruleset_destroy(set);
+        } else {
+#ifdef TG_PLATFORM_WINDOWS
+            flb_free(map);
+#else
+            munmap(map, st.st_size);
+#endif
+        }
+        return NULL;
+    }
+
+    tg_log(TG_LOG_INFO, "mapped %d compiled rules from %s", set->rule_count, filename);
+    return set;
+}
+
+/* Release the mapping behind a rule set loaded from a bundle */
+void tg_security_bundle_unmap(struct tg_security_ruleset *set)
+{
+    if (!set->map) {
+        return;
+    }
+
+#ifdef TG_PLATFORM_WINDOWS
+    flb_free(set->map);
+#else
+    munmap(set->map, set->map_size);
+#endif
+    set->map = NULL;
+    set->map_size = 0;
+}
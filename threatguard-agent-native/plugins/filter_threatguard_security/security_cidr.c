@@ -0,0 +1,756 @@
+/*  ThreatGuard Agent - CIDR Prefix Trie
+ *  Prefixes are compiled into a poptrie: a multibit trie that consumes six
+ *  address bits per level, where each node holds two 64-bit maps instead of
+ *  64 child pointers. "vector" marks the chunk values that continue in an
+ *  internal child and "leafvec" the chunk values where a run of equal
+ *  results starts; the children and the leaf runs of a node are stored
+ *  contiguously, so a step is one popcount over the map. A lookup reads at
+ *  most 6 nodes for IPv4 and 22 for IPv6, independent of the number of
+ *  prefixes, and leaf runs keep the trie small for large feeds.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_cidr.h"
+
+#define TG_CIDR_STRIDE      6
+#define TG_CIDR_FANOUT      (1 << TG_CIDR_STRIDE)
+
+/* A prefix as added; the key is masked to len */
+struct tg_cidr_prefix {
+    uint64_t key[2];
+    uint32_t data;
+    uint32_t seq;               /* add order; the latest change of a prefix wins */
+    uint8_t len;
+    uint8_t removed;
+};
+
+struct tg_cidr_node {
+    uint64_t vector;            /* chunk values continuing in an internal child */
+    uint64_t leafvec;           /* chunk values starting a new leaf run */
+    uint32_t base0;             /* first leaf run */
+    uint32_t base1;             /* first child */
+};
+
+struct tg_cidr_leaf {
+    uint32_t data;
+    int32_t len;                /* -1 = no prefix */
+};
+
+/* One address family */
+struct tg_cidr_table {
+    int bits;
+
+    /* Prefixes; sorted and unique after a compile, with later changes
+     * appended until the next one */
+    struct tg_cidr_prefix *prefixes;
+    uint32_t prefix_count;
+    uint32_t prefix_alloc;
+    uint32_t compiled_count;
+
+    /* Compiled trie, node 0 is the root */
+    struct tg_cidr_node *nodes;
+    uint32_t node_count;
+    uint32_t node_alloc;
+    struct tg_cidr_leaf *leaves;
+    uint32_t leaf_count;
+    uint32_t leaf_alloc;
+};
+
+struct tg_cidr_trie {
+    uint32_t seq;
+    struct tg_cidr_table v4;
+    struct tg_cidr_table v6;
+};
+
+static int tg_cidr_parse_v4(const char *str, size_t len, uint32_t *out)
+{
+    uint32_t addr = 0;
+    uint32_t part = 0;
+    int digits = 0;
+    int parts = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = str[i];
+
+        if (c >= '0' && c <= '9') {
+            part = part * 10 + (uint32_t) (c - '0');
+            if (++digits > 3 || part > 255) {
+                return -1;
+            }
+        } else if (c == '.' && digits > 0 && parts < 3) {
+            addr = (addr << 8) | part;
+            parts++;
+            part = 0;
+            digits = 0;
+        } else {
+            return -1;
+        }
+    }
+
+    if (parts != 3 || digits == 0) {
+        return -1;
+    }
+
+    *out = (addr << 8) | part;
+    return 0;
+}
+
+static int tg_cidr_hex(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* RFC 4291 text form, including "::" and a dotted IPv4 tail */
+static int tg_cidr_parse_v6(const char *str, size_t len, uint16_t words[8])
+{
+    uint16_t parsed[8];
+    int count = 0;
+    int gap = -1;
+    size_t i = 0;
+
+    if (len >= 2 && str[0] == ':' && str[1] == ':') {
+        gap = 0;
+        i = 2;
+    } else if (len == 0 || str[0] == ':') {
+        return -1;
+    }
+
+    while (i < len) {
+        size_t start = i;
+        uint32_t value = 0;
+        int digits = 0;
+        int hex;
+
+        while (i < len && (hex = tg_cidr_hex(str[i])) >= 0) {
+            value = (value << 4) | (uint32_t) hex;
+            digits++;
+            i++;
+        }
+
+        /* Dotted IPv4 tail fills the last two words */
+        if (i < len && str[i] == '.') {
+            uint32_t v4;
+
+            if (count > 6 || tg_cidr_parse_v4(str + start, len - start, &v4) != 0) {
+                return -1;
+            }
+            parsed[count++] = (uint16_t) (v4 >> 16);
+            parsed[count++] = (uint16_t) v4;
+            i = len;
+            break;
+        }
+
+        if (digits == 0 || digits > 4 || count == 8) {
+            return -1;
+        }
+        parsed[count++] = (uint16_t) value;
+
+        if (i == len) {
+            break;
+        }
+        if (str[i] != ':' || ++i == len) {
+            return -1;
+        }
+        if (str[i] == ':') {
+            if (gap >= 0) {
+                return -1;
+            }
+            gap = count;
+            i++;
+        }
+    }
+
+    if ((gap < 0 && count != 8) || (gap >= 0 && count > 7)) {
+        return -1;
+    }
+
+    /* Expand "::" to the missing zero words */
+    memset(words, 0, 8 * sizeof(uint16_t));
+    if (gap < 0) {
+        memcpy(words, parsed, sizeof(parsed));
+    } else {
+        memcpy(words, parsed, (size_t) gap * sizeof(uint16_t));
+        memcpy(words + 8 - (count - gap), parsed + gap, (size_t) (count - gap) * sizeof(uint16_t));
+    }
+    return 0;
+}
+
+int tg_cidr_parse(const char *str, size_t len, struct tg_cidr_addr *addr, int *prefix_len)
+{
+    const char *slash;
+    const char *zone;
+    size_t addr_len;
+    uint16_t words[8];
+    uint32_t v4;
+    int prefix = -1;
+
+    if (!str || !addr || len == 0) {
+        return -1;
+    }
+
+    slash = memchr(str, '/', len);
+    addr_len = slash ? (size_t) (slash - str) : len;
+
+    if (slash) {
+        size_t digits = len - addr_len - 1;
+
+        if (digits == 0 || digits > 3) {
+            return -1;
+        }
+        prefix = 0;
+        for (size_t i = addr_len + 1; i < len; i++) {
+            if (str[i] < '0' || str[i] > '9') {
+                return -1;
+            }
+            prefix = prefix * 10 + (str[i] - '0');
+        }
+    }
+
+    /* Scoped IPv6 addresses: the zone does not take part in matching */
+    zone = memchr(str, '%', addr_len);
+    if (zone) {
+        addr_len = (size_t) (zone - str);
+    }
+
+    if (tg_cidr_parse_v4(str, addr_len, &v4) == 0) {
+        if (prefix > 32) {
+            return -1;
+        }
+        addr->family = TG_CIDR_V4;
+        addr->key[0] = (uint64_t) v4 << 32;
+        addr->key[1] = 0;
+        if (prefix_len) {
+            *prefix_len = prefix < 0 ? 32 : prefix;
+        }
+        return 0;
+    }
+
+    if (tg_cidr_parse_v6(str, addr_len, words) != 0 || prefix > 128) {
+        return -1;
+    }
+
+    /* IPv4-mapped addresses match IPv4 prefixes */
+    if (words[0] == 0 && words[1] == 0 && words[2] == 0 && words[3] == 0 &&
+        words[4] == 0 && words[5] == 0xffff && (prefix < 0 || prefix >= 96)) {
+        addr->family = TG_CIDR_V4;
+        addr->key[0] = ((uint64_t) words[6] << 48) | ((uint64_t) words[7] << 32);
+        addr->key[1] = 0;
+        if (prefix_len) {
+            *prefix_len = prefix < 0 ? 32 : prefix - 96;
+        }
+        return 0;
+    }
+
+    addr->family = TG_CIDR_V6;
+    addr->key[0] = ((uint64_t) words[0] << 48) | ((uint64_t) words[1] << 32) |
+                   ((uint64_t) words[2] << 16) | words[3];
+    addr->key[1] = ((uint64_t) words[4] << 48) | ((uint64_t) words[5] << 32) |
+                   ((uint64_t) words[6] << 16) | words[7];
+    if (prefix_len) {
+        *prefix_len = prefix < 0 ? 128 : prefix;
+    }
+    return 0;
+}
+
+/* Six key bits starting at bit offset; bits past the address are zero */
+static inline uint32_t tg_cidr_chunk(const uint64_t key[2], int offset)
+{
+    if (offset <= 64 - TG_CIDR_STRIDE) {
+        return (uint32_t) (key[0] >> (64 - TG_CIDR_STRIDE - offset)) & (TG_CIDR_FANOUT - 1);
+    }
+    if (offset < 64) {
+        return (uint32_t) ((key[0] << (offset - (64 - TG_CIDR_STRIDE))) |
+                           (key[1] >> (128 - TG_CIDR_STRIDE - offset))) & (TG_CIDR_FANOUT - 1);
+    }
+    offset -= 64;
+    if (offset <= 64 - TG_CIDR_STRIDE) {
+        return (uint32_t) (key[1] >> (64 - TG_CIDR_STRIDE - offset)) & (TG_CIDR_FANOUT - 1);
+    }
+    return (uint32_t) (key[1] << (offset - (64 - TG_CIDR_STRIDE))) & (TG_CIDR_FANOUT - 1);
+}
+
+static void tg_cidr_mask(uint64_t key[2], int len)
+{
+    if (len <= 0) {
+        key[0] = 0;
+        key[1] = 0;
+    } else if (len < 64) {
+        key[0] &= ~0ull << (64 - len);
+        key[1] = 0;
+    } else if (len == 64) {
+        key[1] = 0;
+    } else if (len < 128) {
+        key[1] &= ~0ull << (128 - len);
+    }
+}
+
+static int tg_cidr_grow(void **ptr, uint32_t *alloc, uint32_t needed, size_t elem_size)
+{
+    uint64_t new_alloc;
+    void *tmp;
+
+    if (needed <= *alloc) {
+        return 0;
+    }
+
+    new_alloc = *alloc ? *alloc : 64;
+    while (new_alloc < needed) {
+        new_alloc *= 2;
+    }
+    if (new_alloc > UINT32_MAX) {
+        return -1;
+    }
+
+    tmp = flb_realloc(*ptr, (size_t) new_alloc * elem_size);
+    if (!tmp) {
+        return -1;
+    }
+
+    *ptr = tmp;
+    *alloc = (uint32_t) new_alloc;
+    return 0;
+}
+
+static void tg_cidr_shrink(void **ptr, uint32_t *alloc, uint32_t count, size_t elem_size)
+{
+    void *tmp;
+
+    if (count == 0 || count == *alloc) {
+        return;
+    }
+
+    tmp = flb_realloc(*ptr, (size_t) count * elem_size);
+    if (tmp) {
+        *ptr = tmp;
+        *alloc = count;
+    }
+}
+
+static struct tg_cidr_table *tg_cidr_table_of(struct tg_cidr_trie *trie, int family)
+{
+    return family == TG_CIDR_V4 ? &trie->v4 : &trie->v6;
+}
+
+struct tg_cidr_trie *tg_cidr_trie_create(void)
+{
+    struct tg_cidr_trie *trie;
+
+    trie = flb_calloc(1, sizeof(struct tg_cidr_trie));
+    if (!trie) {
+        return NULL;
+    }
+
+    trie->v4.bits = 32;
+    trie->v6.bits = 128;
+    return trie;
+}
+
+static int tg_cidr_table_copy(struct tg_cidr_table *dst, const struct tg_cidr_table *src)
+{
+    *dst = *src;
+    dst->prefixes = NULL;
+    dst->nodes = NULL;
+    dst->leaves = NULL;
+    dst->prefix_alloc = 0;
+    dst->node_alloc = 0;
+    dst->leaf_alloc = 0;
+
+    if (tg_cidr_grow((void **) &dst->prefixes, &dst->prefix_alloc, src->prefix_count,
+                     sizeof(struct tg_cidr_prefix)) != 0 ||
+        tg_cidr_grow((void **) &dst->nodes, &dst->node_alloc, src->node_count,
+                     sizeof(struct tg_cidr_node)) != 0 ||
+        tg_cidr_grow((void **) &dst->leaves, &dst->leaf_alloc, src->leaf_count,
+                     sizeof(struct tg_cidr_leaf)) != 0) {
+        return -1;
+    }
+
+    if (src->prefix_count > 0) {
+        memcpy(dst->prefixes, src->prefixes,
+               (size_t) src->prefix_count * sizeof(struct tg_cidr_prefix));
+    }
+    if (src->node_count > 0) {
+        memcpy(dst->nodes, src->nodes, (size_t) src->node_count * sizeof(struct tg_cidr_node));
+    }
+    if (src->leaf_count > 0) {
+        memcpy(dst->leaves, src->leaves, (size_t) src->leaf_count * sizeof(struct tg_cidr_leaf));
+    }
+    return 0;
+}
+
+/* Independent copy of trie, including changes not compiled yet */
+struct tg_cidr_trie *tg_cidr_trie_clone(const struct tg_cidr_trie *trie)
+{
+    struct tg_cidr_trie *copy;
+
+    if (!trie) {
+        return NULL;
+    }
+
+    copy = flb_calloc(1, sizeof(struct tg_cidr_trie));
+    if (!copy) {
+        return NULL;
+    }
+
+    copy->seq = trie->seq;
+    if (tg_cidr_table_copy(&copy->v4, &trie->v4) != 0 ||
+        tg_cidr_table_copy(&copy->v6, &trie->v6) != 0) {
+        tg_cidr_trie_destroy(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+static int tg_cidr_trie_change(struct tg_cidr_trie *trie, const struct tg_cidr_addr *addr,
+                               int prefix_len, uint32_t data, int removed)
+{
+    struct tg_cidr_table *table;
+    struct tg_cidr_prefix *prefix;
+
+    if (!trie || !addr || (addr->family != TG_CIDR_V4 && addr->family != TG_CIDR_V6)) {
+        return -1;
+    }
+
+    table = tg_cidr_table_of(trie, addr->family);
+    if (prefix_len < 0 || prefix_len > table->bits ||
+        tg_cidr_grow((void **) &table->prefixes, &table->prefix_alloc,
+                     table->prefix_count + 1, sizeof(struct tg_cidr_prefix)) != 0) {
+        return -1;
+    }
+
+    prefix = &table->prefixes[table->prefix_count++];
+    prefix->key[0] = addr->key[0];
+    prefix->key[1] = addr->key[1];
+    tg_cidr_mask(prefix->key, prefix_len);
+    prefix->data = data;
+    prefix->seq = trie->seq++;
+    prefix->len = (uint8_t) prefix_len;
+    prefix->removed = (uint8_t) removed;
+    return 0;
+}
+
+int tg_cidr_trie_add(struct tg_cidr_trie *trie, const struct tg_cidr_addr *addr,
+                     int prefix_len, uint32_t data)
+{
+    return tg_cidr_trie_change(trie, addr, prefix_len, data, 0);
+}
+
+int tg_cidr_trie_remove(struct tg_cidr_trie *trie, const struct tg_cidr_addr *addr,
+                        int prefix_len)
+{
+    return tg_cidr_trie_change(trie, addr, prefix_len, 0, 1);
+}
+
+/* Address order, covering prefixes before the prefixes they cover */
+static int tg_cidr_cmp_key(const struct tg_cidr_prefix *x, const struct tg_cidr_prefix *y)
+{
+    if (x->key[0] != y->key[0]) {
+        return x->key[0] < y->key[0] ? -1 : 1;
+    }
+    if (x->key[1] != y->key[1]) {
+        return x->key[1] < y->key[1] ? -1 : 1;
+    }
+    if (x->len != y->len) {
+        return x->len < y->len ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Address order, then the order of the changes */
+static int tg_cidr_cmp_prefix(const void *a, const void *b)
+{
+    const struct tg_cidr_prefix *x = a;
+    const struct tg_cidr_prefix *y = b;
+    int cmp = tg_cidr_cmp_key(x, y);
+
+    if (cmp != 0) {
+        return cmp;
+    }
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+int tg_cidr_trie_contains(const struct tg_cidr_trie *trie, const struct tg_cidr_addr *addr,
+                          int prefix_len)
+{
+    const struct tg_cidr_table *table;
+    struct tg_cidr_prefix key;
+    uint32_t lo = 0;
+    uint32_t hi;
+
+    if (!trie || !addr || (addr->family != TG_CIDR_V4 && addr->family != TG_CIDR_V6)) {
+        return 0;
+    }
+
+    table = addr->family == TG_CIDR_V4 ? &trie->v4 : &trie->v6;
+    if (prefix_len < 0 || prefix_len > table->bits) {
+        return 0;
+    }
+
+    key.key[0] = addr->key[0];
+    key.key[1] = addr->key[1];
+    tg_cidr_mask(key.key, prefix_len);
+    key.len = (uint8_t) prefix_len;
+
+    /* The latest change since the compile wins */
+    for (uint32_t i = table->prefix_count; i > table->compiled_count; i--) {
+        if (tg_cidr_cmp_key(&table->prefixes[i - 1], &key) == 0) {
+            return !table->prefixes[i - 1].removed;
+        }
+    }
+
+    /* Compiled prefixes are sorted and unique */
+    hi = table->compiled_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = tg_cidr_cmp_key(&table->prefixes[mid], &key);
+
+        if (cmp == 0) {
+            return 1;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return 0;
+}
+
+/* Sort the prefixes and keep the latest change of each */
+static void tg_cidr_table_normalize(struct tg_cidr_table *table)
+{
+    uint32_t count = 0;
+
+    if (table->prefix_count == 0) {
+        return;
+    }
+
+    qsort(table->prefixes, table->prefix_count, sizeof(struct tg_cidr_prefix),
+          tg_cidr_cmp_prefix);
+
+    for (uint32_t i = 0; i < table->prefix_count; i++) {
+        const struct tg_cidr_prefix *prefix = &table->prefixes[i];
+        const struct tg_cidr_prefix *next = &table->prefixes[i + 1];
+
+        if (i + 1 < table->prefix_count && next->key[0] == prefix->key[0] &&
+            next->key[1] == prefix->key[1] && next->len == prefix->len) {
+            continue;
+        }
+        if (!prefix->removed) {
+            table->prefixes[count++] = *prefix;
+        }
+    }
+    table->prefix_count = count;
+}
+
+/* Fill node with the prefixes [lo, hi), which are sorted, longer than
+ * depth and share the depth bits leading to node; def is the result for
+ * addresses none of them contains */
+static int tg_cidr_build(struct tg_cidr_table *table, uint32_t node, int depth,
+                         uint32_t lo, uint32_t hi, struct tg_cidr_leaf def)
+{
+    struct tg_cidr_leaf leaf[TG_CIDR_FANOUT];
+    uint32_t child_lo[TG_CIDR_FANOUT];
+    uint32_t child_hi[TG_CIDR_FANOUT];
+    uint64_t vector = 0;
+    uint64_t leafvec = 0;
+    uint32_t base0;
+    uint32_t base1;
+    int stride_end = depth + TG_CIDR_STRIDE;
+    int prev = -1;
+
+    for (int c = 0; c < TG_CIDR_FANOUT; c++) {
+        leaf[c] = def;
+    }
+
+    /* Prefixes ending within this stride cover a run of chunk values and
+     * are applied shortest first; longer ones go to the child of their
+     * chunk value, where they are contiguous */
+    for (uint32_t i = lo; i < hi; i++) {
+        const struct tg_cidr_prefix *prefix = &table->prefixes[i];
+        uint32_t c = tg_cidr_chunk(prefix->key, depth);
+
+        if (prefix->len <= stride_end) {
+            uint32_t span = 1u << (stride_end - prefix->len);
+
+            for (uint32_t j = c; j < c + span; j++) {
+                leaf[j].data = prefix->data;
+                leaf[j].len = prefix->len;
+            }
+        } else {
+            if (!(vector & (1ull << c))) {
+                vector |= 1ull << c;
+                child_lo[c] = i;
+            }
+            child_hi[c] = i + 1;
+        }
+    }
+
+    /* Leaf runs */
+    base0 = table->leaf_count;
+    for (int c = 0; c < TG_CIDR_FANOUT; c++) {
+        if (vector & (1ull << c)) {
+            continue;
+        }
+        if (prev < 0 || leaf[c].len != leaf[prev].len || leaf[c].data != leaf[prev].data) {
+            if (tg_cidr_grow((void **) &table->leaves, &table->leaf_alloc,
+                             table->leaf_count + 1, sizeof(struct tg_cidr_leaf)) != 0) {
+                return -1;
+            }
+            table->leaves[table->leaf_count++] = leaf[c];
+            leafvec |= 1ull << c;
+        }
+        prev = c;
+    }
+
+    /* Children are allocated together so that they are indexed by rank */
+    base1 = table->node_count;
+    if (tg_cidr_grow((void **) &table->nodes, &table->node_alloc,
+                     table->node_count + (uint32_t) __builtin_popcountll(vector),
+                     sizeof(struct tg_cidr_node)) != 0) {
+        return -1;
+    }
+    table->node_count += (uint32_t) __builtin_popcountll(vector);
+
+    table->nodes[node].vector = vector;
+    table->nodes[node].leafvec = leafvec;
+    table->nodes[node].base0 = base0;
+    table->nodes[node].base1 = base1;
+
+    for (int c = 0; c < TG_CIDR_FANOUT; c++) {
+        if (!(vector & (1ull << c))) {
+            continue;
+        }
+        if (tg_cidr_build(table, base1++, stride_end, child_lo[c], child_hi[c], leaf[c]) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int tg_cidr_table_compile(struct tg_cidr_table *table)
+{
+    struct tg_cidr_leaf none = { 0, -1 };
+
+    tg_cidr_table_normalize(table);
+
+    table->node_count = 1;
+    table->leaf_count = 0;
+    if (tg_cidr_grow((void **) &table->nodes, &table->node_alloc, 1,
+                     sizeof(struct tg_cidr_node)) != 0 ||
+        tg_cidr_build(table, 0, 0, 0, table->prefix_count, none) != 0) {
+        table->node_count = 0;
+        table->compiled_count = 0;
+        return -1;
+    }
+
+    table->compiled_count = table->prefix_count;
+
+    /* Drop the growth slack; compiled tables live as long as the store */
+    tg_cidr_shrink((void **) &table->prefixes, &table->prefix_alloc, table->prefix_count,
+                   sizeof(struct tg_cidr_prefix));
+    tg_cidr_shrink((void **) &table->nodes, &table->node_alloc, table->node_count,
+                   sizeof(struct tg_cidr_node));
+    tg_cidr_shrink((void **) &table->leaves, &table->leaf_alloc, table->leaf_count,
+                   sizeof(struct tg_cidr_leaf));
+    return 0;
+}
+
+int tg_cidr_trie_compile(struct tg_cidr_trie *trie)
+{
+    if (!trie) {
+        return -1;
+    }
+
+    if (tg_cidr_table_compile(&trie->v4) != 0 || tg_cidr_table_compile(&trie->v6) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to compile CIDR prefix trie");
+        return -1;
+    }
+    return 0;
+}
+
+int tg_cidr_trie_lookup(const struct tg_cidr_trie *trie, const struct tg_cidr_addr *addr,
+                        uint32_t *data)
+{
+    const struct tg_cidr_table *table;
+    const struct tg_cidr_node *node;
+    const struct tg_cidr_leaf *leaf;
+    uint32_t c;
+    int depth = 0;
+
+    if (!trie || !addr) {
+        return -1;
+    }
+
+    table = addr->family == TG_CIDR_V4 ? &trie->v4 : &trie->v6;
+    if (table->node_count == 0) {
+        return -1;
+    }
+
+    /* Descend while the chunk value continues in a child, then take the
+     * leaf run containing it; ranks count the map bits up to the value */
+    node = &table->nodes[0];
+    c = tg_cidr_chunk(addr->key, 0);
+    while (node->vector & (1ull << c)) {
+        node = &table->nodes[node->base1 +
+                             __builtin_popcountll(node->vector & ((2ull << c) - 1)) - 1];
+        depth += TG_CIDR_STRIDE;
+        c = tg_cidr_chunk(addr->key, depth);
+    }
+
+    leaf = &table->leaves[node->base0 +
+                          __builtin_popcountll(node->leafvec & ((2ull << c) - 1)) - 1];
+    if (leaf->len < 0) {
+        return -1;
+    }
+    if (data) {
+        *data = leaf->data;
+    }
+    return leaf->len;
+}
+
+uint32_t tg_cidr_trie_count(const struct tg_cidr_trie *trie)
+{
+    return trie ? trie->v4.compiled_count + trie->v6.compiled_count : 0;
+}
+
+static size_t tg_cidr_table_memory(const struct tg_cidr_table *table)
+{
+    return (size_t) table->prefix_alloc * sizeof(struct tg_cidr_prefix) +
+           (size_t) table->node_alloc * sizeof(struct tg_cidr_node) +
+           (size_t) table->leaf_alloc * sizeof(struct tg_cidr_leaf);
+}
+
+size_t tg_cidr_trie_memory(const struct tg_cidr_trie *trie)
+{
+    if (!trie) {
+        return 0;
+    }
+    return sizeof(*trie) + tg_cidr_table_memory(&trie->v4) + tg_cidr_table_memory(&trie->v6);
+}
+
+static void tg_cidr_table_destroy(struct tg_cidr_table *table)
+{
+    flb_free(table->prefixes);
+    flb_free(table->nodes);
+    flb_free(table->leaves);
+}
+
+void tg_cidr_trie_destroy(struct tg_cidr_trie *trie)
+{
+    if (!trie) {
+        return;
+    }
+
+    tg_cidr_table_destroy(&trie->v4);
+    tg_cidr_table_destroy(&trie->v6);
+    flb_free(trie);
+}
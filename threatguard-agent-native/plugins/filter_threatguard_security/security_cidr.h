@@ -0,0 +1,58 @@
+/*  ThreatGuard Agent - CIDR Prefix Trie
+ *  Longest-prefix match of IPv4 and IPv6 addresses against network
+ *  prefixes in a compressed multibit trie (poptrie)
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_CIDR_H
+#define TG_SECURITY_CIDR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TG_CIDR_V4      4
+#define TG_CIDR_V6      6
+
+/* An address in binary form; IPv4 addresses take the top 32 bits of
+ * key[0], and IPv4-mapped IPv6 addresses are stored as IPv4 */
+struct tg_cidr_addr {
+    int family;
+    uint64_t key[2];
+};
+
+/* Parse "address" or "address/prefix" without allocating. prefix_len is
+ * set to the prefix length, or the full address length if none is given.
+ * Returns 0, or -1 if str is not an address. */
+int tg_cidr_parse(const char *str, size_t len, struct tg_cidr_addr *addr, int *prefix_len);
+
+struct tg_cidr_trie;
+
+/* Build phase: add prefixes with attached data, then compile before
+ * lookups. Adding a prefix again replaces its data; removing a prefix
+ * that is absent is not an error. Changes take effect at the next compile.
+ * A clone is an independent copy that can be changed while the original
+ * is being read. */
+struct tg_cidr_trie *tg_cidr_trie_create(void);
+int tg_cidr_trie_add(struct tg_cidr_trie *trie, const struct tg_cidr_addr *addr,
+                     int prefix_len, uint32_t data);
+int tg_cidr_trie_remove(struct tg_cidr_trie *trie, const struct tg_cidr_addr *addr,
+                        int prefix_len);
+int tg_cidr_trie_compile(struct tg_cidr_trie *trie);
+struct tg_cidr_trie *tg_cidr_trie_clone(const struct tg_cidr_trie *trie);
+
+/* Lookup phase: read-only, safe to share between threads. Returns the
+ * length of the longest prefix containing addr and sets data to what is
+ * attached to it, or returns -1 if no prefix contains addr. */
+int tg_cidr_trie_lookup(const struct tg_cidr_trie *trie, const struct tg_cidr_addr *addr,
+                        uint32_t *data);
+
+/* Whether exactly this prefix is in the trie, counting the changes not
+ * yet compiled. Read-only. */
+int tg_cidr_trie_contains(const struct tg_cidr_trie *trie, const struct tg_cidr_addr *addr,
+                          int prefix_len);
+
+uint32_t tg_cidr_trie_count(const struct tg_cidr_trie *trie);
+size_t tg_cidr_trie_memory(const struct tg_cidr_trie *trie);
+void tg_cidr_trie_destroy(struct tg_cidr_trie *trie);
+
+#endif /* TG_SECURITY_CIDR_H */
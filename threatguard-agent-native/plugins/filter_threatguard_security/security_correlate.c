@@ -0,0 +1,251 @@
+/*  ThreatGuard Agent - Sequence Correlation
+ *  A partial match is 32 bytes: the step it is at, the events counted
+ *  towards that step and the timer that drops it when its window closes. Matches live in a preallocated slab split into
+ *  locked shards, each with its own timer wheel, and are found by an
+ *  8-slot bucket whose keys share one cache line, so feeding an event and
+ *  expiring a match are both O(1) and nothing is ever scanned.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_correlate.h"
+#include "security_timer.h"
+
+#include <pthread.h>
+
+#define TG_CORRELATE_SHARD_BITS 4
+#define TG_CORRELATE_SHARDS     (1u << TG_CORRELATE_SHARD_BITS)
+#define TG_CORRELATE_WAYS       8
+
+/* The timer comes first so that the match is found from it */
+struct tg_correlate_match {
+    struct tg_timer timer;
+    uint16_t count;             /* events towards step */
+    uint8_t step;
+};
+
+struct tg_correlate_shard {
+    pthread_mutex_t lock;
+    uint64_t *keys;             /* 0 = free slot */
+    struct tg_correlate_match *matches;
+    uint32_t bucket_mask;
+    uint32_t count;
+    uint64_t expired;
+    uint64_t evictions;
+    struct tg_timer_wheel wheel;
+};
+
+struct tg_correlate_table {
+    uint64_t *keys;             /* slabs the shards point into */
+    struct tg_correlate_match *matches;
+    struct tg_correlate_shard shards[TG_CORRELATE_SHARDS];
+};
+
+struct tg_correlate_table *tg_correlate_table_create(uint32_t capacity)
+{
+    struct tg_correlate_table *table;
+    uint32_t buckets = 1;
+    uint32_t now = (uint32_t) time(NULL);
+    size_t slots;
+
+    if (capacity == 0 || capacity > (1u << 28)) {
+        return NULL;
+    }
+
+    while ((uint64_t) buckets * TG_CORRELATE_WAYS * TG_CORRELATE_SHARDS < capacity) {
+        buckets *= 2;
+    }
+    slots = (size_t) buckets * TG_CORRELATE_WAYS;
+
+    table = flb_calloc(1, sizeof(struct tg_correlate_table));
+    if (!table) {
+        return NULL;
+    }
+
+    table->keys = flb_calloc(slots * TG_CORRELATE_SHARDS, sizeof(uint64_t));
+    table->matches = flb_calloc(slots * TG_CORRELATE_SHARDS,
+                                sizeof(struct tg_correlate_match));
+    if (!table->keys || !table->matches) {
+        flb_free(table->keys);
+        flb_free(table->matches);
+        flb_free(table);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < TG_CORRELATE_SHARDS; i++) {
+        struct tg_correlate_shard *shard = &table->shards[i];
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->keys = table->keys + i * slots;
+        shard->matches = table->matches + i * slots;
+        shard->bucket_mask = buckets - 1;
+        tg_timer_wheel_init(&shard->wheel, now);
+    }
+    return table;
+}
+
+static void tg_correlate_drop(struct tg_correlate_shard *shard, struct tg_correlate_match *match)
+{
+    tg_timer_cancel(&shard->wheel, &match->timer);
+    shard->keys[match - shard->matches] = 0;
+    shard->count--;
+}
+
+/* Timer callback: the window of a partial match has closed */
+static void tg_correlate_close(struct tg_timer *timer, void *data)
+{
+    struct tg_correlate_shard *shard = data;
+    struct tg_correlate_match *match = (struct tg_correlate_match *) timer;
+
+    shard->keys[match - shard->matches] = 0;
+    shard->count--;
+    shard->expired++;
+}
+
+/* Slot of key, or of a new partial match for it if create is set: a free
+ * slot or else the match closest to closing. Returns -1 if there is
+ * none. */
+static int64_t tg_correlate_slot(struct tg_correlate_shard *shard, uint64_t key, int create)
+{
+    uint32_t base = ((uint32_t) key & shard->bucket_mask) * TG_CORRELATE_WAYS;
+    uint32_t victim = base;
+
+    for (uint32_t slot = base; slot < base + TG_CORRELATE_WAYS; slot++) {
+        if (shard->keys[slot] == key) {
+            return slot;
+        }
+    }
+    if (!create) {
+        return -1;
+    }
+
+    for (uint32_t slot = base; slot < base + TG_CORRELATE_WAYS; slot++) {
+        if (shard->keys[slot] == 0) {
+            victim = slot;
+            break;
+        }
+        if ((int32_t) (shard->matches[slot].timer.expires -
+                       shard->matches[victim].timer.expires) < 0) {
+            victim = slot;
+        }
+    }
+
+    if (shard->keys[victim] != 0) {
+        tg_correlate_drop(shard, &shard->matches[victim]);
+        shard->evictions++;
+    }
+
+    memset(&shard->matches[victim], 0, sizeof(struct tg_correlate_match));
+    shard->keys[victim] = key;
+    shard->count++;
+    return victim;
+}
+
+int tg_correlate_feed(struct tg_correlate_table *table, uint64_t key, time_t now,
+                      uint32_t window, const uint16_t *counts, int steps, uint32_t matches)
+{
+    struct tg_correlate_shard *shard;
+    struct tg_correlate_match *match;
+    uint32_t seconds = (uint32_t) now;
+    int64_t slot;
+    int complete = 0;
+
+    if (!table || key == 0 || !counts || steps <= 0 || steps > TG_CORRELATE_MAX_STEPS ||
+        matches == 0) {
+        return 0;
+    }
+
+    shard = &table->shards[key >> (64 - TG_CORRELATE_SHARD_BITS)];
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* Close the windows that ended before this event */
+    tg_timer_wheel_advance(&shard->wheel, seconds, tg_correlate_close, shard);
+
+    slot = tg_correlate_slot(shard, key, matches & 1);
+    if (slot >= 0) {
+        match = &shard->matches[slot];
+
+        /* A new partial match opens its window */
+        if (!tg_timer_pending(&match->timer)) {
+            tg_timer_schedule(&shard->wheel, &match->timer, seconds + window);
+        }
+
+        if (matches & (1u << match->step)) {
+            if (++match->count >= counts[match->step]) {
+                match->step++;
+                match->count = 0;
+            }
+            if (match->step >= steps) {
+                tg_correlate_drop(shard, match);
+                complete = 1;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return complete;
+}
+
+uint32_t tg_correlate_expire(struct tg_correlate_table *table, time_t now)
+{
+    uint32_t expired = 0;
+
+    if (!table) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < TG_CORRELATE_SHARDS; i++) {
+        struct tg_correlate_shard *shard = &table->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        expired += tg_timer_wheel_advance(&shard->wheel, (uint32_t) now, tg_correlate_close,
+                                          shard);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return expired;
+}
+
+void tg_correlate_table_stats(struct tg_correlate_table *table, uint64_t *open,
+                              uint64_t *expired, uint64_t *evictions)
+{
+    uint64_t total_open = 0;
+    uint64_t total_expired = 0;
+    uint64_t total_evictions = 0;
+
+    if (table) {
+        for (uint32_t i = 0; i < TG_CORRELATE_SHARDS; i++) {
+            struct tg_correlate_shard *shard = &table->shards[i];
+
+            pthread_mutex_lock(&shard->lock);
+            total_open += shard->count;
+            total_expired += shard->expired;
+            total_evictions += shard->evictions;
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+
+    if (open) {
+        *open = total_open;
+    }
+    if (expired) {
+        *expired = total_expired;
+    }
+    if (evictions) {
+        *evictions = total_evictions;
+    }
+}
+
+void tg_correlate_table_destroy(struct tg_correlate_table *table)
+{
+    if (!table) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < TG_CORRELATE_SHARDS; i++) {
+        pthread_mutex_destroy(&table->shards[i].lock);
+    }
+    flb_free(table->keys);
+    flb_free(table->matches);
+    flb_free(table);
+}
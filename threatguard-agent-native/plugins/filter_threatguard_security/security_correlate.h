@@ -0,0 +1,42 @@
+/*  ThreatGuard Agent - Sequence Correlation
+ *  Partial matches of event sequences ("A five times, then B, within two
+ *  minutes") per correlation key, in a bounded table expired by a timer
+ *  wheel
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_CORRELATE_H
+#define TG_SECURITY_CORRELATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define TG_CORRELATE_MAX_STEPS  8
+
+struct tg_correlate_table;
+
+/* A table holds at most about capacity partial matches and is safe to
+ * share between threads. A partial match is dropped when its window
+ * closes; when a key's bucket is full the match closest to closing is
+ * evicted. */
+struct tg_correlate_table *tg_correlate_table_create(uint32_t capacity);
+
+/* Feed an event of key at now to a sequence of steps, step i completing
+ * after counts[i] events, to be completed within window seconds of its
+ * first event. Bit i of matches is set if the event matches step i; an
+ * event counts towards the step the key is at, and only an event matching
+ * step 0 opens a partial match. Returns 1 if the event completes the
+ * sequence, whose partial match is then dropped, or 0. */
+int tg_correlate_feed(struct tg_correlate_table *table, uint64_t key, time_t now,
+                      uint32_t window, const uint16_t *counts, int steps, uint32_t matches);
+
+/* Drop the partial matches whose window has closed by now; feeding a key
+ * does this for its shard as well */
+uint32_t tg_correlate_expire(struct tg_correlate_table *table, time_t now);
+
+void tg_correlate_table_stats(struct tg_correlate_table *table, uint64_t *open,
+                              uint64_t *expired, uint64_t *evictions);
+void tg_correlate_table_destroy(struct tg_correlate_table *table);
+
+#endif /* TG_SECURITY_CORRELATE_H */
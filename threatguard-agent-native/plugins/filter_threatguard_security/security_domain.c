@@ -0,0 +1,671 @@
+/*  ThreatGuard Agent - Domain Suffix Trie
+ *  Domain names are stored label by label from the right, so that "evil.com"
+ *  is the path com -> evil and every name below it extends that path. Labels
+ *  are interned once into small ids, and the trie edges live in one hash
+ *  table keyed by (parent node, label id), so a node costs no child array
+ *  and millions of names sharing a few top-level labels stay compact. A
+ *  lookup walks the labels of the name right to left in place and remembers
+ *  the deepest node that is an entry.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_domain.h"
+
+#include <ctype.h>
+
+#define TG_DOMAIN_MAX_NAME      253
+#define TG_DOMAIN_MAX_LABEL     63
+#define TG_DOMAIN_NONE          UINT32_MAX
+#define TG_DOMAIN_MIN_TABLE     64
+
+struct tg_domain_label {
+    uint32_t hash;
+    uint32_t off;               /* into pool, folded to lower case */
+    uint32_t len;
+};
+
+struct tg_domain_edge {
+    uint32_t parent;
+    uint32_t label;
+    uint32_t child;             /* 0 = empty slot; the root is never a child */
+};
+
+struct tg_domain_node {
+    uint32_t tag;
+    uint32_t entry;             /* the path to this node is an entry */
+};
+
+struct tg_domain_trie {
+    uint32_t count;             /* entries */
+
+    /* Interned labels */
+    char *pool;
+    uint32_t pool_len;
+    uint32_t pool_alloc;
+    struct tg_domain_label *labels;
+    uint32_t label_count;
+    uint32_t label_alloc;
+    uint32_t *label_table;      /* label id + 1, 0 = empty */
+    uint32_t label_size;        /* power of two */
+
+    /* Nodes, 0 is the root, and edges between them */
+    struct tg_domain_node *nodes;
+    uint32_t node_count;
+    uint32_t node_alloc;
+    struct tg_domain_edge *edges;
+    uint32_t edge_count;
+    uint32_t edge_size;         /* power of two */
+};
+
+static inline uint8_t tg_domain_fold(uint8_t c)
+{
+    return (uint8_t) (c - 'A') < 26 ? c + ('a' - 'A') : c;
+}
+
+static inline uint64_t tg_domain_mix(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint32_t tg_domain_label_hash(const char *label, size_t len)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= tg_domain_fold((uint8_t) label[i]);
+        hash *= 1099511628211ull;
+    }
+    return (uint32_t) tg_domain_mix(hash);
+}
+
+static inline uint32_t tg_domain_edge_hash(uint32_t parent, uint32_t label)
+{
+    return (uint32_t) tg_domain_mix(((uint64_t) parent << 32) | label);
+}
+
+static int tg_domain_grow(void **ptr, uint32_t *alloc, uint32_t needed, size_t elem_size)
+{
+    uint64_t new_alloc;
+    void *tmp;
+
+    if (needed <= *alloc) {
+        return 0;
+    }
+
+    new_alloc = *alloc ? *alloc : 64;
+    while (new_alloc < needed) {
+        new_alloc *= 2;
+    }
+    if (new_alloc > UINT32_MAX) {
+        return -1;
+    }
+
+    tmp = flb_realloc(*ptr, (size_t) new_alloc * elem_size);
+    if (!tmp) {
+        return -1;
+    }
+
+    *ptr = tmp;
+    *alloc = (uint32_t) new_alloc;
+    return 0;
+}
+
+/* Normalize a name in place: drop a trailing dot and a leading "*." or
+ * "." so that only the labels remain */
+static void tg_domain_trim(const char **name, size_t *len)
+{
+    if (*len > 0 && (*name)[*len - 1] == '.') {
+        (*len)--;
+    }
+    if (*len >= 2 && (*name)[0] == '*' && (*name)[1] == '.') {
+        *name += 2;
+        *len -= 2;
+    } else if (*len > 0 && (*name)[0] == '.') {
+        (*name)++;
+        (*len)--;
+    }
+}
+
+/* Next label to the left of *pos, which starts at len + 1 as if the name
+ * ended in a dot. Empty labels ("a..b") are returned with length 0. Returns
+ * -1 when the name is used up. */
+static int tg_domain_next_label(const char *name, size_t *pos, const char **label,
+                                size_t *label_len)
+{
+    size_t start;
+    size_t end;
+
+    if (*pos == 0) {
+        return -1;
+    }
+
+    end = *pos - 1;
+    start = end;
+    while (start > 0 && name[start - 1] != '.') {
+        start--;
+    }
+
+    *label = name + start;
+    *label_len = end - start;
+    *pos = start;
+    return 0;
+}
+
+static uint32_t tg_domain_label_find(const struct tg_domain_trie *trie, uint32_t hash,
+                                     const char *label, size_t len)
+{
+    uint32_t mask = trie->label_size - 1;
+    uint32_t pos = hash & mask;
+
+    if (trie->label_size == 0) {
+        return TG_DOMAIN_NONE;
+    }
+
+    for (;;) {
+        uint32_t id = trie->label_table[pos];
+        const struct tg_domain_label *entry;
+        size_t i;
+
+        if (id == 0) {
+            return TG_DOMAIN_NONE;
+        }
+
+        entry = &trie->labels[id - 1];
+        if (entry->hash == hash && entry->len == len) {
+            for (i = 0; i < len; i++) {
+                if ((uint8_t) trie->pool[entry->off + i] != tg_domain_fold((uint8_t) label[i])) {
+                    break;
+                }
+            }
+            if (i == len) {
+                return id - 1;
+            }
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+
+static int tg_domain_label_rehash(struct tg_domain_trie *trie, uint32_t size)
+{
+    uint32_t *table;
+
+    table = flb_calloc(size, sizeof(uint32_t));
+    if (!table) {
+        return -1;
+    }
+
+    for (uint32_t id = 0; id < trie->label_count; id++) {
+        uint32_t pos = trie->labels[id].hash & (size - 1);
+
+        while (table[pos] != 0) {
+            pos = (pos + 1) & (size - 1);
+        }
+        table[pos] = id + 1;
+    }
+
+    flb_free(trie->label_table);
+    trie->label_table = table;
+    trie->label_size = size;
+    return 0;
+}
+
+/* Id of a label, interned if new */
+static uint32_t tg_domain_label_intern(struct tg_domain_trie *trie, const char *label, size_t len)
+{
+    struct tg_domain_label *entry;
+    uint32_t hash = tg_domain_label_hash(label, len);
+    uint32_t id;
+    uint32_t pos;
+
+    id = tg_domain_label_find(trie, hash, label, len);
+    if (id != TG_DOMAIN_NONE) {
+        return id;
+    }
+
+    if ((uint64_t) (trie->label_count + 1) * 4 > (uint64_t) trie->label_size * 3 &&
+        tg_domain_label_rehash(trie, trie->label_size ? trie->label_size * 2 :
+                                     TG_DOMAIN_MIN_TABLE) != 0) {
+        return TG_DOMAIN_NONE;
+    }
+    if (tg_domain_grow((void **) &trie->labels, &trie->label_alloc, trie->label_count + 1,
+                       sizeof(struct tg_domain_label)) != 0 ||
+        (uint64_t) trie->pool_len + len > UINT32_MAX ||
+        tg_domain_grow((void **) &trie->pool, &trie->pool_alloc,
+                       trie->pool_len + (uint32_t) len, 1) != 0) {
+        return TG_DOMAIN_NONE;
+    }
+
+    id = trie->label_count++;
+    entry = &trie->labels[id];
+    entry->hash = hash;
+    entry->off = trie->pool_len;
+    entry->len = (uint32_t) len;
+    for (size_t i = 0; i < len; i++) {
+        trie->pool[trie->pool_len++] = (char) tg_domain_fold((uint8_t) label[i]);
+    }
+
+    pos = hash & (trie->label_size - 1);
+    while (trie->label_table[pos] != 0) {
+        pos = (pos + 1) & (trie->label_size - 1);
+    }
+    trie->label_table[pos] = id + 1;
+    return id;
+}
+
+/* Child of parent along label, or 0 */
+static uint32_t tg_domain_edge_find(const struct tg_domain_trie *trie, uint32_t parent,
+                                    uint32_t label)
+{
+    uint32_t mask = trie->edge_size - 1;
+    uint32_t pos;
+
+    if (trie->edge_size == 0) {
+        return 0;
+    }
+
+    pos = tg_domain_edge_hash(parent, label) & mask;
+    for (;;) {
+        const struct tg_domain_edge *edge = &trie->edges[pos];
+
+        if (edge->child == 0 || (edge->parent == parent && edge->label == label)) {
+            return edge->child;
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+
+static void tg_domain_edge_insert(struct tg_domain_edge *edges, uint32_t size,
+                                  const struct tg_domain_edge *edge)
+{
+    uint32_t pos = tg_domain_edge_hash(edge->parent, edge->label) & (size - 1);
+
+    while (edges[pos].child != 0) {
+        pos = (pos + 1) & (size - 1);
+    }
+    edges[pos] = *edge;
+}
+
+static int tg_domain_edge_rehash(struct tg_domain_trie *trie, uint32_t size)
+{
+    struct tg_domain_edge *edges;
+
+    edges = flb_calloc(size, sizeof(struct tg_domain_edge));
+    if (!edges) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < trie->edge_size; i++) {
+        if (trie->edges[i].child != 0) {
+            tg_domain_edge_insert(edges, size, &trie->edges[i]);
+        }
+    }
+
+    flb_free(trie->edges);
+    trie->edges = edges;
+    trie->edge_size = size;
+    return 0;
+}
+
+/* Child of parent along label, created if absent; 0 on failure */
+static uint32_t tg_domain_child(struct tg_domain_trie *trie, uint32_t parent, uint32_t label)
+{
+    struct tg_domain_edge edge;
+    uint32_t child;
+
+    child = tg_domain_edge_find(trie, parent, label);
+    if (child != 0) {
+        return child;
+    }
+
+    if ((uint64_t) (trie->edge_count + 1) * 4 > (uint64_t) trie->edge_size * 3 &&
+        tg_domain_edge_rehash(trie, trie->edge_size ? trie->edge_size * 2 :
+                                    TG_DOMAIN_MIN_TABLE) != 0) {
+        return 0;
+    }
+    if (tg_domain_grow((void **) &trie->nodes, &trie->node_alloc, trie->node_count + 1,
+                       sizeof(struct tg_domain_node)) != 0) {
+        return 0;
+    }
+
+    child = trie->node_count++;
+    trie->nodes[child].tag = 0;
+    trie->nodes[child].entry = 0;
+
+    edge.parent = parent;
+    edge.label = label;
+    edge.child = child;
+    tg_domain_edge_insert(trie->edges, trie->edge_size, &edge);
+    trie->edge_count++;
+    return child;
+}
+
+struct tg_domain_trie *tg_domain_trie_create(void)
+{
+    struct tg_domain_trie *trie;
+
+    trie = flb_calloc(1, sizeof(struct tg_domain_trie));
+    if (!trie) {
+        return NULL;
+    }
+
+    /* Root */
+    if (tg_domain_grow((void **) &trie->nodes, &trie->node_alloc, 1,
+                       sizeof(struct tg_domain_node)) != 0) {
+        flb_free(trie);
+        return NULL;
+    }
+    trie->nodes[0].tag = 0;
+    trie->nodes[0].entry = 0;
+    trie->node_count = 1;
+    return trie;
+}
+
+static int tg_domain_valid_label(const char *label, size_t len)
+{
+    if (len == 0 || len > TG_DOMAIN_MAX_LABEL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) label[i];
+
+        if (!isalnum(c) && c != '-' && c != '_') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int tg_domain_trie_add(struct tg_domain_trie *trie, const char *name, size_t len, uint32_t tag)
+{
+    const char *label;
+    size_t label_len;
+    size_t pos;
+    uint32_t node = 0;
+
+    if (!trie || !name) {
+        return -1;
+    }
+
+    tg_domain_trim(&name, &len);
+    if (len == 0 || len > TG_DOMAIN_MAX_NAME) {
+        return -1;
+    }
+
+    /* Validate every label before the trie is touched */
+    pos = len + 1;
+    while (tg_domain_next_label(name, &pos, &label, &label_len) == 0) {
+        if (!tg_domain_valid_label(label, label_len)) {
+            return -1;
+        }
+    }
+
+    pos = len + 1;
+    while (tg_domain_next_label(name, &pos, &label, &label_len) == 0) {
+        uint32_t id = tg_domain_label_intern(trie, label, label_len);
+
+        if (id == TG_DOMAIN_NONE) {
+            return -2;
+        }
+        node = tg_domain_child(trie, node, id);
+        if (node == 0) {
+            return -2;
+        }
+    }
+
+    if (!trie->nodes[node].entry) {
+        trie->nodes[node].entry = 1;
+        trie->count++;
+    }
+    trie->nodes[node].tag = tag;
+    return 0;
+}
+
+/* Node reached by the labels of name, or 0 if the path does not exist */
+static uint32_t tg_domain_walk(const struct tg_domain_trie *trie, const char *name, size_t len,
+                               uint32_t *best, int *best_labels)
+{
+    const char *label;
+    size_t label_len;
+    size_t pos = len + 1;
+    uint32_t node = 0;
+    int labels = 0;
+
+    while (tg_domain_next_label(name, &pos, &label, &label_len) == 0) {
+        uint32_t id = tg_domain_label_find(trie, tg_domain_label_hash(label, label_len),
+                                           label, label_len);
+
+        if (id == TG_DOMAIN_NONE) {
+            return 0;
+        }
+        node = tg_domain_edge_find(trie, node, id);
+        if (node == 0) {
+            return 0;
+        }
+
+        labels++;
+        if (best && trie->nodes[node].entry) {
+            *best = node;
+            *best_labels = labels;
+        }
+    }
+    return node;
+}
+
+int tg_domain_trie_remove(struct tg_domain_trie *trie, const char *name, size_t len)
+{
+    uint32_t node;
+
+    if (!trie || !name) {
+        return -1;
+    }
+
+    tg_domain_trim(&name, &len);
+    node = tg_domain_walk(trie, name, len, NULL, NULL);
+
+    /* The path stays; it is reused if the name comes back */
+    if (node != 0 && trie->nodes[node].entry) {
+        trie->nodes[node].entry = 0;
+        trie->count--;
+    }
+    return 0;
+}
+
+int tg_domain_trie_lookup(const struct tg_domain_trie *trie, const char *name, size_t len,
+                          uint32_t *tag)
+{
+    uint32_t best = 0;
+    int best_labels = 0;
+
+    if (!trie || !name || trie->count == 0) {
+        return 0;
+    }
+
+    tg_domain_trim(&name, &len);
+    if (len == 0 || len > TG_DOMAIN_MAX_NAME) {
+        return 0;
+    }
+
+    tg_domain_walk(trie, name, len, &best, &best_labels);
+    if (best_labels > 0 && tag) {
+        *tag = trie->nodes[best].tag;
+    }
+    return best_labels;
+}
+
+/* Independent copy of trie; paths of removed names are copied as well */
+struct tg_domain_trie *tg_domain_trie_clone(const struct tg_domain_trie *trie)
+{
+    struct tg_domain_trie *copy;
+
+    if (!trie) {
+        return NULL;
+    }
+
+    copy = flb_calloc(1, sizeof(struct tg_domain_trie));
+    if (!copy) {
+        return NULL;
+    }
+
+    copy->count = trie->count;
+    copy->pool_len = trie->pool_len;
+    copy->label_count = trie->label_count;
+    copy->label_size = trie->label_size;
+    copy->node_count = trie->node_count;
+    copy->edge_count = trie->edge_count;
+    copy->edge_size = trie->edge_size;
+
+    if (tg_domain_grow((void **) &copy->pool, &copy->pool_alloc, trie->pool_len, 1) != 0 ||
+        tg_domain_grow((void **) &copy->labels, &copy->label_alloc, trie->label_count,
+                       sizeof(struct tg_domain_label)) != 0 ||
+        tg_domain_grow((void **) &copy->nodes, &copy->node_alloc, trie->node_count,
+                       sizeof(struct tg_domain_node)) != 0 ||
+        (trie->label_size > 0 &&
+         !(copy->label_table = flb_malloc((size_t) trie->label_size * sizeof(uint32_t)))) ||
+        (trie->edge_size > 0 &&
+         !(copy->edges = flb_malloc((size_t) trie->edge_size *
+                                    sizeof(struct tg_domain_edge))))) {
+        tg_domain_trie_destroy(copy);
+        return NULL;
+    }
+
+    if (trie->pool_len > 0) {
+        memcpy(copy->pool, trie->pool, trie->pool_len);
+    }
+    if (trie->label_count > 0) {
+        memcpy(copy->labels, trie->labels,
+               (size_t) trie->label_count * sizeof(struct tg_domain_label));
+    }
+    memcpy(copy->nodes, trie->nodes, (size_t) trie->node_count * sizeof(struct tg_domain_node));
+    if (trie->label_size > 0) {
+        memcpy(copy->label_table, trie->label_table,
+               (size_t) trie->label_size * sizeof(uint32_t));
+    }
+    if (trie->edge_size > 0) {
+        memcpy(copy->edges, trie->edges, (size_t) trie->edge_size * sizeof(struct tg_domain_edge));
+    }
+    return copy;
+}
+
+int tg_domain_tail(const char *name, size_t len, int labels, const char **tail,
+                   size_t *tail_len)
+{
+    const char *label = NULL;
+    size_t label_len;
+    size_t pos;
+    int found = 0;
+
+    if (!name || labels <= 0) {
+        return 0;
+    }
+
+    tg_domain_trim(&name, &len);
+    if (len == 0 || len > TG_DOMAIN_MAX_NAME) {
+        return 0;
+    }
+
+    pos = len + 1;
+    while (found < labels && tg_domain_next_label(name, &pos, &label, &label_len) == 0) {
+        found++;
+    }
+
+    *tail = label;
+    *tail_len = (size_t) (name + len - label);
+    return found;
+}
+
+uint32_t tg_domain_trie_count(const struct tg_domain_trie *trie)
+{
+    return trie ? trie->count : 0;
+}
+
+size_t tg_domain_trie_memory(const struct tg_domain_trie *trie)
+{
+    if (!trie) {
+        return 0;
+    }
+
+    return sizeof(*trie) + trie->pool_alloc +
+           (size_t) trie->label_alloc * sizeof(struct tg_domain_label) +
+           (size_t) trie->label_size * sizeof(uint32_t) +
+           (size_t) trie->node_alloc * sizeof(struct tg_domain_node) +
+           (size_t) trie->edge_size * sizeof(struct tg_domain_edge);
+}
+
+void tg_domain_trie_destroy(struct tg_domain_trie *trie)
+{
+    if (!trie) {
+        return;
+    }
+
+    flb_free(trie->pool);
+    flb_free(trie->labels);
+    flb_free(trie->label_table);
+    flb_free(trie->nodes);
+    flb_free(trie->edges);
+    flb_free(trie);
+}
+
+int tg_domain_url_host(const char *url, size_t len, const char **host, size_t *host_len)
+{
+    const char *p = url;
+    const char *end = url + len;
+    const char *authority_end;
+    const char *at;
+    size_t i;
+
+    if (!url || len == 0) {
+        return -1;
+    }
+
+    /* Scheme, if any: letters, digits, '+', '-' and '.' before "://" */
+    for (i = 0; i < len && (isalnum((unsigned char) url[i]) || url[i] == '+' ||
+                            url[i] == '-' || url[i] == '.'); i++) {
+    }
+    if (i > 0 && i + 3 <= len && memcmp(url + i, "://", 3) == 0) {
+        p = url + i + 3;
+    } else if (len >= 2 && url[0] == '/' && url[1] == '/') {
+        p = url + 2;
+    }
+
+    /* Authority ends at the path, query or fragment */
+    authority_end = p;
+    while (authority_end < end && *authority_end != '/' && *authority_end != '?' &&
+           *authority_end != '#') {
+        authority_end++;
+    }
+
+    /* Skip user information */
+    at = NULL;
+    for (const char *c = p; c < authority_end; c++) {
+        if (*c == '@') {
+            at = c;
+        }
+    }
+    if (at) {
+        p = at + 1;
+    }
+
+    if (p < authority_end && *p == '[') {
+        const char *close = memchr(p, ']', (size_t) (authority_end - p));
+
+        if (!close) {
+            return -1;
+        }
+        *host = p + 1;
+        *host_len = (size_t) (close - p - 1);
+    } else {
+        const char *colon = memchr(p, ':', (size_t) (authority_end - p));
+
+        *host = p;
+        *host_len = (size_t) ((colon ? colon : authority_end) - p);
+    }
+
+    return *host_len > 0 ? 0 : -1;
+}
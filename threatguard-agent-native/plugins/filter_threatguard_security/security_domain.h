@@ -0,0 +1,48 @@
+/*  ThreatGuard Agent - Domain Suffix Trie
+ *  Domain indicators matched with suffix semantics: an entry for a domain
+ *  also matches every name below it
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_DOMAIN_H
+#define TG_SECURITY_DOMAIN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct tg_domain_trie;
+
+/* Build phase: one writer, no concurrent lookups. Names are case
+ * insensitive and may carry a trailing dot or a leading "*." wildcard,
+ * which suffix matching implies. Adding a name again replaces its tag;
+ * removing an absent name is not an error. add returns -1 if name is not
+ * a valid domain, or -2 if it cannot be stored. A clone is an independent copy
+ * that can be changed while the original is being read. */
+struct tg_domain_trie *tg_domain_trie_create(void);
+int tg_domain_trie_add(struct tg_domain_trie *trie, const char *name, size_t len, uint32_t tag);
+int tg_domain_trie_remove(struct tg_domain_trie *trie, const char *name, size_t len);
+struct tg_domain_trie *tg_domain_trie_clone(const struct tg_domain_trie *trie);
+
+/* Lookup phase: read-only and allocation free, safe to share between
+ * threads. Returns the label count of the most specific entry that name
+ * equals or lies below and sets tag, or 0 if there is none. */
+int tg_domain_trie_lookup(const struct tg_domain_trie *trie, const char *name, size_t len,
+                          uint32_t *tag);
+
+uint32_t tg_domain_trie_count(const struct tg_domain_trie *trie);
+size_t tg_domain_trie_memory(const struct tg_domain_trie *trie);
+void tg_domain_trie_destroy(struct tg_domain_trie *trie);
+
+/* The last labels of name, at most labels of them, as a range of name
+ * after the same normalization as a lookup. Returns the number of labels
+ * in the range, or 0 if name is empty. Entries that a name lies below all
+ * share its last two labels, or consist of its last label alone. */
+int tg_domain_tail(const char *name, size_t len, int labels, const char **tail,
+                   size_t *tail_len);
+
+/* Host part of a URL, or of a "host[:port][/path]" string without a
+ * scheme, as a range of url; IPv6 literals are returned without brackets.
+ * Returns 0, or -1 if there is no host. */
+int tg_domain_url_host(const char *url, size_t len, const char **host, size_t *host_len);
+
+#endif /* TG_SECURITY_DOMAIN_H */
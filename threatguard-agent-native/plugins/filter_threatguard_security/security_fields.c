@@ -0,0 +1,604 @@
+/*  ThreatGuard Agent - Field Dictionary
+ *  Field names are compiled into a hash-and-displace perfect hash: names
+ *  are split into small buckets by one hash, and each bucket gets the
+ *  displacement that moves all of its names into free table slots. A
+ *  lookup is then one hash, one displacement read and one key compare.
+ *  Names that are nested paths get the step from the path they extend,
+ *  found by lookup once the table is built.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_fields.h"
+
+#define TG_FIELD_MAX_SEEDS  32
+
+struct tg_field_name {
+    uint32_t off;               /* into names[] */
+    uint32_t len;
+};
+
+struct tg_field_dict {
+    int compiled;
+    int mapped;                 /* tables borrowed from an image */
+
+    /* Field names, slot order */
+    char *names;
+    uint32_t names_len;
+    uint32_t names_alloc;
+    struct tg_field_name *fields;
+    uint32_t count;
+    uint32_t alloc;
+
+    /* Build-time open addressing table for de-duplication, slot + 1 */
+    uint32_t *build_table;
+    uint32_t build_size;
+
+    /* Compiled perfect hash */
+    uint64_t seed;
+    uint32_t bucket_count;
+    uint32_t *disp;             /* per bucket displacement */
+    uint32_t table_size;        /* power of two */
+    uint32_t *table;            /* slot + 1, 0 = empty */
+
+    /* Path step per slot, NULL if no name is a nested path */
+    struct tg_field_path *paths;
+};
+
+/* Serialized dictionary; names, name entries, displacements and the slot
+ * table follow in this order, each starting on an 8-byte boundary */
+struct tg_field_image {
+    uint64_t seed;
+    uint32_t count;
+    uint32_t names_len;
+    uint32_t bucket_count;
+    uint32_t table_size;
+};
+
+static int tg_field_grow(void **ptr, uint32_t *alloc, uint32_t needed, size_t elem_size)
+{
+    uint32_t new_alloc;
+    void *tmp;
+
+    if (needed <= *alloc) {
+        return 0;
+    }
+
+    new_alloc = *alloc ? *alloc * 2 : 64;
+    while (new_alloc < needed) {
+        new_alloc *= 2;
+    }
+
+    tmp = flb_realloc(*ptr, (size_t) new_alloc * elem_size);
+    if (!tmp) {
+        return -1;
+    }
+
+    *ptr = tmp;
+    *alloc = new_alloc;
+    return 0;
+}
+
+/* FNV-1a with a 64-bit finalizer so every output bit depends on every byte */
+static uint64_t tg_field_hash(uint64_t seed, const char *name, size_t len)
+{
+    uint64_t hash = 14695981039346656037ull ^ seed;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) name[i];
+        hash *= 1099511628211ull;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint32_t tg_field_bucket(const struct tg_field_dict *dict, uint64_t hash)
+{
+    return (uint32_t) (hash >> 32) % dict->bucket_count;
+}
+
+/* The step is odd, so displacements 0..table_size-1 visit every slot */
+static uint32_t tg_field_slot(const struct tg_field_dict *dict, uint64_t hash, uint32_t disp)
+{
+    uint32_t base = (uint32_t) hash;
+    uint32_t step = ((uint32_t) (hash >> 16) | (uint32_t) (hash >> 48) << 16) | 1;
+
+    return (base + disp * step) & (dict->table_size - 1);
+}
+
+static int tg_field_name_equal(const struct tg_field_dict *dict, uint32_t slot,
+                               const char *name, size_t len)
+{
+    return dict->fields[slot].len == len &&
+           memcmp(dict->names + dict->fields[slot].off, name, len) == 0;
+}
+
+static int tg_field_build_rehash(struct tg_field_dict *dict, uint32_t size)
+{
+    uint32_t *table = flb_calloc(size, sizeof(uint32_t));
+
+    if (!table) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < dict->count; i++) {
+        uint64_t hash = tg_field_hash(0, dict->names + dict->fields[i].off, dict->fields[i].len);
+        uint32_t pos = (uint32_t) hash & (size - 1);
+
+        while (table[pos]) {
+            pos = (pos + 1) & (size - 1);
+        }
+        table[pos] = i + 1;
+    }
+
+    flb_free(dict->build_table);
+    dict->build_table = table;
+    dict->build_size = size;
+    return 0;
+}
+
+/* Create an empty dictionary */
+struct tg_field_dict *tg_field_dict_create(void)
+{
+    struct tg_field_dict *dict;
+
+    dict = flb_calloc(1, sizeof(struct tg_field_dict));
+    if (!dict) {
+        return NULL;
+    }
+
+    if (tg_field_build_rehash(dict, 64) != 0) {
+        flb_free(dict);
+        return NULL;
+    }
+
+    return dict;
+}
+
+int tg_field_path_split(const char *name, size_t len, size_t *parent_len, int32_t *index)
+{
+    size_t i;
+    int64_t value = 0;
+
+    if (!name || len < 3) {
+        return -1;
+    }
+
+    /* Array element: "path[digits]" */
+    if (name[len - 1] == ']') {
+        for (i = len - 1; i > 0 && name[i - 1] >= '0' && name[i - 1] <= '9'; i--) {
+        }
+        if (i == len - 1 || i < 2 || name[i - 1] != '[' || len - 1 - i > 9) {
+            return -1;
+        }
+        for (size_t d = i; d < len - 1; d++) {
+            value = value * 10 + (name[d] - '0');
+        }
+        *parent_len = i - 1;
+        *index = (int32_t) value;
+        return 0;
+    }
+
+    /* Map key: "path.key" */
+    for (i = len - 1; i > 0 && name[i] != '.' && name[i] != '[' && name[i] != ']'; i--) {
+    }
+    if (name[i] != '.' || i == 0 || i == len - 1) {
+        return -1;
+    }
+    *parent_len = i;
+    *index = -1;
+    return 0;
+}
+
+/* Add a field name; returns its slot or -1 on error */
+int tg_field_dict_add(struct tg_field_dict *dict, const char *name, size_t len)
+{
+    uint64_t hash;
+    uint32_t pos;
+
+    if (!dict || dict->compiled || !name) {
+        return -1;
+    }
+
+    hash = tg_field_hash(0, name, len);
+    pos = (uint32_t) hash & (dict->build_size - 1);
+    while (dict->build_table[pos]) {
+        if (tg_field_name_equal(dict, dict->build_table[pos] - 1, name, len)) {
+            return (int) dict->build_table[pos] - 1;
+        }
+        pos = (pos + 1) & (dict->build_size - 1);
+    }
+
+    if ((dict->count + 1) * 2 > dict->build_size) {
+        if (tg_field_build_rehash(dict, dict->build_size * 2) != 0) {
+            return -1;
+        }
+        pos = (uint32_t) hash & (dict->build_size - 1);
+        while (dict->build_table[pos]) {
+            pos = (pos + 1) & (dict->build_size - 1);
+        }
+    }
+
+    if (tg_field_grow((void **) &dict->fields, &dict->alloc, dict->count + 1,
+                      sizeof(struct tg_field_name)) != 0 ||
+        tg_field_grow((void **) &dict->names, &dict->names_alloc,
+                      dict->names_len + (uint32_t) len + 1, 1) != 0) {
+        return -1;
+    }
+
+    memcpy(dict->names + dict->names_len, name, len);
+    dict->names[dict->names_len + len] = '\0';
+    dict->fields[dict->count].off = dict->names_len;
+    dict->fields[dict->count].len = (uint32_t) len;
+    dict->names_len += (uint32_t) len + 1;
+
+    dict->build_table[pos] = dict->count + 1;
+    return (int) dict->count++;
+}
+
+/* Try to place every bucket with the current seed */
+static int tg_field_place(struct tg_field_dict *dict, const uint64_t *hashes,
+                          const uint32_t *order, const uint32_t *bucket_start,
+                          const uint32_t *members)
+{
+    memset(dict->table, 0, (size_t) dict->table_size * sizeof(uint32_t));
+    memset(dict->disp, 0, (size_t) dict->bucket_count * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < dict->bucket_count; i++) {
+        uint32_t bucket = order[i];
+        uint32_t first = bucket_start[bucket];
+        uint32_t last = bucket_start[bucket + 1];
+        int placed = 0;
+
+        if (first == last) {
+            break;
+        }
+
+        for (uint32_t disp = 0; disp < dict->table_size && !placed; disp++) {
+            uint32_t k;
+
+            for (k = first; k < last; k++) {
+                uint32_t slot = tg_field_slot(dict, hashes[members[k]], disp);
+
+                if (dict->table[slot]) {
+                    break;
+                }
+                dict->table[slot] = members[k] + 1;
+            }
+
+            if (k == last) {
+                dict->disp[bucket] = disp;
+                placed = 1;
+            } else {
+                /* Undo the partial placement */
+                while (k-- > first) {
+                    dict->table[tg_field_slot(dict, hashes[members[k]], disp)] = 0;
+                }
+            }
+        }
+
+        if (!placed) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int tg_field_dict_add_path(struct tg_field_dict *dict, const char *name, size_t len)
+{
+    size_t parent_len;
+    int32_t index;
+
+    if (tg_field_path_split(name, len, &parent_len, &index) == 0 &&
+        tg_field_dict_add_path(dict, name, parent_len) < 0) {
+        return -1;
+    }
+    return tg_field_dict_add(dict, name, len);
+}
+
+/* Give each name that is a nested path the step from the path it extends.
+ * Only a path added before it counts, so paths resolve in slot order. */
+static int tg_field_build_paths(struct tg_field_dict *dict)
+{
+    struct tg_field_path *paths;
+    int nested = 0;
+
+    if (dict->count == 0) {
+        return 0;
+    }
+
+    paths = flb_calloc(dict->count, sizeof(struct tg_field_path));
+    if (!paths) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < dict->count; i++) {
+        const char *name = dict->names + dict->fields[i].off;
+        size_t len = dict->fields[i].len;
+        size_t parent_len;
+        int32_t index;
+        int parent = TG_FIELD_SLOT_NONE;
+
+        if (tg_field_path_split(name, len, &parent_len, &index) == 0) {
+            parent = tg_field_dict_lookup(dict, name, parent_len);
+        }
+
+        if (parent == TG_FIELD_SLOT_NONE || (uint32_t) parent >= i) {
+            paths[i].parent = TG_FIELD_SLOT_NONE;
+            paths[i].index = -1;
+            continue;
+        }
+
+        paths[i].parent = parent;
+        paths[i].index = index;
+        if (index < 0) {
+            paths[i].key = name + parent_len + 1;
+            paths[i].key_len = (uint32_t) (len - parent_len - 1);
+        }
+        nested = 1;
+    }
+
+    if (!nested) {
+        flb_free(paths);
+        return 0;
+    }
+
+    dict->paths = paths;
+    return 0;
+}
+
+/* Build the perfect hash; no names can be added afterwards */
+int tg_field_dict_compile(struct tg_field_dict *dict)
+{
+    uint64_t *hashes;
+    uint32_t *bucket_start;
+    uint32_t *members;
+    uint32_t *order;
+    uint32_t max_size = 0;
+    int ret = -1;
+
+    if (!dict || dict->compiled) {
+        return -1;
+    }
+
+    /* About two names per bucket and a table at most half full */
+    dict->bucket_count = dict->count / 2 + 1;
+    dict->table_size = 8;
+    while (dict->table_size < dict->count * 2) {
+        dict->table_size *= 2;
+    }
+
+    dict->disp = flb_calloc(dict->bucket_count, sizeof(uint32_t));
+    dict->table = flb_calloc(dict->table_size, sizeof(uint32_t));
+    hashes = flb_malloc(((size_t) dict->count + 1) * sizeof(uint64_t));
+    bucket_start = flb_malloc(((size_t) dict->bucket_count + 1) * sizeof(uint32_t));
+    members = flb_malloc(((size_t) dict->count + 1) * sizeof(uint32_t));
+    order = flb_malloc((size_t) dict->bucket_count * sizeof(uint32_t));
+
+    if (dict->disp && dict->table && hashes && bucket_start && members && order) {
+        for (uint64_t seed = 0; seed < TG_FIELD_MAX_SEEDS && ret != 0; seed++) {
+            dict->seed = seed * 0x9e3779b97f4a7c15ull;
+
+            /* Group names by bucket */
+            memset(bucket_start, 0, ((size_t) dict->bucket_count + 1) * sizeof(uint32_t));
+            for (uint32_t i = 0; i < dict->count; i++) {
+                hashes[i] = tg_field_hash(dict->seed, dict->names + dict->fields[i].off,
+                                          dict->fields[i].len);
+                bucket_start[tg_field_bucket(dict, hashes[i]) + 1]++;
+            }
+            for (uint32_t b = 0; b < dict->bucket_count; b++) {
+                uint32_t size = bucket_start[b + 1];
+
+                if (size > max_size) {
+                    max_size = size;
+                }
+                bucket_start[b + 1] += bucket_start[b];
+            }
+            for (uint32_t i = 0; i < dict->count; i++) {
+                uint32_t b = tg_field_bucket(dict, hashes[i]);
+                uint32_t k = bucket_start[b]++;
+                members[k] = i;
+            }
+            for (uint32_t b = dict->bucket_count; b > 0; b--) {
+                bucket_start[b] = bucket_start[b - 1];
+            }
+            bucket_start[0] = 0;
+
+            /* Largest buckets first, while the table is still empty;
+             * empty buckets end up last */
+            uint32_t n = 0;
+            for (uint32_t size = max_size + 1; size-- > 0;) {
+                for (uint32_t b = 0; b < dict->bucket_count; b++) {
+                    if (bucket_start[b + 1] - bucket_start[b] == size) {
+                        order[n++] = b;
+                    }
+                }
+            }
+            max_size = 0;
+
+            ret = tg_field_place(dict, hashes, order, bucket_start, members);
+        }
+    }
+
+    flb_free(hashes);
+    flb_free(bucket_start);
+    flb_free(members);
+    flb_free(order);
+
+    if (ret != 0) {
+        tg_log(TG_LOG_ERROR, "failed to build field dictionary for %u fields", dict->count);
+        return -1;
+    }
+
+    flb_free(dict->build_table);
+    dict->build_table = NULL;
+    dict->build_size = 0;
+    dict->compiled = 1;
+
+    if (tg_field_build_paths(dict) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to compile nested field paths");
+        return -1;
+    }
+    return 0;
+}
+
+int tg_field_dict_lookup(const struct tg_field_dict *dict, const char *name, size_t len)
+{
+    uint64_t hash;
+    uint32_t entry;
+
+    if (!dict || !dict->compiled || dict->count == 0) {
+        return TG_FIELD_SLOT_NONE;
+    }
+
+    hash = tg_field_hash(dict->seed, name, len);
+    entry = dict->table[tg_field_slot(dict, hash, dict->disp[tg_field_bucket(dict, hash)])];
+    if (entry && tg_field_name_equal(dict, entry - 1, name, len)) {
+        return (int) entry - 1;
+    }
+    return TG_FIELD_SLOT_NONE;
+}
+
+static size_t tg_field_align(size_t size)
+{
+    return (size + 7) & ~(size_t) 7;
+}
+
+/* Offsets of the tables in an image; returns the image size */
+static size_t tg_field_image_layout(const struct tg_field_image *image, size_t offsets[4])
+{
+    size_t size = tg_field_align(sizeof(struct tg_field_image));
+
+    offsets[0] = size;          /* names */
+    size = tg_field_align(size + image->names_len);
+    offsets[1] = size;          /* fields */
+    size = tg_field_align(size + (size_t) image->count * sizeof(struct tg_field_name));
+    offsets[2] = size;          /* disp */
+    size = tg_field_align(size + (size_t) image->bucket_count * sizeof(uint32_t));
+    offsets[3] = size;          /* table */
+    return tg_field_align(size + (size_t) image->table_size * sizeof(uint32_t));
+}
+
+size_t tg_field_dict_serialize(const struct tg_field_dict *dict, void *buf, size_t size)
+{
+    struct tg_field_image header;
+    size_t offsets[4];
+    size_t needed;
+    char *base = buf;
+
+    if (!dict || !dict->compiled) {
+        return 0;
+    }
+
+    header.seed = dict->seed;
+    header.count = dict->count;
+    header.names_len = dict->names_len;
+    header.bucket_count = dict->bucket_count;
+    header.table_size = dict->table_size;
+
+    needed = tg_field_image_layout(&header, offsets);
+    if (!buf || size < needed) {
+        return needed;
+    }
+
+    memset(buf, 0, needed);
+    memcpy(buf, &header, sizeof(header));
+    if (dict->names_len > 0) {
+        memcpy(base + offsets[0], dict->names, dict->names_len);
+        memcpy(base + offsets[1], dict->fields, (size_t) dict->count * sizeof(struct tg_field_name));
+    }
+    memcpy(base + offsets[2], dict->disp, (size_t) dict->bucket_count * sizeof(uint32_t));
+    memcpy(base + offsets[3], dict->table, (size_t) dict->table_size * sizeof(uint32_t));
+    return needed;
+}
+
+struct tg_field_dict *tg_field_dict_map(const void *image, size_t size)
+{
+    const struct tg_field_image *header = image;
+    const char *base = image;
+    struct tg_field_dict *dict;
+    size_t offsets[4];
+
+    /* A lookup masks the slot and compares the entry's name, so only the
+     * table entries and name ranges need checking */
+    if (!image || size < sizeof(struct tg_field_image) || header->bucket_count == 0 ||
+        header->table_size == 0 || (header->table_size & (header->table_size - 1)) != 0 ||
+        tg_field_image_layout(header, offsets) > size) {
+        return NULL;
+    }
+
+    dict = flb_calloc(1, sizeof(struct tg_field_dict));
+    if (!dict) {
+        return NULL;
+    }
+
+    dict->compiled = 1;
+    dict->mapped = 1;
+    dict->seed = header->seed;
+    dict->count = header->count;
+    dict->names_len = header->names_len;
+    dict->bucket_count = header->bucket_count;
+    dict->table_size = header->table_size;
+    dict->names = (char *) (base + offsets[0]);
+    dict->fields = (struct tg_field_name *) (base + offsets[1]);
+    dict->disp = (uint32_t *) (base + offsets[2]);
+    dict->table = (uint32_t *) (base + offsets[3]);
+
+    for (uint32_t i = 0; i < dict->count; i++) {
+        if (dict->fields[i].off > dict->names_len ||
+            dict->fields[i].len > dict->names_len - dict->fields[i].off) {
+            flb_free(dict);
+            return NULL;
+        }
+    }
+    for (uint32_t i = 0; i < dict->table_size; i++) {
+        if (dict->table[i] > dict->count) {
+            flb_free(dict);
+            return NULL;
+        }
+    }
+
+    if (tg_field_build_paths(dict) != 0) {
+        flb_free(dict);
+        return NULL;
+    }
+
+    return dict;
+}
+
+const struct tg_field_path *tg_field_dict_paths(const struct tg_field_dict *dict)
+{
+    return dict ? dict->paths : NULL;
+}
+
+uint32_t tg_field_dict_count(const struct tg_field_dict *dict)
+{
+    return dict ? dict->count : 0;
+}
+
+void tg_field_dict_destroy(struct tg_field_dict *dict)
+{
+    if (!dict) {
+        return;
+    }
+
+    flb_free(dict->paths);
+
+    if (dict->mapped) {
+        flb_free(dict);
+        return;
+    }
+
+    flb_free(dict->names);
+    flb_free(dict->fields);
+    flb_free(dict->build_table);
+    flb_free(dict->disp);
+    flb_free(dict->table);
+    flb_free(dict);
+}
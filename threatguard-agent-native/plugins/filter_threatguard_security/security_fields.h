@@ -0,0 +1,60 @@
+/*  ThreatGuard Agent - Field Dictionary
+ *  Perfect hash of the field names referenced by rules, used to index the
+ *  keys of each record once into a slot table, and the steps of the names
+ *  that are nested paths
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_FIELDS_H
+#define TG_SECURITY_FIELDS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TG_FIELD_SLOT_NONE  (-1)
+
+struct tg_field_dict;
+
+/* Last step of a nested field path such as "process.parent.exe" or
+ * "process.args[0]": the value of the path's slot is found in the value
+ * of the slot of the path it steps into */
+struct tg_field_path {
+    int32_t parent;             /* slot stepped into, TG_FIELD_SLOT_NONE for top-level keys */
+    int32_t index;              /* array element, -1 for the key */
+    const char *key;            /* map key, in the dictionary's names */
+    uint32_t key_len;
+};
+
+/* Build phase: add field names, then compile once before lookups. Adding
+ * a name twice returns the slot it already has. add_path adds the paths a
+ * nested path steps through before it, so a path's slot comes after the
+ * slot it steps into. */
+struct tg_field_dict *tg_field_dict_create(void);
+int tg_field_dict_add(struct tg_field_dict *dict, const char *name, size_t len);
+int tg_field_dict_add_path(struct tg_field_dict *dict, const char *name, size_t len);
+int tg_field_dict_compile(struct tg_field_dict *dict);
+
+/* Lookup phase: read-only, safe to share between threads. Returns the
+ * slot of the name or TG_FIELD_SLOT_NONE. */
+int tg_field_dict_lookup(const struct tg_field_dict *dict, const char *name, size_t len);
+
+/* Flat image of a compiled dictionary, for rule bundles. serialize
+ * returns the image size and writes it to buf if size allows (buf 8-byte
+ * aligned); 0 if dict is not compiled. map validates an image and returns
+ * a dictionary that reads it in place, so the image must outlive it. */
+size_t tg_field_dict_serialize(const struct tg_field_dict *dict, void *buf, size_t size);
+struct tg_field_dict *tg_field_dict_map(const void *image, size_t size);
+
+/* Path step of each slot, indexed by slot, compiled with the dictionary
+ * or when mapping it; NULL if no name is a nested path */
+const struct tg_field_path *tg_field_dict_paths(const struct tg_field_dict *dict);
+
+/* Split the last step off a nested path: the path it steps into is the
+ * first *parent_len bytes of name, and the step is array element *index,
+ * or the key after the dot if *index is -1. Returns -1 for a plain key. */
+int tg_field_path_split(const char *name, size_t len, size_t *parent_len, int32_t *index);
+
+uint32_t tg_field_dict_count(const struct tg_field_dict *dict);
+void tg_field_dict_destroy(struct tg_field_dict *dict);
+
+#endif /* TG_SECURITY_FIELDS_H */
@@ -0,0 +1,285 @@
+/*  ThreatGuard Agent - Distinct Counting
+ *  The top TG_HLL_PRECISION bits of a value's hash pick a register, which
+ *  keeps the longest run of leading zeros seen in the remaining bits. A
+ *  key's window is covered by two sketches of half a window each, the
+ *  current one and the one before it, so an estimate never counts values
+ *  older than the window; it is kept with the key and recomputed only when
+ *  a value raises the union of the two. Keys live in a preallocated slab
+ *  split into locked shards, found by an 8-slot bucket whose keys share
+ *  one cache line.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_hll.h"
+
+#include <pthread.h>
+
+#define TG_HLL_MAX_RANK         56  /* 2^-rank summed as 2^56-scaled integers */
+
+#define TG_DISTINCT_SHARD_BITS  4
+#define TG_DISTINCT_SHARDS      (1u << TG_DISTINCT_SHARD_BITS)
+#define TG_DISTINCT_WAYS        8
+
+/* TG_HLL_REGISTERS * ln(TG_HLL_REGISTERS / zeros), the linear counting
+ * estimate, for 1 to TG_HLL_REGISTERS empty registers */
+static const float tg_hll_linear[TG_HLL_REGISTERS] = {
+    621.06, 532.34, 480.44, 443.61, 415.05, 391.71, 371.98, 354.89,
+    339.82, 326.33, 314.13, 302.99, 292.75, 283.26, 274.43, 266.17,
+    258.41, 251.09, 244.17, 237.61, 231.36, 225.41, 219.72, 214.27,
+    209.04, 204.02, 199.19, 194.54, 190.05, 185.71, 181.51, 177.45,
+    173.51, 169.69, 165.98, 162.37, 158.86, 155.45, 152.12, 148.88,
+    145.72, 142.64, 139.63, 136.68, 133.81, 130.99, 128.24, 125.55,
+    122.91, 120.32, 117.79, 115.30, 112.86, 110.47, 108.12, 105.81,
+    103.55, 101.32, 99.14, 96.98, 94.87, 92.79, 90.74, 88.72,
+    86.74, 84.78, 82.86, 80.96, 79.09, 77.25, 75.44, 73.65,
+    71.88, 70.14, 68.42, 66.73, 65.05, 63.40, 61.77, 60.16,
+    58.57, 57.00, 55.45, 53.92, 52.40, 50.90, 49.42, 47.96,
+    46.51, 45.08, 43.67, 42.27, 40.89, 39.52, 38.16, 36.82,
+    35.50, 34.18, 32.88, 31.60, 30.32, 29.06, 27.81, 26.58,
+    25.35, 24.14, 22.94, 21.75, 20.57, 19.40, 18.24, 17.09,
+    15.95, 14.83, 13.71, 12.60, 11.50, 10.41, 9.33, 8.26,
+    7.20, 6.15, 5.10, 4.06, 3.04, 2.02, 1.00, 0.00,
+};
+
+int tg_hll_add(struct tg_hll *hll, uint64_t hash)
+{
+    uint32_t index = (uint32_t) (hash >> (64 - TG_HLL_PRECISION));
+    uint64_t rest = hash << TG_HLL_PRECISION;
+    uint8_t rank;
+
+    rank = rest ? (uint8_t) (__builtin_clzll(rest) + 1) : TG_HLL_MAX_RANK;
+    if (rank > TG_HLL_MAX_RANK) {
+        rank = TG_HLL_MAX_RANK;
+    }
+
+    if (rank <= hll->registers[index]) {
+        return 0;
+    }
+    hll->registers[index] = rank;
+    return 1;
+}
+
+uint32_t tg_hll_estimate(const struct tg_hll *a, const struct tg_hll *b)
+{
+    const double m = TG_HLL_REGISTERS;
+    const double alpha = 0.7213 / (1.0 + 1.079 / m);
+    uint64_t sum = 0;
+    uint32_t zeros = 0;
+    double estimate;
+
+    for (uint32_t i = 0; i < TG_HLL_REGISTERS; i++) {
+        uint8_t rank = a->registers[i];
+
+        if (b && b->registers[i] > rank) {
+            rank = b->registers[i];
+        }
+        zeros += rank == 0;
+        sum += 1ull << (TG_HLL_MAX_RANK - rank);
+    }
+
+    estimate = alpha * m * m * (double) (1ull << TG_HLL_MAX_RANK) / (double) sum;
+
+    /* Small cardinalities are counted by the empty registers */
+    if (estimate <= 2.5 * m && zeros > 0) {
+        estimate = tg_hll_linear[zeros - 1];
+    }
+    return estimate >= (double) UINT32_MAX ? UINT32_MAX : (uint32_t) (estimate + 0.5);
+}
+
+/* Sketches of one key */
+struct tg_distinct {
+    uint32_t last_seen;
+    uint32_t epoch;             /* half window of sketches[current] */
+    uint32_t estimate;          /* of the union of both sketches */
+    uint32_t current;
+    struct tg_hll sketches[2];
+};
+
+struct tg_distinct_shard {
+    pthread_mutex_t lock;
+    uint64_t *keys;             /* 0 = free slot */
+    struct tg_distinct *records;
+    uint32_t bucket_mask;
+    uint32_t count;
+    uint64_t evictions;
+};
+
+struct tg_distinct_table {
+    uint64_t *keys;             /* slabs the shards point into */
+    struct tg_distinct *records;
+    struct tg_distinct_shard shards[TG_DISTINCT_SHARDS];
+};
+
+struct tg_distinct_table *tg_distinct_table_create(uint32_t capacity)
+{
+    struct tg_distinct_table *table;
+    uint32_t buckets = 1;
+    size_t slots;
+
+    if (capacity == 0 || capacity > (1u << 26)) {
+        return NULL;
+    }
+
+    while ((uint64_t) buckets * TG_DISTINCT_WAYS * TG_DISTINCT_SHARDS < capacity) {
+        buckets *= 2;
+    }
+    slots = (size_t) buckets * TG_DISTINCT_WAYS;
+
+    table = flb_calloc(1, sizeof(struct tg_distinct_table));
+    if (!table) {
+        return NULL;
+    }
+
+    table->keys = flb_calloc(slots * TG_DISTINCT_SHARDS, sizeof(uint64_t));
+    table->records = flb_calloc(slots * TG_DISTINCT_SHARDS, sizeof(struct tg_distinct));
+    if (!table->keys || !table->records) {
+        flb_free(table->keys);
+        flb_free(table->records);
+        flb_free(table);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < TG_DISTINCT_SHARDS; i++) {
+        struct tg_distinct_shard *shard = &table->shards[i];
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->keys = table->keys + i * slots;
+        shard->records = table->records + i * slots;
+        shard->bucket_mask = buckets - 1;
+    }
+    return table;
+}
+
+/* Slot of key, taking a free slot or the one seen least recently if the
+ * key is new; sets *created then */
+static uint32_t tg_distinct_slot(struct tg_distinct_shard *shard, uint64_t key, int *created)
+{
+    uint32_t base = ((uint32_t) key & shard->bucket_mask) * TG_DISTINCT_WAYS;
+    uint32_t victim = base;
+
+    *created = 0;
+    for (uint32_t slot = base; slot < base + TG_DISTINCT_WAYS; slot++) {
+        if (shard->keys[slot] == key) {
+            return slot;
+        }
+    }
+
+    for (uint32_t slot = base; slot < base + TG_DISTINCT_WAYS; slot++) {
+        if (shard->keys[slot] == 0) {
+            victim = slot;
+            break;
+        }
+        if (shard->records[slot].last_seen < shard->records[victim].last_seen) {
+            victim = slot;
+        }
+    }
+
+    if (shard->keys[victim] == 0) {
+        shard->count++;
+    } else {
+        shard->evictions++;
+    }
+    shard->keys[victim] = key;
+    *created = 1;
+    return victim;
+}
+
+uint32_t tg_distinct_track(struct tg_distinct_table *table, uint64_t key, uint64_t hash,
+                           time_t now, uint32_t window)
+{
+    struct tg_distinct_shard *shard;
+    struct tg_distinct *record;
+    struct tg_hll *current;
+    struct tg_hll *previous;
+    uint32_t half;
+    uint32_t epoch;
+    uint32_t estimate;
+    int created;
+    int changed;
+
+    if (!table || key == 0) {
+        return 0;
+    }
+
+    half = window > 1 ? window / 2 : 1;
+    epoch = (uint32_t) now / half;
+    shard = &table->shards[key >> (64 - TG_DISTINCT_SHARD_BITS)];
+
+    pthread_mutex_lock(&shard->lock);
+
+    record = &shard->records[tg_distinct_slot(shard, key, &created)];
+    if (created) {
+        memset(record, 0, sizeof(*record));
+        record->epoch = epoch;
+    }
+
+    /* Move on to the half window of now; a clock stepping back stays in
+     * the current one */
+    changed = 0;
+    if ((int32_t) (epoch - record->epoch) > 0) {
+        if (epoch - record->epoch == 1) {
+            record->current ^= 1;
+        } else {
+            memset(&record->sketches[record->current ^ 1], 0, sizeof(struct tg_hll));
+        }
+        memset(&record->sketches[record->current], 0, sizeof(struct tg_hll));
+        record->epoch = epoch;
+        changed = 1;
+    }
+    record->last_seen = (uint32_t) now;
+
+    current = &record->sketches[record->current];
+    previous = &record->sketches[record->current ^ 1];
+    if (tg_hll_add(current, hash)) {
+        uint32_t index = (uint32_t) (hash >> (64 - TG_HLL_PRECISION));
+
+        changed |= current->registers[index] > previous->registers[index];
+    }
+    if (changed) {
+        record->estimate = tg_hll_estimate(current, previous);
+    }
+    estimate = record->estimate;
+
+    pthread_mutex_unlock(&shard->lock);
+    return estimate;
+}
+
+void tg_distinct_table_stats(struct tg_distinct_table *table, uint64_t *keys,
+                             uint64_t *evictions)
+{
+    uint64_t total_keys = 0;
+    uint64_t total_evictions = 0;
+
+    if (table) {
+        for (uint32_t i = 0; i < TG_DISTINCT_SHARDS; i++) {
+            struct tg_distinct_shard *shard = &table->shards[i];
+
+            pthread_mutex_lock(&shard->lock);
+            total_keys += shard->count;
+            total_evictions += shard->evictions;
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+
+    if (keys) {
+        *keys = total_keys;
+    }
+    if (evictions) {
+        *evictions = total_evictions;
+    }
+}
+
+void tg_distinct_table_destroy(struct tg_distinct_table *table)
+{
+    if (!table) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < TG_DISTINCT_SHARDS; i++) {
+        pthread_mutex_destroy(&table->shards[i].lock);
+    }
+    flb_free(table->keys);
+    flb_free(table->records);
+    flb_free(table);
+}
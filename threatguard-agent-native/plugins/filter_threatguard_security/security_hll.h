@@ -0,0 +1,47 @@
+/*  ThreatGuard Agent - Distinct Counting
+ *  HyperLogLog sketches of the distinct values seen per key, such as the
+ *  ports or user names one source touches, in a bounded key table
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_HLL_H
+#define TG_SECURITY_HLL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* A sketch of 2^TG_HLL_PRECISION one-byte registers counts any number of
+ * distinct values within about 9%, and small numbers closer than that */
+#define TG_HLL_PRECISION    7
+#define TG_HLL_REGISTERS    (1u << TG_HLL_PRECISION)
+
+struct tg_hll {
+    uint8_t registers[TG_HLL_REGISTERS];
+};
+
+/* Add the 64-bit hash of a value; returns 1 if the sketch changed */
+int tg_hll_add(struct tg_hll *hll, uint64_t hash);
+
+/* Distinct values added to a, or to a and b together if b is not NULL */
+uint32_t tg_hll_estimate(const struct tg_hll *a, const struct tg_hll *b);
+
+struct tg_distinct_table;
+
+/* A table keeps sketches for at most about capacity keys and is safe to
+ * share between threads; when a key's bucket is full the key seen least
+ * recently in it is evicted. */
+struct tg_distinct_table *tg_distinct_table_create(uint32_t capacity);
+
+/* Add the value hash to the sketch of key at now and return the distinct
+ * values of key within the last window seconds. Values older than half a
+ * window may already be forgotten; a key is always counted with the same
+ * window. */
+uint32_t tg_distinct_track(struct tg_distinct_table *table, uint64_t key, uint64_t hash,
+                           time_t now, uint32_t window);
+
+void tg_distinct_table_stats(struct tg_distinct_table *table, uint64_t *keys,
+                             uint64_t *evictions);
+void tg_distinct_table_destroy(struct tg_distinct_table *table);
+
+#endif /* TG_SECURITY_HLL_H */
@@ -0,0 +1,1206 @@
+/*  ThreatGuard Agent - Indicator Store
+ *  Indicators are hashed once and split into shards by the top bits of
+ *  the hash. Each shard is an open addressing table of hashes and offsets
+ *  into a string pool, fronted by a blocked Bloom filter: all probe bits of
+ *  an indicator fall into one 64-byte block, so the usual "not an
+ *  indicator" answer reads a single cache line after hashing, and a hit
+ *  costs one more for the table slot and one for the string compare. IP
+ *  indicators are network prefixes and live in a CIDR trie instead, and
+ *  domains, which match every name below them, in a domain suffix trie. A
+ *  URL that is not itself an indicator is checked by its host.
+ *
+ *  A store is not changed once it is shared. An update derives a new store
+ *  that shares every shard with the current one and copies a shard the
+ *  first time it changes it, so the cost of an update follows the shards
+ *  it touches rather than the size of the feed, and lookups in the current
+ *  store go on undisturbed until it is retired. The tries are sharded too:
+ *  IP prefixes by their top six bits and domains by their last two labels,
+ *  with the few shorter prefixes and single-label domains in one extra
+ *  shard that every lookup of the kind consults.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_ioc.h"
+#include "security_cidr.h"
+#include "security_domain.h"
+
+#include <ctype.h>
+
+#define TG_IOC_SHARD_BITS       6
+#define TG_IOC_SHARDS           (1 << TG_IOC_SHARD_BITS)
+#define TG_IOC_SHARED           TG_IOC_SHARDS   /* index of the extra shard */
+#define TG_IOC_MIN_SLOTS        64
+#define TG_IOC_NONE             UINT32_MAX
+
+/* Table slots per Bloom block: at the 3/8 to 3/4 table load kept by
+ * growing, this gives 21 to 43 filter bits per indicator */
+#define TG_IOC_BLOOM_SLOTS      32
+#define TG_IOC_BLOOM_WORDS      8
+#define TG_IOC_BLOOM_PROBES     6
+
+struct tg_ioc_entry {
+    uint32_t hash;              /* low bits of the indicator hash */
+    uint32_t off;               /* into pool */
+    uint32_t tag;
+    uint16_t len;               /* 0 = empty slot */
+    uint8_t kind;
+    uint8_t reserved;
+};
+
+struct tg_ioc_shard {
+    uint32_t refs;              /* stores holding the shard */
+    int dirty;                  /* tries changed since the last compile */
+
+    /* Hashed indicators */
+    uint32_t count;
+    uint32_t size;              /* table slots, power of two; 0 until needed */
+    struct tg_ioc_entry *table;
+    uint64_t *bloom;            /* size / TG_IOC_BLOOM_SLOTS blocks, 64-byte aligned */
+    void *bloom_mem;
+    char *pool;                 /* indicator strings, normalized */
+    uint32_t pool_len;
+    uint32_t pool_alloc;
+
+    /* Network prefixes and domains, NULL until needed */
+    struct tg_cidr_trie *ips;
+    struct tg_domain_trie *domains;
+};
+
+struct tg_ioc_store {
+    uint64_t id;                /* unique among stores, for verdict caches */
+    uint64_t generation;        /* of the last feed read */
+    struct tg_ioc_shard *shards[TG_IOC_SHARDS + 1];
+    uint8_t owned[TG_IOC_SHARDS + 1];   /* shard is private to this store */
+};
+
+/* Verdict cache: sets of TG_IOC_CACHE_WAYS entries, one cache line each,
+ * kept in LRU order. An entry is valid while its stamp equals the cache
+ * stamp, which moves on whenever the store changes. */
+#define TG_IOC_CACHE_WAYS       4
+
+struct tg_ioc_cache_entry {
+    uint64_t hash;              /* of kind and value; 0 = empty */
+    uint32_t tag;
+    uint16_t stamp;
+    uint8_t kind;
+    uint8_t found;
+};
+
+struct tg_ioc_cache {
+    uint64_t store_id;          /* store the entries were looked up in */
+    uint16_t stamp;
+    uint32_t set_mask;
+    struct tg_ioc_cache_entry *entries;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* Last store id handed out */
+static uint64_t tg_ioc_store_ids;
+
+static const char *tg_ioc_kind_names[TG_IOC_KINDS] = {
+    "ip", "domain", "url", "hash"
+};
+
+static inline uint8_t tg_ioc_fold(uint8_t c)
+{
+    return (uint8_t) (c - 'A') < 26 ? c + ('a' - 'A') : c;
+}
+
+static inline int tg_ioc_folds(int kind)
+{
+    return kind == TG_IOC_DOMAIN || kind == TG_IOC_HASH;
+}
+
+static int tg_ioc_is_hex(uint8_t c)
+{
+    c = tg_ioc_fold(c);
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+}
+
+static uint64_t tg_ioc_hash(int kind, const char *value, size_t len)
+{
+    uint64_t hash = 14695981039346656037ull ^ ((uint64_t) (kind + 1) * 0x9e3779b97f4a7c15ull);
+
+    if (tg_ioc_folds(kind)) {
+        for (size_t i = 0; i < len; i++) {
+            hash ^= tg_ioc_fold((uint8_t) value[i]);
+            hash *= 1099511628211ull;
+        }
+    } else {
+        for (size_t i = 0; i < len; i++) {
+            hash ^= (uint8_t) value[i];
+            hash *= 1099511628211ull;
+        }
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static inline int tg_ioc_shard_index(uint64_t hash)
+{
+    return (int) (hash >> (64 - TG_IOC_SHARD_BITS));
+}
+
+/* Shard of an IP prefix; prefixes shorter than the shard bits span shards */
+static inline int tg_ioc_ip_shard(const struct tg_cidr_addr *addr, int prefix_len)
+{
+    if (prefix_len < TG_IOC_SHARD_BITS) {
+        return TG_IOC_SHARED;
+    }
+    return (int) (addr->key[0] >> (64 - TG_IOC_SHARD_BITS));
+}
+
+/* Shard of a domain and of the names below it: by the last two labels */
+static int tg_ioc_domain_shard(const char *name, size_t len)
+{
+    const char *tail;
+    size_t tail_len;
+
+    switch (tg_domain_tail(name, len, 2, &tail, &tail_len)) {
+        case 0:
+            return -1;
+        case 1:
+            return TG_IOC_SHARED;
+        default:
+            return tg_ioc_shard_index(tg_ioc_hash(TG_IOC_DOMAIN, tail, tail_len));
+    }
+}
+
+/* Filter block of hash; the shard and table position use other bits */
+static inline uint64_t *tg_ioc_bloom_block(const struct tg_ioc_shard *shard, uint64_t hash)
+{
+    uint32_t blocks = shard->size / TG_IOC_BLOOM_SLOTS;
+
+    return shard->bloom + (size_t) ((hash >> 32) & (blocks - 1)) * TG_IOC_BLOOM_WORDS;
+}
+
+/* Probe bits within the block, 9 bits each */
+static inline uint64_t tg_ioc_bloom_bits(uint64_t hash)
+{
+    return (hash ^ (hash >> 29)) * 0x9e3779b97f4a7c15ull;
+}
+
+static void tg_ioc_bloom_set(struct tg_ioc_shard *shard, uint64_t hash)
+{
+    uint64_t *block = tg_ioc_bloom_block(shard, hash);
+    uint64_t bits = tg_ioc_bloom_bits(hash);
+
+    for (int i = 0; i < TG_IOC_BLOOM_PROBES; i++, bits >>= 9) {
+        block[(bits & 511) >> 6] |= 1ull << (bits & 63);
+    }
+}
+
+static inline int tg_ioc_bloom_test(const struct tg_ioc_shard *shard, uint64_t hash)
+{
+    const uint64_t *block = tg_ioc_bloom_block(shard, hash);
+    uint64_t bits = tg_ioc_bloom_bits(hash);
+
+    for (int i = 0; i < TG_IOC_BLOOM_PROBES; i++, bits >>= 9) {
+        if (!(block[(bits & 511) >> 6] & (1ull << (bits & 63)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int tg_ioc_equal(int kind, const char *stored, const char *value, size_t len)
+{
+    if (!tg_ioc_folds(kind)) {
+        return memcmp(stored, value, len) == 0;
+    }
+
+    /* Stored folded */
+    for (size_t i = 0; i < len; i++) {
+        if ((uint8_t) stored[i] != tg_ioc_fold((uint8_t) value[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Table slot holding the indicator, or TG_IOC_NONE */
+static uint32_t tg_ioc_find(const struct tg_ioc_shard *shard, int kind,
+                            uint64_t hash, const char *value, size_t len)
+{
+    uint32_t mask = shard->size - 1;
+    uint32_t pos = (uint32_t) hash & mask;
+
+    for (;;) {
+        const struct tg_ioc_entry *entry = &shard->table[pos];
+
+        if (entry->len == 0) {
+            return TG_IOC_NONE;
+        }
+        if (entry->hash == (uint32_t) hash && entry->kind == kind && entry->len == len &&
+            tg_ioc_equal(kind, shard->pool + entry->off, value, len)) {
+            return pos;
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+
+/* Allocate an empty table and filter of size slots */
+static int tg_ioc_shard_alloc(struct tg_ioc_shard *shard, uint32_t size)
+{
+    size_t bloom_size = (size_t) (size / TG_IOC_BLOOM_SLOTS) * TG_IOC_BLOOM_WORDS *
+                        sizeof(uint64_t);
+
+    shard->table = flb_calloc(size, sizeof(struct tg_ioc_entry));
+    shard->bloom_mem = flb_calloc(1, bloom_size + 64);
+    if (!shard->table || !shard->bloom_mem) {
+        flb_free(shard->table);
+        flb_free(shard->bloom_mem);
+        shard->table = NULL;
+        shard->bloom_mem = NULL;
+        return -1;
+    }
+
+    shard->bloom = (uint64_t *) (((uintptr_t) shard->bloom_mem + 63) & ~(uintptr_t) 63);
+    shard->size = size;
+    return 0;
+}
+
+/* Place an entry known to be absent; hash is its full hash */
+static void tg_ioc_shard_insert(struct tg_ioc_shard *shard, const struct tg_ioc_entry *entry,
+                                uint64_t hash)
+{
+    uint32_t mask = shard->size - 1;
+    uint32_t pos = (uint32_t) hash & mask;
+
+    while (shard->table[pos].len != 0) {
+        pos = (pos + 1) & mask;
+    }
+    shard->table[pos] = *entry;
+    tg_ioc_bloom_set(shard, hash);
+}
+
+/* Double the table and rebuild the filter to match; full hashes are
+ * recomputed from the stored strings */
+static int tg_ioc_shard_grow(struct tg_ioc_shard *shard)
+{
+    struct tg_ioc_entry *old_table = shard->table;
+    void *old_bloom = shard->bloom_mem;
+    uint32_t old_size = shard->size;
+
+    if (old_size > UINT32_MAX / 2 ||
+        tg_ioc_shard_alloc(shard, old_size * 2) != 0) {
+        shard->table = old_table;
+        shard->bloom_mem = old_bloom;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < old_size; i++) {
+        const struct tg_ioc_entry *entry = &old_table[i];
+
+        if (entry->len != 0) {
+            tg_ioc_shard_insert(shard, entry, tg_ioc_hash(entry->kind, shard->pool + entry->off,
+                                                          entry->len));
+        }
+    }
+
+    flb_free(old_table);
+    flb_free(old_bloom);
+    return 0;
+}
+
+static int tg_ioc_pool_append(struct tg_ioc_shard *shard, int kind,
+                              const char *value, size_t len, uint32_t *off)
+{
+    if ((uint64_t) shard->pool_len + len > UINT32_MAX) {
+        return -1;
+    }
+
+    if (shard->pool_len + len > shard->pool_alloc) {
+        uint64_t alloc = shard->pool_alloc ? shard->pool_alloc : 1024;
+        char *tmp;
+
+        while (alloc < (uint64_t) shard->pool_len + len) {
+            alloc *= 2;
+        }
+        if (alloc > UINT32_MAX) {
+            alloc = UINT32_MAX;
+        }
+
+        tmp = flb_realloc(shard->pool, alloc);
+        if (!tmp) {
+            return -1;
+        }
+        shard->pool = tmp;
+        shard->pool_alloc = (uint32_t) alloc;
+    }
+
+    *off = shard->pool_len;
+    if (tg_ioc_folds(kind)) {
+        for (size_t i = 0; i < len; i++) {
+            shard->pool[shard->pool_len + i] = (char) tg_ioc_fold((uint8_t) value[i]);
+        }
+    } else {
+        memcpy(shard->pool + shard->pool_len, value, len);
+    }
+    shard->pool_len += (uint32_t) len;
+    return 0;
+}
+
+/* Free the table slot pos. Entries further along the probe run move back
+ * into the hole when their home slot allows it, so lookups need no
+ * tombstones; the filter keeps the bits of removed entries until the shard
+ * is next copied. */
+static void tg_ioc_shard_delete(struct tg_ioc_shard *shard, uint32_t pos)
+{
+    uint32_t mask = shard->size - 1;
+    uint32_t hole = pos;
+    uint32_t next = (pos + 1) & mask;
+
+    while (shard->table[next].len != 0) {
+        uint32_t home = shard->table[next].hash & mask;
+
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            shard->table[hole] = shard->table[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+
+    memset(&shard->table[hole], 0, sizeof(struct tg_ioc_entry));
+    shard->count--;
+}
+
+static void tg_ioc_shard_destroy(struct tg_ioc_shard *shard)
+{
+    if (!shard) {
+        return;
+    }
+
+    flb_free(shard->table);
+    flb_free(shard->bloom_mem);
+    flb_free(shard->pool);
+    tg_cidr_trie_destroy(shard->ips);
+    tg_domain_trie_destroy(shard->domains);
+    flb_free(shard);
+}
+
+/* Private copy of a shard for an update. The hashed indicators are
+ * inserted afresh, which drops the strings and filter bits of removed
+ * ones. */
+static struct tg_ioc_shard *tg_ioc_shard_clone(const struct tg_ioc_shard *shard)
+{
+    struct tg_ioc_shard *copy;
+
+    copy = flb_calloc(1, sizeof(struct tg_ioc_shard));
+    if (!copy) {
+        return NULL;
+    }
+    copy->refs = 1;
+    copy->dirty = shard->dirty;
+
+    if (shard->size > 0 && tg_ioc_shard_alloc(copy, shard->size) != 0) {
+        flb_free(copy);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < shard->size; i++) {
+        struct tg_ioc_entry entry = shard->table[i];
+
+        if (entry.len == 0) {
+            continue;
+        }
+        if (tg_ioc_pool_append(copy, entry.kind, shard->pool + entry.off, entry.len,
+                               &entry.off) != 0) {
+            tg_ioc_shard_destroy(copy);
+            return NULL;
+        }
+        tg_ioc_shard_insert(copy, &entry, tg_ioc_hash(entry.kind, copy->pool + entry.off,
+                                                      entry.len));
+        copy->count++;
+    }
+
+    if ((shard->ips && !(copy->ips = tg_cidr_trie_clone(shard->ips))) ||
+        (shard->domains && !(copy->domains = tg_domain_trie_clone(shard->domains)))) {
+        tg_ioc_shard_destroy(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+static void tg_ioc_shard_release(struct tg_ioc_shard *shard)
+{
+    if (shard && __atomic_sub_fetch(&shard->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        tg_ioc_shard_destroy(shard);
+    }
+}
+
+/* Shard index of store ready to be changed: created, or copied if it is
+ * shared with another store */
+static struct tg_ioc_shard *tg_ioc_shard_writable(struct tg_ioc_store *store, int index)
+{
+    struct tg_ioc_shard *shard = store->shards[index];
+
+    if (shard && store->owned[index]) {
+        return shard;
+    }
+
+    if (shard) {
+        shard = tg_ioc_shard_clone(store->shards[index]);
+        if (!shard) {
+            return NULL;
+        }
+        tg_ioc_shard_release(store->shards[index]);
+    } else {
+        shard = flb_calloc(1, sizeof(struct tg_ioc_shard));
+        if (!shard) {
+            return NULL;
+        }
+        shard->refs = 1;
+    }
+
+    store->shards[index] = shard;
+    store->owned[index] = 1;
+    return shard;
+}
+
+/* Whether value is well formed for kind; the store does not interpret
+ * indicators beyond what lookups need */
+static int tg_ioc_valid(int kind, const char *value, size_t len)
+{
+    if (len == 0 || len > TG_IOC_MAX_VALUE) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = (uint8_t) value[i];
+
+        switch (kind) {
+            case TG_IOC_HASH:
+                if (!tg_ioc_is_hex(c)) {
+                    return 0;
+                }
+                break;
+            default:
+                if (c <= ' ' || c == 0x7f) {
+                    return 0;
+                }
+                break;
+        }
+    }
+
+    /* MD5, SHA-1, SHA-256 or SHA-512 */
+    if (kind == TG_IOC_HASH && len != 32 && len != 40 && len != 64 && len != 128) {
+        return 0;
+    }
+    return 1;
+}
+
+struct tg_ioc_store *tg_ioc_store_create(void)
+{
+    struct tg_ioc_store *store;
+
+    store = flb_calloc(1, sizeof(struct tg_ioc_store));
+    if (!store) {
+        return NULL;
+    }
+
+    store->id = __atomic_add_fetch(&tg_ioc_store_ids, 1, __ATOMIC_RELAXED);
+    return store;
+}
+
+/* New store sharing every shard with store; shards are copied as the new
+ * store changes them */
+struct tg_ioc_store *tg_ioc_store_derive(const struct tg_ioc_store *store)
+{
+    struct tg_ioc_store *derived;
+
+    if (!store) {
+        return NULL;
+    }
+
+    derived = flb_calloc(1, sizeof(struct tg_ioc_store));
+    if (!derived) {
+        return NULL;
+    }
+
+    derived->id = __atomic_add_fetch(&tg_ioc_store_ids, 1, __ATOMIC_RELAXED);
+    derived->generation = store->generation;
+    for (int i = 0; i <= TG_IOC_SHARDS; i++) {
+        if (store->shards[i]) {
+            __atomic_add_fetch(&store->shards[i]->refs, 1, __ATOMIC_RELAXED);
+            derived->shards[i] = store->shards[i];
+        }
+    }
+    return derived;
+}
+
+/* Whether [name, name + len) is lower case str in any case */
+static int tg_ioc_name_is(const char *name, size_t len, const char *str)
+{
+    if (strlen(str) != len) {
+        return 0;
+    }
+    return tg_ioc_equal(TG_IOC_HASH, str, name, len);
+}
+
+/* Indicator kind named by a feed type; the hash algorithms share a kind */
+int tg_ioc_kind_parse(const char *name, size_t len)
+{
+    static const char *hash_names[] = { "md5", "sha1", "sha256", "sha512", NULL };
+
+    for (int i = 0; i < TG_IOC_KINDS; i++) {
+        if (tg_ioc_name_is(name, len, tg_ioc_kind_names[i])) {
+            return i;
+        }
+    }
+    for (int i = 0; hash_names[i]; i++) {
+        if (tg_ioc_name_is(name, len, hash_names[i])) {
+            return TG_IOC_HASH;
+        }
+    }
+    return -1;
+}
+
+/* Add or remove an indicator */
+static int tg_ioc_store_change(struct tg_ioc_store *store, int kind, const char *value,
+                               size_t len, uint32_t tag, int remove)
+{
+    struct tg_ioc_shard *shard;
+    struct tg_ioc_entry entry;
+    struct tg_cidr_addr addr;
+    uint64_t hash;
+    uint32_t pos;
+    int prefix_len;
+    int index;
+    int ret;
+
+    if (!store || !value || kind < 0 || kind >= TG_IOC_KINDS) {
+        return TG_IOC_ERR_INVALID;
+    }
+
+    if (kind == TG_IOC_IP) {
+        if (tg_cidr_parse(value, len, &addr, &prefix_len) != 0) {
+            return TG_IOC_ERR_INVALID;
+        }
+        index = tg_ioc_ip_shard(&addr, prefix_len);
+
+        /* Only a shard that holds the prefix is copied to remove it */
+        if (remove && (!store->shards[index] || !store->shards[index]->ips ||
+                       !tg_cidr_trie_contains(store->shards[index]->ips, &addr,
+                                              prefix_len))) {
+            return 0;
+        }
+
+        shard = tg_ioc_shard_writable(store, index);
+        if (!shard || (!shard->ips && !(shard->ips = tg_cidr_trie_create()))) {
+            return TG_IOC_ERR_MEMORY;
+        }
+        shard->dirty = 1;
+
+        /* The prefix is valid, so the trie only fails to grow */
+        if (remove) {
+            ret = tg_cidr_trie_remove(shard->ips, &addr, prefix_len);
+        } else {
+            ret = tg_cidr_trie_add(shard->ips, &addr, prefix_len, tag);
+        }
+        return ret == 0 ? 0 : TG_IOC_ERR_MEMORY;
+    }
+
+    if (kind == TG_IOC_DOMAIN) {
+        index = tg_ioc_domain_shard(value, len);
+        if (index < 0) {
+            return TG_IOC_ERR_INVALID;
+        }
+        if (remove && (!store->shards[index] || !store->shards[index]->domains)) {
+            return 0;
+        }
+
+        shard = tg_ioc_shard_writable(store, index);
+        if (!shard || (!shard->domains && !(shard->domains = tg_domain_trie_create()))) {
+            return TG_IOC_ERR_MEMORY;
+        }
+        if (remove) {
+            return tg_domain_trie_remove(shard->domains, value, len);
+        }
+        ret = tg_domain_trie_add(shard->domains, value, len, tag);
+        if (ret == -2) {
+            return TG_IOC_ERR_MEMORY;
+        }
+        return ret == 0 ? 0 : TG_IOC_ERR_INVALID;
+    }
+
+    if (!tg_ioc_valid(kind, value, len)) {
+        return TG_IOC_ERR_INVALID;
+    }
+
+    hash = tg_ioc_hash(kind, value, len);
+    index = tg_ioc_shard_index(hash);
+
+    /* Only a shard that holds the indicator is copied to remove it */
+    shard = store->shards[index];
+    pos = shard && shard->count > 0 ? tg_ioc_find(shard, kind, hash, value, len) : TG_IOC_NONE;
+    if (remove && pos == TG_IOC_NONE) {
+        return 0;
+    }
+
+    shard = tg_ioc_shard_writable(store, index);
+    if (!shard) {
+        return TG_IOC_ERR_MEMORY;
+    }
+    if (pos != TG_IOC_NONE) {
+        /* A copy places entries afresh */
+        pos = tg_ioc_find(shard, kind, hash, value, len);
+        if (remove) {
+            tg_ioc_shard_delete(shard, pos);
+        } else {
+            shard->table[pos].tag = tag;
+        }
+        return 0;
+    }
+
+    if (shard->size == 0) {
+        if (tg_ioc_shard_alloc(shard, TG_IOC_MIN_SLOTS) != 0) {
+            return TG_IOC_ERR_MEMORY;
+        }
+    } else if ((uint64_t) (shard->count + 1) * 4 > (uint64_t) shard->size * 3 &&
+               tg_ioc_shard_grow(shard) != 0) {
+        /* Keep the load at or below 3/4 */
+        return TG_IOC_ERR_MEMORY;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.hash = (uint32_t) hash;
+    entry.tag = tag;
+    entry.len = (uint16_t) len;
+    entry.kind = (uint8_t) kind;
+    if (tg_ioc_pool_append(shard, kind, value, len, &entry.off) != 0) {
+        return TG_IOC_ERR_MEMORY;
+    }
+
+    tg_ioc_shard_insert(shard, &entry, hash);
+    shard->count++;
+    return 0;
+}
+
+int tg_ioc_store_add(struct tg_ioc_store *store, int kind, const char *value, size_t len,
+                     uint32_t tag)
+{
+    return tg_ioc_store_change(store, kind, value, len, tag, 0);
+}
+
+int tg_ioc_store_remove(struct tg_ioc_store *store, int kind, const char *value, size_t len)
+{
+    return tg_ioc_store_change(store, kind, value, len, 0, 1);
+}
+
+/* Prepare indicators changed since the last compile for lookups */
+int tg_ioc_store_compile(struct tg_ioc_store *store)
+{
+    if (!store) {
+        return -1;
+    }
+
+    for (int i = 0; i <= TG_IOC_SHARDS; i++) {
+        struct tg_ioc_shard *shard = store->shards[i];
+
+        /* Shards shared with another store were compiled there */
+        if (!shard || !store->owned[i] || !shard->dirty) {
+            continue;
+        }
+        if (shard->ips && tg_cidr_trie_compile(shard->ips) != 0) {
+            return -1;
+        }
+        shard->dirty = 0;
+    }
+    return 0;
+}
+
+uint64_t tg_ioc_store_generation(const struct tg_ioc_store *store)
+{
+    return store ? store->generation : 0;
+}
+
+/* Strip surrounding blanks of [*str, *str + *len) */
+static void tg_ioc_strip(const char **str, size_t *len)
+{
+    while (*len > 0 && isspace((unsigned char) (*str)[0])) {
+        (*str)++;
+        (*len)--;
+    }
+    while (*len > 0 && isspace((unsigned char) (*str)[*len - 1])) {
+        (*len)--;
+    }
+}
+
+/* Generation number of a "generation|N" line */
+static int tg_ioc_parse_generation(const char *value, size_t len, uint64_t *generation)
+{
+    uint64_t number = 0;
+
+    if (len == 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9' || number > (UINT64_MAX - 9) / 10) {
+            return -1;
+        }
+        number = number * 10 + (uint64_t) (value[i] - '0');
+    }
+
+    *generation = number;
+    return 0;
+}
+
+/* Read a feed or delta file into the store without compiling it. Each
+ * line is "kind|indicator" or "kind|indicator|tag" to add an indicator,
+ * prefixed with '+' (optional) or '-' to remove it; "generation|N" sets
+ * the generation of the store, and '#' starts a comment. Malformed lines
+ * are skipped, but an indicator that cannot be stored stops the read. */
+int tg_ioc_store_apply(struct tg_ioc_store *store, const char *filename)
+{
+    char line[TG_IOC_MAX_VALUE + 64];
+    int changed = 0;
+    int skipped = 0;
+    FILE *file;
+
+    if (!store || !filename) {
+        return TG_IOC_ERR_INVALID;
+    }
+
+    file = fopen(filename, "r");
+    if (!file) {
+        tg_log(TG_LOG_ERROR, "failed to open threat intel feed %s: %s", filename, strerror(errno));
+        return TG_IOC_ERR_INVALID;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        const char *kind_name = line;
+        const char *value;
+        size_t kind_len;
+        size_t value_len;
+        uint32_t tag = 0;
+        char *sep;
+        char *end;
+        int remove = 0;
+        int kind;
+        int ret;
+
+        /* Overlong line: skip the rest of it */
+        if (!strchr(line, '\n') && !feof(file)) {
+            int c;
+
+            while ((c = fgetc(file)) != EOF && c != '\n') {
+            }
+            skipped++;
+            continue;
+        }
+
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+
+        sep = strchr(line, '|');
+        if (!sep) {
+            skipped++;
+            continue;
+        }
+
+        kind_len = (size_t) (sep - line);
+        value = sep + 1;
+        sep = strchr(sep + 1, '|');
+        if (sep) {
+            value_len = (size_t) (sep - value);
+            tag = (uint32_t) strtoul(sep + 1, &end, 10);
+            if (end == sep + 1 || end[strspn(end, " \t\r\n")] != '\0') {
+                skipped++;
+                continue;
+            }
+        } else {
+            value_len = strlen(value);
+        }
+        tg_ioc_strip(&kind_name, &kind_len);
+        tg_ioc_strip(&value, &value_len);
+
+        if (kind_len > 0 && (kind_name[0] == '+' || kind_name[0] == '-')) {
+            remove = kind_name[0] == '-';
+            kind_name++;
+            kind_len--;
+        } else if (!sep && tg_ioc_name_is(kind_name, kind_len, "generation")) {
+            if (tg_ioc_parse_generation(value, value_len, &store->generation) != 0) {
+                skipped++;
+            }
+            continue;
+        }
+
+        kind = tg_ioc_kind_parse(kind_name, kind_len);
+        if (kind < 0) {
+            skipped++;
+            continue;
+        }
+
+        if (remove) {
+            ret = tg_ioc_store_remove(store, kind, value, value_len);
+        } else {
+            ret = tg_ioc_store_add(store, kind, value, value_len, tag);
+        }
+        if (ret == TG_IOC_ERR_MEMORY) {
+            /* Skipping it would lose the indicator for good */
+            tg_log(TG_LOG_ERROR, "failed to store indicator from threat intel feed %s",
+                   filename);
+            fclose(file);
+            return TG_IOC_ERR_MEMORY;
+        }
+        if (ret != 0) {
+            skipped++;
+        } else {
+            changed++;
+        }
+    }
+
+    fclose(file);
+
+    if (skipped > 0) {
+        tg_log(TG_LOG_WARN, "skipped %d invalid lines in threat intel feed %s", skipped, filename);
+    }
+    return changed;
+}
+
+/* Read a feed file and compile the store */
+int tg_ioc_store_load(struct tg_ioc_store *store, const char *filename)
+{
+    int loaded;
+
+    loaded = tg_ioc_store_apply(store, filename);
+    if (loaded < 0 || tg_ioc_store_compile(store) != 0) {
+        return -1;
+    }
+
+    tg_log(TG_LOG_INFO, "loaded %d indicators from %s", loaded, filename);
+    return loaded;
+}
+
+/* Generation of a feed file, given on a "generation|N" line ahead of any
+ * indicator. Returns 0, or -1 if the file has none. */
+int tg_ioc_feed_generation(const char *filename, uint64_t *generation)
+{
+    char line[TG_IOC_MAX_VALUE + 64];
+    int ret = -1;
+    FILE *file;
+
+    if (!filename || !generation) {
+        return -1;
+    }
+
+    file = fopen(filename, "r");
+    if (!file) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        const char *value;
+        const char *name = line;
+        size_t name_len;
+        size_t value_len;
+        char *sep;
+
+        if (!strchr(line, '\n') && !feof(file)) {
+            break;
+        }
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+
+        sep = strchr(line, '|');
+        if (sep) {
+            name_len = (size_t) (sep - line);
+            value = sep + 1;
+            value_len = strlen(value);
+            tg_ioc_strip(&name, &name_len);
+            tg_ioc_strip(&value, &value_len);
+            if (tg_ioc_name_is(name, name_len, "generation") &&
+                tg_ioc_parse_generation(value, value_len, generation) == 0) {
+                ret = 0;
+            }
+        }
+        break;
+    }
+
+    fclose(file);
+    return ret;
+}
+
+/* Exact match among the hashed indicators */
+static int tg_ioc_hashed_lookup(const struct tg_ioc_store *store, int kind,
+                                const char *value, size_t len, uint32_t *tag)
+{
+    const struct tg_ioc_shard *shard;
+    uint64_t hash;
+    uint32_t pos;
+
+    if (len == 0 || len > TG_IOC_MAX_VALUE) {
+        return 0;
+    }
+
+    hash = tg_ioc_hash(kind, value, len);
+    shard = store->shards[tg_ioc_shard_index(hash)];
+    if (!shard || shard->count == 0 || !tg_ioc_bloom_test(shard, hash)) {
+        return 0;
+    }
+
+    pos = tg_ioc_find(shard, kind, hash, value, len);
+    if (pos == TG_IOC_NONE) {
+        return 0;
+    }
+    if (tag) {
+        *tag = shard->table[pos].tag;
+    }
+    return 1;
+}
+
+/* Most specific prefix holding addr: prefixes in its shard are longer than
+ * the shared ones */
+static int tg_ioc_ip_lookup(const struct tg_ioc_store *store, const struct tg_cidr_addr *addr,
+                            uint32_t *tag)
+{
+    const struct tg_ioc_shard *shard = store->shards[tg_ioc_ip_shard(addr, TG_IOC_SHARD_BITS)];
+    const struct tg_ioc_shard *shared = store->shards[TG_IOC_SHARED];
+
+    if (shard && shard->ips && tg_cidr_trie_lookup(shard->ips, addr, tag) >= 0) {
+        return 1;
+    }
+    return shared && shared->ips && tg_cidr_trie_lookup(shared->ips, addr, tag) >= 0;
+}
+
+/* Most specific domain name lies below: entries in its shard have more
+ * labels than the shared ones */
+static int tg_ioc_domain_lookup(const struct tg_ioc_store *store, const char *name,
+                                size_t len, uint32_t *tag)
+{
+    const struct tg_ioc_shard *shared = store->shards[TG_IOC_SHARED];
+    const struct tg_ioc_shard *shard;
+    int index;
+
+    index = tg_ioc_domain_shard(name, len);
+    if (index < 0) {
+        return 0;
+    }
+
+    shard = store->shards[index];
+    if (index != TG_IOC_SHARED && shard && shard->domains &&
+        tg_domain_trie_lookup(shard->domains, name, len, tag) > 0) {
+        return 1;
+    }
+    return shared && shared->domains && tg_domain_trie_lookup(shared->domains, name, len, tag) > 0;
+}
+
+int tg_ioc_store_lookup(const struct tg_ioc_store *store, int kind,
+                        const char *value, size_t len, uint32_t *tag)
+{
+    struct tg_cidr_addr addr;
+    const char *host;
+    size_t host_len;
+    int prefix_len;
+
+    if (!store || !value || kind < 0 || kind >= TG_IOC_KINDS) {
+        return 0;
+    }
+
+    switch (kind) {
+        case TG_IOC_IP:
+            /* An address, matched against the prefixes containing it */
+            if (memchr(value, '/', len) ||
+                tg_cidr_parse(value, len, &addr, &prefix_len) != 0) {
+                return 0;
+            }
+            return tg_ioc_ip_lookup(store, &addr, tag);
+        case TG_IOC_DOMAIN:
+            return tg_ioc_domain_lookup(store, value, len, tag);
+        case TG_IOC_URL:
+            if (tg_ioc_hashed_lookup(store, kind, value, len, tag)) {
+                return 1;
+            }
+
+            /* Then by host, which is an address or a domain name */
+            if (tg_domain_url_host(value, len, &host, &host_len) != 0) {
+                return 0;
+            }
+            if (tg_cidr_parse(host, host_len, &addr, &prefix_len) == 0) {
+                return tg_ioc_ip_lookup(store, &addr, tag);
+            }
+            return tg_ioc_domain_lookup(store, host, host_len, tag);
+        default:
+            return tg_ioc_hashed_lookup(store, kind, value, len, tag);
+    }
+}
+
+/* Indicators as of the last compile */
+uint64_t tg_ioc_store_count(const struct tg_ioc_store *store)
+{
+    uint64_t count = 0;
+
+    if (!store) {
+        return 0;
+    }
+
+    for (int i = 0; i <= TG_IOC_SHARDS; i++) {
+        const struct tg_ioc_shard *shard = store->shards[i];
+
+        if (shard) {
+            count += shard->count + tg_cidr_trie_count(shard->ips) +
+                     tg_domain_trie_count(shard->domains);
+        }
+    }
+    return count;
+}
+
+/* Bytes held by the store's tables, filters and strings, including the
+ * shards it shares with other stores */
+size_t tg_ioc_store_memory(const struct tg_ioc_store *store)
+{
+    size_t total;
+
+    if (!store) {
+        return 0;
+    }
+
+    total = sizeof(*store);
+    for (int i = 0; i <= TG_IOC_SHARDS; i++) {
+        const struct tg_ioc_shard *shard = store->shards[i];
+
+        if (!shard) {
+            continue;
+        }
+        total += sizeof(*shard) + shard->pool_alloc +
+                 (size_t) shard->size * sizeof(struct tg_ioc_entry) +
+                 (size_t) (shard->size / TG_IOC_BLOOM_SLOTS) * TG_IOC_BLOOM_WORDS *
+                 sizeof(uint64_t) +
+                 tg_cidr_trie_memory(shard->ips) + tg_domain_trie_memory(shard->domains);
+    }
+    return total;
+}
+
+/* Free the store and every shard no other store holds */
+void tg_ioc_store_destroy(struct tg_ioc_store *store)
+{
+    if (!store) {
+        return;
+    }
+
+    for (int i = 0; i <= TG_IOC_SHARDS; i++) {
+        tg_ioc_shard_release(store->shards[i]);
+    }
+    flb_free(store);
+}
+
+/* Cache of about entries verdicts, rounded up to whole sets */
+struct tg_ioc_cache *tg_ioc_cache_create(uint32_t entries)
+{
+    struct tg_ioc_cache *cache;
+    uint32_t sets = 1;
+
+    if (entries == 0 || entries > (1u << 30)) {
+        return NULL;
+    }
+
+    while ((uint64_t) sets * TG_IOC_CACHE_WAYS < entries) {
+        sets *= 2;
+    }
+
+    cache = flb_calloc(1, sizeof(struct tg_ioc_cache));
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->entries = flb_calloc((size_t) sets * TG_IOC_CACHE_WAYS,
+                                sizeof(struct tg_ioc_cache_entry));
+    if (!cache->entries) {
+        flb_free(cache);
+        return NULL;
+    }
+
+    cache->set_mask = sets - 1;
+    cache->stamp = 1;
+    return cache;
+}
+
+/* Forget every verdict */
+static void tg_ioc_cache_invalidate(struct tg_ioc_cache *cache)
+{
+    /* Entries from a stamp about to come round again are cleared */
+    if (++cache->stamp == 0) {
+        memset(cache->entries, 0, ((size_t) cache->set_mask + 1) * TG_IOC_CACHE_WAYS *
+                                  sizeof(struct tg_ioc_cache_entry));
+        cache->stamp = 1;
+    }
+}
+
+/* tg_ioc_store_lookup through the cache. Entries are matched by a 64-bit
+ * hash of kind and value, so two values could in principle share one;
+ * with a few thousand entries live the odds are negligible. */
+int tg_ioc_cache_lookup(struct tg_ioc_cache *cache, const struct tg_ioc_store *store, int kind,
+                        const char *value, size_t len, uint32_t *tag)
+{
+    struct tg_ioc_cache_entry *set;
+    struct tg_ioc_cache_entry entry;
+    uint64_t hash;
+    int way;
+
+    if (!cache || !store || !value || kind < 0 || kind >= TG_IOC_KINDS) {
+        return tg_ioc_store_lookup(store, kind, value, len, tag);
+    }
+
+    if (cache->store_id != store->id) {
+        tg_ioc_cache_invalidate(cache);
+        cache->store_id = store->id;
+    }
+
+    hash = tg_ioc_hash(kind, value, len) | 1;
+    set = &cache->entries[(size_t) ((hash >> 32) & cache->set_mask) * TG_IOC_CACHE_WAYS];
+
+    for (way = 0; way < TG_IOC_CACHE_WAYS; way++) {
+        if (set[way].hash == hash && set[way].kind == kind && set[way].stamp == cache->stamp) {
+            break;
+        }
+    }
+
+    if (way < TG_IOC_CACHE_WAYS) {
+        cache->hits++;
+        entry = set[way];
+    } else {
+        cache->misses++;
+        entry.hash = hash;
+        entry.tag = 0;
+        entry.stamp = cache->stamp;
+        entry.kind = (uint8_t) kind;
+        entry.found = (uint8_t) tg_ioc_store_lookup(store, kind, value, len, &entry.tag);
+        way = TG_IOC_CACHE_WAYS - 1;
+    }
+
+    /* Most recent first; a new entry pushes out the least recent */
+    memmove(&set[1], &set[0], (size_t) way * sizeof(struct tg_ioc_cache_entry));
+    set[0] = entry;
+
+    if (entry.found && tag) {
+        *tag = entry.tag;
+    }
+    return entry.found;
+}
+
+void tg_ioc_cache_stats(const struct tg_ioc_cache *cache, uint64_t *hits, uint64_t *misses)
+{
+    *hits = cache ? cache->hits : 0;
+    *misses = cache ? cache->misses : 0;
+}
+
+void tg_ioc_cache_destroy(struct tg_ioc_cache *cache)
+{
+    if (!cache) {
+        return;
+    }
+
+    flb_free(cache->entries);
+    flb_free(cache);
+}
@@ -0,0 +1,81 @@
+/*  ThreatGuard Agent - Indicator Store
+ *  Exact-match sets of threat intelligence indicators behind a blocked
+ *  Bloom filter, a CIDR trie of IP prefixes and a domain suffix trie,
+ *  sized for millions of entries
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_IOC_H
+#define TG_SECURITY_IOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Indicator kinds; domains and file hashes compare case-insensitively,
+ * IP indicators are addresses or CIDR prefixes, and a domain also matches
+ * every name below it */
+#define TG_IOC_IP           0
+#define TG_IOC_DOMAIN       1
+#define TG_IOC_URL          2
+#define TG_IOC_HASH         3
+#define TG_IOC_KINDS        4
+
+#define TG_IOC_MAX_VALUE    2048
+
+/* Errors of add, remove and apply */
+#define TG_IOC_ERR_INVALID  (-1)
+#define TG_IOC_ERR_MEMORY   (-2)
+
+struct tg_ioc_store;
+
+/* Build phase: a store is filled by one thread and compiled before it is
+ * shared, and not changed afterwards. Each indicator carries a tag from
+ * the feed; adding an indicator again replaces its tag, and removing an
+ * absent one is not an error. add and remove return TG_IOC_ERR_INVALID if
+ * value is not a valid indicator of kind, or TG_IOC_ERR_MEMORY if it cannot
+ * be stored. apply reads a feed or delta file of "[+|-]kind|indicator[|tag]"
+ * and "generation|N" lines, skipping malformed ones, and returns the number
+ * of changes, TG_IOC_ERR_INVALID if the file cannot be read, or
+ * TG_IOC_ERR_MEMORY if an indicator cannot be stored; the store is then
+ * partly changed and must be discarded. load then compiles the store. */
+struct tg_ioc_store *tg_ioc_store_create(void);
+int tg_ioc_kind_parse(const char *name, size_t len);
+int tg_ioc_store_add(struct tg_ioc_store *store, int kind, const char *value, size_t len,
+                     uint32_t tag);
+int tg_ioc_store_remove(struct tg_ioc_store *store, int kind, const char *value, size_t len);
+int tg_ioc_store_compile(struct tg_ioc_store *store);
+int tg_ioc_store_apply(struct tg_ioc_store *store, const char *filename);
+int tg_ioc_store_load(struct tg_ioc_store *store, const char *filename);
+int tg_ioc_feed_generation(const char *filename, uint64_t *generation);
+
+/* Updates: derive returns a new store in the build phase that shares the
+ * shards of a compiled store and copies those it changes, so the original
+ * can stay in use until the new one is compiled and replaces it. Either
+ * store may be destroyed first. */
+struct tg_ioc_store *tg_ioc_store_derive(const struct tg_ioc_store *store);
+uint64_t tg_ioc_store_generation(const struct tg_ioc_store *store);
+
+/* Lookup phase: read-only and allocation free, safe to share between
+ * threads. Returns 1 if value is a known indicator of kind and sets tag
+ * if not NULL; an IP address or domain matches the most specific entry
+ * holding it, and a URL matches itself or else its host. */
+int tg_ioc_store_lookup(const struct tg_ioc_store *store, int kind,
+                        const char *value, size_t len, uint32_t *tag);
+
+/* Verdict cache for one thread: remembers recent lookups, found or not,
+ * of about entries values and answers them without the store. Its
+ * verdicts are dropped when it is used with a different store, such as
+ * one that replaced the store after a feed update. */
+struct tg_ioc_cache;
+
+struct tg_ioc_cache *tg_ioc_cache_create(uint32_t entries);
+int tg_ioc_cache_lookup(struct tg_ioc_cache *cache, const struct tg_ioc_store *store, int kind,
+                        const char *value, size_t len, uint32_t *tag);
+void tg_ioc_cache_stats(const struct tg_ioc_cache *cache, uint64_t *hits, uint64_t *misses);
+void tg_ioc_cache_destroy(struct tg_ioc_cache *cache);
+
+uint64_t tg_ioc_store_count(const struct tg_ioc_store *store);
+size_t tg_ioc_store_memory(const struct tg_ioc_store *store);
+void tg_ioc_store_destroy(struct tg_ioc_store *store);
+
+#endif /* TG_SECURITY_IOC_H */
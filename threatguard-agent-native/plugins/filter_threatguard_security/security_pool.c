@@ -0,0 +1,172 @@
+/*  ThreatGuard Agent - Evaluation Worker Pool
+ *  One job is posted at a time. Every thread of the pool takes part in
+ *  each job, taking task numbers from a shared counter until none is
+ *  left, and the submitter waits until all of them have left the job, so
+ *  no thread can still be reading a job once its submitter returns.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_pool.h"
+
+#include <pthread.h>
+
+struct tg_pool {
+    pthread_mutex_t run_lock;   /* held by the submitter of the running job */
+    pthread_mutex_t lock;
+    pthread_cond_t start;       /* a job was posted, or the pool stops */
+    pthread_cond_t done;        /* the last thread left the job */
+    int stop;
+    uint64_t job;               /* number of the last job posted */
+    int busy;                   /* threads not done with the job yet */
+
+    /* The current job */
+    tg_pool_task_cb task;
+    void *data;
+    uint32_t tasks;
+    uint32_t next;              /* next task number to take */
+
+    int thread_count;
+    pthread_t threads[TG_POOL_MAX_THREADS];
+};
+
+/* Run tasks of the current job until none is left */
+static void tg_pool_work(struct tg_pool *pool)
+{
+    uint32_t task;
+
+    while ((task = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->tasks) {
+        pool->task(pool->data, task);
+    }
+}
+
+static void *tg_pool_thread(void *arg)
+{
+    struct tg_pool *pool = arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stop && pool->job == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        seen = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+
+        tg_pool_work(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+struct tg_pool *tg_pool_create(int threads)
+{
+    struct tg_pool *pool;
+
+    if (threads <= 0 || threads > TG_POOL_MAX_THREADS) {
+        return NULL;
+    }
+
+    pool = flb_calloc(1, sizeof(struct tg_pool));
+    if (!pool) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&pool->run_lock, NULL) != 0) {
+        flb_free(pool);
+        return NULL;
+    }
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        pthread_mutex_destroy(&pool->run_lock);
+        flb_free(pool);
+        return NULL;
+    }
+    if (pthread_cond_init(&pool->start, NULL) != 0) {
+        pthread_mutex_destroy(&pool->lock);
+        pthread_mutex_destroy(&pool->run_lock);
+        flb_free(pool);
+        return NULL;
+    }
+    if (pthread_cond_init(&pool->done, NULL) != 0) {
+        pthread_cond_destroy(&pool->start);
+        pthread_mutex_destroy(&pool->lock);
+        pthread_mutex_destroy(&pool->run_lock);
+        flb_free(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, tg_pool_thread, pool) != 0) {
+            tg_log(TG_LOG_ERROR, "failed to start evaluation thread %d of %d", i + 1, threads);
+            tg_pool_destroy(pool);
+            return NULL;
+        }
+        pool->thread_count++;
+    }
+
+    return pool;
+}
+
+int tg_pool_width(const struct tg_pool *pool)
+{
+    return pool ? pool->thread_count + 1 : 1;
+}
+
+int tg_pool_run(struct tg_pool *pool, tg_pool_task_cb task, void *data, uint32_t tasks)
+{
+    if (!pool || !task || pthread_mutex_trylock(&pool->run_lock) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->data = data;
+    pool->tasks = tasks;
+    pool->next = 0;
+    pool->busy = pool->thread_count;
+    pool->job++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    tg_pool_work(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_unlock(&pool->run_lock);
+    return 0;
+}
+
+void tg_pool_destroy(struct tg_pool *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->run_lock);
+    flb_free(pool);
+}
@@ -0,0 +1,34 @@
+/*  ThreatGuard Agent - Evaluation Worker Pool
+ *  Fixed set of threads that run the tasks of one job at a time together
+ *  with the thread that submitted it
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_POOL_H
+#define TG_SECURITY_POOL_H
+
+#include <stdint.h>
+
+#define TG_POOL_MAX_THREADS 64
+
+struct tg_pool;
+
+/* Run task number task of a job; tasks of a job run in any order and on
+ * any thread, at the same time */
+typedef void (*tg_pool_task_cb)(void *data, uint32_t task);
+
+/* Start threads threads, at most TG_POOL_MAX_THREADS; NULL on failure */
+struct tg_pool *tg_pool_create(int threads);
+
+/* Threads of the pool, plus one for the submitting thread */
+int tg_pool_width(const struct tg_pool *pool);
+
+/* Run tasks tasks of task and return once all have run; the calling
+ * thread runs tasks too. Returns -1 without running any if another job
+ * is running, so callers can do the work themselves instead of waiting. */
+int tg_pool_run(struct tg_pool *pool, tg_pool_task_cb task, void *data, uint32_t tasks);
+
+/* Stop the threads once the running job, if any, is done */
+void tg_pool_destroy(struct tg_pool *pool);
+
+#endif /* TG_SECURITY_POOL_H */
@@ -0,0 +1,1597 @@
+/*  ThreatGuard Agent - Regex Set Matcher
+ *  Patterns are parsed into a small syntax tree, compiled into one shared
+ *  Thompson NFA program and executed through a DFA whose states are built
+ *  on demand. Each input byte costs one table lookup once its transition
+ *  is cached; building a new state costs O(program size). When the cache
+ *  exceeds its budget it is flushed and rebuilt from the current state, so
+ *  memory stays bounded and matching stays linear in the input length.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_regex.h"
+
+#include <ctype.h>
+
+/* Program instructions */
+#define TG_REGEX_OP_CLASS    0   /* consume a byte in classes[x] */
+#define TG_REGEX_OP_SPLIT    1   /* continue at x and y */
+#define TG_REGEX_OP_JMP      2   /* continue at x */
+#define TG_REGEX_OP_EOT      3   /* succeed only at end of text */
+#define TG_REGEX_OP_MATCH    4   /* pattern x matched */
+
+/* Syntax tree nodes */
+#define TG_REGEX_NODE_CLASS  0
+#define TG_REGEX_NODE_CAT    1
+#define TG_REGEX_NODE_ALT    2
+#define TG_REGEX_NODE_REPEAT 3
+#define TG_REGEX_NODE_EMPTY  4
+#define TG_REGEX_NODE_EOL    5
+
+#define TG_REGEX_MAX_NODES       1024
+#define TG_REGEX_MAX_REPEAT      100
+#define TG_REGEX_MAX_DEPTH       64
+#define TG_REGEX_MAX_INSTS       (1u << 24)
+
+/* A flush after fewer than this many bytes per cached state means the
+ * input keeps producing new states; matching then falls back to direct
+ * NFA simulation for a while instead of rebuilding states it will discard */
+#define TG_REGEX_THRASH_BYTES_PER_STATE  10
+#define TG_REGEX_NFA_BACKOFF_SCANS       256
+
+#define TG_REGEX_STATE_UNKNOWN   UINT32_MAX
+#define TG_REGEX_STATE_ERROR     (UINT32_MAX - 1)
+
+struct tg_regex_inst {
+    uint8_t op;
+    uint32_t x;
+    uint32_t y;
+};
+
+struct tg_regex_set {
+    int compiled;
+    int mapped;                 /* program borrowed from an image */
+
+    /* Shared program */
+    struct tg_regex_inst *insts;
+    uint32_t inst_count;
+    uint32_t inst_alloc;
+
+    /* 256-bit byte sets referenced by CLASS instructions */
+    uint8_t (*classes)[32];
+    uint32_t class_count;
+    uint32_t class_alloc;
+
+    /* Entry point of each pattern */
+    uint32_t *starts;
+    uint8_t *anchored;
+    uint32_t pattern_count;
+    uint32_t pattern_alloc;
+
+    /* Byte equivalence classes, filled by tg_regex_set_compile() */
+    uint16_t byte_class[256];
+    uint8_t symbol_byte[257];   /* representative byte of each symbol */
+    uint32_t symbol_count;      /* byte classes plus the end-of-text symbol */
+};
+
+/* Serialized program; instructions, classes, starts and anchored flags
+ * follow in this order, each starting on an 8-byte boundary */
+struct tg_regex_image {
+    uint32_t inst_count;
+    uint32_t class_count;
+    uint32_t pattern_count;
+    uint32_t symbol_count;
+    uint16_t byte_class[256];
+    uint8_t symbol_byte[257];
+};
+
+struct tg_regex_node {
+    int type;
+    int left;
+    int right;
+    uint32_t cls;
+    int min;
+    int max;                    /* -1 = unbounded */
+};
+
+struct tg_regex_parser {
+    struct tg_regex_set *set;
+    const char *pattern;
+    size_t pos;
+    size_t len;
+    int depth;
+    struct tg_regex_node nodes[TG_REGEX_MAX_NODES];
+    int node_count;
+    char *error;
+    size_t error_size;
+};
+
+struct tg_regex_dfa_state {
+    uint32_t leaf_start;        /* sorted program positions in leaves[] */
+    uint32_t leaf_count;
+    uint32_t match_start;       /* pattern ids in matches[] */
+    uint32_t match_count;
+    uint32_t hash;
+};
+
+struct tg_regex_dfa {
+    const struct tg_regex_set *set;
+    uint32_t symbols;
+
+    /* State cache */
+    struct tg_regex_dfa_state *states;
+    uint32_t state_count;
+    uint32_t state_alloc;
+    uint32_t *trans;            /* state_count x symbols, TG_REGEX_STATE_UNKNOWN if unbuilt */
+    uint32_t trans_rows;
+    uint32_t *leaves;
+    uint32_t leaf_count;
+    uint32_t leaf_alloc;
+    uint32_t *matches;
+    uint32_t match_count;
+    uint32_t match_alloc;
+    uint32_t *table;            /* open addressing, state index + 1, 0 = empty */
+    uint32_t table_size;
+    uint32_t start_state;
+
+    size_t cache_size;
+    size_t cache_used;
+
+    /* Closure scratch space */
+    uint32_t *mark;
+    uint32_t mark_gen;
+    uint32_t *stack;
+    uint32_t *scratch;
+    uint32_t scratch_count;
+
+    /* Unanchored entry points are live at every position. Their CLASS
+     * leaves stay implicit in state leaf sets and are indexed by the
+     * symbols they accept; only their other leaves are re-seeded. */
+    uint8_t *implicit;          /* per instruction */
+    uint32_t implicit_count;
+    uint32_t *restart_off;      /* symbols + 1 offsets into restart_next[] */
+    uint32_t *restart_next;
+    uint32_t *restart;
+    uint32_t restart_count;
+
+    /* NFA fallback */
+    uint32_t *nfa_leaves;
+    uint32_t nfa_backoff;
+    uint64_t bytes_scanned;
+    uint64_t flush_mark;        /* bytes_scanned at the last flush */
+
+    uint64_t states_built;
+    uint64_t cache_flushes;
+    uint64_t nfa_scans;
+};
+
+/*
+ * Program construction
+ */
+
+static int tg_regex_grow(void **ptr, uint32_t *alloc, uint32_t needed, size_t elem_size)
+{
+    uint32_t new_alloc;
+    void *tmp;
+
+    if (needed <= *alloc) {
+        return 0;
+    }
+
+    new_alloc = *alloc ? *alloc * 2 : 64;
+    while (new_alloc < needed) {
+        new_alloc *= 2;
+    }
+
+    tmp = flb_realloc(*ptr, (size_t) new_alloc * elem_size);
+    if (!tmp) {
+        return -1;
+    }
+
+    *ptr = tmp;
+    *alloc = new_alloc;
+    return 0;
+}
+
+static int tg_regex_emit(struct tg_regex_set *set, uint8_t op, uint32_t x, uint32_t y)
+{
+    if (set->inst_count >= TG_REGEX_MAX_INSTS ||
+        tg_regex_grow((void **) &set->insts, &set->inst_alloc, set->inst_count + 1,
+                      sizeof(struct tg_regex_inst)) != 0) {
+        return -1;
+    }
+
+    set->insts[set->inst_count].op = op;
+    set->insts[set->inst_count].x = x;
+    set->insts[set->inst_count].y = y;
+    return (int) set->inst_count++;
+}
+
+static int tg_regex_new_class(struct tg_regex_set *set, uint32_t *cls)
+{
+    if (tg_regex_grow((void **) &set->classes, &set->class_alloc, set->class_count + 1,
+                      sizeof(set->classes[0])) != 0) {
+        return -1;
+    }
+
+    memset(set->classes[set->class_count], 0, sizeof(set->classes[0]));
+    *cls = set->class_count++;
+    return 0;
+}
+
+static inline void tg_regex_class_set(uint8_t *bits, int byte)
+{
+    bits[byte >> 3] |= (uint8_t) (1u << (byte & 7));
+}
+
+static inline int tg_regex_class_has(const uint8_t *bits, int byte)
+{
+    return (bits[byte >> 3] >> (byte & 7)) & 1;
+}
+
+/*
+ * Parser
+ */
+
+static int tg_regex_fail(struct tg_regex_parser *p, const char *msg)
+{
+    if (p->error && p->error_size > 0) {
+        snprintf(p->error, p->error_size, "%s at offset %zu", msg, p->pos);
+    }
+    return -1;
+}
+
+static int tg_regex_node(struct tg_regex_parser *p, int type, int left, int right)
+{
+    struct tg_regex_node *node;
+
+    if (p->node_count >= TG_REGEX_MAX_NODES) {
+        return tg_regex_fail(p, "pattern too complex");
+    }
+
+    node = &p->nodes[p->node_count];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return p->node_count++;
+}
+
+static void tg_regex_class_add_range(uint8_t *bits, int lo, int hi)
+{
+    for (int c = lo; c <= hi; c++) {
+        tg_regex_class_set(bits, c);
+    }
+}
+
+/* Add \d, \w, \s (or their negations) to a byte set; returns 0 if not a shorthand */
+static int tg_regex_class_shorthand(uint8_t *bits, char c)
+{
+    uint8_t tmp[32];
+    int negate = isupper((unsigned char) c);
+
+    memset(tmp, 0, sizeof(tmp));
+    switch (tolower((unsigned char) c)) {
+        case 'd':
+            tg_regex_class_add_range(tmp, '0', '9');
+            break;
+        case 'w':
+            tg_regex_class_add_range(tmp, '0', '9');
+            tg_regex_class_add_range(tmp, 'a', 'z');
+            tg_regex_class_add_range(tmp, 'A', 'Z');
+            tg_regex_class_set(tmp, '_');
+            break;
+        case 's':
+            tg_regex_class_set(tmp, ' ');
+            tg_regex_class_add_range(tmp, '\t', '\r');
+            break;
+        default:
+            return 0;
+    }
+
+    for (int i = 0; i < 32; i++) {
+        bits[i] |= negate ? (uint8_t) ~tmp[i] : tmp[i];
+    }
+    return 1;
+}
+
+static int tg_regex_hex(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Decode a single escaped byte after '\'; returns -1 on error */
+static int tg_regex_escape_byte(struct tg_regex_parser *p)
+{
+    char c;
+
+    if (p->pos >= p->len) {
+        return tg_regex_fail(p, "trailing backslash");
+    }
+
+    c = p->pattern[p->pos++];
+    switch (c) {
+        case 't':
+            return '\t';
+        case 'n':
+            return '\n';
+        case 'r':
+            return '\r';
+        case 'x': {
+            int hi;
+            int lo;
+
+            if (p->pos + 2 > p->len ||
+                (hi = tg_regex_hex(p->pattern[p->pos])) < 0 ||
+                (lo = tg_regex_hex(p->pattern[p->pos + 1])) < 0) {
+                return tg_regex_fail(p, "invalid \\x escape");
+            }
+            p->pos += 2;
+            return (hi << 4) | lo;
+        }
+        default:
+            if (isalnum((unsigned char) c)) {
+                p->pos--;
+                return tg_regex_fail(p, "unsupported escape");
+            }
+            return (unsigned char) c;
+    }
+}
+
+static int tg_regex_parse_bracket(struct tg_regex_parser *p)
+{
+    uint32_t cls;
+    uint8_t bits[32];
+    int negate = 0;
+    int first = 1;
+    int node;
+
+    memset(bits, 0, sizeof(bits));
+
+    if (p->pos < p->len && p->pattern[p->pos] == '^') {
+        negate = 1;
+        p->pos++;
+    }
+
+    while (1) {
+        int lo;
+        int hi;
+
+        if (p->pos >= p->len) {
+            return tg_regex_fail(p, "unterminated character class");
+        }
+
+        if (p->pattern[p->pos] == ']' && !first) {
+            p->pos++;
+            break;
+        }
+        first = 0;
+
+        if (p->pattern[p->pos] == '\\') {
+            p->pos++;
+            if (p->pos < p->len && tg_regex_class_shorthand(bits, p->pattern[p->pos])) {
+                p->pos++;
+                continue;
+            }
+            lo = tg_regex_escape_byte(p);
+            if (lo < 0) {
+                return -1;
+            }
+        } else {
+            lo = (unsigned char) p->pattern[p->pos++];
+        }
+
+        hi = lo;
+        if (p->pos + 1 < p->len && p->pattern[p->pos] == '-' &&
+            p->pattern[p->pos + 1] != ']') {
+            p->pos++;
+            if (p->pattern[p->pos] == '\\') {
+                p->pos++;
+                hi = tg_regex_escape_byte(p);
+                if (hi < 0) {
+                    return -1;
+                }
+            } else {
+                hi = (unsigned char) p->pattern[p->pos++];
+            }
+            if (hi < lo) {
+                return tg_regex_fail(p, "invalid character range");
+            }
+        }
+
+        tg_regex_class_add_range(bits, lo, hi);
+    }
+
+    if (negate) {
+        for (int i = 0; i < 32; i++) {
+            bits[i] = (uint8_t) ~bits[i];
+        }
+    }
+
+    if (tg_regex_new_class(p->set, &cls) != 0) {
+        return tg_regex_fail(p, "out of memory");
+    }
+    memcpy(p->set->classes[cls], bits, sizeof(bits));
+
+    node = tg_regex_node(p, TG_REGEX_NODE_CLASS, -1, -1);
+    if (node >= 0) {
+        p->nodes[node].cls = cls;
+    }
+    return node;
+}
+
+static int tg_regex_byte_node(struct tg_regex_parser *p, const uint8_t *bits)
+{
+    uint32_t cls;
+    int node;
+
+    if (tg_regex_new_class(p->set, &cls) != 0) {
+        return tg_regex_fail(p, "out of memory");
+    }
+    memcpy(p->set->classes[cls], bits, 32);
+
+    node = tg_regex_node(p, TG_REGEX_NODE_CLASS, -1, -1);
+    if (node >= 0) {
+        p->nodes[node].cls = cls;
+    }
+    return node;
+}
+
+static int tg_regex_parse_alt(struct tg_regex_parser *p);
+
+static int tg_regex_parse_atom(struct tg_regex_parser *p)
+{
+    uint8_t bits[32];
+    char c = p->pattern[p->pos];
+    int node;
+
+    memset(bits, 0, sizeof(bits));
+
+    switch (c) {
+        case '(':
+            p->pos++;
+            if (p->pos + 1 < p->len && p->pattern[p->pos] == '?' &&
+                p->pattern[p->pos + 1] == ':') {
+                p->pos += 2;
+            }
+            if (++p->depth > TG_REGEX_MAX_DEPTH) {
+                return tg_regex_fail(p, "groups nested too deeply");
+            }
+            node = tg_regex_parse_alt(p);
+            p->depth--;
+            if (node < 0) {
+                return -1;
+            }
+            if (p->pos >= p->len || p->pattern[p->pos] != ')') {
+                return tg_regex_fail(p, "missing )");
+            }
+            p->pos++;
+            return node;
+
+        case '[':
+            p->pos++;
+            return tg_regex_parse_bracket(p);
+
+        case '.':
+            p->pos++;
+            tg_regex_class_add_range(bits, 0, 255);
+            bits['\n' >> 3] &= (uint8_t) ~(1u << ('\n' & 7));
+            return tg_regex_byte_node(p, bits);
+
+        case '$':
+            p->pos++;
+            return tg_regex_node(p, TG_REGEX_NODE_EOL, -1, -1);
+
+        case '^':
+            return tg_regex_fail(p, "^ is only supported at the start of a pattern");
+
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            return tg_regex_fail(p, "quantifier without operand");
+
+        case '\\':
+            p->pos++;
+            if (p->pos < p->len && tg_regex_class_shorthand(bits, p->pattern[p->pos])) {
+                p->pos++;
+                return tg_regex_byte_node(p, bits);
+            }
+            node = tg_regex_escape_byte(p);
+            if (node < 0) {
+                return -1;
+            }
+            tg_regex_class_set(bits, node);
+            return tg_regex_byte_node(p, bits);
+
+        default:
+            p->pos++;
+            tg_regex_class_set(bits, (unsigned char) c);
+            return tg_regex_byte_node(p, bits);
+    }
+}
+
+static int tg_regex_parse_number(struct tg_regex_parser *p, int *out)
+{
+    int value = 0;
+    int digits = 0;
+
+    while (p->pos < p->len && isdigit((unsigned char) p->pattern[p->pos])) {
+        value = value * 10 + (p->pattern[p->pos++] - '0');
+        if (value > TG_REGEX_MAX_REPEAT) {
+            return tg_regex_fail(p, "repetition count too large");
+        }
+        digits++;
+    }
+
+    *out = value;
+    return digits > 0 ? 0 : -1;
+}
+
+static int tg_regex_parse_repeat(struct tg_regex_parser *p)
+{
+    int node = tg_regex_parse_atom(p);
+
+    while (node >= 0 && p->pos < p->len) {
+        char c = p->pattern[p->pos];
+        int min;
+        int max;
+
+        if (c == '*') {
+            min = 0;
+            max = -1;
+            p->pos++;
+        } else if (c == '+') {
+            min = 1;
+            max = -1;
+            p->pos++;
+        } else if (c == '?') {
+            min = 0;
+            max = 1;
+            p->pos++;
+        } else if (c == '{') {
+            p->pos++;
+            if (tg_regex_parse_number(p, &min) != 0) {
+                return tg_regex_fail(p, "invalid repetition");
+            }
+            max = min;
+            if (p->pos < p->len && p->pattern[p->pos] == ',') {
+                p->pos++;
+                if (p->pos < p->len && p->pattern[p->pos] == '}') {
+                    max = -1;
+                } else if (tg_regex_parse_number(p, &max) != 0 || max < min) {
+                    return tg_regex_fail(p, "invalid repetition");
+                }
+            }
+            if (p->pos >= p->len || p->pattern[p->pos] != '}') {
+                return tg_regex_fail(p, "missing }");
+            }
+            p->pos++;
+        } else {
+            break;
+        }
+
+        /* Lazy modifiers make no difference when only reporting matches */
+        if (p->pos < p->len && p->pattern[p->pos] == '?') {
+            p->pos++;
+        }
+
+        int rep = tg_regex_node(p, TG_REGEX_NODE_REPEAT, node, -1);
+        if (rep < 0) {
+            return -1;
+        }
+        p->nodes[rep].min = min;
+        p->nodes[rep].max = max;
+        node = rep;
+    }
+
+    return node;
+}
+
+static int tg_regex_parse_cat(struct tg_regex_parser *p)
+{
+    int node = -1;
+
+    while (p->pos < p->len && p->pattern[p->pos] != '|' && p->pattern[p->pos] != ')') {
+        int next = tg_regex_parse_repeat(p);
+        if (next < 0) {
+            return -1;
+        }
+        node = (node < 0) ? next : tg_regex_node(p, TG_REGEX_NODE_CAT, node, next);
+        if (node < 0) {
+            return -1;
+        }
+    }
+
+    if (node < 0) {
+        node = tg_regex_node(p, TG_REGEX_NODE_EMPTY, -1, -1);
+    }
+    return node;
+}
+
+static int tg_regex_parse_alt(struct tg_regex_parser *p)
+{
+    int node = tg_regex_parse_cat(p);
+
+    while (node >= 0 && p->pos < p->len && p->pattern[p->pos] == '|') {
+        int next;
+
+        p->pos++;
+        next = tg_regex_parse_cat(p);
+        if (next < 0) {
+            return -1;
+        }
+        node = tg_regex_node(p, TG_REGEX_NODE_ALT, node, next);
+    }
+
+    return node;
+}
+
+/*
+ * Code generation
+ */
+
+static int tg_regex_codegen(struct tg_regex_set *set, struct tg_regex_parser *p, int index)
+{
+    struct tg_regex_node *node = &p->nodes[index];
+    int split;
+    int jmp;
+    int loop;
+
+    switch (node->type) {
+        case TG_REGEX_NODE_EMPTY:
+            return 0;
+
+        case TG_REGEX_NODE_CLASS:
+            return tg_regex_emit(set, TG_REGEX_OP_CLASS, node->cls, 0) < 0 ? -1 : 0;
+
+        case TG_REGEX_NODE_EOL:
+            return tg_regex_emit(set, TG_REGEX_OP_EOT, 0, 0) < 0 ? -1 : 0;
+
+        case TG_REGEX_NODE_CAT:
+            if (tg_regex_codegen(set, p, node->left) != 0) {
+                return -1;
+            }
+            return tg_regex_codegen(set, p, node->right);
+
+        case TG_REGEX_NODE_ALT:
+            split = tg_regex_emit(set, TG_REGEX_OP_SPLIT, 0, 0);
+            if (split < 0) {
+                return -1;
+            }
+            set->insts[split].x = set->inst_count;
+            if (tg_regex_codegen(set, p, node->left) != 0) {
+                return -1;
+            }
+            jmp = tg_regex_emit(set, TG_REGEX_OP_JMP, 0, 0);
+            if (jmp < 0) {
+                return -1;
+            }
+            set->insts[split].y = set->inst_count;
+            if (tg_regex_codegen(set, p, node->right) != 0) {
+                return -1;
+            }
+            set->insts[jmp].x = set->inst_count;
+            return 0;
+
+        case TG_REGEX_NODE_REPEAT: {
+            uint32_t optional[TG_REGEX_MAX_REPEAT];
+            int optional_count = 0;
+
+            for (int i = 0; i < node->min; i++) {
+                if (tg_regex_codegen(set, p, node->left) != 0) {
+                    return -1;
+                }
+            }
+
+            if (node->max < 0) {
+                loop = tg_regex_emit(set, TG_REGEX_OP_SPLIT, 0, 0);
+                if (loop < 0) {
+                    return -1;
+                }
+                set->insts[loop].x = set->inst_count;
+                if (tg_regex_codegen(set, p, node->left) != 0 ||
+                    tg_regex_emit(set, TG_REGEX_OP_JMP, (uint32_t) loop, 0) < 0) {
+                    return -1;
+                }
+                set->insts[loop].y = set->inst_count;
+                return 0;
+            }
+
+            /* Optional copies all skip to the end */
+            for (int i = node->min; i < node->max; i++) {
+                split = tg_regex_emit(set, TG_REGEX_OP_SPLIT, 0, 0);
+                if (split < 0) {
+                    return -1;
+                }
+                set->insts[split].x = set->inst_count;
+                optional[optional_count++] = (uint32_t) split;
+                if (tg_regex_codegen(set, p, node->left) != 0) {
+                    return -1;
+                }
+            }
+            for (int i = 0; i < optional_count; i++) {
+                set->insts[optional[i]].y = set->inst_count;
+            }
+            return 0;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+/* Create an empty regex set */
+struct tg_regex_set *tg_regex_set_create(void)
+{
+    return flb_calloc(1, sizeof(struct tg_regex_set));
+}
+
+/* Parse a pattern and append its program; nothing is added on error */
+int tg_regex_set_add(struct tg_regex_set *set, const char *pattern, uint32_t pattern_id,
+                     char *error, size_t error_size)
+{
+    struct tg_regex_parser *p;
+    uint32_t inst_mark;
+    uint32_t class_mark;
+    uint32_t start;
+    int anchored = 0;
+    int root;
+
+    if (!set || set->compiled || !pattern) {
+        return -1;
+    }
+
+    p = flb_calloc(1, sizeof(struct tg_regex_parser));
+    if (!p) {
+        return -1;
+    }
+
+    p->set = set;
+    p->pattern = pattern;
+    p->len = strlen(pattern);
+    p->error = error;
+    p->error_size = error_size;
+
+    if (p->len > 0 && pattern[0] == '^') {
+        anchored = 1;
+        p->pos = 1;
+    }
+
+    inst_mark = set->inst_count;
+    class_mark = set->class_count;
+
+    root = tg_regex_parse_alt(p);
+    if (root >= 0 && p->pos < p->len) {
+        root = tg_regex_fail(p, "unbalanced )");
+    }
+
+    start = set->inst_count;
+    if (root < 0 ||
+        tg_regex_grow((void **) &set->starts, &set->pattern_alloc, set->pattern_count + 1,
+                      sizeof(uint32_t)) != 0 ||
+        tg_regex_codegen(set, p, root) != 0 ||
+        tg_regex_emit(set, TG_REGEX_OP_MATCH, pattern_id, 0) < 0) {
+        if (root >= 0) {
+            tg_regex_fail(p, "program too large");
+        }
+        set->inst_count = inst_mark;
+        set->class_count = class_mark;
+        flb_free(p);
+        return -1;
+    }
+
+    /* anchored[] follows starts[] capacity */
+    uint8_t *flags = flb_realloc(set->anchored, set->pattern_alloc);
+    if (!flags) {
+        set->inst_count = inst_mark;
+        set->class_count = class_mark;
+        flb_free(p);
+        return -1;
+    }
+    set->anchored = flags;
+
+    set->starts[set->pattern_count] = start;
+    set->anchored[set->pattern_count] = (uint8_t) anchored;
+    set->pattern_count++;
+
+    flb_free(p);
+    return 0;
+}
+
+/* Split bytes into equivalence classes: a boundary falls wherever any
+ * byte set changes membership between two neighbouring bytes */
+int tg_regex_set_compile(struct tg_regex_set *set)
+{
+    uint8_t boundary[256];
+    uint32_t symbol = 0;
+
+    if (!set || set->compiled) {
+        return -1;
+    }
+
+    memset(boundary, 0, sizeof(boundary));
+    boundary[0] = 1;
+    for (uint32_t i = 0; i < set->class_count; i++) {
+        for (int b = 1; b < 256; b++) {
+            if (tg_regex_class_has(set->classes[i], b) !=
+                tg_regex_class_has(set->classes[i], b - 1)) {
+                boundary[b] = 1;
+            }
+        }
+    }
+
+    for (int b = 0; b < 256; b++) {
+        if (b > 0 && boundary[b]) {
+            symbol++;
+        }
+        if (boundary[b]) {
+            set->symbol_byte[symbol] = (uint8_t) b;
+        }
+        set->byte_class[b] = (uint16_t) symbol;
+    }
+
+    /* Last symbol is end-of-text */
+    set->symbol_count = symbol + 2;
+    set->compiled = 1;
+
+    tg_log(TG_LOG_DEBUG, "compiled regex set: %u patterns, %u instructions, %u symbols",
+           set->pattern_count, set->inst_count, set->symbol_count);
+    return 0;
+}
+
+uint32_t tg_regex_set_count(const struct tg_regex_set *set)
+{
+    return set ? set->pattern_count : 0;
+}
+
+static size_t tg_regex_align(size_t size)
+{
+    return (size + 7) & ~(size_t) 7;
+}
+
+/* Offsets of the arrays in an image; returns the image size */
+static size_t tg_regex_image_layout(uint32_t insts, uint32_t classes, uint32_t patterns,
+                                    size_t offsets[4])
+{
+    size_t size = tg_regex_align(sizeof(struct tg_regex_image));
+
+    offsets[0] = size;          /* insts */
+    size = tg_regex_align(size + (size_t) insts * sizeof(struct tg_regex_inst));
+    offsets[1] = size;          /* classes */
+    size = tg_regex_align(size + (size_t) classes * 32);
+    offsets[2] = size;          /* starts */
+    size = tg_regex_align(size + (size_t) patterns * sizeof(uint32_t));
+    offsets[3] = size;          /* anchored */
+    return tg_regex_align(size + patterns);
+}
+
+size_t tg_regex_set_serialize(const struct tg_regex_set *set, void *buf, size_t size)
+{
+    struct tg_regex_image *image = buf;
+    char *base = buf;
+    size_t offsets[4];
+    size_t needed;
+
+    if (!set || !set->compiled) {
+        return 0;
+    }
+
+    needed = tg_regex_image_layout(set->inst_count, set->class_count, set->pattern_count,
+                                   offsets);
+    if (!buf || size < needed) {
+        return needed;
+    }
+
+    /* Zeroed first so struct padding is deterministic */
+    memset(buf, 0, needed);
+    image->inst_count = set->inst_count;
+    image->class_count = set->class_count;
+    image->pattern_count = set->pattern_count;
+    image->symbol_count = set->symbol_count;
+    memcpy(image->byte_class, set->byte_class, sizeof(image->byte_class));
+    memcpy(image->symbol_byte, set->symbol_byte, sizeof(image->symbol_byte));
+
+    for (uint32_t i = 0; i < set->inst_count; i++) {
+        struct tg_regex_inst *inst = (struct tg_regex_inst *) (base + offsets[0]) + i;
+
+        inst->op = set->insts[i].op;
+        inst->x = set->insts[i].x;
+        inst->y = set->insts[i].y;
+    }
+    memcpy(base + offsets[1], set->classes, (size_t) set->class_count * 32);
+    memcpy(base + offsets[2], set->starts, (size_t) set->pattern_count * sizeof(uint32_t));
+    memcpy(base + offsets[3], set->anchored, set->pattern_count);
+    return needed;
+}
+
+/* Check that every instruction references valid targets, so a damaged
+ * image cannot send the matcher out of bounds */
+static int tg_regex_image_valid(const struct tg_regex_set *set, uint32_t id_limit)
+{
+    uint32_t symbols = set->symbol_count - 1;
+
+    if (symbols == 0 || symbols > 256) {
+        return 0;
+    }
+    for (int b = 0; b < 256; b++) {
+        if (set->byte_class[b] >= symbols) {
+            return 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < set->inst_count; i++) {
+        const struct tg_regex_inst *inst = &set->insts[i];
+
+        switch (inst->op) {
+            case TG_REGEX_OP_CLASS:
+                if (inst->x >= set->class_count) {
+                    return 0;
+                }
+                break;
+            case TG_REGEX_OP_SPLIT:
+                if (inst->x >= set->inst_count || inst->y >= set->inst_count) {
+                    return 0;
+                }
+                break;
+            case TG_REGEX_OP_JMP:
+                if (inst->x >= set->inst_count) {
+                    return 0;
+                }
+                break;
+            case TG_REGEX_OP_EOT:
+                break;
+            case TG_REGEX_OP_MATCH:
+                if (inst->x >= id_limit) {
+                    return 0;
+                }
+                break;
+            default:
+                return 0;
+        }
+
+        /* CLASS and EOT continue at the next instruction */
+        if ((inst->op == TG_REGEX_OP_CLASS || inst->op == TG_REGEX_OP_EOT) &&
+            i + 1 == set->inst_count) {
+            return 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < set->pattern_count; i++) {
+        if (set->starts[i] >= set->inst_count) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+struct tg_regex_set *tg_regex_set_map(const void *image, size_t size, uint32_t id_limit)
+{
+    const struct tg_regex_image *header = image;
+    const char *base = image;
+    struct tg_regex_set *set;
+    size_t offsets[4];
+
+    if (!image || size < sizeof(struct tg_regex_image) ||
+        header->inst_count > TG_REGEX_MAX_INSTS ||
+        tg_regex_image_layout(header->inst_count, header->class_count,
+                              header->pattern_count, offsets) > size) {
+        return NULL;
+    }
+
+    set = flb_calloc(1, sizeof(struct tg_regex_set));
+    if (!set) {
+        return NULL;
+    }
+
+    set->compiled = 1;
+    set->mapped = 1;
+    set->inst_count = header->inst_count;
+    set->class_count = header->class_count;
+    set->pattern_count = header->pattern_count;
+    set->symbol_count = header->symbol_count;
+    memcpy(set->byte_class, header->byte_class, sizeof(set->byte_class));
+    memcpy(set->symbol_byte, header->symbol_byte, sizeof(set->symbol_byte));
+    set->insts = (struct tg_regex_inst *) (base + offsets[0]);
+    set->classes = (uint8_t (*)[32]) (base + offsets[1]);
+    set->starts = (uint32_t *) (base + offsets[2]);
+    set->anchored = (uint8_t *) (base + offsets[3]);
+
+    if (!tg_regex_image_valid(set, id_limit)) {
+        flb_free(set);
+        return NULL;
+    }
+
+    return set;
+}
+
+void tg_regex_set_destroy(struct tg_regex_set *set)
+{
+    if (!set) {
+        return;
+    }
+
+    if (set->mapped) {
+        flb_free(set);
+        return;
+    }
+
+    flb_free(set->insts);
+    flb_free(set->classes);
+    flb_free(set->starts);
+    flb_free(set->anchored);
+    flb_free(set);
+}
+
+/*
+ * Lazy DFA
+ */
+
+static void tg_regex_closure(struct tg_regex_dfa *dfa, uint32_t pc)
+{
+    const struct tg_regex_inst *insts = dfa->set->insts;
+    uint32_t top = 0;
+
+    dfa->stack[top++] = pc;
+    while (top > 0) {
+        pc = dfa->stack[--top];
+        if (dfa->mark[pc] == dfa->mark_gen) {
+            continue;
+        }
+        dfa->mark[pc] = dfa->mark_gen;
+
+        switch (insts[pc].op) {
+            case TG_REGEX_OP_SPLIT:
+                dfa->stack[top++] = insts[pc].y;
+                dfa->stack[top++] = insts[pc].x;
+                break;
+            case TG_REGEX_OP_JMP:
+                dfa->stack[top++] = insts[pc].x;
+                break;
+            default:
+                if (!dfa->implicit[pc]) {
+                    dfa->scratch[dfa->scratch_count++] = pc;
+                }
+                break;
+        }
+    }
+}
+
+static void tg_regex_mark_reset(struct tg_regex_dfa *dfa)
+{
+    dfa->scratch_count = 0;
+    if (++dfa->mark_gen == 0) {
+        memset(dfa->mark, 0, dfa->set->inst_count * sizeof(uint32_t));
+        dfa->mark_gen = 1;
+    }
+}
+
+static int tg_regex_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t tg_regex_hash_leaves(const uint32_t *leaves, uint32_t count)
+{
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < count; i++) {
+        hash ^= leaves[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t tg_regex_state_cost(const struct tg_regex_dfa *dfa, uint32_t leaves, uint32_t matches)
+{
+    return sizeof(struct tg_regex_dfa_state) +
+           (size_t) dfa->symbols * sizeof(uint32_t) +
+           ((size_t) leaves + matches) * sizeof(uint32_t) +
+           2 * sizeof(uint32_t);
+}
+
+static void tg_regex_dfa_flush(struct tg_regex_dfa *dfa)
+{
+    dfa->state_count = 0;
+    dfa->leaf_count = 0;
+    dfa->match_count = 0;
+    dfa->cache_used = 0;
+    dfa->start_state = TG_REGEX_STATE_UNKNOWN;
+    if (dfa->table) {
+        memset(dfa->table, 0, (size_t) dfa->table_size * sizeof(uint32_t));
+    }
+    dfa->cache_flushes++;
+}
+
+static int tg_regex_table_rehash(struct tg_regex_dfa *dfa, uint32_t size)
+{
+    uint32_t *table = flb_calloc(size, sizeof(uint32_t));
+
+    if (!table) {
+        return -1;
+    }
+
+    for (uint32_t s = 0; s < dfa->state_count; s++) {
+        uint32_t slot = dfa->states[s].hash & (size - 1);
+        while (table[slot]) {
+            slot = (slot + 1) & (size - 1);
+        }
+        table[slot] = s + 1;
+    }
+
+    flb_free(dfa->table);
+    dfa->table = table;
+    dfa->table_size = size;
+    return 0;
+}
+
+/* Find or add the state for the leaf set in scratch[] */
+static uint32_t tg_regex_dfa_intern(struct tg_regex_dfa *dfa)
+{
+    const struct tg_regex_inst *insts = dfa->set->insts;
+    struct tg_regex_dfa_state *state;
+    uint32_t count = dfa->scratch_count;
+    uint32_t match_count = 0;
+    uint32_t hash;
+    uint32_t slot;
+    uint32_t index;
+    size_t cost;
+
+    qsort(dfa->scratch, count, sizeof(uint32_t), tg_regex_cmp_u32);
+    hash = tg_regex_hash_leaves(dfa->scratch, count);
+
+    slot = hash & (dfa->table_size - 1);
+    while (dfa->table[slot]) {
+        state = &dfa->states[dfa->table[slot] - 1];
+        if (state->hash == hash && state->leaf_count == count &&
+            memcmp(&dfa->leaves[state->leaf_start], dfa->scratch,
+                   count * sizeof(uint32_t)) == 0) {
+            return dfa->table[slot] - 1;
+        }
+        slot = (slot + 1) & (dfa->table_size - 1);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (insts[dfa->scratch[i]].op == TG_REGEX_OP_MATCH) {
+            match_count++;
+        }
+    }
+
+    /* Flush rather than grow past the budget; a single state is always admitted */
+    cost = tg_regex_state_cost(dfa, count, match_count);
+    if (dfa->state_count > 0 && dfa->cache_used + cost > dfa->cache_size) {
+        tg_regex_dfa_flush(dfa);
+    }
+
+    if (tg_regex_grow((void **) &dfa->states, &dfa->state_alloc, dfa->state_count + 1,
+                      sizeof(struct tg_regex_dfa_state)) != 0 ||
+        tg_regex_grow((void **) &dfa->leaves, &dfa->leaf_alloc, dfa->leaf_count + count,
+                      sizeof(uint32_t)) != 0 ||
+        tg_regex_grow((void **) &dfa->matches, &dfa->match_alloc,
+                      dfa->match_count + match_count, sizeof(uint32_t)) != 0) {
+        return TG_REGEX_STATE_ERROR;
+    }
+
+    /* trans[] always tracks state_alloc rows */
+    if (dfa->trans_rows < dfa->state_alloc) {
+        uint32_t *trans = flb_realloc(dfa->trans, (size_t) dfa->state_alloc *
+                                      dfa->symbols * sizeof(uint32_t));
+        if (!trans) {
+            return TG_REGEX_STATE_ERROR;
+        }
+        dfa->trans = trans;
+        dfa->trans_rows = dfa->state_alloc;
+    }
+
+    if ((dfa->state_count + 1) * 2 > dfa->table_size &&
+        tg_regex_table_rehash(dfa, dfa->table_size * 2) != 0) {
+        return TG_REGEX_STATE_ERROR;
+    }
+
+    index = dfa->state_count++;
+    state = &dfa->states[index];
+    state->hash = hash;
+    state->leaf_start = dfa->leaf_count;
+    state->leaf_count = count;
+    state->match_start = dfa->match_count;
+    state->match_count = match_count;
+
+    memcpy(&dfa->leaves[dfa->leaf_count], dfa->scratch, count * sizeof(uint32_t));
+    dfa->leaf_count += count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (insts[dfa->scratch[i]].op == TG_REGEX_OP_MATCH) {
+            dfa->matches[dfa->match_count++] = insts[dfa->scratch[i]].x;
+        }
+    }
+
+    for (uint32_t s = 0; s < dfa->symbols; s++) {
+        dfa->trans[(size_t) index * dfa->symbols + s] = TG_REGEX_STATE_UNKNOWN;
+    }
+
+    slot = hash & (dfa->table_size - 1);
+    while (dfa->table[slot]) {
+        slot = (slot + 1) & (dfa->table_size - 1);
+    }
+    dfa->table[slot] = index + 1;
+
+    dfa->cache_used += cost;
+    dfa->states_built++;
+    return index;
+}
+
+static uint32_t tg_regex_dfa_start(struct tg_regex_dfa *dfa)
+{
+    const struct tg_regex_set *set = dfa->set;
+
+    if (dfa->start_state != TG_REGEX_STATE_UNKNOWN) {
+        return dfa->start_state;
+    }
+
+    tg_regex_mark_reset(dfa);
+    for (uint32_t i = 0; i < set->pattern_count; i++) {
+        tg_regex_closure(dfa, set->starts[i]);
+    }
+
+    dfa->start_state = tg_regex_dfa_intern(dfa);
+    return dfa->start_state;
+}
+
+/* Compute in scratch[] the leaves reachable from a leaf set on one symbol */
+static void tg_regex_advance(struct tg_regex_dfa *dfa, const uint32_t *leaves,
+                             uint32_t count, uint32_t symbol)
+{
+    const struct tg_regex_set *set = dfa->set;
+    uint32_t end_symbol = dfa->symbols - 1;
+    uint8_t byte = set->symbol_byte[symbol];
+
+    tg_regex_mark_reset(dfa);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t pc = leaves[i];
+        const struct tg_regex_inst *inst = &set->insts[pc];
+
+        if (inst->op == TG_REGEX_OP_CLASS && symbol != end_symbol &&
+            tg_regex_class_has(set->classes[inst->x], byte)) {
+            tg_regex_closure(dfa, pc + 1);
+        } else if (inst->op == TG_REGEX_OP_EOT && symbol == end_symbol) {
+            tg_regex_closure(dfa, pc + 1);
+        }
+    }
+
+    /* Unanchored patterns may start at every position: follow the implicit
+     * leaves accepting this symbol and re-seed the remaining ones */
+    if (symbol != end_symbol) {
+        for (uint32_t i = dfa->restart_off[symbol]; i < dfa->restart_off[symbol + 1]; i++) {
+            tg_regex_closure(dfa, dfa->restart_next[i] + 1);
+        }
+        for (uint32_t i = 0; i < dfa->restart_count; i++) {
+            uint32_t pc = dfa->restart[i];
+
+            if (dfa->mark[pc] != dfa->mark_gen) {
+                dfa->mark[pc] = dfa->mark_gen;
+                dfa->scratch[dfa->scratch_count++] = pc;
+            }
+        }
+    }
+}
+
+/* Build the successor of a state on one symbol and cache the transition */
+static uint32_t tg_regex_dfa_step(struct tg_regex_dfa *dfa, uint32_t from, uint32_t symbol)
+{
+    const struct tg_regex_dfa_state *state = &dfa->states[from];
+    uint64_t flushes = dfa->cache_flushes;
+    uint32_t next;
+
+    tg_regex_advance(dfa, &dfa->leaves[state->leaf_start], state->leaf_count, symbol);
+
+    next = tg_regex_dfa_intern(dfa);
+    if (next != TG_REGEX_STATE_ERROR && dfa->cache_flushes == flushes) {
+        dfa->trans[(size_t) from * dfa->symbols + symbol] = next;
+    }
+    return next;
+}
+
+/* Report MATCH leaves of scratch[] */
+static int tg_regex_nfa_report(struct tg_regex_dfa *dfa, tg_regex_match_cb cb, void *data,
+                               int *matches)
+{
+    const struct tg_regex_inst *insts = dfa->set->insts;
+
+    for (uint32_t i = 0; i < dfa->scratch_count; i++) {
+        const struct tg_regex_inst *inst = &insts[dfa->scratch[i]];
+
+        if (inst->op == TG_REGEX_OP_MATCH) {
+            (*matches)++;
+            if (cb && cb(inst->x, data) != 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Simulate the program directly from a leaf set: no caching, O(program)
+ * per byte. Leaves are taken from scratch[]. */
+static int tg_regex_nfa_scan(struct tg_regex_dfa *dfa, const char *text, size_t len,
+                             tg_regex_match_cb cb, void *data, int *matches)
+{
+    const uint16_t *byte_class = dfa->set->byte_class;
+    uint32_t *tmp;
+    uint32_t count;
+
+    for (size_t i = 0; i < len; i++) {
+        /* The current set becomes the input of the next step */
+        tmp = dfa->nfa_leaves;
+        dfa->nfa_leaves = dfa->scratch;
+        dfa->scratch = tmp;
+        count = dfa->scratch_count;
+
+        tg_regex_advance(dfa, dfa->nfa_leaves, count, byte_class[(uint8_t) text[i]]);
+        if (tg_regex_nfa_report(dfa, cb, data, matches)) {
+            return 1;
+        }
+        if (dfa->scratch_count == 0) {
+            return 0;
+        }
+    }
+
+    tmp = dfa->nfa_leaves;
+    dfa->nfa_leaves = dfa->scratch;
+    dfa->scratch = tmp;
+    count = dfa->scratch_count;
+
+    tg_regex_advance(dfa, dfa->nfa_leaves, count, dfa->symbols - 1);
+    return tg_regex_nfa_report(dfa, cb, data, matches);
+}
+
+static int tg_regex_dfa_report(struct tg_regex_dfa *dfa, uint32_t index,
+                               tg_regex_match_cb cb, void *data, int *matches)
+{
+    const struct tg_regex_dfa_state *state = &dfa->states[index];
+
+    for (uint32_t i = 0; i < state->match_count; i++) {
+        (*matches)++;
+        if (cb && cb(dfa->matches[state->match_start + i], data) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Create a lazy DFA bound to a compiled set */
+struct tg_regex_dfa *tg_regex_dfa_create(const struct tg_regex_set *set, size_t cache_size)
+{
+    struct tg_regex_dfa *dfa;
+
+    if (!set || !set->compiled) {
+        return NULL;
+    }
+
+    dfa = flb_calloc(1, sizeof(struct tg_regex_dfa));
+    if (!dfa) {
+        return NULL;
+    }
+
+    dfa->set = set;
+    dfa->symbols = set->symbol_count;
+    dfa->cache_size = cache_size < TG_REGEX_MIN_CACHE_SIZE ? TG_REGEX_MIN_CACHE_SIZE : cache_size;
+    dfa->start_state = TG_REGEX_STATE_UNKNOWN;
+
+    dfa->mark = flb_calloc(set->inst_count ? set->inst_count : 1, sizeof(uint32_t));
+    dfa->stack = flb_malloc(((size_t) set->inst_count * 2 + 1) * sizeof(uint32_t));
+    dfa->scratch = flb_malloc(((size_t) set->inst_count + 1) * sizeof(uint32_t));
+    dfa->nfa_leaves = flb_malloc(((size_t) set->inst_count + 1) * sizeof(uint32_t));
+    dfa->implicit = flb_calloc(set->inst_count ? set->inst_count : 1, sizeof(uint8_t));
+    dfa->restart = flb_malloc(((size_t) set->inst_count + 1) * sizeof(uint32_t));
+    dfa->restart_off = flb_calloc((size_t) dfa->symbols + 1, sizeof(uint32_t));
+    if (!dfa->mark || !dfa->stack || !dfa->scratch || !dfa->nfa_leaves || !dfa->implicit ||
+        !dfa->restart || !dfa->restart_off || tg_regex_table_rehash(dfa, 64) != 0 ||
+        tg_regex_grow((void **) &dfa->leaves, &dfa->leaf_alloc, 1, sizeof(uint32_t)) != 0) {
+        tg_regex_dfa_destroy(dfa);
+        return NULL;
+    }
+
+    /* Closure of the unanchored entry points */
+    tg_regex_mark_reset(dfa);
+    for (uint32_t i = 0; i < set->pattern_count; i++) {
+        if (!set->anchored[i]) {
+            tg_regex_closure(dfa, set->starts[i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < dfa->scratch_count; i++) {
+        uint32_t pc = dfa->scratch[i];
+
+        if (set->insts[pc].op == TG_REGEX_OP_CLASS) {
+            dfa->implicit[pc] = 1;
+            dfa->implicit_count++;
+        } else {
+            dfa->restart[dfa->restart_count++] = dfa->scratch[i];
+        }
+    }
+
+    /* Index implicit leaves by the byte symbols they accept */
+    for (uint32_t s = 0; s + 1 < dfa->symbols; s++) {
+        uint32_t count = 0;
+
+        for (uint32_t i = 0; i < dfa->scratch_count; i++) {
+            const struct tg_regex_inst *inst = &set->insts[dfa->scratch[i]];
+
+            if (inst->op == TG_REGEX_OP_CLASS &&
+                tg_regex_class_has(set->classes[inst->x], set->symbol_byte[s])) {
+                count++;
+            }
+        }
+        dfa->restart_off[s + 1] = dfa->restart_off[s] + count;
+    }
+    dfa->restart_off[dfa->symbols] = dfa->restart_off[dfa->symbols - 1];
+
+    dfa->restart_next = flb_malloc(((size_t) dfa->restart_off[dfa->symbols] + 1) *
+                                   sizeof(uint32_t));
+    if (!dfa->restart_next) {
+        tg_regex_dfa_destroy(dfa);
+        return NULL;
+    }
+
+    for (uint32_t s = 0; s + 1 < dfa->symbols; s++) {
+        uint32_t next = dfa->restart_off[s];
+
+        for (uint32_t i = 0; i < dfa->scratch_count; i++) {
+            const struct tg_regex_inst *inst = &set->insts[dfa->scratch[i]];
+
+            if (inst->op == TG_REGEX_OP_CLASS &&
+                tg_regex_class_has(set->classes[inst->x], set->symbol_byte[s])) {
+                dfa->restart_next[next++] = dfa->scratch[i];
+            }
+        }
+    }
+
+    return dfa;
+}
+
+/* Report every pattern matching somewhere in text; returns the number of
+ * reports or -1 if a state could not be allocated */
+int tg_regex_dfa_scan(struct tg_regex_dfa *dfa, const char *text, size_t len,
+                      tg_regex_match_cb cb, void *data)
+{
+    const uint16_t *byte_class;
+    uint32_t symbols;
+    uint32_t state;
+    uint64_t base;
+    int matches = 0;
+
+    if (!dfa || !text || dfa->set->pattern_count == 0) {
+        return 0;
+    }
+
+    byte_class = dfa->set->byte_class;
+    symbols = dfa->symbols;
+    base = dfa->bytes_scanned;
+    dfa->bytes_scanned += len;
+
+    /* Recently thrashing: simulate the NFA from the start */
+    if (dfa->nfa_backoff > 0) {
+        dfa->nfa_backoff--;
+        dfa->nfa_scans++;
+
+        tg_regex_mark_reset(dfa);
+        for (uint32_t i = 0; i < dfa->set->pattern_count; i++) {
+            tg_regex_closure(dfa, dfa->set->starts[i]);
+        }
+        if (!tg_regex_nfa_report(dfa, cb, data, &matches)) {
+            tg_regex_nfa_scan(dfa, text, len, cb, data, &matches);
+        }
+        return matches;
+    }
+
+    state = tg_regex_dfa_start(dfa);
+    if (state == TG_REGEX_STATE_ERROR) {
+        return -1;
+    }
+    if (tg_regex_dfa_report(dfa, state, cb, data, &matches)) {
+        return matches;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        uint32_t symbol = byte_class[(uint8_t) text[i]];
+        uint32_t next = dfa->trans[(size_t) state * symbols + symbol];
+
+        if (next == TG_REGEX_STATE_UNKNOWN) {
+            uint32_t cached = dfa->state_count;
+            uint64_t flushes = dfa->cache_flushes;
+
+            next = tg_regex_dfa_step(dfa, state, symbol);
+            if (next == TG_REGEX_STATE_ERROR) {
+                return -1;
+            }
+
+            if (dfa->cache_flushes != flushes) {
+                uint64_t pos = base + i;
+                int thrashing = pos - dfa->flush_mark <
+                                (uint64_t) cached * TG_REGEX_THRASH_BYTES_PER_STATE;
+
+                dfa->flush_mark = pos;
+                if (thrashing) {
+                    /* scratch[] still holds the leaves of the new state */
+                    dfa->nfa_backoff = TG_REGEX_NFA_BACKOFF_SCANS;
+                    dfa->nfa_scans++;
+                    if (!tg_regex_dfa_report(dfa, next, cb, data, &matches)) {
+                        tg_regex_nfa_scan(dfa, text + i + 1, len - i - 1, cb, data, &matches);
+                    }
+                    return matches;
+                }
+            }
+        }
+        state = next;
+
+        if (dfa->states[state].match_count > 0 &&
+            tg_regex_dfa_report(dfa, state, cb, data, &matches)) {
+            return matches;
+        }
+
+        /* Only anchored patterns remain and none of them survived */
+        if (dfa->states[state].leaf_count == 0 && dfa->implicit_count == 0) {
+            return matches;
+        }
+    }
+
+    /* Resolve $ assertions */
+    uint32_t end = dfa->trans[(size_t) state * symbols + symbols - 1];
+    if (end == TG_REGEX_STATE_UNKNOWN) {
+        end = tg_regex_dfa_step(dfa, state, symbols - 1);
+        if (end == TG_REGEX_STATE_ERROR) {
+            return -1;
+        }
+    }
+    tg_regex_dfa_report(dfa, end, cb, data, &matches);
+
+    return matches;
+}
+
+void tg_regex_dfa_get_stats(const struct tg_regex_dfa *dfa, struct tg_regex_dfa_stats *stats)
+{
+    if (!dfa || !stats) {
+        return;
+    }
+
+    stats->states = dfa->state_count;
+    stats->cache_used = dfa->cache_used;
+    stats->cache_size = dfa->cache_size;
+    stats->states_built = dfa->states_built;
+    stats->cache_flushes = dfa->cache_flushes;
+    stats->nfa_scans = dfa->nfa_scans;
+}
+
+void tg_regex_dfa_destroy(struct tg_regex_dfa *dfa)
+{
+    if (!dfa) {
+        return;
+    }
+
+    flb_free(dfa->states);
+    flb_free(dfa->trans);
+    flb_free(dfa->leaves);
+    flb_free(dfa->matches);
+    flb_free(dfa->table);
+    flb_free(dfa->mark);
+    flb_free(dfa->stack);
+    flb_free(dfa->scratch);
+    flb_free(dfa->nfa_leaves);
+    flb_free(dfa->implicit);
+    flb_free(dfa->restart);
+    flb_free(dfa->restart_off);
+    flb_free(dfa->restart_next);
+    flb_free(dfa);
+}
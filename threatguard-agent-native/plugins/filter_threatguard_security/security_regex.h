@@ -0,0 +1,61 @@
+/*  ThreatGuard Agent - Regex Set Matcher
+ *  Compiles many regexes into one program and matches them together
+ *  through a lazily built DFA with a bounded state cache
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_REGEX_H
+#define TG_SECURITY_REGEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TG_REGEX_DEFAULT_CACHE_SIZE   (1024 * 1024)
+#define TG_REGEX_MIN_CACHE_SIZE       (16 * 1024)
+
+struct tg_regex_set;
+struct tg_regex_dfa;
+
+/* Called for each pattern matching at the current position; return
+ * non-zero to stop the scan */
+typedef int (*tg_regex_match_cb)(uint32_t pattern_id, void *data);
+
+struct tg_regex_dfa_stats {
+    uint32_t states;            /* states currently cached */
+    size_t cache_used;          /* bytes charged against cache_size */
+    size_t cache_size;
+    uint64_t states_built;      /* states constructed since creation */
+    uint64_t cache_flushes;     /* times the cache was reset to stay in budget */
+    uint64_t nfa_scans;         /* scans finished by NFA simulation after thrashing */
+};
+
+/* Regex program: add patterns, compile once, then share read-only.
+ * Supported syntax: literals, ., [...] classes with ranges and negation,
+ * \d \w \s (and negations), \xHH, groups, |, *, +, ?, {m,n}, a leading ^
+ * and $. Matching is unanchored unless the pattern starts with ^. */
+struct tg_regex_set *tg_regex_set_create(void);
+int tg_regex_set_add(struct tg_regex_set *set, const char *pattern, uint32_t pattern_id,
+                     char *error, size_t error_size);
+int tg_regex_set_compile(struct tg_regex_set *set);
+uint32_t tg_regex_set_count(const struct tg_regex_set *set);
+
+/* Flat image of a compiled program, for rule bundles. serialize returns
+ * the image size and writes it to buf if size allows (buf 8-byte
+ * aligned); 0 if set is not compiled. map validates an image and returns
+ * a program that reads it in place, so the image must outlive it and
+ * every DFA built on it; every pattern id must be below id_limit. */
+size_t tg_regex_set_serialize(const struct tg_regex_set *set, void *buf, size_t size);
+struct tg_regex_set *tg_regex_set_map(const void *image, size_t size, uint32_t id_limit);
+void tg_regex_set_destroy(struct tg_regex_set *set);
+
+/* Lazy DFA over a compiled set. Scanning fills the state cache, so each
+ * thread needs its own tg_regex_dfa; the set itself may be shared. When
+ * the cache thrashes, scans fall back to NFA simulation for a while, so
+ * the cost per byte stays bounded by the program size. */
+struct tg_regex_dfa *tg_regex_dfa_create(const struct tg_regex_set *set, size_t cache_size);
+int tg_regex_dfa_scan(struct tg_regex_dfa *dfa, const char *text, size_t len,
+                      tg_regex_match_cb cb, void *data);
+void tg_regex_dfa_get_stats(const struct tg_regex_dfa *dfa, struct tg_regex_dfa_stats *stats);
+void tg_regex_dfa_destroy(struct tg_regex_dfa *dfa);
+
+#endif /* TG_SECURITY_REGEX_H */
@@ -0,0 +1,512 @@
+/*  ThreatGuard Agent - Security Rules Reload
+ *  Publishes compiled rule sets to the filter and reloads the rules file
+ *  when it changes. Rule sets are replaced RCU-style: workers read the
+ *  current set without locking, a reload swaps the pointer, and the old
+ *  set is freed once every worker has left the chunk it was filtering.
+ *  Threat intelligence stores are published the same way, and the watcher
+ *  thread also applies threat intelligence updates.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "security_rules.h"
+
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef TG_PLATFORM_LINUX
+#include <sys/inotify.h>
+#endif
+
+/* Quiet period after the last change before the file is read, so that an
+ * editor or deploy tool is done writing it */
+#define TG_RELOAD_SETTLE_MS     250
+
+/* Interval at which the file is checked without inotify, and at which
+ * retired rule sets are reclaimed */
+#define TG_RELOAD_POLL_MS       2000
+
+/* How long a reload waits for readers of the old set to finish */
+#define TG_RELOAD_GRACE_MS      1000
+
+/* Set up rule set publication; no set is published yet */
+int tg_security_ruleset_init(struct tg_security_ctx *ctx)
+{
+    ctx->ruleset = NULL;
+    ctx->ruleset_generation = 0;
+    ctx->ruleset_epoch = 1;     /* 0 marks a worker outside any read section */
+    ctx->retired = NULL;
+    ctx->ioc_retired = NULL;
+    ctx->rules_file = NULL;
+    ctx->reload_running = 0;
+    ctx->reload_pipe[0] = -1;
+    ctx->reload_pipe[1] = -1;
+    ctx->reload_inotify = -1;
+    memset(&ctx->rules_file_stat, 0, sizeof(ctx->rules_file_stat));
+
+    if (pthread_mutex_init(&ctx->reload_lock, NULL) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to create rules reload lock");
+        return -1;
+    }
+
+    ctx->reload_ready = 1;
+    return 0;
+}
+
+/* Enter a read-side section and return the current rule set, which stays
+ * valid until tg_security_ruleset_read_unlock, as does the indicator store
+ * taken into worker->ioc. The worker announces the
+ * epoch it entered in before loading the pointer, so a writer that sees
+ * an older epoch knows the worker may still hold the previous set. */
+struct tg_security_ruleset *tg_security_ruleset_read_lock(struct tg_security_ctx *ctx,
+                                                          struct tg_security_worker *worker)
+{
+    uint64_t epoch = __atomic_load_n(&ctx->ruleset_epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&worker->epoch, epoch, __ATOMIC_SEQ_CST);
+    worker->ioc = __atomic_load_n(&ctx->ioc, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ctx->ruleset, __ATOMIC_SEQ_CST);
+}
+
+void tg_security_ruleset_read_unlock(struct tg_security_worker *worker)
+{
+    worker->ioc = NULL;
+    __atomic_store_n(&worker->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Free retired sets and stores no worker can still be reading. Caller
+ * holds reload_lock. Returns the number left. */
+static int tg_security_ruleset_reclaim_locked(struct tg_security_ctx *ctx)
+{
+    struct tg_security_ruleset **link = &ctx->retired;
+    struct tg_security_retired_ioc **ioc_link = &ctx->ioc_retired;
+    struct tg_security_retired_ioc *retired;
+    struct tg_security_ruleset *set;
+    struct tg_security_worker *worker;
+    uint64_t oldest = 0;
+    int left = 0;
+
+    if (!ctx->retired && !ctx->ioc_retired) {
+        return 0;
+    }
+
+    /* Oldest epoch any worker is reading in */
+    pthread_mutex_lock(&ctx->worker_lock);
+    for (worker = ctx->workers; worker; worker = worker->next) {
+        uint64_t epoch = __atomic_load_n(&worker->epoch, __ATOMIC_SEQ_CST);
+
+        if (epoch != 0 && (oldest == 0 || epoch < oldest)) {
+            oldest = epoch;
+        }
+    }
+    pthread_mutex_unlock(&ctx->worker_lock);
+
+    while ((set = *link)) {
+        /* Readers that entered at retire_epoch or later saw the new set */
+        if (oldest == 0 || oldest >= set->retire_epoch) {
+            *link = set->next;
+            tg_log(TG_LOG_DEBUG, "freed rule set generation %llu",
+                   (unsigned long long) set->generation);
+            tg_security_ruleset_destroy(set);
+        } else {
+            link = &set->next;
+            left++;
+        }
+    }
+
+    while ((retired = *ioc_link)) {
+        if (oldest == 0 || oldest >= retired->retire_epoch) {
+            *ioc_link = retired->next;
+            tg_ioc_store_destroy(retired->store);
+            flb_free(retired);
+        } else {
+            ioc_link = &retired->next;
+            left++;
+        }
+    }
+
+    return left;
+}
+
+void tg_security_ruleset_reclaim(struct tg_security_ctx *ctx)
+{
+    pthread_mutex_lock(&ctx->reload_lock);
+    tg_security_ruleset_reclaim_locked(ctx);
+    pthread_mutex_unlock(&ctx->reload_lock);
+}
+
+/* Make set the current rule set. Workers pick it up at their next chunk;
+ * the previous set is retired and freed once its readers are gone. */
+void tg_security_ruleset_publish(struct tg_security_ctx *ctx, struct tg_security_ruleset *set)
+{
+    struct tg_security_ruleset *old;
+
+    pthread_mutex_lock(&ctx->reload_lock);
+
+    set->generation = ++ctx->ruleset_generation;
+    old = __atomic_exchange_n(&ctx->ruleset, set, __ATOMIC_SEQ_CST);
+    if (old) {
+        old->retire_epoch = __atomic_add_fetch(&ctx->ruleset_epoch, 1, __ATOMIC_SEQ_CST);
+        old->next = ctx->retired;
+        ctx->retired = old;
+        tg_security_ruleset_reclaim_locked(ctx);
+    }
+
+    pthread_mutex_unlock(&ctx->reload_lock);
+}
+
+/* Make store the current indicator store. Workers pick it up at their
+ * next chunk; the previous store is retired like a rule set. */
+void tg_security_ioc_publish(struct tg_security_ctx *ctx, struct tg_ioc_store *store)
+{
+    struct tg_security_retired_ioc *retired;
+    struct tg_ioc_store *old;
+
+    /* Allocated up front so that publishing cannot fail halfway */
+    retired = flb_calloc(1, sizeof(struct tg_security_retired_ioc));
+
+    pthread_mutex_lock(&ctx->reload_lock);
+
+    old = __atomic_exchange_n(&ctx->ioc, store, __ATOMIC_SEQ_CST);
+    if (old) {
+        uint64_t epoch = __atomic_add_fetch(&ctx->ruleset_epoch, 1, __ATOMIC_SEQ_CST);
+
+        if (retired) {
+            retired->store = old;
+            retired->retire_epoch = epoch;
+            retired->next = ctx->ioc_retired;
+            ctx->ioc_retired = retired;
+            retired = NULL;
+        } else {
+            /* Without memory to track it, the old store is leaked rather
+             * than freed under a reader */
+            tg_log(TG_LOG_ERROR, "cannot retire threat intelligence store, leaking it");
+        }
+        tg_security_ruleset_reclaim_locked(ctx);
+    }
+
+    pthread_mutex_unlock(&ctx->reload_lock);
+    flb_free(retired);
+}
+
+/* Wait a bounded time for readers of retired sets; whatever is left is
+ * retried by the watcher and freed at exit at the latest */
+static void tg_security_ruleset_drain(struct tg_security_ctx *ctx)
+{
+    struct timespec delay = { 0, 10 * 1000 * 1000 };
+
+    for (int waited = 0; waited < TG_RELOAD_GRACE_MS; waited += 10) {
+        int left;
+
+        pthread_mutex_lock(&ctx->reload_lock);
+        left = tg_security_ruleset_reclaim_locked(ctx);
+        pthread_mutex_unlock(&ctx->reload_lock);
+
+        if (left == 0) {
+            return;
+        }
+        nanosleep(&delay, NULL);
+    }
+}
+
+/* Whether the rules file differs from the one last loaded */
+static int tg_security_rules_file_changed(struct tg_security_ctx *ctx, struct stat *st)
+{
+    if (stat(ctx->rules_file, st) != 0) {
+        return 0;
+    }
+
+    return st->st_dev != ctx->rules_file_stat.st_dev ||
+           st->st_ino != ctx->rules_file_stat.st_ino ||
+           st->st_size != ctx->rules_file_stat.st_size ||
+           st->st_mtime != ctx->rules_file_stat.st_mtime;
+}
+
+/* Load and compile the rules file into a new set and publish it. The
+ * current set stays in place if the file cannot be read or has no rules. */
+int tg_security_reload_rules(struct tg_security_ctx *ctx)
+{
+    struct tg_security_ruleset *set;
+    struct stat st;
+
+    if (!ctx || !ctx->rules_file) {
+        return -1;
+    }
+
+    if (stat(ctx->rules_file, &st) != 0) {
+        tg_log(TG_LOG_WARN, "rules file %s is gone, keeping current rules", ctx->rules_file);
+        return -1;
+    }
+
+    /* A broken file is reported once, not on every poll */
+    ctx->rules_file_stat = st;
+
+    set = tg_security_load_ruleset(ctx->rules_file);
+    if (!set) {
+        tg_log(TG_LOG_WARN, "no rules loaded from %s, keeping current rules", ctx->rules_file);
+        return -1;
+    }
+
+    tg_security_ruleset_publish(ctx, set);
+    tg_log(TG_LOG_INFO, "reloaded %d security rules from %s (generation %llu)",
+           set->rule_count, ctx->rules_file, (unsigned long long) set->generation);
+
+    tg_security_ruleset_drain(ctx);
+    return 0;
+}
+
+#ifdef TG_PLATFORM_LINUX
+/* Consume pending inotify events: returns 2 if one names the rules file,
+ * 1 if only other entries changed, 0 otherwise. The directory is watched
+ * rather than the file, as editors and deploy tools usually replace the
+ * file by a rename. */
+static int tg_security_reload_read_events(struct tg_security_ctx *ctx)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const char *name = strrchr(ctx->rules_file, '/');
+    int relevant = 0;
+    ssize_t len;
+
+    name = name ? name + 1 : ctx->rules_file;
+
+    while ((len = read(ctx->reload_inotify, buf, sizeof(buf))) > 0) {
+        for (char *ptr = buf; ptr < buf + len;) {
+            const struct inotify_event *event = (const struct inotify_event *) ptr;
+
+            if (event->len > 0 && strcmp(event->name, name) == 0) {
+                relevant = 2;
+            } else if (relevant == 0) {
+                relevant = 1;
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return relevant;
+}
+
+static int tg_security_reload_watch(struct tg_security_ctx *ctx)
+{
+    char dir[TG_MAX_PATH];
+    const char *slash = strrchr(ctx->rules_file, '/');
+    size_t len;
+
+    if (!slash) {
+        strcpy(dir, ".");
+    } else {
+        len = slash == ctx->rules_file ? 1 : (size_t) (slash - ctx->rules_file);
+        if (len >= sizeof(dir)) {
+            return -1;
+        }
+        memcpy(dir, ctx->rules_file, len);
+        dir[len] = '\0';
+    }
+
+    ctx->reload_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ctx->reload_inotify < 0) {
+        tg_log(TG_LOG_WARN, "inotify unavailable (%s), polling %s",
+               strerror(errno), ctx->rules_file);
+        return -1;
+    }
+
+    if (inotify_add_watch(ctx->reload_inotify, dir,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+        tg_log(TG_LOG_WARN, "cannot watch %s (%s), polling %s",
+               dir, strerror(errno), ctx->rules_file);
+        close(ctx->reload_inotify);
+        ctx->reload_inotify = -1;
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+/* Watcher thread: waits for changes to the rules file, lets them settle,
+ * then reloads. Without inotify the file is polled. Threat intelligence
+ * updates are checked for on the poll interval. */
+static void *tg_security_reload_thread(void *data)
+{
+    struct tg_security_ctx *ctx = data;
+    struct pollfd fds[2];
+    struct stat st;
+    int nfds = 1;
+    int pending = 0;
+    int timeout;
+    int ret;
+
+    fds[0].fd = ctx->reload_pipe[0];
+    fds[0].events = POLLIN;
+    if (ctx->reload_inotify >= 0) {
+        fds[1].fd = ctx->reload_inotify;
+        fds[1].events = POLLIN;
+        nfds = 2;
+    }
+
+    while (1) {
+        if (pending) {
+            timeout = TG_RELOAD_SETTLE_MS;
+        } else if (nfds == 1 || ctx->threat_intel_spool ||
+                   __atomic_load_n(&ctx->retired, __ATOMIC_RELAXED) ||
+                   __atomic_load_n(&ctx->ioc_retired, __ATOMIC_RELAXED)) {
+            timeout = TG_RELOAD_POLL_MS;
+        } else {
+            timeout = -1;
+        }
+
+        ret = poll(fds, nfds, timeout);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            tg_log(TG_LOG_ERROR, "rules watcher failed: %s", strerror(errno));
+            break;
+        }
+
+        /* Stop request */
+        if (fds[0].revents) {
+            break;
+        }
+
+        if (ret == 0) {
+            if (pending || (nfds == 1 && ctx->rules_file &&
+                            tg_security_rules_file_changed(ctx, &st))) {
+                pending = 0;
+                tg_security_reload_rules(ctx);
+            }
+            if (ctx->threat_intel_spool) {
+                tg_security_update_threat_intel(ctx);
+            }
+            tg_security_ruleset_reclaim(ctx);
+            continue;
+        }
+
+#ifdef TG_PLATFORM_LINUX
+        /* Writes to the file itself always count; other entries only if
+         * the path now resolves to a different file, as after the symlink
+         * swap of a mounted config map */
+        if (nfds == 2 && fds[1].revents) {
+            ret = tg_security_reload_read_events(ctx);
+            if (ret == 2 || (ret == 1 && tg_security_rules_file_changed(ctx, &st))) {
+                pending = 1;
+            }
+        }
+#endif
+    }
+
+    return NULL;
+}
+
+/* Watch rules_file and reload it whenever it changes, and apply threat
+ * intelligence updates if a spool is set. rules_file may be NULL to only
+ * apply updates. */
+int tg_security_reload_start(struct tg_security_ctx *ctx, const char *rules_file)
+{
+    if (!ctx || (!rules_file && !ctx->threat_intel_spool) || ctx->reload_running) {
+        return -1;
+    }
+
+    if (rules_file) {
+        ctx->rules_file = flb_strdup(rules_file);
+        if (!ctx->rules_file) {
+            return -1;
+        }
+
+        /* Changes made from now on count, even if the initial load used
+         * the default rules */
+        if (stat(ctx->rules_file, &ctx->rules_file_stat) != 0) {
+            memset(&ctx->rules_file_stat, 0, sizeof(ctx->rules_file_stat));
+        }
+    }
+
+    if (pipe(ctx->reload_pipe) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to create rules watcher pipe: %s", strerror(errno));
+        ctx->reload_pipe[0] = -1;
+        ctx->reload_pipe[1] = -1;
+        return -1;
+    }
+    fcntl(ctx->reload_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(ctx->reload_pipe[1], F_SETFD, FD_CLOEXEC);
+
+#ifdef TG_PLATFORM_LINUX
+    if (ctx->rules_file) {
+        tg_security_reload_watch(ctx);
+    }
+#endif
+
+    if (pthread_create(&ctx->reload_thread, NULL, tg_security_reload_thread, ctx) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to start rules watcher");
+        tg_security_reload_stop(ctx);
+        return -1;
+    }
+    ctx->reload_running = 1;
+
+    if (ctx->rules_file) {
+        tg_log(TG_LOG_INFO, "watching %s for rule changes (%s)", ctx->rules_file,
+               ctx->reload_inotify >= 0 ? "inotify" : "polling");
+    }
+    if (ctx->threat_intel_spool) {
+        tg_log(TG_LOG_INFO, "applying threat intelligence updates from %s every %d s",
+               ctx->threat_intel_spool, ctx->threat_intel_interval);
+    }
+    return 0;
+}
+
+/* Stop the watcher; a reload in progress completes first */
+void tg_security_reload_stop(struct tg_security_ctx *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    if (ctx->reload_running) {
+        if (write(ctx->reload_pipe[1], "x", 1) != 1) {
+            tg_log(TG_LOG_WARN, "failed to signal rules watcher");
+        }
+        pthread_join(ctx->reload_thread, NULL);
+        ctx->reload_running = 0;
+    }
+
+    if (ctx->reload_inotify >= 0) {
+        close(ctx->reload_inotify);
+        ctx->reload_inotify = -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (ctx->reload_pipe[i] >= 0) {
+            close(ctx->reload_pipe[i]);
+            ctx->reload_pipe[i] = -1;
+        }
+    }
+
+    flb_free(ctx->rules_file);
+    ctx->rules_file = NULL;
+}
+
+/* Free the current and all retired rule sets, and the retired indicator
+ * stores; no worker may be reading */
+void tg_security_ruleset_cleanup(struct tg_security_ctx *ctx)
+{
+    struct tg_security_retired_ioc *retired;
+    struct tg_security_ruleset *set;
+
+    if (!ctx || !ctx->reload_ready) {
+        return;
+    }
+
+    while ((set = ctx->retired)) {
+        ctx->retired = set->next;
+        tg_security_ruleset_destroy(set);
+    }
+
+    while ((retired = ctx->ioc_retired)) {
+        ctx->ioc_retired = retired->next;
+        tg_ioc_store_destroy(retired->store);
+        flb_free(retired);
+    }
+
+    tg_security_ruleset_destroy(ctx->ruleset);
+    ctx->ruleset = NULL;
+
+    pthread_mutex_destroy(&ctx->reload_lock);
+    ctx->reload_ready = 0;
+}
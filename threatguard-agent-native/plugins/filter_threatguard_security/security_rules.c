@@ -3,67 +3,27 @@
  *  Copyright (C) 2025 BG Threat AI
  */
 
-#include "../../include/threatguard.h"
-
-/* Security rule actions */
-#define TG_SECURITY_ACTION_PASS     0
-#define TG_SECURITY_ACTION_FLAG     1
-#define TG_SECURITY_ACTION_DROP     2
-#define TG_SECURITY_ACTION_ENRICH   3
-
-/* Security rule types */
-#define TG_RULE_TYPE_FIELD_MATCH    1
-#define TG_RULE_TYPE_FIELD_REGEX    2
-#define TG_RULE_TYPE_FIELD_EXISTS   3
-#define TG_RULE_TYPE_THREAT_INTEL   4
-#define TG_RULE_TYPE_BEHAVIORAL     5
-#define TG_RULE_TYPE_COMPLIANCE     6
-
-/* Extended security rule structure */
-struct tg_security_rule {
-    int id;
-    char name[128];
-    char description[256];
-    int type;
-    int priority;
-    int action;
-    int enabled;
-    
-    /* Rule matching criteria */
-    char field_name[64];
-    char pattern[256];
-    tg_compliance_t compliance_type;
-    
-    /* Rule statistics */
-    uint64_t match_count;
-    time_t last_match;
-    time_t created;
+#include "security_rules.h"
+
+#include <dirent.h>
+
+/* Suffix of delta files in the threat intelligence spool; a file that
+ * cannot be applied is renamed with TG_THREAT_INTEL_REJECTED appended */
+#define TG_THREAT_INTEL_DELTA       ".delta"
+#define TG_THREAT_INTEL_REJECTED    ".rejected"
+
+const char *tg_security_threat_intel_fields[TG_SECURITY_THREAT_INTEL_FIELDS] = {
+    "src_ip", "dst_ip", "domain", "url", "file_hash"
 };
 
-/* Update the context structure to include the extended rules */
-struct tg_security_ctx {
-    struct flb_filter_instance *ins;
-    struct tg_agent_config *config;
-    
-    /* Security rules */
-    int rule_count;
-    struct tg_security_rule rules[10000]; /* Support up to 10k rules */
-    
-    /* Threat intelligence cache */
-    struct flb_hash *threat_intel_cache;
-    time_t threat_intel_last_update;
-    
-    /* Behavioral analysis state */
-    struct flb_hash *user_sessions;
-    struct flb_hash *process_tracking;
-    
-    /* Statistics */
-    uint64_t events_processed;
-    uint64_t events_flagged;
-    uint64_t events_dropped;
-    uint64_t rules_matched;
+/* Indicator kind looked up for each field */
+const int tg_security_threat_intel_kinds[TG_SECURITY_THREAT_INTEL_FIELDS] = {
+    TG_IOC_IP, TG_IOC_IP, TG_IOC_DOMAIN, TG_IOC_URL, TG_IOC_HASH
 };
 
+static void tg_security_user_session_closed(uint64_t key, const struct tg_session *session,
+                                            void *data);
+
 /* Initialize security rules system */
 int tg_security_init_rules(struct tg_security_ctx *ctx)
 {
@@ -74,150 +34,268 @@ int tg_security_init_rules(struct tg_security_ctx *ctx)
     
     tg_log(TG_LOG_DEBUG, "initializing security rules engine");
     
-    /* Initialize rule array */
-    ctx->rule_count = 0;
-    memset(ctx->rules, 0, sizeof(ctx->rules));
+    /* Substring checks use the widest vector search the CPU supports */
+    tg_log(TG_LOG_DEBUG, "substring search: %s",
+           tg_search_name(tg_search_init(TG_SEARCH_AVX2)));
     
-    /* Initialize threat intelligence cache */
-    ctx->threat_intel_cache = flb_hash_create(FLB_HASH_EVICT_LRU, 10000, 0);
-    if (!ctx->threat_intel_cache) {
-        tg_log(TG_LOG_ERROR, "failed to create threat intelligence cache");
+    /* No rule set until one is loaded and published */
+    ctx->regex_cache_size = TG_REGEX_DEFAULT_CACHE_SIZE;
+    if (tg_security_ruleset_init(ctx) != 0) {
         return -1;
     }
+    
+    /* No indicators until a feed is loaded */
+    ctx->ioc = NULL;
+    ctx->threat_intel_spool = NULL;
+    ctx->threat_intel_interval = 60;
+    ctx->threat_intel_cache_size = 8192;
     ctx->threat_intel_last_update = 0;
     
-    /* Initialize behavioral analysis tracking */
-    ctx->user_sessions = flb_hash_create(FLB_HASH_EVICT_LRU, 1000, 300); /* 5 min TTL */
-    ctx->process_tracking = flb_hash_create(FLB_HASH_EVICT_LRU, 5000, 600); /* 10 min TTL */
+    /* Initialize behavioral analysis tracking; RATE rule counters are
+     * sized by the filter configuration */
+    ctx->rate_keys = NULL;
+    ctx->distinct_keys = NULL;
+    ctx->sequence_keys = NULL;
+    ctx->behavior_clock = 0;
+    ctx->full_rule_stats = 0;
+    ctx->columnar_evaluation = 0;
+    ctx->pool = NULL;
+    ctx->pool_min_chunk = TG_SECURITY_POOL_MIN_CHUNK;
+    memset(&ctx->enrichment, 0, sizeof(ctx->enrichment));
     
-    if (!ctx->user_sessions || !ctx->process_tracking) {
-        tg_log(TG_LOG_ERROR, "failed to create behavioral tracking structures");
+    /* Session and process tracking have no caller in rule evaluation;
+     * their tables are created on first use */
+    ctx->user_sessions = NULL;
+    ctx->process_tracking = NULL;
+    
+    /* Initialize per-worker state */
+    if (tg_security_workers_init(ctx) != 0) {
         return -1;
     }
     
-    /* Initialize statistics */
-    ctx->events_processed = 0;
-    ctx->events_flagged = 0;
-    ctx->events_dropped = 0;
-    ctx->rules_matched = 0;
-    
     tg_log(TG_LOG_INFO, "security rules engine initialized successfully");
     return 0;
 }
 
+/* Create an empty rule set; rule arrays grow as rules are added */
+struct tg_security_ruleset *tg_security_ruleset_create(void)
+{
+    struct tg_security_ruleset *set;
+
+    set = flb_calloc(1, sizeof(struct tg_security_ruleset));
+    if (!set) {
+        tg_log(TG_LOG_ERROR, "failed to allocate rule set");
+        return NULL;
+    }
+
+    for (int i = 0; i < TG_SECURITY_THREAT_INTEL_FIELDS; i++) {
+        set->threat_intel_slots[i] = TG_FIELD_SLOT_NONE;
+    }
+    set->event_type_slot = TG_FIELD_SLOT_NONE;
+
+    return set;
+}
+
 /* Add default security rules */
-void tg_security_add_default_rules(struct tg_security_ctx *ctx)
+void tg_security_add_default_rules(struct tg_security_ruleset *set)
 {
-    if (!ctx) {
+    if (!set) {
         return;
     }
     
     tg_log(TG_LOG_DEBUG, "adding default security rules");
     
     /* Rule 1: Failed login detection */
-    tg_security_add_rule(ctx, 1, "Failed Login Detection", 
+    tg_security_add_rule(set, 1, "Failed Login Detection", 
                          "Detect authentication failures",
                          TG_RULE_TYPE_FIELD_REGEX, 90, TG_SECURITY_ACTION_FLAG,
                          "message", "(failed|failure|denied|invalid).*login");
     
     /* Rule 2: Privilege escalation detection */
-    tg_security_add_rule(ctx, 2, "Privilege Escalation",
+    tg_security_add_rule(set, 2, "Privilege Escalation",
                          "Detect privilege escalation attempts", 
                          TG_RULE_TYPE_FIELD_REGEX, 95, TG_SECURITY_ACTION_FLAG,
-                         "message", "(sudo|su|runas|escalat|privileg)");
+                         "message", "(sudo|runas|escalat|privileg|su([^a-z]|$))");
     
     /* Rule 3: Malware indicators */
-    tg_security_add_rule(ctx, 3, "Malware Indicators",
+    tg_security_add_rule(set, 3, "Malware Indicators",
                          "Detect malware-related events",
                          TG_RULE_TYPE_FIELD_REGEX, 85, TG_SECURITY_ACTION_FLAG,
                          "message", "(virus|malware|trojan|ransomware|backdoor)");
     
     /* Rule 4: Suspicious network activity */
-    tg_security_add_rule(ctx, 4, "Suspicious Network Activity",
+    tg_security_add_rule(set, 4, "Suspicious Network Activity",
                          "Detect suspicious network connections",
                          TG_RULE_TYPE_FIELD_REGEX, 75, TG_SECURITY_ACTION_FLAG,
                          "message", "(connection.*refused|port.*scan|brute.*force)");
     
     /* Rule 5: System file modification */
-    tg_security_add_rule(ctx, 5, "System File Modification",
+    tg_security_add_rule(set, 5, "System File Modification",
                          "Detect modifications to system files",
                          TG_RULE_TYPE_FIELD_REGEX, 80, TG_SECURITY_ACTION_FLAG,
                          "message", "(system32|etc/passwd|etc/shadow|hosts).*modif");
     
     /* Rule 6: Compliance - PCI DSS payment data */
-    tg_security_add_rule(ctx, 6, "PCI DSS Payment Data",
+    tg_security_add_rule(set, 6, "PCI DSS Payment Data",
                          "Monitor payment card data access",
                          TG_RULE_TYPE_COMPLIANCE, 100, TG_SECURITY_ACTION_FLAG,
                          "message", "(card|payment|transaction)");
     
     /* Rule 7: HIPAA patient data */
-    tg_security_add_rule(ctx, 7, "HIPAA Patient Data",
+    tg_security_add_rule(set, 7, "HIPAA Patient Data",
                          "Monitor patient health information",
                          TG_RULE_TYPE_COMPLIANCE, 100, TG_SECURITY_ACTION_FLAG,
                          "message", "(patient|medical|health|phi)");
     
     /* Rule 8: Noise reduction - heartbeats */
-    tg_security_add_rule(ctx, 8, "Noise Reduction",
+    tg_security_add_rule(set, 8, "Noise Reduction",
                          "Drop low-value heartbeat messages",
                          TG_RULE_TYPE_FIELD_REGEX, 10, TG_SECURITY_ACTION_DROP,
-                         "message", "(heartbeat|ping|health.*check)");
+                         "message", "^(heartbeat|ping|health.*check)");
     
     /* Rule 9: Critical system events */
-    tg_security_add_rule(ctx, 9, "Critical System Events",
+    tg_security_add_rule(set, 9, "Critical System Events",
                          "Flag critical system events",
                          TG_RULE_TYPE_FIELD_REGEX, 100, TG_SECURITY_ACTION_FLAG,
                          "level", "(critical|fatal|emergency)");
     
     /* Rule 10: Threat intelligence indicators */
-    tg_security_add_rule(ctx, 10, "Threat Intelligence",
+    tg_security_add_rule(set, 10, "Threat Intelligence",
                          "Check against threat intel feeds",
                          TG_RULE_TYPE_THREAT_INTEL, 98, TG_SECURITY_ACTION_FLAG,
                          "*", "*");
     
-    tg_log(TG_LOG_INFO, "added %d default security rules", ctx->rule_count);
+    tg_log(TG_LOG_INFO, "added %d default security rules", set->rule_count);
+}
+
+/* Make room for one more rule in the hot and cold arrays and for a
+ * pattern of pattern_len bytes in the pool */
+static int tg_security_reserve_rule(struct tg_security_ruleset *set, size_t pattern_len)
+{
+    if (set->rule_count == set->rule_alloc) {
+        int alloc = set->rule_alloc ? set->rule_alloc * 2 : 64;
+        struct tg_security_rule *rules;
+        struct tg_security_rule_info *info;
+
+        if (alloc > TG_SECURITY_MAX_RULES) {
+            alloc = TG_SECURITY_MAX_RULES;
+        }
+
+        rules = flb_realloc(set->rules, alloc * sizeof(struct tg_security_rule));
+        if (!rules) {
+            return -1;
+        }
+        set->rules = rules;
+
+        info = flb_realloc(set->rule_info, alloc * sizeof(struct tg_security_rule_info));
+        if (!info) {
+            return -1;
+        }
+        set->rule_info = info;
+        set->rule_alloc = alloc;
+    }
+
+    if (set->patterns_len + pattern_len + 1 > set->patterns_alloc) {
+        size_t alloc = set->patterns_alloc ? set->patterns_alloc * 2 : 4096;
+        char *patterns;
+
+        while (alloc < set->patterns_len + pattern_len + 1) {
+            alloc *= 2;
+        }
+
+        patterns = flb_realloc(set->patterns, alloc);
+        if (!patterns) {
+            return -1;
+        }
+        set->patterns = patterns;
+        set->patterns_alloc = alloc;
+    }
+
+    return 0;
 }
 
 /* Add a security rule */
-int tg_security_add_rule(struct tg_security_ctx *ctx, int id, const char *name,
+int tg_security_add_rule(struct tg_security_ruleset *set, int id, const char *name,
                         const char *description, int type, int priority, int action,
                         const char *field_name, const char *pattern)
 {
-    if (!ctx || ctx->rule_count >= 10000) {
+    struct tg_security_sequence sequence;
+    size_t pattern_len;
+
+    if (!set || set->map || set->rule_count >= TG_SECURITY_MAX_RULES) {
+        return -1;
+    }
+
+    if (type == TG_RULE_TYPE_RATE && tg_security_rate_parse(pattern, NULL, NULL, NULL) != 0) {
+        tg_log(TG_LOG_ERROR, "invalid rate '%s' in rule %d: %s", pattern, id, name);
         return -1;
     }
+    if (type == TG_RULE_TYPE_DISTINCT &&
+        tg_security_distinct_parse(pattern, NULL, NULL, NULL, NULL, NULL) != 0) {
+        tg_log(TG_LOG_ERROR, "invalid distinct count '%s' in rule %d: %s", pattern, id, name);
+        return -1;
+    }
+    if (type == TG_RULE_TYPE_SEQUENCE && tg_security_sequence_parse(pattern, &sequence) != 0) {
+        tg_log(TG_LOG_ERROR, "invalid sequence '%s' in rule %d: %s", pattern, id, name);
+        return -1;
+    }
+
+    pattern_len = strlen(pattern);
+    if (pattern_len > TG_SECURITY_MAX_PATTERN) {
+        pattern_len = TG_SECURITY_MAX_PATTERN;
+    }
+
+    if (tg_security_reserve_rule(set, pattern_len) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to allocate rule %d: %s", id, name);
+        return -1;
+    }
+
+    if (priority > INT16_MAX) {
+        priority = INT16_MAX;
+    } else if (priority < INT16_MIN) {
+        priority = INT16_MIN;
+    }
     
-    struct tg_security_rule *rule = &ctx->rules[ctx->rule_count];
+    struct tg_security_rule *rule = &set->rules[set->rule_count];
+    struct tg_security_rule_info *info = &set->rule_info[set->rule_count];
     
-    rule->id = id;
-    strncpy(rule->name, name, sizeof(rule->name) - 1);
-    strncpy(rule->description, description, sizeof(rule->description) - 1);
+    memset(rule, 0, sizeof(*rule));
     rule->type = type;
     rule->priority = priority;
     rule->action = action;
     rule->enabled = 1;
     
-    strncpy(rule->field_name, field_name, sizeof(rule->field_name) - 1);
-    strncpy(rule->pattern, pattern, sizeof(rule->pattern) - 1);
+    memcpy(set->patterns + set->patterns_len, pattern, pattern_len);
+    set->patterns[set->patterns_len + pattern_len] = '\0';
+    rule->pattern = (uint32_t) set->patterns_len;
+    rule->pattern_len = (uint16_t) pattern_len;
+    set->patterns_len += pattern_len + 1;
+    
     rule->compliance_type = TG_COMPLIANCE_NONE;
+    rule->matcher = TG_RULE_MATCHER_GENERIC;
+    rule->field_slot = TG_FIELD_SLOT_NONE;
     
-    rule->match_count = 0;
-    rule->last_match = 0;
-    rule->created = time(NULL);
+    memset(info, 0, sizeof(*info));
+    info->id = id;
+    strncpy(info->name, name, sizeof(info->name) - 1);
+    strncpy(info->description, description, sizeof(info->description) - 1);
+    strncpy(info->field_name, field_name, sizeof(info->field_name) - 1);
+    info->created = time(NULL);
     
-    ctx->rule_count++;
+    set->rule_count++;
     
     tg_log(TG_LOG_DEBUG, "added rule %d: %s (priority %d)", id, name, priority);
     return 0;
 }
 
 /* Load rules from configuration file */
-int tg_security_load_rules_file(struct tg_security_ctx *ctx, const char *filename)
+int tg_security_load_rules_file(struct tg_security_ruleset *set, const char *filename)
 {
     FILE *file;
     char line[512];
     int rules_loaded = 0;
     
-    if (!ctx || !filename) {
+    if (!set || !filename) {
         return -1;
     }
     
@@ -229,26 +307,29 @@ int tg_security_load_rules_file(struct tg_security_ctx *ctx, const char *filenam
     
     tg_log(TG_LOG_DEBUG, "loading security rules from %s", filename);
     
-    while (fgets(line, sizeof(line), file) && ctx->rule_count < 10000) {
+    while (fgets(line, sizeof(line), file) && set->rule_count < TG_SECURITY_MAX_RULES) {
         /* Skip comments and empty lines */
         if (line[0] == '#' || line[0] == '\n' || line[0] == '\0') {
             continue;
         }
         
-        /* Parse rule line: id|name|type|priority|action|field|pattern */
-        char *token;
+        /* Parse rule line: id|name|type|priority|action|field|pattern;
+         * field may be a nested path such as user.name or process.args[0] */
+        char *token = line;
         char *tokens[7];
         int token_count = 0;
         
-        /* Tokenize the line */
-        token = strtok(line, "|");
-        while (token && token_count < 7) {
-            tokens[token_count] = token;
-            token_count++;
-            token = strtok(NULL, "|");
+        /* Tokenize the line; the pattern is the remainder and may contain '|' */
+        while (token && token_count < 6) {
+            tokens[token_count++] = token;
+            token = strchr(token, '|');
+            if (token) {
+                *token++ = '\0';
+            }
         }
+        tokens[6] = token;
         
-        if (token_count >= 6) {
+        if (token_count == 6 && tokens[6]) {
             int id = atoi(tokens[0]);
             char *name = tokens[1];
             int type = atoi(tokens[2]);
@@ -260,7 +341,7 @@ int tg_security_load_rules_file(struct tg_security_ctx *ctx, const char *filenam
             /* Remove newline from pattern */
             pattern[strcspn(pattern, "\n")] = '\0';
             
-            if (tg_security_add_rule(ctx, id, name, "", type, priority, action, field, pattern) == 0) {
+            if (tg_security_add_rule(set, id, name, "", type, priority, action, field, pattern) == 0) {
                 rules_loaded++;
             }
         }
@@ -272,117 +353,1052 @@ int tg_security_load_rules_file(struct tg_security_ctx *ctx, const char *filenam
     return rules_loaded;
 }
 
-/* Threat intelligence lookup */
-int tg_threat_intel_lookup(const char *indicator, size_t indicator_len)
+/* Release compiled matchers, the field dictionary and the evaluation
+ * plan, leaving every rule on the generic path */
+static void tg_security_free_matchers(struct tg_security_ruleset *set)
 {
-    /* This is a placeholder implementation */
-    /* In production, this would query real threat intelligence feeds */
-    
-    if (!indicator || indicator_len == 0) {
+    flb_free(set->plan);
+    flb_free(set->stateful);
+    flb_free(set->windows);
+    flb_free(set->window_index);
+    set->plan = NULL;
+    set->stateful = NULL;
+    set->windows = NULL;
+    set->window_index = NULL;
+    set->plan_count = 0;
+    set->stateful_count = 0;
+
+    for (int i = 0; i < set->matcher_count; i++) {
+        tg_ac_destroy(set->matchers[i].ac);
+        tg_regex_set_destroy(set->matchers[i].regex);
+    }
+
+    flb_free(set->matchers);
+    set->matchers = NULL;
+    set->matcher_count = 0;
+
+    tg_field_dict_destroy(set->fields);
+    set->fields = NULL;
+    set->paths = NULL;
+    for (int i = 0; i < TG_SECURITY_THREAT_INTEL_FIELDS; i++) {
+        set->threat_intel_slots[i] = TG_FIELD_SLOT_NONE;
+    }
+    set->event_type_slot = TG_FIELD_SLOT_NONE;
+
+    /* Mapped rule tables are read-only */
+    if (set->map) {
+        return;
+    }
+
+    for (int i = 0; i < set->rule_count; i++) {
+        set->rules[i].matcher = TG_RULE_MATCHER_GENERIC;
+        set->rules[i].field_slot = TG_FIELD_SLOT_NONE;
+    }
+}
+
+/* Free a rule set that no worker can be reading any more */
+void tg_security_ruleset_destroy(struct tg_security_ruleset *set)
+{
+    if (!set) {
+        return;
+    }
+
+    tg_security_free_matchers(set);
+    if (set->map) {
+        tg_security_bundle_unmap(set);
+    } else {
+        flb_free(set->rules);
+        flb_free(set->rule_info);
+        flb_free(set->patterns);
+    }
+    flb_free(set);
+}
+
+/* Rule types that read the field named by the rule */
+static int tg_security_rule_reads_field(const struct tg_security_rule *rule,
+                                        const struct tg_security_rule_info *info)
+{
+    switch (rule->type) {
+        case TG_RULE_TYPE_FIELD_MATCH:
+        case TG_RULE_TYPE_FIELD_REGEX:
+        case TG_RULE_TYPE_FIELD_EXISTS:
+        case TG_RULE_TYPE_RATE:
+        case TG_RULE_TYPE_DISTINCT:
+        case TG_RULE_TYPE_SEQUENCE:
+            return info->field_name[0] != '\0' && strcmp(info->field_name, "*") != 0;
+        default:
+            return 0;
+    }
+}
+
+/* Give every field a rule can read a dictionary slot */
+static int tg_security_build_fields(struct tg_security_ruleset *set)
+{
+    set->fields = tg_field_dict_create();
+    if (!set->fields) {
+        return -1;
+    }
+
+    for (int i = 0; i < TG_SECURITY_THREAT_INTEL_FIELDS; i++) {
+        const char *name = tg_security_threat_intel_fields[i];
+
+        set->threat_intel_slots[i] = tg_field_dict_add(set->fields, name, strlen(name));
+        if (set->threat_intel_slots[i] < 0) {
+            return -1;
+        }
+    }
+
+    set->event_type_slot = tg_field_dict_add(set->fields, "event_type", 10);
+    if (set->event_type_slot < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < set->rule_count; i++) {
+        struct tg_security_rule *rule = &set->rules[i];
+        struct tg_security_rule_info *info = &set->rule_info[i];
+
+        if (!tg_security_rule_reads_field(rule, info)) {
+            continue;
+        }
+
+        rule->field_slot = tg_field_dict_add_path(set->fields, info->field_name,
+                                                  strlen(info->field_name));
+        if (rule->field_slot < 0) {
+            return -1;
+        }
+        
+        /* The field whose values a DISTINCT rule counts is indexed too */
+        if (rule->type == TG_RULE_TYPE_DISTINCT) {
+            const char *field;
+            size_t field_len;
+            
+            if (tg_security_distinct_parse(set->patterns + rule->pattern, &field, &field_len,
+                                           NULL, NULL, NULL) != 0 ||
+                tg_field_dict_add_path(set->fields, field, field_len) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    if (tg_field_dict_compile(set->fields) != 0) {
+        return -1;
+    }
+    set->paths = tg_field_dict_paths(set->fields);
+
+    return 0;
+}
+
+/* A pattern without regex metacharacters is matched as a plain substring */
+static int tg_security_pattern_is_literal(const char *pattern)
+{
+    if (!pattern[0]) {
         return 0;
     }
+    return pattern[strcspn(pattern, "\\^$.|?*+()[]{}")] == '\0';
+}
+
+static struct tg_security_field_matcher *tg_security_get_matcher(struct tg_security_ruleset *set,
+                                                                 const char *field_name,
+                                                                 int field_slot)
+{
+    struct tg_security_field_matcher *matcher;
+
+    for (int i = 0; i < set->matcher_count; i++) {
+        if (strcmp(set->matchers[i].field_name, field_name) == 0) {
+            return &set->matchers[i];
+        }
+    }
+
+    /* At most one matcher per distinct field, so rule_count bounds the array */
+    matcher = &set->matchers[set->matcher_count++];
+    strncpy(matcher->field_name, field_name, sizeof(matcher->field_name) - 1);
+    matcher->field_name[sizeof(matcher->field_name) - 1] = '\0';
+    matcher->field_slot = field_slot;
+
+    return matcher;
+}
+
+/* Add one FIELD_REGEX rule to its field matcher; returns the matcher kind
+ * used, TG_RULE_MATCHER_GENERIC if the pattern could not be compiled */
+static int tg_security_compile_rule(struct tg_security_ruleset *set,
+                                    struct tg_security_field_matcher *matcher, uint32_t index)
+{
+    struct tg_security_rule *rule = &set->rules[index];
+    struct tg_security_rule_info *info = &set->rule_info[index];
+    const char *pattern = set->patterns + rule->pattern;
+    char error[128];
+
+    if (tg_security_pattern_is_literal(pattern)) {
+        if (!matcher->ac && !(matcher->ac = tg_ac_create())) {
+            return -1;
+        }
+        if (tg_ac_add_pattern(matcher->ac, pattern, rule->pattern_len, index) != 0) {
+            return -1;
+        }
+        return TG_RULE_MATCHER_LITERAL;
+    }
+
+    if (!matcher->regex && !(matcher->regex = tg_regex_set_create())) {
+        return -1;
+    }
+    if (tg_regex_set_add(matcher->regex, pattern, index, error, sizeof(error)) != 0) {
+        tg_log(TG_LOG_WARN, "rule %d (%s): invalid regex '%s': %s, using substring match",
+               info->id, info->name, pattern, error);
+        return TG_RULE_MATCHER_GENERIC;
+    }
+    return TG_RULE_MATCHER_REGEX;
+}
+
+/* Index rule fields and compile FIELD_REGEX rules into one automaton and
+ * one regex program per field; workers build their own lazy DFAs */
+static int tg_security_compile_matchers(struct tg_security_ruleset *set)
+{
+    int literal_rules = 0;
+    int regex_rules = 0;
+
+    /* Bundles are compiled already */
+    if (set->map) {
+        return 0;
+    }
+
+    tg_security_free_matchers(set);
+
+    if (set->rule_count == 0) {
+        return 0;
+    }
+
+    set->matchers = flb_calloc(set->rule_count, sizeof(struct tg_security_field_matcher));
+    if (!set->matchers) {
+        tg_log(TG_LOG_ERROR, "failed to allocate rule matchers");
+        tg_security_free_matchers(set);
+        return -1;
+    }
+
+    if (tg_security_build_fields(set) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to build rule field dictionary");
+        tg_security_free_matchers(set);
+        return -1;
+    }
+
+    for (int i = 0; i < set->rule_count; i++) {
+        struct tg_security_rule *rule = &set->rules[i];
+        struct tg_security_field_matcher *matcher;
+        int kind;
+
+        if (rule->type != TG_RULE_TYPE_FIELD_REGEX) {
+            continue;
+        }
+
+        matcher = tg_security_get_matcher(set, set->rule_info[i].field_name, rule->field_slot);
+        kind = tg_security_compile_rule(set, matcher, i);
+        if (kind < 0) {
+            tg_log(TG_LOG_ERROR, "failed to compile rule %d: %s",
+                   set->rule_info[i].id, set->rule_info[i].name);
+            tg_security_free_matchers(set);
+            return -1;
+        }
+
+        rule->matcher = kind;
+        if (kind == TG_RULE_MATCHER_LITERAL) {
+            literal_rules++;
+        } else if (kind == TG_RULE_MATCHER_REGEX) {
+            regex_rules++;
+        }
+    }
+
+    for (int i = 0; i < set->matcher_count; i++) {
+        struct tg_security_field_matcher *matcher = &set->matchers[i];
+        int ret = 0;
+
+        if (matcher->ac) {
+            ret = tg_ac_compile(matcher->ac);
+        }
+        if (ret == 0 && matcher->regex) {
+            ret = tg_regex_set_compile(matcher->regex);
+        }
+
+        if (ret != 0) {
+            tg_log(TG_LOG_ERROR, "failed to compile matcher for field %s", matcher->field_name);
+            tg_security_free_matchers(set);
+            return -1;
+        }
+    }
+
+    tg_log(TG_LOG_INFO, "compiled %d literal and %d regex rules into %d field matchers, "
+           "%u indexed fields", literal_rules, regex_rules, set->matcher_count,
+           tg_field_dict_count(set->fields));
+    return 0;
+}
+
+/* Compile the matchers of set and plan its evaluation. A set whose
+ * matchers fail to compile is still planned, for per-rule evaluation. */
+int tg_security_compile_rules(struct tg_security_ruleset *set)
+{
+    int ret;
+
+    if (!set) {
+        return -1;
+    }
+
+    ret = tg_security_compile_matchers(set);
+    if (tg_security_plan_rules(set) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to plan rule evaluation");
+        return -1;
+    }
+    return ret;
+}
+
+/* A rule that keeps state across events, and must see every one */
+static int tg_security_rule_is_stateful(const struct tg_security_rule *rule)
+{
+    return rule->type == TG_RULE_TYPE_RATE || rule->type == TG_RULE_TYPE_DISTINCT ||
+           rule->type == TG_RULE_TYPE_SEQUENCE;
+}
+
+/* Parse the pattern of window rule index, so that events never do */
+static int tg_security_window_init(const struct tg_security_ruleset *set, int index,
+                                   struct tg_security_window *window)
+{
+    const struct tg_security_rule *rule = &set->rules[index];
+    const char *pattern = set->patterns + rule->pattern;
+    const char *field;
+    size_t field_len;
+
+    memset(window, 0, sizeof(*window));
+    window->field_slot = TG_FIELD_SLOT_NONE;
+    if (rule->type == TG_RULE_TYPE_RATE) {
+        if (tg_security_rate_parse(pattern, &window->limit, &window->window,
+                                   &window->event_type) != 0) {
+            return -1;
+        }
+        /* The window spans at most TG_WINDOW_BUCKETS units of width seconds */
+        window->width = (window->window + TG_WINDOW_BUCKETS - 1) / TG_WINDOW_BUCKETS;
+    } else if (rule->type == TG_RULE_TYPE_DISTINCT) {
+        if (tg_security_distinct_parse(pattern, &field, &field_len, &window->limit,
+                                       &window->window, &window->event_type) != 0) {
+            return -1;
+        }
+        /* build_fields indexed the counted field, so its slot is known */
+        memcpy(window->field_name, field, field_len);
+        window->field_name[field_len] = '\0';
+        if (set->fields) {
+            window->field_slot = tg_field_dict_lookup(set->fields, field, field_len);
+        }
+    } else if (rule->type == TG_RULE_TYPE_SEQUENCE) {
+        if (tg_security_sequence_parse(pattern, &window->sequence) != 0) {
+            return -1;
+        }
+        window->window = window->sequence.window;
+    }
+
+    if (window->event_type) {
+        window->event_type_len = strlen(window->event_type);
+    }
+    return 0;
+}
+
+/* Highest priority first, then in the order their rules were loaded */
+static int tg_security_cmp_step(const void *a, const void *b)
+{
+    const struct tg_security_step *x = a;
+    const struct tg_security_step *y = b;
+
+    if (x->priority != y->priority) {
+        return y->priority - x->priority;
+    }
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+/* Group the steps of the sorted plan. A tie in priority goes to the rule
+ * loaded first, so steps may only trade places when any match among them
+ * gives the same action: consecutive steps of one priority and one
+ * action, whose rules of that priority no step of another action comes
+ * between. Other steps are groups of their own. last[m] is the highest
+ * index of the rules of matcher m at its priority. */
+static void tg_security_group_steps(struct tg_security_ruleset *set, const uint32_t *last)
+{
+    struct tg_security_step *plan = set->plan;
+    int start = 0;
+
+    while (start < set->plan_count) {
+        uint32_t group_last = plan[start].kind == TG_SECURITY_STEP_MATCHER ?
+                              last[plan[start].index] : plan[start].index;
+        int end = start + 1;
+        int interleaved;
+
+        while (plan[start].action != TG_SECURITY_STEP_MIXED && end < set->plan_count &&
+               plan[end].priority == plan[start].priority &&
+               plan[end].action == plan[start].action) {
+            uint32_t step_last = plan[end].kind == TG_SECURITY_STEP_MATCHER ?
+                                 last[plan[end].index] : plan[end].index;
+
+            if (step_last > group_last) {
+                group_last = step_last;
+            }
+            end++;
+        }
+
+        interleaved = end < set->plan_count && plan[end].priority == plan[start].priority &&
+                      plan[end].first < group_last;
+        for (int s = start; s < end; s++) {
+            plan[s].group = (uint32_t) (interleaved ? s : start);
+        }
+        start = end;
+    }
+}
+
+/* Order the evaluation of set: each generic rule is a step, and each
+ * field matcher is one step with the priority of its highest rule */
+int tg_security_plan_rules(struct tg_security_ruleset *set)
+{
+    struct tg_security_step *plan;
+    uint32_t *last;
+    int count = 0;
+
+    flb_free(set->plan);
+    flb_free(set->stateful);
+    flb_free(set->windows);
+    flb_free(set->window_index);
+    set->plan_count = 0;
+    set->stateful_count = 0;
+
+    set->plan = flb_calloc((size_t) set->rule_count + set->matcher_count + 1,
+                           sizeof(struct tg_security_step));
+    set->stateful = flb_calloc((size_t) set->rule_count + 1, sizeof(uint32_t));
+    set->windows = flb_calloc((size_t) set->rule_count + 1, sizeof(struct tg_security_window));
+    set->window_index = flb_malloc(((size_t) set->rule_count + 1) * sizeof(int32_t));
+    last = flb_calloc((size_t) set->matcher_count + 1, sizeof(uint32_t));
+    if (!set->plan || !set->stateful || !set->windows || !set->window_index || !last) {
+        flb_free(last);
+        flb_free(set->plan);
+        flb_free(set->stateful);
+        flb_free(set->windows);
+        flb_free(set->window_index);
+        set->plan = NULL;
+        set->stateful = NULL;
+        set->windows = NULL;
+        set->window_index = NULL;
+        return -1;
+    }
+    plan = set->plan;
+
+    /* Matchers take the first steps, matcher m at step m */
+    for (int m = 0; m < set->matcher_count; m++) {
+        plan[m].kind = TG_SECURITY_STEP_MATCHER;
+        plan[m].index = (uint32_t) m;
+        plan[m].priority = INT16_MIN;
+    }
+    count = set->matcher_count;
+
+    for (int i = 0; i < set->rule_count; i++) {
+        const struct tg_security_rule *rule = &set->rules[i];
+
+        set->window_index[i] = -1;
+        if (!rule->enabled) {
+            continue;
+        }
+
+        if (rule->matcher != TG_RULE_MATCHER_GENERIC) {
+            for (int m = 0; m < set->matcher_count; m++) {
+                if (strcmp(set->matchers[m].field_name, set->rule_info[i].field_name) == 0) {
+                    if (rule->priority > plan[m].priority) {
+                        plan[m].priority = rule->priority;
+                        plan[m].action = rule->action;
+                        plan[m].first = (uint32_t) i;
+                    } else if (rule->priority == plan[m].priority &&
+                               rule->action != plan[m].action) {
+                        plan[m].action = TG_SECURITY_STEP_MIXED;
+                    }
+                    if (rule->priority == plan[m].priority) {
+                        last[m] = (uint32_t) i;
+                    }
+                    break;
+                }
+            }
+        } else if (tg_security_rule_is_stateful(rule)) {
+            /* A window rule whose pattern does not parse never matches */
+            if (tg_security_window_init(set, i, &set->windows[set->stateful_count]) != 0) {
+                tg_log(TG_LOG_WARN, "rule %d: invalid window pattern, skipping",
+                       set->rule_info[i].id);
+                continue;
+            }
+            set->window_index[i] = set->stateful_count;
+            set->stateful[set->stateful_count++] = (uint32_t) i;
+        } else {
+            plan[count].kind = TG_SECURITY_STEP_RULE;
+            plan[count].index = (uint32_t) i;
+            plan[count].first = (uint32_t) i;
+            plan[count].action = rule->action;
+            plan[count].priority = rule->priority;
+            count++;
+        }
+    }
+
+    /* A matcher without enabled rules never reports anything */
+    set->plan_count = 0;
+    for (int s = 0; s < count; s++) {
+        if (plan[s].kind == TG_SECURITY_STEP_MATCHER && plan[s].priority == INT16_MIN) {
+            continue;
+        }
+        plan[set->plan_count++] = plan[s];
+    }
+
+    qsort(plan, set->plan_count, sizeof(struct tg_security_step), tg_security_cmp_step);
+    tg_security_group_steps(set, last);
+    flb_free(last);
+    return 0;
+}
+
+/* Load a compiled rule set from a rules file, mapping it directly if it is
+ * a precompiled bundle. Returns NULL if no rules could be loaded. */
+struct tg_security_ruleset *tg_security_load_ruleset(const char *filename)
+{
+    struct tg_security_ruleset *set;
+
+    if (tg_security_bundle_detect(filename)) {
+        return tg_security_bundle_load(filename);
+    }
+
+    set = tg_security_ruleset_create();
+    if (!set) {
+        return NULL;
+    }
+
+    if (tg_security_load_rules_file(set, filename) <= 0) {
+        tg_security_ruleset_destroy(set);
+        return NULL;
+    }
+
+    if (tg_security_compile_rules(set) != 0) {
+        tg_log(TG_LOG_WARN, "failed to compile rule matchers for %s, "
+               "using per-rule evaluation", filename);
+    }
+    return set;
+}
+
+/* Load the threat intelligence feed into a new indicator store and make
+ * it the one filters look up. Returns the number of indicators loaded. */
+int tg_security_load_threat_intel(struct tg_security_ctx *ctx, const char *filename)
+{
+    struct tg_ioc_store *store;
+    int ret;
+
+    if (!ctx || !filename) {
+        return -1;
+    }
+
+    store = tg_ioc_store_create();
+    if (!store) {
+        return -1;
+    }
+
+    ret = tg_ioc_store_load(store, filename);
+    if (ret < 0) {
+        tg_ioc_store_destroy(store);
+        return -1;
+    }
+
+    tg_security_ioc_publish(ctx, store);
+
+    tg_log(TG_LOG_INFO, "threat intelligence store holds %llu indicators in %zu KB",
+           (unsigned long long) tg_ioc_store_count(store), tg_ioc_store_memory(store) / 1024);
+    return ret;
+}
+
+/* Threat intelligence lookup, through the worker's verdict cache if it
+ * has one */
+int tg_threat_intel_lookup(const struct tg_ioc_store *store, struct tg_ioc_cache *cache,
+                           int kind, const char *indicator, size_t indicator_len)
+{
+    uint32_t tag = 0;
     
-    /* Create null-terminated string for comparison */
-    char *temp = flb_malloc(indicator_len + 1);
-    if (!temp) {
+    if (!store || !indicator || indicator_len == 0) {
         return 0;
     }
-    memcpy(temp, indicator, indicator_len);
-    temp[indicator_len] = '\0';
     
-    /* Check against known malicious indicators */
-    const char *malicious_indicators[] = {
-        "192.168.1.666",     /* Example malicious IP */
-        "evil.com",          /* Example malicious domain */
-        "malware.exe",       /* Example malicious file */
-        "backdoor.dll",      /* Example malicious library */
-        "c2server.net",      /* Example C2 server */
-        NULL
-    };
+    if (!tg_ioc_cache_lookup(cache, store, kind, indicator, indicator_len, &tag)) {
+        return 0;
+    }
     
-    int is_malicious = 0;
-    for (int i = 0; malicious_indicators[i]; i++) {
-        if (strstr(temp, malicious_indicators[i])) {
-            is_malicious = 1;
+    tg_log(TG_LOG_WARN, "threat intelligence match: %.*s (tag %u)",
+           (int)indicator_len, indicator, tag);
+    return 1;
+}
+
+/* A delta file waiting in the spool */
+struct tg_threat_intel_delta {
+    uint64_t generation;
+    char *path;
+    int applied;                /* removed once the store is published */
+};
+
+static int tg_threat_intel_delta_cmp(const void *a, const void *b)
+{
+    const struct tg_threat_intel_delta *da = a;
+    const struct tg_threat_intel_delta *db = b;
+
+    if (da->generation != db->generation) {
+        return da->generation < db->generation ? -1 : 1;
+    }
+    return strcmp(da->path, db->path);
+}
+
+/* Set a delta file that cannot be applied aside, so it is reported once */
+static void tg_threat_intel_reject(const char *path)
+{
+    char rejected[TG_MAX_PATH];
+
+    if (snprintf(rejected, sizeof(rejected), "%s" TG_THREAT_INTEL_REJECTED, path) >=
+            (int) sizeof(rejected) ||
+        rename(path, rejected) != 0) {
+        unlink(path);
+    }
+}
+
+/* Delta files in the spool directory with their generations; files
+ * without one are rejected. Returns the number found, or -1. */
+static int tg_threat_intel_scan(const char *spool, struct tg_threat_intel_delta **deltas)
+{
+    struct tg_threat_intel_delta *list = NULL;
+    struct dirent *entry;
+    char path[TG_MAX_PATH];
+    size_t suffix_len = strlen(TG_THREAT_INTEL_DELTA);
+    int count = 0;
+    int alloc = 0;
+    DIR *dir;
+
+    dir = opendir(spool);
+    if (!dir) {
+        tg_log(TG_LOG_DEBUG, "cannot open threat intel spool %s: %s", spool, strerror(errno));
+        return -1;
+    }
+
+    while ((entry = readdir(dir))) {
+        size_t name_len = strlen(entry->d_name);
+        uint64_t generation;
+
+        if (name_len <= suffix_len ||
+            strcmp(entry->d_name + name_len - suffix_len, TG_THREAT_INTEL_DELTA) != 0 ||
+            snprintf(path, sizeof(path), "%s/%s", spool, entry->d_name) >= (int) sizeof(path)) {
+            continue;
+        }
+
+        if (tg_ioc_feed_generation(path, &generation) != 0) {
+            tg_log(TG_LOG_WARN, "threat intel delta %s has no generation, rejected", path);
+            tg_threat_intel_reject(path);
+            continue;
+        }
+
+        if (count == alloc) {
+            int new_alloc = alloc ? alloc * 2 : 16;
+            struct tg_threat_intel_delta *tmp;
+
+            tmp = flb_realloc(list, new_alloc * sizeof(struct tg_threat_intel_delta));
+            if (!tmp) {
+                break;
+            }
+            list = tmp;
+            alloc = new_alloc;
+        }
+
+        list[count].generation = generation;
+        list[count].applied = 0;
+        list[count].path = flb_strdup(path);
+        if (!list[count].path) {
+            break;
+        }
+        count++;
+    }
+
+    closedir(dir);
+
+    if (count > 1) {
+        qsort(list, count, sizeof(struct tg_threat_intel_delta), tg_threat_intel_delta_cmp);
+    }
+    *deltas = list;
+    return count;
+}
+
+/* Apply the delta files waiting in the spool, oldest generation first, to
+ * a store derived from the current one and publish it. Only the shards
+ * the deltas touch are copied, and lookups go on in the current store
+ * meanwhile. Deltas at or below the current generation are stale and
+ * dropped; applied deltas are removed once the new store is published.
+ * Deltas past a missing generation stay in the spool until it arrives or
+ * a full feed covers it, so a published store never lacks one. If an
+ * indicator cannot be stored, nothing is published and every delta stays
+ * in the spool for the next scan.
+ * Called from the rules watcher; scans at most every
+ * threat_intel_interval seconds. */
+int tg_security_update_threat_intel(struct tg_security_ctx *ctx)
+{
+    struct tg_threat_intel_delta *deltas = NULL;
+    struct tg_ioc_store *current;
+    struct tg_ioc_store *store = NULL;
+    uint64_t generation;
+    time_t now = time(NULL);
+    int status;
+    int applied = 0;
+    int count;
+    int ret = 0;
+
+    if (!ctx || !ctx->threat_intel_spool) {
+        return -1;
+    }
+
+    if (now - ctx->threat_intel_last_update < ctx->threat_intel_interval) {
+        return 0;
+    }
+    ctx->threat_intel_last_update = now;
+
+    count = tg_threat_intel_scan(ctx->threat_intel_spool, &deltas);
+    if (count <= 0) {
+        flb_free(deltas);
+        return count;
+    }
+
+    /* Only this thread publishes stores once the filter is running */
+    current = __atomic_load_n(&ctx->ioc, __ATOMIC_ACQUIRE);
+    generation = tg_ioc_store_generation(current);
+
+    for (int i = 0; i < count; i++) {
+        struct tg_threat_intel_delta *delta = &deltas[i];
+
+        if (delta->generation <= generation) {
+            tg_log(TG_LOG_DEBUG, "dropping stale threat intel delta %s (generation %llu)",
+                   delta->path, (unsigned long long) delta->generation);
+            unlink(delta->path);
+            continue;
+        }
+
+        /* Never skip a generation: later deltas wait for the missing one,
+         * or for a full feed that covers it */
+        if (delta->generation != generation + 1) {
+            tg_log(TG_LOG_WARN, "threat intel delta %llu is missing, keeping %d later "
+                   "deltas spooled", (unsigned long long) generation + 1, count - i);
+            break;
+        }
+
+        if (!store) {
+            store = current ? tg_ioc_store_derive(current) : tg_ioc_store_create();
+            if (!store) {
+                tg_log(TG_LOG_ERROR, "failed to allocate threat intel store for update");
+                ret = -1;
+                break;
+            }
+        }
+
+        status = tg_ioc_store_apply(store, delta->path);
+        if (status == TG_IOC_ERR_MEMORY) {
+            /* The derived store is incomplete; retry every delta next time */
+            ret = -1;
             break;
         }
+        if (status < 0) {
+            /* Its generation is missing from now on */
+            tg_log(TG_LOG_WARN, "threat intel delta %s rejected", delta->path);
+            tg_threat_intel_reject(delta->path);
+            break;
+        }
+
+        generation = delta->generation;
+        delta->applied = 1;
+        applied++;
+    }
+
+    if (applied > 0 && ret == 0 && tg_ioc_store_compile(store) == 0) {
+        tg_security_ioc_publish(ctx, store);
+        store = NULL;
+
+        for (int i = 0; i < count; i++) {
+            if (deltas[i].applied) {
+                unlink(deltas[i].path);
+            }
+        }
+        tg_log(TG_LOG_INFO, "applied %d threat intel deltas, generation %llu, "
+               "%llu indicators", applied, (unsigned long long) generation,
+               (unsigned long long) tg_ioc_store_count(ctx->ioc));
+    } else if (applied > 0) {
+        tg_log(TG_LOG_ERROR, "failed to apply threat intel deltas, keeping generation %llu",
+               (unsigned long long) tg_ioc_store_generation(current));
+        ret = -1;
+    }
+
+    tg_ioc_store_destroy(store);
+    for (int i = 0; i < count; i++) {
+        flb_free(deltas[i].path);
     }
+    flb_free(deltas);
+    return ret;
+}
+
+/* Parse a window of behavioral rules, in seconds or with an s, m or h
+ * suffix, up to TG_SECURITY_RATE_MAX_WINDOW */
+static int tg_security_window_parse(const char *p, char **end, uint32_t *seconds)
+{
+    unsigned long value;
+    unsigned long unit = 1;
     
-    flb_free(temp);
+    if (*p < '0' || *p > '9') {
+        return -1;
+    }
     
-    if (is_malicious) {
-        tg_log(TG_LOG_WARN, "threat intelligence match: %.*s", (int)indicator_len, indicator);
+    value = strtoul(p, end, 10);
+    switch (**end) {
+        case 'h':
+            unit = 3600;
+            (*end)++;
+            break;
+        case 'm':
+            unit = 60;
+            (*end)++;
+            break;
+        case 's':
+            (*end)++;
+            break;
+        default:
+            break;
+    }
+    if (value == 0 || value > TG_SECURITY_RATE_MAX_WINDOW / unit) {
+        return -1;
     }
     
-    return is_malicious;
+    *seconds = (uint32_t) (value * unit);
+    return 0;
 }
 
-/* Update threat intelligence cache */
-int tg_security_update_threat_intel(struct tg_security_ctx *ctx)
+/* Parse the pattern of a RATE rule, "limit/window[,event_type]": the rule
+ * fires once more than limit events share the rule field's value within
+ * window, given in seconds or with an s, m or h suffix. With an event type
+ * only events whose event_type equals it are counted. */
+int tg_security_rate_parse(const char *pattern, uint32_t *limit, uint32_t *window,
+                           const char **event_type)
 {
-    if (!ctx || !ctx->threat_intel_cache) {
+    char *end;
+    unsigned long count;
+    uint32_t seconds;
+    
+    if (!pattern || *pattern < '0' || *pattern > '9') {
+        return -1;
+    }
+    count = strtoul(pattern, &end, 10);
+    if (*end != '/' || count > UINT32_MAX) {
         return -1;
     }
     
-    time_t current_time = time(NULL);
+    if (tg_security_window_parse(end + 1, &end, &seconds) != 0) {
+        return -1;
+    }
     
-    /* Update every 15 minutes */
-    if (current_time - ctx->threat_intel_last_update < 900) {
-        return 0;
+    if (*end == ',') {
+        end++;
+        if (*end == '\0') {
+            return -1;
+        }
+    } else if (*end != '\0') {
+        return -1;
     }
     
-    tg_log(TG_LOG_DEBUG, "updating threat intelligence cache");
+    if (limit) {
+        *limit = (uint32_t) count;
+    }
+    if (window) {
+        *window = seconds;
+    }
+    if (event_type) {
+        *event_type = *end ? end : NULL;
+    }
+    return 0;
+}
+
+/* Parse the pattern of a DISTINCT rule, "field:limit/window[,event_type]":
+ * the rule fires once more than limit distinct values of field are seen
+ * with the same value of the rule field within window, which reads as for
+ * a RATE rule */
+int tg_security_distinct_parse(const char *pattern, const char **field, size_t *field_len,
+                               uint32_t *limit, uint32_t *window, const char **event_type)
+{
+    const char *colon;
     
-    /* This would fetch updates from threat intelligence feeds */
-    /* For now, just update the timestamp */
-    ctx->threat_intel_last_update = current_time;
+    if (!pattern) {
+        return -1;
+    }
     
-    tg_log(TG_LOG_DEBUG, "threat intelligence cache updated");
+    colon = strchr(pattern, ':');
+    if (!colon || colon == pattern || (size_t) (colon - pattern) >= TG_SECURITY_MAX_FIELD ||
+        tg_security_rate_parse(colon + 1, limit, window, event_type) != 0) {
+        return -1;
+    }
+    
+    if (field) {
+        *field = pattern;
+    }
+    if (field_len) {
+        *field_len = (size_t) (colon - pattern);
+    }
     return 0;
 }
 
+/* Parse the pattern of a SEQUENCE rule, "step>step>.../window": each
+ * step is an event type, optionally followed by "*count" when it takes
+ * count events, and the rule fires once the events of every step arrive
+ * in order with the same value of the rule field within window of the
+ * first, e.g. "login_failure*5>login_success/2m" */
+int tg_security_sequence_parse(const char *pattern, struct tg_security_sequence *sequence)
+{
+    const char *slash;
+    const char *p;
+    char *end;
+    
+    if (!pattern || !sequence) {
+        return -1;
+    }
+    
+    slash = strrchr(pattern, '/');
+    if (!slash || tg_security_window_parse(slash + 1, &end, &sequence->window) != 0 ||
+        *end != '\0') {
+        return -1;
+    }
+    
+    sequence->steps = 0;
+    p = pattern;
+    while (p < slash) {
+        const char *stop = memchr(p, '>', (size_t) (slash - p));
+        const char *star;
+        unsigned long count = 1;
+        
+        if (!stop) {
+            stop = slash;
+        }
+        if (sequence->steps == TG_CORRELATE_MAX_STEPS) {
+            return -1;
+        }
+        
+        star = memchr(p, '*', (size_t) (stop - p));
+        if (star) {
+            if (star + 1 == stop || star[1] < '0' || star[1] > '9') {
+                return -1;
+            }
+            count = strtoul(star + 1, &end, 10);
+            if (end != stop || count == 0 || count > UINT16_MAX) {
+                return -1;
+            }
+        } else {
+            star = stop;
+        }
+        if (star == p) {
+            return -1;
+        }
+        
+        sequence->types[sequence->steps] = p;
+        sequence->type_lens[sequence->steps] = (uint16_t) (star - p);
+        sequence->counts[sequence->steps] = (uint16_t) count;
+        sequence->steps++;
+        
+        p = stop + 1;
+        if (stop < slash && p == slash) {
+            return -1;
+        }
+    }
+    
+    return sequence->steps > 0 ? 0 : -1;
+}
+
+/* A user session idle for TG_SECURITY_USER_SESSION_TTL, or evicted */
+static void tg_security_user_session_closed(uint64_t key, const struct tg_session *session,
+                                            void *data)
+{
+    (void) data;
+    
+    tg_log(TG_LOG_DEBUG, "user session %016llx closed: %u events in %u seconds",
+           (unsigned long long) key, session->count,
+           session->last_seen - session->first_seen);
+}
+
+/* Behavioral analysis - close the behavioral state whose time is up. Each
+ * table also does this for a shard it touches; the sweep here closes the
+ * rest, at most once a second for all workers together. */
+void tg_security_behavior_expire(struct tg_security_ctx *ctx)
+{
+    uint32_t now;
+    uint32_t last;
+    
+    if (!ctx) {
+        return;
+    }
+    
+    now = (uint32_t) time(NULL);
+    last = __atomic_load_n(&ctx->behavior_clock, __ATOMIC_RELAXED);
+    if (last == now ||
+        !__atomic_compare_exchange_n(&ctx->behavior_clock, &last, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    
+    tg_session_table_expire(__atomic_load_n(&ctx->user_sessions, __ATOMIC_ACQUIRE), now);
+    tg_session_table_expire(__atomic_load_n(&ctx->process_tracking, __ATOMIC_ACQUIRE), now);
+    tg_session_table_expire(ctx->rate_keys, now);
+    tg_correlate_expire(ctx->sequence_keys, now);
+}
+
+/* Session table in slot, created by the first caller to need it; NULL if
+ * it cannot be allocated */
+static struct tg_session_table *tg_security_session_table(struct tg_session_table **slot,
+                                                          uint32_t capacity, uint32_t ttl,
+                                                          tg_session_close_cb close)
+{
+    struct tg_session_table *table = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    struct tg_session_table *expected = NULL;
+    
+    if (table) {
+        return table;
+    }
+    
+    table = tg_session_table_create(capacity, ttl, close, NULL);
+    if (!table) {
+        tg_log(TG_LOG_ERROR, "failed to create behavioral tracking structures");
+        return NULL;
+    }
+    
+    /* Another thread may have won the race */
+    if (!__atomic_compare_exchange_n(slot, &expected, table, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        tg_session_table_destroy(table);
+        table = expected;
+    }
+    return table;
+}
+
 /* Behavioral analysis - track user sessions */
 void tg_security_track_user_session(struct tg_security_ctx *ctx, const char *username,
                                    const char *source_ip, const char *event_type)
 {
-    if (!ctx || !username || !ctx->user_sessions) {
+    struct tg_session_table *sessions;
+    struct tg_session session;
+    time_t now;
+    uint64_t key;
+    
+    if (!ctx || !username) {
         return;
     }
     
-    char session_key[128];
-    snprintf(session_key, sizeof(session_key), "%s:%s", username, source_ip);
+    sessions = tg_security_session_table(&ctx->user_sessions, TG_SECURITY_USER_SESSIONS,
+                                         TG_SECURITY_USER_SESSION_TTL,
+                                         tg_security_user_session_closed);
+    if (!sessions) {
+        return;
+    }
     
-    /* Get existing session info */
-    int session_data_size;
-    char *session_data = flb_hash_get(ctx->user_sessions, session_key, 
-                                     strlen(session_key), &session_data_size);
+    if (!source_ip) {
+        source_ip = "";
+    }
     
-    if (!session_data) {
-        /* New session */
-        char new_session[64];
-        snprintf(new_session, sizeof(new_session), "1:%ld", time(NULL));
-        flb_hash_add(ctx->user_sessions, session_key, strlen(session_key),
-                     new_session, strlen(new_session));
-        
-        tg_log(TG_LOG_DEBUG, "new user session tracked: %s", session_key);
-    } else {
-        /* Update existing session */
-        int login_count;
-        time_t first_login;
-        sscanf(session_data, "%d:%ld", &login_count, &first_login);
-        
-        login_count++;
-        
-        /* Check for suspicious activity */
-        if (login_count > 10) {
-            tg_log(TG_LOG_WARN, "excessive login attempts detected: %s (%d attempts)", 
-                   session_key, login_count);
-        }
-        
-        char updated_session[64];
-        snprintf(updated_session, sizeof(updated_session), "%d:%ld", login_count, first_login);
-        flb_hash_add(ctx->user_sessions, session_key, strlen(session_key),
-                     updated_session, strlen(updated_session));
+    /* The session record is found by a hash of user and source and
+     * updated in place */
+    now = time(NULL);
+    key = tg_session_key(username, strlen(username), source_ip, strlen(source_ip));
+    if (tg_session_track(sessions, key, now, 1, &session) == 1) {
+        tg_log(TG_LOG_DEBUG, "new user session tracked: %s:%s", username, source_ip);
     }
 }
 
@@ -390,13 +1406,31 @@ void tg_security_track_user_session(struct tg_security_ctx *ctx, const char *use
 void tg_security_track_process(struct tg_security_ctx *ctx, const char *process_name,
                               const char *username, const char *command_line)
 {
-    if (!ctx || !process_name || !ctx->process_tracking) {
+    struct tg_session_table *processes;
+    struct tg_session session;
+    
+    (void) command_line;
+    
+    if (!ctx || !process_name) {
+        return;
+    }
+    
+    processes = tg_security_session_table(&ctx->process_tracking, TG_SECURITY_PROCESS_SESSIONS,
+                                          TG_SECURITY_PROCESS_SESSION_TTL, NULL);
+    if (!processes) {
         return;
     }
     
-    char process_key[128];
-    snprintf(process_key, sizeof(process_key), "%s:%s", username ? username : "unknown", 
-             process_name);
+    if (!username) {
+        username = "unknown";
+    }
+    
+    /* Executions of a process by a user, closed after
+     * TG_SECURITY_PROCESS_SESSION_TTL without one */
+    tg_session_track(processes,
+                     tg_session_key(username, strlen(username),
+                                    process_name, strlen(process_name)),
+                     time(NULL), 1, &session);
     
     /* Check for suspicious processes */
     const char *suspicious_processes[] = {
@@ -409,41 +1443,115 @@ void tg_security_track_process(struct tg_security_ctx *ctx, const char *process_
     
     for (int i = 0; suspicious_processes[i]; i++) {
         if (strstr(process_name, suspicious_processes[i])) {
-            tg_log(TG_LOG_WARN, "suspicious process detected: %s by %s", 
-                   process_name, username ? username : "unknown");
-            
-            /* Add to tracking */
-            char process_info[256];
-            snprintf(process_info, sizeof(process_info), "SUSPICIOUS:%ld:%s", 
-                     time(NULL), command_line ? command_line : "");
-            flb_hash_add(ctx->process_tracking, process_key, strlen(process_key),
-                         process_info, strlen(process_info));
+            tg_log(TG_LOG_WARN, "suspicious process detected: %s by %s (%u runs)", 
+                   process_name, username, session.count);
             return;
         }
     }
+}
+
+/* Most expensive rules first */
+static int tg_security_cmp_rule_cost(const void *a, const void *b)
+{
+    const struct tg_security_rule_stats *x = a;
+    const struct tg_security_rule_stats *y = b;
     
-    /* Track normal process */
-    char process_info[256];
-    snprintf(process_info, sizeof(process_info), "NORMAL:%ld:%s", 
-             time(NULL), command_line ? command_line : "");
-    flb_hash_add(ctx->process_tracking, process_key, strlen(process_key),
-                 process_info, strlen(process_info));
+    return (x->cost_ns < y->cost_ns) - (x->cost_ns > y->cost_ns);
 }
 
 /* Get rule statistics */
 void tg_security_get_rule_stats(struct tg_security_ctx *ctx, char *buffer, size_t buffer_size)
 {
-    if (!ctx || !buffer) {
+    struct tg_security_ruleset *set;
+    struct tg_security_stats totals;
+    struct tg_security_rule_stats *rules = NULL;
+    int rule_count = 0;
+    int count = -1;
+    uint64_t sessions;
+    uint64_t sessions_expired;
+    uint64_t evictions;
+    uint64_t processes;
+    uint64_t processes_expired;
+    uint64_t rate_keys;
+    uint64_t rate_evictions;
+    uint64_t distinct_keys;
+    uint64_t distinct_evictions;
+    uint64_t sequences_open;
+    uint64_t sequences_expired;
+    uint64_t sequence_evictions;
+    size_t len;
+    
+    if (!ctx || !buffer || buffer_size == 0) {
         return;
     }
     
+    tg_session_table_stats(__atomic_load_n(&ctx->user_sessions, __ATOMIC_ACQUIRE),
+                           &sessions, &sessions_expired, &evictions);
+    tg_session_table_stats(__atomic_load_n(&ctx->process_tracking, __ATOMIC_ACQUIRE),
+                           &processes, &processes_expired, NULL);
+    tg_session_table_stats(ctx->rate_keys, &rate_keys, NULL, &rate_evictions);
+    tg_distinct_table_stats(ctx->distinct_keys, &distinct_keys, &distinct_evictions);
+    tg_correlate_table_stats(ctx->sequence_keys, &sequences_open, &sequences_expired,
+                             &sequence_evictions);
+    
+    /* Holding reload_lock keeps the current set, and the rule names
+     * reported from it, alive while formatting */
+    pthread_mutex_lock(&ctx->reload_lock);
+    set = ctx->ruleset;
+    if (set) {
+        rule_count = set->rule_count;
+        rules = rule_count > 0 ?
+                flb_malloc(rule_count * sizeof(struct tg_security_rule_stats)) : NULL;
+        count = tg_security_stats_collect(ctx, set, &totals, rules, rules ? rule_count : 0);
+    }
+    if (count < 0) {
+        memset(&totals, 0, sizeof(totals));
+        count = 0;
+    }
+    
     snprintf(buffer, buffer_size,
-             "Rules: %d active, Events: %llu processed, %llu flagged, %llu dropped, Rules matched: %llu",
-             ctx->rule_count, 
-             (unsigned long long)ctx->events_processed,
-             (unsigned long long)ctx->events_flagged,
-             (unsigned long long)ctx->events_dropped,
-             (unsigned long long)ctx->rules_matched);
+             "Rules: %d active, Events: %llu processed, %llu flagged, %llu dropped, Rules matched: %llu, "
+             "Threat intel cache: %llu hits, %llu misses, "
+             "User sessions: %llu tracked, %llu expired, %llu evicted, "
+             "Processes: %llu tracked, %llu expired, "
+             "Rate keys: %llu tracked, %llu evicted, Distinct keys: %llu tracked, %llu evicted, "
+             "Sequences: %llu open, %llu expired, %llu evicted",
+             rule_count, 
+             (unsigned long long)totals.events_processed,
+             (unsigned long long)totals.events_flagged,
+             (unsigned long long)totals.events_dropped,
+             (unsigned long long)totals.rules_matched,
+             (unsigned long long)totals.intel_cache_hits,
+             (unsigned long long)totals.intel_cache_misses,
+             (unsigned long long)sessions,
+             (unsigned long long)sessions_expired,
+             (unsigned long long)evictions,
+             (unsigned long long)processes,
+             (unsigned long long)processes_expired,
+             (unsigned long long)rate_keys,
+             (unsigned long long)rate_evictions,
+             (unsigned long long)distinct_keys,
+             (unsigned long long)distinct_evictions,
+             (unsigned long long)sequences_open,
+             (unsigned long long)sequences_expired,
+             (unsigned long long)sequence_evictions);
+    
+    /* Append the most expensive rules */
+    if (count > 0) {
+        qsort(rules, count, sizeof(struct tg_security_rule_stats), tg_security_cmp_rule_cost);
+    }
+    for (int i = 0; i < count && i < 3 && rules[i].cost_ns > 0; i++) {
+        len = strlen(buffer);
+        snprintf(buffer + len, buffer_size - len,
+                 "%s rule %d (%s): %llu evaluations, %llu matches, %llu ns",
+                 i == 0 ? "; Costliest:" : ",", rules[i].id, rules[i].name,
+                 (unsigned long long)rules[i].evaluations,
+                 (unsigned long long)rules[i].matches,
+                 (unsigned long long)rules[i].cost_ns);
+    }
+    pthread_mutex_unlock(&ctx->reload_lock);
+    
+    flb_free(rules);
 }
 
 /* Cleanup security rules system */
@@ -453,22 +1561,34 @@ void tg_security_cleanup_rules(struct tg_security_ctx *ctx)
         return;
     }
     
-    if (ctx->threat_intel_cache) {
-        flb_hash_destroy(ctx->threat_intel_cache);
-        ctx->threat_intel_cache = NULL;
-    }
+    /* No reload may start once the rule sets are released */
+    tg_security_reload_stop(ctx);
     
-    if (ctx->user_sessions) {
-        flb_hash_destroy(ctx->user_sessions);
-        ctx->user_sessions = NULL;
-    }
+    /* Evaluation threads hold workers, released below */
+    tg_pool_destroy(ctx->pool);
+    ctx->pool = NULL;
     
-    if (ctx->process_tracking) {
-        flb_hash_destroy(ctx->process_tracking);
-        ctx->process_tracking = NULL;
-    }
+    flb_free(ctx->enrichment.data);
+    memset(&ctx->enrichment, 0, sizeof(ctx->enrichment));
     
-    ctx->rule_count = 0;
+    tg_ioc_store_destroy(ctx->ioc);
+    ctx->ioc = NULL;
+    flb_free(ctx->threat_intel_spool);
+    ctx->threat_intel_spool = NULL;
+    
+    tg_session_table_destroy(ctx->user_sessions);
+    ctx->user_sessions = NULL;
+    tg_session_table_destroy(ctx->rate_keys);
+    ctx->rate_keys = NULL;
+    tg_distinct_table_destroy(ctx->distinct_keys);
+    ctx->distinct_keys = NULL;
+    tg_correlate_table_destroy(ctx->sequence_keys);
+    ctx->sequence_keys = NULL;
+    tg_session_table_destroy(ctx->process_tracking);
+    ctx->process_tracking = NULL;
+
+    tg_security_ruleset_cleanup(ctx);
+    tg_security_workers_destroy(ctx);
     
     tg_log(TG_LOG_DEBUG, "security rules system cleaned up");
-}
\ No newline at end of file
+}
@@ -0,0 +1,492 @@
+/*  ThreatGuard Agent - Security Rules Engine
+ *  Rule, context and matcher definitions shared by the security filter
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_RULES_H
+#define TG_SECURITY_RULES_H
+
+#include "../../include/threatguard.h"
+#include "security_ac.h"
+#include "security_regex.h"
+#include "security_fields.h"
+#include "security_ioc.h"
+#include "security_session.h"
+#include "security_hll.h"
+#include "security_correlate.h"
+#include "security_search.h"
+#include "security_pool.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define TG_SECURITY_MAX_RULES       10000
+
+/* Behavioral tracking bounds */
+#define TG_SECURITY_USER_SESSIONS       16384
+#define TG_SECURITY_USER_SESSION_TTL    300     /* seconds */
+#define TG_SECURITY_PROCESS_SESSIONS    8192    /* user and process pairs */
+#define TG_SECURITY_PROCESS_SESSION_TTL 600     /* seconds */
+#define TG_SECURITY_RATE_KEYS           65536   /* default keys counted by RATE rules */
+#define TG_SECURITY_RATE_MAX_WINDOW     3600    /* seconds */
+#define TG_SECURITY_DISTINCT_KEYS       16384   /* default keys counted by DISTINCT rules */
+#define TG_SECURITY_SEQUENCE_KEYS       131072  /* default open SEQUENCE rule matches */
+
+/* Security rule actions */
+#define TG_SECURITY_ACTION_PASS     0
+#define TG_SECURITY_ACTION_FLAG     1
+#define TG_SECURITY_ACTION_DROP     2
+#define TG_SECURITY_ACTION_ENRICH   3
+
+/* Security rule types */
+#define TG_RULE_TYPE_FIELD_MATCH    1
+#define TG_RULE_TYPE_FIELD_REGEX    2
+#define TG_RULE_TYPE_FIELD_EXISTS   3
+#define TG_RULE_TYPE_THREAT_INTEL   4
+#define TG_RULE_TYPE_BEHAVIORAL     5
+#define TG_RULE_TYPE_COMPLIANCE     6
+#define TG_RULE_TYPE_RATE           7   /* more than N events per window for one field value */
+#define TG_RULE_TYPE_DISTINCT       8   /* more than N values of a field per window for one value */
+#define TG_RULE_TYPE_SEQUENCE       9   /* event types in order within a window for one value */
+
+/* How a rule is evaluated once rules are compiled */
+#define TG_RULE_MATCHER_GENERIC     0   /* per-rule tg_security_check_* call */
+#define TG_RULE_MATCHER_LITERAL     1   /* shared per-field Aho-Corasick pass */
+#define TG_RULE_MATCHER_REGEX       2   /* shared per-field lazy DFA pass */
+
+/* Fields checked by THREAT_INTEL rules */
+#define TG_SECURITY_THREAT_INTEL_FIELDS 5
+extern const char *tg_security_threat_intel_fields[TG_SECURITY_THREAT_INTEL_FIELDS];
+extern const int tg_security_threat_intel_kinds[TG_SECURITY_THREAT_INTEL_FIELDS];
+
+#define TG_SECURITY_MAX_PATTERN     255
+#define TG_SECURITY_MAX_FIELD       64  /* field name buffer, NUL included */
+
+/* Hot rule data: only what evaluation reads, 16 bytes so that four rules
+ * share a cache line. Metadata lives in the parallel rule_info[] table. */
+struct tg_security_rule {
+    uint32_t pattern;           /* offset of the NUL-terminated pattern in set->patterns */
+    uint16_t pattern_len;
+    int16_t priority;
+    int16_t field_slot;         /* field dictionary slot, TG_FIELD_SLOT_NONE if not indexed */
+    uint8_t type;
+    uint8_t action;
+    uint8_t enabled;
+    uint8_t matcher;            /* TG_RULE_MATCHER_*, selects the compiled matcher */
+    uint8_t compliance_type;    /* tg_compliance_t flags */
+};
+
+/* Steps of a SEQUENCE rule, pointing into its pattern */
+struct tg_security_sequence {
+    int steps;
+    uint32_t window;            /* seconds */
+    const char *types[TG_CORRELATE_MAX_STEPS];
+    uint16_t type_lens[TG_CORRELATE_MAX_STEPS];
+    uint16_t counts[TG_CORRELATE_MAX_STEPS];
+};
+
+/* Pattern of a window rule, parsed once when the set is planned */
+struct tg_security_window {
+    uint32_t limit;
+    uint32_t window;            /* seconds */
+    uint32_t width;             /* seconds per bucket of a RATE window */
+    const char *event_type;     /* into the pattern pool, NULL to count every event */
+    size_t event_type_len;
+    int field_slot;             /* field whose values a DISTINCT rule counts */
+    char field_name[TG_SECURITY_MAX_FIELD];
+    struct tg_security_sequence sequence;   /* steps of a SEQUENCE rule */
+};
+
+/* Cold rule metadata, read for reporting and when rules are compiled */
+struct tg_security_rule_info {
+    int id;
+    char name[128];
+    char description[256];
+    char field_name[64];
+    time_t created;
+};
+
+/* One event in TG_SECURITY_STATS_SAMPLE has its rule evaluations timed */
+#define TG_SECURITY_STATS_SAMPLE    64
+
+/* Workers reorder their evaluation plan by measured cost once every
+ * TG_SECURITY_PLAN_REORDER events */
+#define TG_SECURITY_PLAN_REORDER    65536
+
+/* Chunks split across the evaluation workers by default, in bytes, and
+ * the fewest records of one range */
+#define TG_SECURITY_POOL_MIN_CHUNK  (256 * 1024)
+#define TG_SECURITY_POOL_RANGE      256
+
+/* Records decoded and evaluated together in columnar mode */
+#define TG_SECURITY_BATCH_RECORDS   512
+#define TG_SECURITY_BATCH_WORDS     (TG_SECURITY_BATCH_RECORDS / 64)
+#define TG_SECURITY_BATCH_CELLS     (TG_SECURITY_BATCH_RECORDS * 16)    /* cleared one by one */
+
+/* String value of a field in one record of a batch; ptr is NULL when the
+ * record has no such field or its value is not a string */
+struct tg_security_view {
+    const char *ptr;
+    size_t len;
+};
+
+/* Rule index of a result no rule matched */
+#define TG_SECURITY_RULE_NONE       UINT32_MAX
+
+/* Kinds of evaluation plan steps */
+#define TG_SECURITY_STEP_RULE       0   /* one generic rule */
+#define TG_SECURITY_STEP_MATCHER    1   /* one compiled field matcher */
+
+/* Action of a step whose rules of its priority have different actions */
+#define TG_SECURITY_STEP_MIXED      0xff
+
+/* Group of a result not taken from a plan step */
+#define TG_SECURITY_GROUP_NONE      UINT32_MAX
+
+/* One step of the evaluation plan, reporting rules of at most priority.
+ * Steps of one group may run in any order, see tg_security_plan_rules. */
+struct tg_security_step {
+    int16_t priority;
+    uint8_t kind;               /* TG_SECURITY_STEP_* */
+    uint8_t action;             /* of its rules of that priority, or TG_SECURITY_STEP_MIXED */
+    uint32_t index;             /* rule or matcher index */
+    uint32_t first;             /* lowest index of its rules of that priority */
+    uint32_t group;             /* position of the group's first step in the set's plan */
+    float rank;                 /* expected cost of a match, set in worker copies */
+};
+
+/* Counters of one rule, or one compiled field matcher, in one worker */
+struct tg_security_rule_counters {
+    uint64_t evaluations;
+    uint64_t matches;
+    uint64_t timed_evaluations; /* evaluations on sampled events */
+    uint64_t timed_ns;          /* total cost of the timed evaluations */
+    time_t last_match;
+};
+
+/* Event counters of one worker, or of all of them once collected */
+struct tg_security_stats {
+    uint64_t events_processed;
+    uint64_t events_flagged;
+    uint64_t events_dropped;
+    uint64_t rules_matched;
+    uint64_t intel_cache_hits;      /* threat intel lookups answered by the verdict cache */
+    uint64_t intel_cache_misses;
+};
+
+/* Aggregated statistics of one rule */
+struct tg_security_rule_stats {
+    int id;
+    const char *name;
+    uint64_t evaluations;
+    uint64_t matches;
+    uint64_t cost_ns;           /* estimated from the timed evaluations */
+    time_t last_match;
+};
+
+/* Compiled matchers for one field: every literal rule on the field shares
+ * one automaton and every regex rule shares one regex program */
+struct tg_security_field_matcher {
+    char field_name[64];
+    int field_slot;
+    struct tg_ac *ac;
+    struct tg_regex_set *regex;
+};
+
+/* A loaded and compiled set of rules. A rule set is built by one thread,
+ * then published to the filter and never modified again; a reload builds
+ * a new set and swaps it in, and the old one is freed once no worker can
+ * still be reading it. */
+struct tg_security_ruleset {
+    uint64_t generation;        /* assigned when published */
+
+    /* Security rules, sized to the number loaded */
+    int rule_count;
+    int rule_alloc;
+    struct tg_security_rule *rules;
+    struct tg_security_rule_info *rule_info;
+    char *patterns;             /* pattern string pool */
+    size_t patterns_len;
+    size_t patterns_alloc;
+
+    /* Compiled field matchers */
+    int matcher_count;
+    struct tg_security_field_matcher *matchers;
+
+    /* Evaluation plan: the enabled rules that keep state across events
+     * (RATE, DISTINCT, SEQUENCE) see every event, then the other rules and
+     * matchers run in order of decreasing priority until none left can
+     * outrank the match found. Window rule s has its parsed pattern at
+     * windows[s], and window_index[i] is s for rule i, -1 for the others. */
+    int stateful_count;
+    uint32_t *stateful;
+    struct tg_security_window *windows;
+    int32_t *window_index;
+    int plan_count;
+    struct tg_security_step *plan;
+
+    /* Field dictionary: every field a rule reads gets a slot, and the keys
+     * of each record are indexed into the slot table in one pass. A field
+     * named by a nested path is resolved from the slot of the path it
+     * steps into, unless the record has a top-level key of that name. */
+    struct tg_field_dict *fields;
+    const struct tg_field_path *paths;  /* the dictionary's, NULL if no path is nested */
+    int threat_intel_slots[TG_SECURITY_THREAT_INTEL_FIELDS];
+    int event_type_slot;
+
+    /* Bundle mapping the tables above point into, NULL if the set was
+     * built in memory; a mapped set is read-only */
+    void *map;
+    size_t map_size;
+
+    /* Reclamation after the set has been replaced */
+    uint64_t retire_epoch;
+    struct tg_security_ruleset *next;
+};
+
+/* An indicator store replaced by an update, freed like a retired rule
+ * set once no worker can still be reading it */
+struct tg_security_retired_ioc {
+    struct tg_ioc_store *store;
+    uint64_t retire_epoch;
+    struct tg_security_retired_ioc *next;
+};
+
+/* Rules an event matched, in the order they matched, up to
+ * TG_SECURITY_EVENT_RULES of them, for its enrichment. Evaluation stops
+ * once the action is decided, so rules that could not change it may be
+ * missing. */
+#define TG_SECURITY_EVENT_RULES     8
+
+struct tg_security_event {
+    int rule_ids[TG_SECURITY_EVENT_RULES];
+    uint8_t rule_count;
+    uint16_t clear;             /* chance in 10000 that no matched rule is right */
+};
+
+/* Enrichment appended to flagged events: the key/value pairs, encoded
+ * once, with the values of the dynamic keys missing. The detection time
+ * goes after byte time, the threat score after byte score and the matched
+ * rule ids at the end. */
+#define TG_SECURITY_ENRICH_FIELDS   5
+
+struct tg_security_enrichment {
+    char *data;
+    size_t size;
+    size_t time;
+    size_t score;
+};
+
+/* State of one worker thread. Only the owning thread writes it, so the
+ * counters need no atomics; readers aggregate all workers under
+ * worker_lock, which also guards resizing. The evaluation scratch belongs
+ * to the rule set the worker last evaluated. */
+struct tg_security_worker {
+    struct tg_security_stats stats;
+    int rule_alloc;
+    int matcher_alloc;
+    struct tg_security_rule_counters *rules;
+    struct tg_security_rule_counters *matchers;
+
+    /* Rule set epoch while inside a read-side section, 0 otherwise */
+    uint64_t epoch;
+    const struct tg_ioc_store *ioc;     /* indicator store of the read-side section */
+    struct tg_ioc_cache *ioc_cache;     /* recent threat intel verdicts, NULL if off */
+    struct tg_session_table *rates;     /* the context's rate_keys, shared */
+    struct tg_distinct_table *distinct; /* the context's distinct_keys, shared */
+    struct tg_correlate_table *sequences;   /* the context's sequence_keys, shared */
+    int full_stats;             /* evaluate rules that cannot change the action */
+    int columnar;               /* evaluate chunks in batches of records */
+
+    /* Evaluation scratch, valid for rule set generation */
+    uint64_t generation;
+    uint32_t match_seq;         /* current event */
+    uint32_t *rule_match_seq;   /* per-rule stamp to report each rule once per event */
+    const msgpack_object **field_values;
+    uint32_t *field_seq;        /* field_values[slot] is set for this event if == match_seq */
+    struct tg_regex_dfa **dfas; /* lazy DFA per field matcher; the cache is per thread */
+    struct tg_security_step *plan;  /* the set's plan, reordered by measured cost */
+    struct tg_security_event event; /* rules matched by the current event */
+
+    /* Columnar evaluation of a batch, NULL unless columnar. Field columns
+     * are slot major: the value of slot s in record r is at
+     * s * TG_SECURITY_BATCH_RECORDS + r. */
+    int batch;                  /* field lookups read the columns */
+    uint32_t batch_record;      /* record a generic rule is evaluated on */
+    msgpack_object *batch_records;
+    size_t *batch_ends;         /* input offset past each record */
+    const msgpack_object **batch_values;
+    struct tg_security_view *batch_views;
+    uint32_t *batch_cells;      /* column cells set by the batch, to clear them */
+    uint32_t batch_cell_count;  /* over TG_SECURITY_BATCH_CELLS: clear every column */
+    int batch_priority[TG_SECURITY_BATCH_RECORDS];
+    uint32_t batch_rule[TG_SECURITY_BATCH_RECORDS];     /* rule the action is from */
+    uint32_t batch_group[TG_SECURITY_BATCH_RECORDS];    /* plan group of that rule */
+    uint8_t batch_action[TG_SECURITY_BATCH_RECORDS];
+    uint64_t batch_pending[TG_SECURITY_BATCH_WORDS];    /* still evaluated */
+    uint64_t batch_active[TG_SECURITY_BATCH_WORDS];     /* evaluated by the current step */
+    uint64_t batch_dirty[TG_SECURITY_BATCH_WORDS];      /* pending with a match */
+    uint64_t batch_matched[TG_SECURITY_BATCH_WORDS];    /* matches of the current rule */
+    struct tg_security_event *batch_events;     /* rules matched by each record */
+
+    struct tg_security_worker *next;
+};
+
+struct tg_security_ctx {
+    struct flb_filter_instance *ins;
+    struct tg_agent_config *config;
+
+    /* Current rule set; readers pin it with their worker epoch */
+    struct tg_security_ruleset *ruleset;
+    size_t regex_cache_size;    /* lazy DFA state cache budget per field and worker */
+    uint64_t ruleset_generation;
+    uint64_t ruleset_epoch;
+    struct tg_security_ruleset *retired;    /* replaced sets not yet freed */
+    struct tg_security_retired_ioc *ioc_retired;    /* replaced stores not yet freed */
+    pthread_mutex_t reload_lock;            /* serializes publishing and reclaiming */
+    int reload_ready;
+
+    /* Rules file watcher */
+    char *rules_file;
+    pthread_t reload_thread;
+    int reload_running;
+    int reload_pipe[2];         /* written to stop the watcher */
+    int reload_inotify;
+    struct stat rules_file_stat;    /* rules file as last loaded */
+
+    /* Threat intelligence indicators, read like the rule set, and the
+     * spool directory of delta files applied by the watcher */
+    struct tg_ioc_store *ioc;
+    char *threat_intel_spool;
+    int threat_intel_interval;  /* seconds between spool scans */
+    uint32_t threat_intel_cache_size;   /* verdict cache entries per worker, 0 = off */
+    time_t threat_intel_last_update;
+
+    /* Behavioral analysis state */
+    struct tg_session_table *user_sessions;    /* by user and source, NULL until used */
+    struct tg_session_table *rate_keys;        /* by RATE rule and field value, NULL if off */
+    struct tg_distinct_table *distinct_keys;   /* by DISTINCT rule and field value, NULL if off */
+    struct tg_correlate_table *sequence_keys;  /* by SEQUENCE rule and field value, NULL if off */
+    struct tg_session_table *process_tracking; /* by user and process, NULL until used */
+    uint32_t behavior_clock;    /* second of the last expiry sweep */
+    int full_rule_stats;        /* every rule sees every event, for exact statistics */
+    int columnar_evaluation;    /* rules run over field columns of record batches */
+    struct tg_pool *pool;       /* threads evaluating large chunks, NULL if off */
+    size_t pool_min_chunk;      /* smaller chunks are evaluated by the filter thread */
+    struct tg_security_enrichment enrichment;  /* empty until tg_security_enrich_init */
+
+    /* Worker threads */
+    pthread_key_t worker_key;
+    pthread_mutex_t worker_lock;
+    int workers_ready;
+    struct tg_security_worker *workers;
+};
+
+/* Rule management (security_rules.c) */
+int tg_security_init_rules(struct tg_security_ctx *ctx);
+struct tg_security_ruleset *tg_security_ruleset_create(void);
+void tg_security_ruleset_destroy(struct tg_security_ruleset *set);
+void tg_security_add_default_rules(struct tg_security_ruleset *set);
+int tg_security_add_rule(struct tg_security_ruleset *set, int id, const char *name,
+                        const char *description, int type, int priority, int action,
+                        const char *field_name, const char *pattern);
+int tg_security_load_rules_file(struct tg_security_ruleset *set, const char *filename);
+int tg_security_compile_rules(struct tg_security_ruleset *set);
+int tg_security_plan_rules(struct tg_security_ruleset *set);
+struct tg_security_ruleset *tg_security_load_ruleset(const char *filename);
+int tg_security_load_threat_intel(struct tg_security_ctx *ctx, const char *filename);
+int tg_threat_intel_lookup(const struct tg_ioc_store *store, struct tg_ioc_cache *cache,
+                           int kind, const char *indicator, size_t indicator_len);
+int tg_security_update_threat_intel(struct tg_security_ctx *ctx);
+int tg_security_rate_parse(const char *pattern, uint32_t *limit, uint32_t *window,
+                           const char **event_type);
+int tg_security_distinct_parse(const char *pattern, const char **field, size_t *field_len,
+                               uint32_t *limit, uint32_t *window, const char **event_type);
+int tg_security_sequence_parse(const char *pattern, struct tg_security_sequence *sequence);
+void tg_security_track_user_session(struct tg_security_ctx *ctx, const char *username,
+                                   const char *source_ip, const char *event_type);
+void tg_security_behavior_expire(struct tg_security_ctx *ctx);
+void tg_security_track_process(struct tg_security_ctx *ctx, const char *process_name,
+                              const char *username, const char *command_line);
+void tg_security_get_rule_stats(struct tg_security_ctx *ctx, char *buffer, size_t buffer_size);
+void tg_security_cleanup_rules(struct tg_security_ctx *ctx);
+
+/* Rule set publication and hot reload (security_reload.c) */
+int tg_security_ruleset_init(struct tg_security_ctx *ctx);
+struct tg_security_ruleset *tg_security_ruleset_read_lock(struct tg_security_ctx *ctx,
+                                                          struct tg_security_worker *worker);
+void tg_security_ruleset_read_unlock(struct tg_security_worker *worker);
+void tg_security_ruleset_publish(struct tg_security_ctx *ctx, struct tg_security_ruleset *set);
+void tg_security_ruleset_reclaim(struct tg_security_ctx *ctx);
+void tg_security_ioc_publish(struct tg_security_ctx *ctx, struct tg_ioc_store *store);
+int tg_security_reload_rules(struct tg_security_ctx *ctx);
+int tg_security_reload_start(struct tg_security_ctx *ctx, const char *rules_file);
+void tg_security_reload_stop(struct tg_security_ctx *ctx);
+void tg_security_ruleset_cleanup(struct tg_security_ctx *ctx);
+
+/* Precompiled rule bundles (security_bundle.c) */
+int tg_security_bundle_detect(const char *filename);
+int tg_security_bundle_write(const struct tg_security_ruleset *set, const char *filename);
+struct tg_security_ruleset *tg_security_bundle_load(const char *filename);
+void tg_security_bundle_unmap(struct tg_security_ruleset *set);
+
+/* Worker state and statistics (security_worker.c) */
+int tg_security_workers_init(struct tg_security_ctx *ctx);
+struct tg_security_worker *tg_security_worker_get(struct tg_security_ctx *ctx);
+int tg_security_worker_bind(struct tg_security_ctx *ctx, struct tg_security_worker *worker,
+                            const struct tg_security_ruleset *set);
+void tg_security_worker_reorder(const struct tg_security_ruleset *set,
+                                struct tg_security_worker *worker);
+int tg_security_stats_collect(struct tg_security_ctx *ctx, const struct tg_security_ruleset *set,
+                              struct tg_security_stats *totals,
+                              struct tg_security_rule_stats *rules, int max_rules);
+void tg_security_workers_destroy(struct tg_security_ctx *ctx);
+
+/* Rule evaluation (filter_threatguard_security.c). Callers hold a read
+ * lock on set and have bound worker to it; window rules count events at
+ * now, the coarse clock. */
+int tg_security_apply_filter(msgpack_object *obj, const struct tg_security_ruleset *set,
+                             struct tg_security_worker *worker);
+void tg_security_apply_batch(msgpack_object *records, uint32_t count,
+                             const struct tg_security_ruleset *set,
+                             struct tg_security_worker *worker, uint8_t *actions);
+int tg_security_rule_matches(const struct tg_security_ruleset *set,
+                             struct tg_security_worker *worker,
+                             const struct tg_security_rule *rule, msgpack_object_map *map,
+                             time_t now);
+int tg_security_check_field_match(const struct tg_security_ruleset *set,
+                                  struct tg_security_worker *worker,
+                                  const struct tg_security_rule *rule, msgpack_object_map *map);
+int tg_security_check_field_regex(const struct tg_security_ruleset *set,
+                                  struct tg_security_worker *worker,
+                                  const struct tg_security_rule *rule, msgpack_object_map *map);
+int tg_security_check_field_exists(const struct tg_security_ruleset *set,
+                                   struct tg_security_worker *worker,
+                                   const struct tg_security_rule *rule, msgpack_object_map *map);
+int tg_security_check_threat_intel(const struct tg_security_ruleset *set,
+                                   struct tg_security_worker *worker,
+                                   const struct tg_security_rule *rule, msgpack_object_map *map);
+int tg_security_check_behavioral(const struct tg_security_ruleset *set,
+                                 struct tg_security_worker *worker,
+                                 const struct tg_security_rule *rule, msgpack_object_map *map);
+int tg_security_check_compliance(const struct tg_security_ruleset *set,
+                                 struct tg_security_worker *worker,
+                                 const struct tg_security_rule *rule, msgpack_object_map *map);
+int tg_security_check_rate(const struct tg_security_ruleset *set,
+                           struct tg_security_worker *worker,
+                           const struct tg_security_rule *rule, msgpack_object_map *map,
+                           time_t now);
+int tg_security_check_distinct(const struct tg_security_ruleset *set,
+                               struct tg_security_worker *worker,
+                               const struct tg_security_rule *rule, msgpack_object_map *map,
+                               time_t now);
+int tg_security_check_sequence(const struct tg_security_ruleset *set,
+                               struct tg_security_worker *worker,
+                               const struct tg_security_rule *rule, msgpack_object_map *map,
+                               time_t now);
+int tg_security_enrich_init(struct tg_security_ctx *ctx);
+void tg_security_enrich_event(msgpack_object *obj, const char *raw, size_t raw_size,
+                              const struct tg_security_event *event,
+                              struct tg_security_ctx *ctx, msgpack_packer *packer);
+
+#endif /* TG_SECURITY_RULES_H */
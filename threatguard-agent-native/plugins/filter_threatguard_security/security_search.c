@@ -0,0 +1,392 @@
+/*  ThreatGuard Agent - Substring Search
+ *  The vector implementations compare a block of candidate positions at
+ *  once against the first and the last byte of the needle, and compare
+ *  the rest of the needle only where both match, which on log text is
+ *  rarely more than once per block. The CPU is queried once with cpuid;
+ *  AVX2 is used only if the OS saves the YMM registers.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_search.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define TG_SEARCH_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TG_SEARCH_TARGET(isa)
+#else
+#include <cpuid.h>
+#define TG_SEARCH_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+typedef const char *(*tg_search_fn)(const char *text, size_t len,
+                                    const char *needle, size_t needle_len);
+
+/* ASCII lower case of c */
+static inline uint8_t tg_search_fold(uint8_t c)
+{
+    return (uint8_t) (c - 'A') < 26 ? c | 0x20 : c;
+}
+
+static inline uint8_t tg_search_upper(uint8_t c)
+{
+    return (uint8_t) (c - 'a') < 26 ? c & ~0x20 : c;
+}
+
+static int tg_search_equal_nocase(const char *a, const char *b, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (tg_search_fold((uint8_t) a[i]) != tg_search_fold((uint8_t) b[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static const char *tg_search_scalar(const char *text, size_t len,
+                                    const char *needle, size_t needle_len)
+{
+    const char *end;
+    const char *p;
+
+    if (needle_len == 0) {
+        return text;
+    }
+    if (needle_len > len) {
+        return NULL;
+    }
+
+    /* Candidate starts are found with memchr, itself vectorized in most C
+     * libraries */
+    end = text + (len - needle_len) + 1;
+    for (p = text; p < end; p++) {
+        p = memchr(p, needle[0], (size_t) (end - p));
+        if (!p) {
+            return NULL;
+        }
+        if (p[needle_len - 1] == needle[needle_len - 1] &&
+            memcmp(p, needle, needle_len) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const char *tg_search_scalar_nocase(const char *text, size_t len,
+                                           const char *needle, size_t needle_len)
+{
+    uint8_t first;
+    uint8_t last;
+
+    if (needle_len == 0) {
+        return text;
+    }
+    if (needle_len > len) {
+        return NULL;
+    }
+
+    first = tg_search_fold((uint8_t) needle[0]);
+    last = tg_search_fold((uint8_t) needle[needle_len - 1]);
+    for (size_t i = 0; i + needle_len <= len; i++) {
+        if (tg_search_fold((uint8_t) text[i]) == first &&
+            tg_search_fold((uint8_t) text[i + needle_len - 1]) == last &&
+            tg_search_equal_nocase(text + i + 1, needle + 1, needle_len - 1)) {
+            return text + i;
+        }
+    }
+    return NULL;
+}
+
+#ifdef TG_SEARCH_X86
+
+static inline uint32_t tg_search_ctz(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+
+    _BitScanForward(&index, mask);
+    return (uint32_t) index;
+#else
+    return (uint32_t) __builtin_ctz(mask);
+#endif
+}
+
+TG_SEARCH_TARGET("sse2")
+static const char *tg_search_sse2(const char *text, size_t len,
+                                  const char *needle, size_t needle_len)
+{
+    __m128i first;
+    __m128i last;
+    size_t i;
+
+    if (needle_len < 2 || needle_len > len) {
+        return tg_search_scalar(text, len, needle, needle_len);
+    }
+
+    first = _mm_set1_epi8(needle[0]);
+    last = _mm_set1_epi8(needle[needle_len - 1]);
+
+    /* Blocks of 16 starts whose needles end within text */
+    for (i = 0; i + 16 + needle_len - 1 <= len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *) (text + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *) (text + i + needle_len - 1));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                          _mm_cmpeq_epi8(last, block_last)));
+
+        while (mask) {
+            size_t start = i + tg_search_ctz(mask);
+
+            if (memcmp(text + start + 1, needle + 1, needle_len - 2) == 0) {
+                return text + start;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return tg_search_scalar(text + i, len - i, needle, needle_len);
+}
+
+TG_SEARCH_TARGET("sse2")
+static const char *tg_search_sse2_nocase(const char *text, size_t len,
+                                         const char *needle, size_t needle_len)
+{
+    __m128i first_lower;
+    __m128i first_upper;
+    __m128i last_lower;
+    __m128i last_upper;
+    size_t i;
+
+    if (needle_len < 2 || needle_len > len) {
+        return tg_search_scalar_nocase(text, len, needle, needle_len);
+    }
+
+    first_lower = _mm_set1_epi8((char) tg_search_fold((uint8_t) needle[0]));
+    first_upper = _mm_set1_epi8((char) tg_search_upper((uint8_t) needle[0]));
+    last_lower = _mm_set1_epi8((char) tg_search_fold((uint8_t) needle[needle_len - 1]));
+    last_upper = _mm_set1_epi8((char) tg_search_upper((uint8_t) needle[needle_len - 1]));
+
+    for (i = 0; i + 16 + needle_len - 1 <= len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *) (text + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *) (text + i + needle_len - 1));
+        __m128i eq_first = _mm_or_si128(_mm_cmpeq_epi8(first_lower, block_first),
+                                        _mm_cmpeq_epi8(first_upper, block_first));
+        __m128i eq_last = _mm_or_si128(_mm_cmpeq_epi8(last_lower, block_last),
+                                       _mm_cmpeq_epi8(last_upper, block_last));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
+
+        while (mask) {
+            size_t start = i + tg_search_ctz(mask);
+
+            if (tg_search_equal_nocase(text + start + 1, needle + 1, needle_len - 2)) {
+                return text + start;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return tg_search_scalar_nocase(text + i, len - i, needle, needle_len);
+}
+
+TG_SEARCH_TARGET("avx2")
+static const char *tg_search_avx2(const char *text, size_t len,
+                                  const char *needle, size_t needle_len)
+{
+    __m256i first;
+    __m256i last;
+    size_t i;
+
+    if (needle_len < 2 || needle_len > len) {
+        return tg_search_scalar(text, len, needle, needle_len);
+    }
+
+    first = _mm256_set1_epi8(needle[0]);
+    last = _mm256_set1_epi8(needle[needle_len - 1]);
+
+    for (i = 0; i + 32 + needle_len - 1 <= len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *) (text + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *) (text + i + needle_len - 1));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                             _mm256_cmpeq_epi8(last, block_last)));
+
+        while (mask) {
+            size_t start = i + tg_search_ctz(mask);
+
+            if (memcmp(text + start + 1, needle + 1, needle_len - 2) == 0) {
+                return text + start;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    /* Fewer than 32 starts left: half a block at a time, in SSE code that
+     * stalls unless the upper halves of the YMM registers are clear */
+    _mm256_zeroupper();
+    return tg_search_sse2(text + i, len - i, needle, needle_len);
+}
+
+TG_SEARCH_TARGET("avx2")
+static const char *tg_search_avx2_nocase(const char *text, size_t len,
+                                         const char *needle, size_t needle_len)
+{
+    __m256i first_lower;
+    __m256i first_upper;
+    __m256i last_lower;
+    __m256i last_upper;
+    size_t i;
+
+    if (needle_len < 2 || needle_len > len) {
+        return tg_search_scalar_nocase(text, len, needle, needle_len);
+    }
+
+    first_lower = _mm256_set1_epi8((char) tg_search_fold((uint8_t) needle[0]));
+    first_upper = _mm256_set1_epi8((char) tg_search_upper((uint8_t) needle[0]));
+    last_lower = _mm256_set1_epi8((char) tg_search_fold((uint8_t) needle[needle_len - 1]));
+    last_upper = _mm256_set1_epi8((char) tg_search_upper((uint8_t) needle[needle_len - 1]));
+
+    for (i = 0; i + 32 + needle_len - 1 <= len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *) (text + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *) (text + i + needle_len - 1));
+        __m256i eq_first = _mm256_or_si256(_mm256_cmpeq_epi8(first_lower, block_first),
+                                           _mm256_cmpeq_epi8(first_upper, block_first));
+        __m256i eq_last = _mm256_or_si256(_mm256_cmpeq_epi8(last_lower, block_last),
+                                          _mm256_cmpeq_epi8(last_upper, block_last));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(eq_first, eq_last));
+
+        while (mask) {
+            size_t start = i + tg_search_ctz(mask);
+
+            if (tg_search_equal_nocase(text + start + 1, needle + 1, needle_len - 2)) {
+                return text + start;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    _mm256_zeroupper();
+    return tg_search_sse2_nocase(text + i, len - i, needle, needle_len);
+}
+
+static void tg_search_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#ifdef _MSC_VER
+    int info[4];
+
+    __cpuidex(info, (int) leaf, (int) subleaf);
+    for (int i = 0; i < 4; i++) {
+        regs[i] = (uint32_t) info[i];
+    }
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/* Register state the OS saves on context switches (XCR0) */
+static uint64_t tg_search_xgetbv(void)
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t lo;
+    uint32_t hi;
+
+    __asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    return ((uint64_t) hi << 32) | lo;
+#endif
+}
+
+/* Best implementation the CPU and OS support */
+static int tg_search_cpu_level(void)
+{
+    uint32_t regs[4];
+    uint32_t max_leaf;
+    int level = TG_SEARCH_SCALAR;
+
+    tg_search_cpuid(0, 0, regs);
+    max_leaf = regs[0];
+    if (max_leaf < 1) {
+        return level;
+    }
+
+    tg_search_cpuid(1, 0, regs);
+    if (regs[3] & (1u << 26)) {
+        level = TG_SEARCH_SSE2;
+    }
+
+    /* AVX2 needs the CPU flag, AVX with OSXSAVE, and XMM and YMM state
+     * enabled by the OS */
+    if (level == TG_SEARCH_SSE2 && max_leaf >= 7 &&
+        (regs[2] & (1u << 27)) && (regs[2] & (1u << 28)) &&
+        (tg_search_xgetbv() & 0x6) == 0x6) {
+        tg_search_cpuid(7, 0, regs);
+        if (regs[1] & (1u << 5)) {
+            level = TG_SEARCH_AVX2;
+        }
+    }
+
+    return level;
+}
+
+#endif /* TG_SEARCH_X86 */
+
+static tg_search_fn tg_search_exact = tg_search_scalar;
+static tg_search_fn tg_search_folded = tg_search_scalar_nocase;
+
+int tg_search_init(int level)
+{
+    int supported = TG_SEARCH_SCALAR;
+
+#ifdef TG_SEARCH_X86
+    supported = tg_search_cpu_level();
+#endif
+    if (level > supported) {
+        level = supported;
+    }
+
+    switch (level) {
+#ifdef TG_SEARCH_X86
+        case TG_SEARCH_AVX2:
+            tg_search_exact = tg_search_avx2;
+            tg_search_folded = tg_search_avx2_nocase;
+            break;
+        case TG_SEARCH_SSE2:
+            tg_search_exact = tg_search_sse2;
+            tg_search_folded = tg_search_sse2_nocase;
+            break;
+#endif
+        default:
+            level = TG_SEARCH_SCALAR;
+            tg_search_exact = tg_search_scalar;
+            tg_search_folded = tg_search_scalar_nocase;
+            break;
+    }
+
+    return level;
+}
+
+const char *tg_search_name(int level)
+{
+    switch (level) {
+        case TG_SEARCH_AVX2:
+            return "avx2";
+        case TG_SEARCH_SSE2:
+            return "sse2";
+        default:
+            return "scalar";
+    }
+}
+
+const char *tg_search(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+    return tg_search_exact(text, len, needle, needle_len);
+}
+
+const char *tg_search_nocase(const char *text, size_t len, const char *needle,
+                             size_t needle_len)
+{
+    return tg_search_folded(text, len, needle, needle_len);
+}
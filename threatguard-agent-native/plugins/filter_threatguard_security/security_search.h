@@ -0,0 +1,35 @@
+/*  ThreatGuard Agent - Substring Search
+ *  Vectorized search of one needle in a string body that need not be
+ *  NUL-terminated, with the implementation picked once from the CPU
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_SEARCH_H
+#define TG_SECURITY_SEARCH_H
+
+#include <stddef.h>
+
+/* Implementations, from the slowest */
+#define TG_SEARCH_SCALAR    0
+#define TG_SEARCH_SSE2      1
+#define TG_SEARCH_AVX2      2
+
+/* Use the best implementation the CPU supports, up to level, and return
+ * it. Searches use the scalar one until this is called; call it before
+ * searching from several threads. */
+int tg_search_init(int level);
+const char *tg_search_name(int level);
+
+/* First occurrence of needle in the len bytes of text, or NULL. NUL bytes
+ * are ordinary bytes; an empty needle is found at text. */
+const char *tg_search(const char *text, size_t len, const char *needle, size_t needle_len);
+
+/* The same, with ASCII letters matching either case */
+const char *tg_search_nocase(const char *text, size_t len, const char *needle,
+                             size_t needle_len);
+
+/* Search for a string literal */
+#define TG_SEARCH_LITERAL(text, len, literal) \
+    tg_search(text, len, literal, sizeof(literal) - 1)
+
+#endif /* TG_SECURITY_SEARCH_H */
@@ -0,0 +1,368 @@
+/*  ThreatGuard Agent - Session Table
+ *  Sessions live in a slab allocated once, split into shards with a lock
+ *  each. Within a shard a key maps to a bucket of TG_SESSION_WAYS slots,
+ *  whose keys share one cache line in a parallel key array, so finding a
+ *  session reads one line and updating it writes its record in place.
+ *  A full bucket reuses the slot of the session seen least recently.
+ *  Each shard has a timer wheel that closes idle sessions. A session's
+ *  timer is not moved on every event: when it fires for a session seen
+ *  since, it is scheduled again for the session's new end.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_session.h"
+#include "security_timer.h"
+
+#include <pthread.h>
+
+#define TG_SESSION_SHARD_BITS   4
+#define TG_SESSION_SHARDS       (1u << TG_SESSION_SHARD_BITS)
+#define TG_SESSION_WAYS         8
+
+struct tg_session_shard {
+    pthread_mutex_t lock;
+    struct tg_session_table *table;
+    uint64_t *keys;             /* 0 = free slot */
+    struct tg_session *sessions;
+    struct tg_timer *timers;    /* expiry of each session, if the table has a ttl */
+    uint32_t bucket_mask;
+    uint32_t count;
+    uint64_t evictions;
+    uint64_t expired;
+    struct tg_timer_wheel wheel;
+};
+
+struct tg_session_table {
+    uint32_t ttl;
+    tg_session_close_cb close;
+    void *close_data;
+    uint64_t *keys;             /* slabs the shards point into */
+    struct tg_session *sessions;
+    struct tg_timer *timers;
+    struct tg_session_shard shards[TG_SESSION_SHARDS];
+};
+
+/* Drop the units between head and unit and make unit the head */
+static void tg_window_advance(struct tg_window *window, uint32_t unit)
+{
+    uint32_t gap = unit - window->head;
+
+    if ((int32_t) gap <= 0) {
+        return;
+    }
+
+    if (gap >= TG_WINDOW_BUCKETS) {
+        memset(window->buckets, 0, sizeof(window->buckets));
+        window->total = 0;
+    } else {
+        for (uint32_t i = 1; i <= gap; i++) {
+            uint16_t *bucket = &window->buckets[(window->head + i) % TG_WINDOW_BUCKETS];
+
+            window->total -= *bucket;
+            *bucket = 0;
+        }
+    }
+    window->head = unit;
+}
+
+uint32_t tg_window_add(struct tg_window *window, uint32_t unit, uint32_t n)
+{
+    uint16_t *bucket;
+    uint32_t room;
+
+    tg_window_advance(window, unit);
+
+    bucket = &window->buckets[window->head % TG_WINDOW_BUCKETS];
+    room = UINT16_MAX - *bucket;
+    if (n > room) {
+        n = room;
+    }
+    *bucket += (uint16_t) n;
+    window->total += n;
+    return window->total;
+}
+
+uint32_t tg_window_sum(const struct tg_window *window, uint32_t unit, uint32_t units)
+{
+    uint32_t gap = unit - window->head;
+    uint32_t total = 0;
+
+    if ((int32_t) gap < 0) {
+        gap = 0;
+    }
+    if (units > TG_WINDOW_BUCKETS) {
+        units = TG_WINDOW_BUCKETS;
+    }
+    if (gap >= units) {
+        return 0;
+    }
+
+    /* The whole window is kept in total; a shorter one is summed */
+    if (gap == 0 && units == TG_WINDOW_BUCKETS) {
+        return window->total;
+    }
+    for (uint32_t i = 0; i < units - gap; i++) {
+        total += window->buckets[(window->head + TG_WINDOW_BUCKETS - i) % TG_WINDOW_BUCKETS];
+    }
+    return total;
+}
+
+static inline uint64_t tg_session_mix(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+uint64_t tg_session_key(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < a_len; i++) {
+        hash ^= (uint8_t) a[i];
+        hash *= 1099511628211ull;
+    }
+
+    /* Separator, so that ("ab", "c") and ("a", "bc") differ */
+    hash ^= 0xff;
+    hash *= 1099511628211ull;
+
+    for (size_t i = 0; i < b_len; i++) {
+        hash ^= (uint8_t) b[i];
+        hash *= 1099511628211ull;
+    }
+
+    hash = tg_session_mix(hash);
+    return hash ? hash : 1;
+}
+
+struct tg_session_table *tg_session_table_create(uint32_t capacity, uint32_t ttl,
+                                                 tg_session_close_cb close, void *data)
+{
+    struct tg_session_table *table;
+    uint32_t buckets = 1;
+    uint32_t now = (uint32_t) time(NULL);
+    size_t slots;
+
+    if (capacity == 0 || capacity > (1u << 28)) {
+        return NULL;
+    }
+
+    while ((uint64_t) buckets * TG_SESSION_WAYS * TG_SESSION_SHARDS < capacity) {
+        buckets *= 2;
+    }
+    slots = (size_t) buckets * TG_SESSION_WAYS;
+
+    table = flb_calloc(1, sizeof(struct tg_session_table));
+    if (!table) {
+        return NULL;
+    }
+
+    table->keys = flb_calloc(slots * TG_SESSION_SHARDS, sizeof(uint64_t));
+    table->sessions = flb_calloc(slots * TG_SESSION_SHARDS, sizeof(struct tg_session));
+    if (ttl > 0) {
+        table->timers = flb_calloc(slots * TG_SESSION_SHARDS, sizeof(struct tg_timer));
+    }
+    if (!table->keys || !table->sessions || (ttl > 0 && !table->timers)) {
+        flb_free(table->keys);
+        flb_free(table->sessions);
+        flb_free(table->timers);
+        flb_free(table);
+        return NULL;
+    }
+
+    table->ttl = ttl;
+    table->close = close;
+    table->close_data = data;
+    for (uint32_t i = 0; i < TG_SESSION_SHARDS; i++) {
+        struct tg_session_shard *shard = &table->shards[i];
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->table = table;
+        shard->keys = table->keys + i * slots;
+        shard->sessions = table->sessions + i * slots;
+        shard->timers = table->timers ? table->timers + i * slots : NULL;
+        shard->bucket_mask = buckets - 1;
+        tg_timer_wheel_init(&shard->wheel, now);
+    }
+    return table;
+}
+
+/* End the session in slot, which frees it */
+static void tg_session_close(struct tg_session_shard *shard, uint32_t slot)
+{
+    struct tg_session_table *table = shard->table;
+
+    if (table->close) {
+        table->close(shard->keys[slot], &shard->sessions[slot], table->close_data);
+    }
+    if (shard->timers) {
+        tg_timer_cancel(&shard->wheel, &shard->timers[slot]);
+    }
+    shard->keys[slot] = 0;
+    shard->count--;
+}
+
+/* Timer callback: a session may have been idle for the ttl */
+static void tg_session_timeout(struct tg_timer *timer, void *data)
+{
+    struct tg_session_shard *shard = data;
+    uint32_t slot = (uint32_t) (timer - shard->timers);
+    uint32_t end = shard->sessions[slot].last_seen + shard->table->ttl;
+
+    /* Seen since the timer was set, or the clock stepped back */
+    if ((int32_t) (end - shard->wheel.now) > 0) {
+        tg_timer_schedule(&shard->wheel, timer, end);
+        return;
+    }
+
+    tg_session_close(shard, slot);
+    shard->expired++;
+}
+
+/* Slot for a key not in its bucket: a free one, else the one seen least
+ * recently */
+static uint32_t tg_session_victim(const struct tg_session_shard *shard, uint32_t base)
+{
+    uint32_t victim = base;
+
+    for (uint32_t way = 0; way < TG_SESSION_WAYS; way++) {
+        uint32_t slot = base + way;
+
+        if (shard->keys[slot] == 0) {
+            return slot;
+        }
+        if (shard->sessions[slot].last_seen < shard->sessions[victim].last_seen) {
+            victim = slot;
+        }
+    }
+
+    return victim;
+}
+
+int tg_session_track(struct tg_session_table *table, uint64_t key, time_t now,
+                     uint32_t width, struct tg_session *session)
+{
+    struct tg_session_shard *shard;
+    struct tg_session *record;
+    uint32_t seconds = (uint32_t) now;
+    uint32_t base;
+    uint32_t slot;
+    int created = 0;
+
+    if (!table || key == 0 || width == 0 || !session) {
+        return -1;
+    }
+
+    shard = &table->shards[key >> (64 - TG_SESSION_SHARD_BITS)];
+    base = ((uint32_t) key & shard->bucket_mask) * TG_SESSION_WAYS;
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* Sessions idle for the ttl by now are closed first */
+    if (shard->timers) {
+        tg_timer_wheel_advance(&shard->wheel, seconds, tg_session_timeout, shard);
+    }
+
+    for (slot = base; slot < base + TG_SESSION_WAYS; slot++) {
+        if (shard->keys[slot] == key) {
+            break;
+        }
+    }
+
+    if (slot == base + TG_SESSION_WAYS) {
+        slot = tg_session_victim(shard, base);
+        if (shard->keys[slot] != 0) {
+            tg_session_close(shard, slot);
+            shard->evictions++;
+        }
+        shard->keys[slot] = key;
+        shard->count++;
+        created = 1;
+    }
+
+    record = &shard->sessions[slot];
+    if (created) {
+        memset(record, 0, sizeof(*record));
+        record->first_seen = seconds;
+        record->window.head = seconds / width;
+        if (shard->timers) {
+            tg_timer_schedule(&shard->wheel, &shard->timers[slot], seconds + table->ttl);
+        }
+    }
+
+    record->last_seen = seconds;
+    record->count++;
+    tg_window_add(&record->window, seconds / width, 1);
+    *session = *record;
+
+    pthread_mutex_unlock(&shard->lock);
+    return created;
+}
+
+uint32_t tg_session_table_expire(struct tg_session_table *table, time_t now)
+{
+    uint32_t fired = 0;
+
+    if (!table || table->ttl == 0) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < TG_SESSION_SHARDS; i++) {
+        struct tg_session_shard *shard = &table->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        fired += tg_timer_wheel_advance(&shard->wheel, (uint32_t) now, tg_session_timeout, shard);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return fired;
+}
+
+void tg_session_table_stats(struct tg_session_table *table, uint64_t *sessions,
+                            uint64_t *expired, uint64_t *evictions)
+{
+    uint64_t total_sessions = 0;
+    uint64_t total_expired = 0;
+    uint64_t total_evictions = 0;
+
+    if (table) {
+        for (uint32_t i = 0; i < TG_SESSION_SHARDS; i++) {
+            struct tg_session_shard *shard = &table->shards[i];
+
+            pthread_mutex_lock(&shard->lock);
+            total_sessions += shard->count;
+            total_expired += shard->expired;
+            total_evictions += shard->evictions;
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+
+    if (sessions) {
+        *sessions = total_sessions;
+    }
+    if (expired) {
+        *expired = total_expired;
+    }
+    if (evictions) {
+        *evictions = total_evictions;
+    }
+}
+
+void tg_session_table_destroy(struct tg_session_table *table)
+{
+    if (!table) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < TG_SESSION_SHARDS; i++) {
+        pthread_mutex_destroy(&table->shards[i].lock);
+    }
+    flb_free(table->keys);
+    flb_free(table->sessions);
+    flb_free(table->timers);
+    flb_free(table);
+}
@@ -0,0 +1,75 @@
+/*  ThreatGuard Agent - Session Table
+ *  Fixed-size behavioral records keyed by a hash of their identity, held
+ *  in one preallocated slab and updated in place
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_SESSION_H
+#define TG_SECURITY_SESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Sliding window of event counts in TG_WINDOW_BUCKETS buckets of one time
+ * unit each, the newest being unit head. Buckets saturate instead of
+ * wrapping; total is the sum of all buckets. */
+#define TG_WINDOW_BUCKETS   60
+
+struct tg_window {
+    uint32_t head;
+    uint32_t total;
+    uint16_t buckets[TG_WINDOW_BUCKETS];
+};
+
+/* Count n events in unit and return the events of the window ending at
+ * unit. Units older than the window are dropped; an event from a unit
+ * before head is counted in head. */
+uint32_t tg_window_add(struct tg_window *window, uint32_t unit, uint32_t n);
+
+/* Events of the last units units up to unit, at most TG_WINDOW_BUCKETS,
+ * without changing the window */
+uint32_t tg_window_sum(const struct tg_window *window, uint32_t unit, uint32_t units);
+
+/* One tracked identity. Times are in seconds since the epoch. */
+struct tg_session {
+    uint32_t first_seen;
+    uint32_t last_seen;
+    uint32_t count;             /* events since first_seen */
+    struct tg_window window;    /* events per time unit of the tracker */
+};
+
+struct tg_session_table;
+
+/* Called with the final state of a session that expires or is evicted,
+ * under a lock of the table, which it must not use */
+typedef void (*tg_session_close_cb)(uint64_t key, const struct tg_session *session, void *data);
+
+/* A table holds at most about capacity sessions and is safe to share
+ * between threads. A session idle for ttl seconds, if ttl is not 0, is
+ * closed and starts over when its key is seen again; when a key's bucket
+ * is full the session seen least recently in it is evicted. close may be
+ * NULL. */
+struct tg_session_table *tg_session_table_create(uint32_t capacity, uint32_t ttl,
+                                                 tg_session_close_cb close, void *data);
+
+/* Key of the identity made of two strings, such as user and source */
+uint64_t tg_session_key(const char *a, size_t a_len, const char *b, size_t b_len);
+
+/* Count one event of key at now in a window of width second units and
+ * copy its session to session; a key is always tracked with the same
+ * width. Returns 1 if the session is new, 0 if it existed, or -1 on bad
+ * arguments. */
+int tg_session_track(struct tg_session_table *table, uint64_t key, time_t now,
+                     uint32_t width, struct tg_session *session);
+
+/* Close the sessions idle for the ttl by now, in O(1) each; tracking a
+ * key does this for its shard as well. Returns the number of timers that
+ * fired, some of which belonged to sessions still in use. */
+uint32_t tg_session_table_expire(struct tg_session_table *table, time_t now);
+
+void tg_session_table_stats(struct tg_session_table *table, uint64_t *sessions,
+                            uint64_t *expired, uint64_t *evictions);
+void tg_session_table_destroy(struct tg_session_table *table);
+
+#endif /* TG_SECURITY_SESSION_H */
@@ -0,0 +1,135 @@
+/*  ThreatGuard Agent - Timer Wheel
+ *  A timer due within 64 ticks sits in the slot of its tick on level 0;
+ *  one due later sits on the level whose slots are 64 times coarser than
+ *  the level below, and moves down a level each time the wheel below it
+ *  wraps, so scheduling, cancelling and firing are O(1) and a tick costs
+ *  one slot unless a level wraps.
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../../include/threatguard.h"
+#include "security_timer.h"
+
+#define TG_TIMER_MASK       (TG_TIMER_SLOTS - 1)
+#define TG_TIMER_REACH      (1u << (TG_TIMER_SLOT_BITS * TG_TIMER_LEVELS))
+
+void tg_timer_wheel_init(struct tg_timer_wheel *wheel, uint32_t now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+static void tg_timer_unlink(struct tg_timer *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* Slot of a timer due at least now */
+static void tg_timer_place(struct tg_timer_wheel *wheel, struct tg_timer *timer)
+{
+    uint32_t delta = timer->expires - wheel->now;
+    struct tg_timer **slot;
+    int level = 0;
+
+    while (level < TG_TIMER_LEVELS - 1 &&
+           delta >= (1u << (TG_TIMER_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    slot = &wheel->slots[level][(timer->expires >> (TG_TIMER_SLOT_BITS * level)) & TG_TIMER_MASK];
+
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+void tg_timer_schedule(struct tg_timer_wheel *wheel, struct tg_timer *timer, uint32_t expires)
+{
+    if (timer->pprev) {
+        tg_timer_unlink(timer);
+    } else {
+        wheel->pending++;
+    }
+
+    if ((int32_t) (expires - wheel->now) <= 0) {
+        expires = wheel->now + 1;
+    } else if (expires - wheel->now >= TG_TIMER_REACH) {
+        expires = wheel->now + TG_TIMER_REACH - 1;
+    }
+
+    timer->expires = expires;
+    tg_timer_place(wheel, timer);
+}
+
+void tg_timer_cancel(struct tg_timer_wheel *wheel, struct tg_timer *timer)
+{
+    if (timer->pprev) {
+        tg_timer_unlink(timer);
+        wheel->pending--;
+    }
+}
+
+int tg_timer_pending(const struct tg_timer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+/* Move the timers of one slot down to the levels below */
+static void tg_timer_cascade(struct tg_timer_wheel *wheel, int level, uint32_t index)
+{
+    struct tg_timer *timer = wheel->slots[level][index];
+
+    wheel->slots[level][index] = NULL;
+    while (timer) {
+        struct tg_timer *next = timer->next;
+
+        tg_timer_place(wheel, timer);
+        timer = next;
+    }
+}
+
+uint32_t tg_timer_wheel_advance(struct tg_timer_wheel *wheel, uint32_t now,
+                                tg_timer_cb expire, void *data)
+{
+    uint32_t fired = 0;
+
+    while ((int32_t) (now - wheel->now) > 0) {
+        struct tg_timer **slot;
+        struct tg_timer *timer;
+        uint32_t tick;
+
+        /* Nothing to fire on the way */
+        if (wheel->pending == 0) {
+            wheel->now = now;
+            break;
+        }
+
+        tick = ++wheel->now;
+
+        /* A level whose slot index wraps to 0 pulls in the next slot of
+         * the level above */
+        for (int level = 1; level < TG_TIMER_LEVELS; level++) {
+            if (((tick >> (TG_TIMER_SLOT_BITS * (level - 1))) & TG_TIMER_MASK) != 0) {
+                break;
+            }
+            tg_timer_cascade(wheel, level, (tick >> (TG_TIMER_SLOT_BITS * level)) & TG_TIMER_MASK);
+        }
+
+        slot = &wheel->slots[0][tick & TG_TIMER_MASK];
+        while ((timer = *slot) != NULL) {
+            tg_timer_unlink(timer);
+            wheel->pending--;
+            fired++;
+            expire(timer, data);
+        }
+    }
+
+    return fired;
+}
@@ -0,0 +1,50 @@
+/*  ThreatGuard Agent - Timer Wheel
+ *  Hierarchical timing wheel of one-second ticks for expiring behavioral
+ *  state without scanning it
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#ifndef TG_SECURITY_TIMER_H
+#define TG_SECURITY_TIMER_H
+
+#include <stdint.h>
+
+#define TG_TIMER_LEVELS     4
+#define TG_TIMER_SLOT_BITS  6
+#define TG_TIMER_SLOTS      (1u << TG_TIMER_SLOT_BITS)
+
+/* Timers are embedded in the state they expire, which finds itself from
+ * the timer pointer in the callback. A timer must be zeroed before first
+ * use. */
+struct tg_timer {
+    struct tg_timer *next;
+    struct tg_timer **pprev;    /* NULL when not scheduled */
+    uint32_t expires;           /* tick, in seconds */
+};
+
+/* Four levels of 64 slots reach 2^24 ticks, about 194 days, ahead. Not
+ * thread safe; the owner of the wheel serializes every call. */
+struct tg_timer_wheel {
+    uint32_t now;               /* last tick processed */
+    uint32_t pending;
+    struct tg_timer *slots[TG_TIMER_LEVELS][TG_TIMER_SLOTS];
+};
+
+typedef void (*tg_timer_cb)(struct tg_timer *timer, void *data);
+
+void tg_timer_wheel_init(struct tg_timer_wheel *wheel, uint32_t now);
+
+/* Schedule or reschedule timer to fire at tick expires, in O(1). A tick
+ * that has passed fires with the next one; ticks beyond the reach of the
+ * wheel fire at its end. */
+void tg_timer_schedule(struct tg_timer_wheel *wheel, struct tg_timer *timer, uint32_t expires);
+void tg_timer_cancel(struct tg_timer_wheel *wheel, struct tg_timer *timer);
+int tg_timer_pending(const struct tg_timer *timer);
+
+/* Process the ticks up to now and call expire for every timer that fires,
+ * unscheduled first so that expire may schedule it again. Returns the
+ * number of timers fired. */
+uint32_t tg_timer_wheel_advance(struct tg_timer_wheel *wheel, uint32_t now,
+                                tg_timer_cb expire, void *data);
+
+#endif /* TG_SECURITY_TIMER_H */
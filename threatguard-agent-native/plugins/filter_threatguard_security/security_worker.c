@@ -0,0 +1,413 @@
+/*  ThreatGuard Agent - Security Worker State
+ *  Per-worker rule counters and evaluation scratch, written without
+ *  contention on the hot path and aggregated only when statistics are read
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "security_rules.h"
+
+/* Set up the per-thread worker registry */
+int tg_security_workers_init(struct tg_security_ctx *ctx)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    ctx->workers = NULL;
+    ctx->workers_ready = 0;
+
+    if (pthread_key_create(&ctx->worker_key, NULL) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to create security worker key");
+        return -1;
+    }
+
+    if (pthread_mutex_init(&ctx->worker_lock, NULL) != 0) {
+        tg_log(TG_LOG_ERROR, "failed to create security worker lock");
+        pthread_key_delete(ctx->worker_key);
+        return -1;
+    }
+
+    ctx->workers_ready = 1;
+    return 0;
+}
+
+/* State of the calling thread, created on first use; NULL if it cannot
+ * be allocated */
+struct tg_security_worker *tg_security_worker_get(struct tg_security_ctx *ctx)
+{
+    struct tg_security_worker *worker;
+
+    if (!ctx->workers_ready) {
+        return NULL;
+    }
+
+    worker = pthread_getspecific(ctx->worker_key);
+    if (worker) {
+        return worker;
+    }
+
+    worker = flb_calloc(1, sizeof(struct tg_security_worker));
+    if (!worker) {
+        return NULL;
+    }
+    worker->rates = ctx->rate_keys;
+    worker->distinct = ctx->distinct_keys;
+    worker->sequences = ctx->sequence_keys;
+    worker->full_stats = ctx->full_rule_stats;
+    worker->columnar = ctx->columnar_evaluation;
+    if (pthread_setspecific(ctx->worker_key, worker) != 0) {
+        flb_free(worker);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ctx->worker_lock);
+    worker->next = ctx->workers;
+    ctx->workers = worker;
+    pthread_mutex_unlock(&ctx->worker_lock);
+
+    return worker;
+}
+
+/* Make counters hold at least size entries and zero the first size */
+static int tg_security_worker_reset_counters(struct tg_security_rule_counters **counters,
+                                             int *alloc, int size)
+{
+    struct tg_security_rule_counters *tmp;
+
+    if (size > *alloc) {
+        tmp = flb_realloc(*counters, (size_t) size * sizeof(struct tg_security_rule_counters));
+        if (!tmp) {
+            return -1;
+        }
+        *counters = tmp;
+        *alloc = size;
+    }
+
+    if (size > 0) {
+        memset(*counters, 0, (size_t) size * sizeof(struct tg_security_rule_counters));
+    }
+    return 0;
+}
+
+/* Release the evaluation scratch of the previous rule set */
+static void tg_security_worker_free_scratch(struct tg_security_worker *worker)
+{
+    if (worker->dfas) {
+        for (int i = 0; i < worker->matcher_alloc; i++) {
+            tg_regex_dfa_destroy(worker->dfas[i]);
+        }
+    }
+
+    flb_free(worker->dfas);
+    flb_free(worker->rule_match_seq);
+    flb_free(worker->field_values);
+    flb_free(worker->field_seq);
+    flb_free(worker->plan);
+    flb_free(worker->batch_records);
+    flb_free(worker->batch_ends);
+    flb_free(worker->batch_values);
+    flb_free(worker->batch_views);
+    flb_free(worker->batch_cells);
+    flb_free(worker->batch_events);
+    worker->dfas = NULL;
+    worker->rule_match_seq = NULL;
+    worker->field_values = NULL;
+    worker->field_seq = NULL;
+    worker->plan = NULL;
+    worker->batch_records = NULL;
+    worker->batch_ends = NULL;
+    worker->batch_values = NULL;
+    worker->batch_views = NULL;
+    worker->batch_cells = NULL;
+    worker->batch_events = NULL;
+    worker->match_seq = 0;
+}
+
+/* Prepare a worker to evaluate set: scratch sized for its rules, fields
+ * and matchers, and per-rule counters restarted when the set changed */
+int tg_security_worker_bind(struct tg_security_ctx *ctx, struct tg_security_worker *worker,
+                            const struct tg_security_ruleset *set)
+{
+    uint32_t field_count;
+    int ret;
+
+    /* Lookups go straight to the store while the cache cannot be had */
+    if (!worker->ioc_cache && ctx->threat_intel_cache_size > 0) {
+        struct tg_ioc_cache *cache = tg_ioc_cache_create(ctx->threat_intel_cache_size);
+
+        pthread_mutex_lock(&ctx->worker_lock);
+        worker->ioc_cache = cache;
+        pthread_mutex_unlock(&ctx->worker_lock);
+    }
+
+    if (worker->generation == set->generation) {
+        return 0;
+    }
+
+    tg_security_worker_free_scratch(worker);
+
+    /* Readers may be walking the counters */
+    pthread_mutex_lock(&ctx->worker_lock);
+    worker->generation = 0;
+    ret = tg_security_worker_reset_counters(&worker->rules, &worker->rule_alloc,
+                                            set->rule_count);
+    if (ret == 0) {
+        ret = tg_security_worker_reset_counters(&worker->matchers, &worker->matcher_alloc,
+                                                set->matcher_count);
+    }
+    pthread_mutex_unlock(&ctx->worker_lock);
+    if (ret != 0) {
+        return -1;
+    }
+
+    field_count = tg_field_dict_count(set->fields);
+    worker->rule_match_seq = flb_calloc((size_t) set->rule_count + 1, sizeof(uint32_t));
+    worker->field_values = flb_calloc((size_t) field_count + 1, sizeof(msgpack_object *));
+    worker->field_seq = flb_calloc((size_t) field_count + 1, sizeof(uint32_t));
+    worker->dfas = flb_calloc((size_t) worker->matcher_alloc + 1, sizeof(struct tg_regex_dfa *));
+    worker->plan = flb_malloc(((size_t) set->plan_count + 1) * sizeof(struct tg_security_step));
+    if (!worker->rule_match_seq || !worker->field_values || !worker->field_seq ||
+        !worker->dfas || !worker->plan || (!set->plan && set->rule_count > 0)) {
+        tg_security_worker_free_scratch(worker);
+        return -1;
+    }
+
+    /* One column per field slot, each a batch of records long */
+    if (worker->columnar) {
+        size_t cells = ((size_t) field_count + 1) * TG_SECURITY_BATCH_RECORDS;
+
+        worker->batch_records = flb_malloc(TG_SECURITY_BATCH_RECORDS * sizeof(msgpack_object));
+        worker->batch_ends = flb_malloc(TG_SECURITY_BATCH_RECORDS * sizeof(size_t));
+        worker->batch_values = flb_malloc(cells * sizeof(msgpack_object *));
+        worker->batch_views = flb_malloc(cells * sizeof(struct tg_security_view));
+        worker->batch_cells = flb_malloc(TG_SECURITY_BATCH_CELLS * sizeof(uint32_t));
+        worker->batch_events = flb_malloc(TG_SECURITY_BATCH_RECORDS *
+                                          sizeof(struct tg_security_event));
+        if (!worker->batch_records || !worker->batch_ends || !worker->batch_values ||
+            !worker->batch_views || !worker->batch_cells || !worker->batch_events) {
+            tg_security_worker_free_scratch(worker);
+            return -1;
+        }
+        worker->batch_cell_count = TG_SECURITY_BATCH_CELLS + 1;
+    }
+
+    if (set->plan_count > 0) {
+        memcpy(worker->plan, set->plan, (size_t) set->plan_count * sizeof(struct tg_security_step));
+    }
+
+    for (int i = 0; i < set->matcher_count; i++) {
+        if (!set->matchers[i].regex) {
+            continue;
+        }
+        worker->dfas[i] = tg_regex_dfa_create(set->matchers[i].regex, ctx->regex_cache_size);
+        if (!worker->dfas[i]) {
+            tg_security_worker_free_scratch(worker);
+            return -1;
+        }
+    }
+
+    /* Publish the generation last: collection only reads rule counters of
+     * workers bound to the set being reported */
+    pthread_mutex_lock(&ctx->worker_lock);
+    worker->generation = set->generation;
+    pthread_mutex_unlock(&ctx->worker_lock);
+
+    return 0;
+}
+
+/* Expected cost of evaluating a step until it matches: its mean cost over
+ * its hit rate. A step not timed yet ranks first, so that it gets timed. */
+static float tg_security_step_rank(const struct tg_security_rule_counters *counters)
+{
+    double cost;
+
+    if (counters->timed_evaluations == 0) {
+        return 0;
+    }
+
+    cost = (double) counters->timed_ns / counters->timed_evaluations;
+    return (float) (cost * (counters->evaluations + 1) / (counters->matches + 1));
+}
+
+/* Cheapest expected match first, then in the order their rules were loaded */
+static int tg_security_cmp_step_rank(const void *a, const void *b)
+{
+    const struct tg_security_step *x = a;
+    const struct tg_security_step *y = b;
+
+    if (x->rank != y->rank) {
+        return x->rank < y->rank ? -1 : 1;
+    }
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+/* Reorder the steps of each group in the worker's plan by rank. Any match
+ * in a group settles the action at its priority, so evaluation of the
+ * group stops at its first match and the likeliest, cheapest steps should
+ * come first; the order of the groups never changes. */
+void tg_security_worker_reorder(const struct tg_security_ruleset *set,
+                                struct tg_security_worker *worker)
+{
+    struct tg_security_step *plan = worker->plan;
+    int start = 0;
+
+    for (int s = 0; s < set->plan_count; s++) {
+        plan[s].rank = tg_security_step_rank(plan[s].kind == TG_SECURITY_STEP_MATCHER ?
+                                             &worker->matchers[plan[s].index] :
+                                             &worker->rules[plan[s].index]);
+    }
+
+    while (start < set->plan_count) {
+        int end = start + 1;
+
+        while (end < set->plan_count && plan[end].group == plan[start].group) {
+            end++;
+        }
+        if (end - start > 1) {
+            qsort(&plan[start], end - start, sizeof(struct tg_security_step),
+                  tg_security_cmp_step_rank);
+        }
+        start = end;
+    }
+}
+
+/* Scale the timed cost of a counter to all of its evaluations */
+static uint64_t tg_security_stats_cost(const struct tg_security_rule_counters *counters)
+{
+    if (counters->timed_evaluations == 0) {
+        return 0;
+    }
+    return (uint64_t) ((double) counters->timed_ns * counters->evaluations /
+                       counters->timed_evaluations);
+}
+
+/* Compiled matcher that evaluates a rule, or -1 for generic rules */
+static int tg_security_stats_matcher(const struct tg_security_ruleset *set, int index)
+{
+    if (set->rules[index].matcher == TG_RULE_MATCHER_GENERIC) {
+        return -1;
+    }
+
+    for (int m = 0; m < set->matcher_count; m++) {
+        if (strcmp(set->matchers[m].field_name, set->rule_info[index].field_name) == 0) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+/* Sum the state of all workers. Event totals go to totals, per-rule
+ * figures for set to the first max_rules entries of rules; either may be
+ * NULL. Rule counters restart when a worker moves to a new rule set, so
+ * only workers bound to set contribute to them. A compiled rule is
+ * evaluated by every scan of its field matcher and is charged an equal
+ * share of the matcher cost. The caller keeps set alive. Returns the
+ * number of rule entries filled. */
+int tg_security_stats_collect(struct tg_security_ctx *ctx, const struct tg_security_ruleset *set,
+                              struct tg_security_stats *totals,
+                              struct tg_security_rule_stats *rules, int max_rules)
+{
+    struct tg_security_worker *worker;
+    int *rule_matcher = NULL;
+    int *matcher_rules = NULL;
+    int count = 0;
+
+    if (!ctx || !set || !ctx->workers_ready) {
+        return -1;
+    }
+
+    if (totals) {
+        memset(totals, 0, sizeof(*totals));
+    }
+
+    if (rules && max_rules > 0) {
+        count = set->rule_count < max_rules ? set->rule_count : max_rules;
+        rule_matcher = flb_malloc(((size_t) count + 1) * sizeof(int));
+        matcher_rules = flb_calloc((size_t) set->matcher_count + 1, sizeof(int));
+        if (!rule_matcher || !matcher_rules) {
+            flb_free(rule_matcher);
+            flb_free(matcher_rules);
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            memset(&rules[i], 0, sizeof(rules[i]));
+            rules[i].id = set->rule_info[i].id;
+            rules[i].name = set->rule_info[i].name;
+            rule_matcher[i] = tg_security_stats_matcher(set, i);
+            if (rule_matcher[i] >= 0) {
+                matcher_rules[rule_matcher[i]]++;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&ctx->worker_lock);
+    for (worker = ctx->workers; worker; worker = worker->next) {
+        if (totals) {
+            uint64_t hits;
+            uint64_t misses;
+
+            totals->events_processed += worker->stats.events_processed;
+            totals->events_flagged += worker->stats.events_flagged;
+            totals->events_dropped += worker->stats.events_dropped;
+            totals->rules_matched += worker->stats.rules_matched;
+
+            tg_ioc_cache_stats(worker->ioc_cache, &hits, &misses);
+            totals->intel_cache_hits += hits;
+            totals->intel_cache_misses += misses;
+        }
+
+        if (worker->generation != set->generation) {
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            const struct tg_security_rule_counters *counters = &worker->rules[i];
+            int m = rule_matcher[i];
+
+            rules[i].matches += counters->matches;
+            if (counters->last_match > rules[i].last_match) {
+                rules[i].last_match = counters->last_match;
+            }
+
+            if (m < 0) {
+                rules[i].evaluations += counters->evaluations;
+                rules[i].cost_ns += tg_security_stats_cost(counters);
+            } else {
+                rules[i].evaluations += worker->matchers[m].evaluations;
+                rules[i].cost_ns += tg_security_stats_cost(&worker->matchers[m]) /
+                                    matcher_rules[m];
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctx->worker_lock);
+
+    flb_free(rule_matcher);
+    flb_free(matcher_rules);
+    return count;
+}
+
+/* Release every worker */
+void tg_security_workers_destroy(struct tg_security_ctx *ctx)
+{
+    struct tg_security_worker *worker;
+    struct tg_security_worker *next;
+
+    if (!ctx || !ctx->workers_ready) {
+        return;
+    }
+
+    for (worker = ctx->workers; worker; worker = next) {
+        next = worker->next;
+        tg_security_worker_free_scratch(worker);
+        tg_ioc_cache_destroy(worker->ioc_cache);
+        flb_free(worker->rules);
+        flb_free(worker->matchers);
+        flb_free(worker);
+    }
+    ctx->workers = NULL;
+
+    pthread_key_delete(ctx->worker_key);
+    pthread_mutex_destroy(&ctx->worker_lock);
+    ctx->workers_ready = 0;
+}
@@ -175,6 +175,29 @@ uint64_t tg_utils_get_timestamp_ms(void)
     return tg_utils_get_timestamp_us() / 1000;
 }
 
+/* Wall clock seconds from the coarse clock: no syscall and no hardware
+ * counter read, for stamping on hot paths */
+time_t tg_utils_coarse_time(void)
+{
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec ts;
+    
+    if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0) {
+        return ts.tv_sec;
+    }
+#endif
+    return time(NULL);
+}
+
+/* Monotonic timestamp in nanoseconds, for measuring short intervals */
+uint64_t tg_utils_monotonic_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 /* Format timestamp as ISO 8601 string */
 void tg_utils_format_timestamp(uint64_t timestamp_ms, char *buffer, size_t buffer_size)
 {
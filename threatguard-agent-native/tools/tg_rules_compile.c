@@ -0,0 +1,62 @@
+/*  ThreatGuard Agent - Rule Bundle Compiler
+ *  Compiles a security rules file into a binary bundle the security filter
+ *  maps at startup and on reload instead of parsing and compiling the rules
+ *  Copyright (C) 2025 BG Threat AI
+ */
+
+#include "../plugins/filter_threatguard_security/security_rules.h"
+#include "../include/threatguard.h"
+
+static void compile_usage(const char *name)
+{
+    printf("usage: %s <rules.conf> <rules.bundle>\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    struct tg_security_ruleset *set;
+    struct tg_security_ruleset *check;
+    int ret;
+
+    if (argc != 3) {
+        compile_usage(argv[0]);
+        return argc == 2 && strcmp(argv[1], "-h") == 0 ? 0 : 1;
+    }
+
+    if (tg_security_bundle_detect(argv[1])) {
+        fprintf(stderr, "%s is already a rule bundle\n", argv[1]);
+        return 1;
+    }
+
+    set = tg_security_load_ruleset(argv[1]);
+    if (!set) {
+        fprintf(stderr, "no rules loaded from %s\n", argv[1]);
+        return 1;
+    }
+
+    ret = tg_security_bundle_write(set, argv[2]);
+    if (ret != 0) {
+        fprintf(stderr, "failed to write %s\n", argv[2]);
+        tg_security_ruleset_destroy(set);
+        return 1;
+    }
+
+    /* Map the result the way the filter will */
+    check = tg_security_bundle_load(argv[2]);
+    if (!check || check->rule_count != set->rule_count ||
+        check->matcher_count != set->matcher_count) {
+        fprintf(stderr, "%s does not load back, removing it\n", argv[2]);
+        remove(argv[2]);
+        tg_security_ruleset_destroy(check);
+        tg_security_ruleset_destroy(set);
+        return 1;
+    }
+
+    printf("%s: %d rules, %d field matchers, %u indexed fields\n",
+           argv[2], check->rule_count, check->matcher_count,
+           tg_field_dict_count(check->fields));
+
+    tg_security_ruleset_destroy(check);
+    tg_security_ruleset_destroy(set);
+    return 0;
+}